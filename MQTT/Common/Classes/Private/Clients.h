@@ -11,6 +11,12 @@
 #include "MQTTClient.h"             // MQTT (Public)
 #include "MQTTClientPersistence.h"  // MQTT (Public)
 #include "LinkedList.h"             // MQTT (Utilities)
+#include "TimerWheel.h"             // MQTT (Utilities)
+#include "Socket.h"                 // MQTT (Web)
+#include "MQTTPacketParser.h"       // MQTT (Public)
+#include "TopicAliases.h"           // MQTT (Private)
+#include "MessageIds.h"             // MQTT (Private)
+#include "MessageTable.h"           // MQTT (Private)
 
 #pragma mark Definitions
 
@@ -19,13 +25,25 @@
  *
  *  @field version The MQTT library version running for all the clients. This value never changes after being set up.
  *  @field clients A list of clients running concurrently on the current system.
+ *  @field timers The timers of all the clients (keepalive, retries, timeouts), guarded by the lock the clients are.
  */
 typedef struct
 {
     char const* const version;
     List* clients;
+    timerWheel timers;
 } ClientStates;
 
+/*!
+ *  @abstract Who a payload lent by the application, rather than copied, is given back to.
+ *  @discussion A NULL release means the payload is not lent: it is a copy owned (and freed) by the library.
+ */
+typedef struct
+{
+	void (*release)(void* context, void* payload);	// Called once the payload is no longer needed.
+	void* context;
+} payloadLender;
+
 /*!
  *  @abstract Stored publication data to minimize copying.
  */
@@ -35,6 +53,8 @@ typedef struct
 	size_t topiclen;
 	char* payload;
 	size_t payloadlen;
+	payloadLender lender;	// Set if payload is lent, and given back instead of freed.
+	SocketBuffer_stream const* stream;	// Set if the payload is streamed rather than held in payload, lent like one.
 	int refcount;
 } Publications;
 
@@ -47,8 +67,10 @@ typedef struct
 	int retain;
 	int msgid;
 	Publications *publish;
-	time_t lastTouch;		// Used for retry and expiry.
+	uint64_t lastTouch;		// Monotonic time (ms) last sent, used for retry and expiry.
+	timer retryTimer;		// Outbound only: expires as the message is due to be sent again
 	char nextMessageType;	// PUBREC, PUBREL, PUBCOMP
+	bool delivered;			// Inbound QoS 2 only: handed to the application as it arrived, in chunks, so PUBREL only completes the flow
 	size_t len;				// Length of the whole structure+data
 } Messages;
 
@@ -63,14 +85,32 @@ typedef struct
 	int qos;
 } willMessages;
 
+/*!
+ *  @abstract A publish being received in chunks (see MQTTPacketParser), as only the first one carries its variable header.
+ */
+typedef struct
+{
+	unsigned char header;	// MQTT header byte
+	char* topic;			// Copy of the topic, NULL if no publish is being received in chunks
+	size_t topiclen;
+	int msgId;
+	size_t payloadlen;		// Length of the whole payload
+} chunkedPublish;
+
 /*!
  *  @abstract Network related data
  */
 typedef struct
 {
 	int socket;
-	time_t lastSent;
-	time_t lastReceived;
+	uint64_t lastSent;          // Monotonic time (ms) of the last output
+	uint64_t lastReceived;      // Monotonic time (ms) of the last input
+	MQTTPacketParser parser;    // Splits the bytes received into packets
+	int MQTTVersion;            // Protocol version of the connection, set as CONNECT is sent
+	int receiveMaximum;         // QoS 1 and 2 publishes the server takes in flight at once (MQTT 5), 0 for no limit
+	topicAliases aliasesOut;    // Topic aliases the client publishes with (MQTT 5)
+	topicAliases aliasesIn;     // Topic aliases the server publishes with (MQTT 5)
+	chunkedPublish chunked;     // The publish being received in chunks, if any
     #if defined(OPENSSL)
 	SSL* ssl;
 	SSL_CTX* ctx;
@@ -91,19 +131,30 @@ typedef struct
 	unsigned int ping_outstanding : 1;
 	int connect_state : 4;
 	networkHandles net;
-	int msgID;
+	int msgID;                      // Message identifier assigned last
+	messageIds msgIds;              // Message identifiers in use
 	int keepAliveInterval;
+	timer keepaliveTimer;           // Expires as the connection may have been idle for the keepalive interval
 	int retryInterval;
 	int maxInflightMessages;
 	willMessages* will;
 	List* inboundMsgs;
 	List* outboundMsgs;             // In flight
+	messageTable inboundIndex;      // The elements of inboundMsgs by message id
+	messageTable outboundIndex;     // The elements of outboundMsgs by message id
 	List* messageQueue;
 	unsigned int qentry_seqno;
 	void* phandle;                  // The persistence handle
 	MQTTClient_persistence* persistence; // A persistence implementation
 	void* context;                  // Calling context - used when calling disconnect_internal */
 	int MQTTVersion;
+	int maxWriteDelay;              // Longest time (ms) output may be held back to be coalesced, 0 for none
+	Socket_options sockopts;        // Options every socket of the client is created with
+	int zeroCopy;                   // Whether QoS 0 and 1 messages are delivered pointing into the read buffer, instead of copied
+	int topicAliasMaximum;          // Topic aliases used in each direction with MQTT 5, 0 for none
+	size_t chunkThreshold;          // Publishes received with a payload at least this long are delivered in chunks as they arrive, 0 for none
+	int coalesceDelay;              // Longest time (ms) a subscribe or unsubscribe may be held back for more to join its packet, 0 for none
+	int coalesceTopics;             // Most topics in a packet of coalesced subscribes or unsubscribes, 0 for no limit
     #if defined(OPENSSL)
 	MQTTClient_SSLOptions* sslopts;
 	SSL_SESSION* session;           // SSL session pointer for fast handhake
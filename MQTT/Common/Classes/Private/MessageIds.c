@@ -0,0 +1,65 @@
+#include "MessageIds.h"     // Header
+#include "StackTrace.h"     // MQTT (Utilities)
+
+#include <string.h>         // C Standard
+
+#include "Heap.h"           // MQTT (Utilities)
+
+#pragma mark - Definitions
+
+/*!
+ *  @abstract The highest message identifier.
+ */
+#define MESSAGEIDS_MAX 65535
+
+#pragma mark - Public API
+
+void MessageIds_reset(messageIds* ids)
+{
+    memset(ids->words, 0, sizeof(ids->words));
+}
+
+int MessageIds_assign(messageIds* ids, int last)
+{
+    int msgid = 0;
+
+    FUNC_ENTRY;
+    int const start = (last < 1 || last >= MESSAGEIDS_MAX) ? 1 : last + 1;
+    unsigned int word = (unsigned int)start / 64;
+    uint64_t vacant = ~ids->words[word] & (~(uint64_t)0 << (start % 64));
+
+    // The word of the start is visited twice: first from the start on, last for the identifiers before it.
+    for (unsigned int n = 0; n <= MESSAGEIDS_WORDS; ++n)
+    {
+        if (word == 0) { vacant &= ~(uint64_t)1; }    // 0 is not an identifier.
+        if (vacant != 0)
+        {
+            int const bit = __builtin_ctzll(vacant);
+            ids->words[word] |= (uint64_t)1 << bit;
+            msgid = (int)(word * 64) + bit;
+            break;
+        }
+        word = (word + 1) % MESSAGEIDS_WORDS;
+        vacant = ~ids->words[word];
+    }
+    FUNC_EXIT_RC(msgid);
+    return msgid;
+}
+
+void MessageIds_hold(messageIds* ids, int msgid)
+{
+    if (msgid < 1 || msgid > MESSAGEIDS_MAX) { return; }
+    ids->words[msgid / 64] |= (uint64_t)1 << (msgid % 64);
+}
+
+void MessageIds_release(messageIds* ids, int msgid)
+{
+    if (msgid < 1 || msgid > MESSAGEIDS_MAX) { return; }
+    ids->words[msgid / 64] &= ~((uint64_t)1 << (msgid % 64));
+}
+
+bool MessageIds_isHeld(messageIds const* ids, int msgid)
+{
+    if (msgid < 1 || msgid > MESSAGEIDS_MAX) { return false; }
+    return (ids->words[msgid / 64] >> (msgid % 64)) & 1;
+}
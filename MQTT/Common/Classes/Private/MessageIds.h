@@ -0,0 +1,62 @@
+/*!
+ *  @abstract Message identifiers in use by a client.
+ *  @discussion An identifier (1 to 65535) is held from the moment it is assigned until the flow using it completes. One bit per identifier records which are held, so that finding a free one scans 64 identifiers at a time instead of searching the lists of commands or messages in flight for each candidate.
+ */
+#pragma once
+
+#include <stdbool.h>    // C Standard
+#include <stdint.h>     // C Standard
+
+#pragma mark Definitions
+
+/*!
+ *  @abstract Words of the bitmap, one bit for each identifier from 0 to 65535 (0 is never assigned).
+ */
+#define MESSAGEIDS_WORDS (65536 / 64)
+
+/*!
+ *  @abstract The identifiers held by a client. All zero means none is held.
+ */
+typedef struct
+{
+    uint64_t words[MESSAGEIDS_WORDS];
+} messageIds;
+
+#pragma mark Public API
+
+/*!
+ *  @abstract Release every identifier, as the state of a session is discarded.
+ *
+ *  @param ids the identifiers of the client.
+ */
+void MessageIds_reset(messageIds* ids);
+
+/*!
+ *  @abstract Assign the first free identifier after the one last assigned, wrapping around after 65535.
+ *
+ *  @param ids the identifiers of the client.
+ *  @param last the identifier assigned last, 0 if none yet.
+ *  @return the identifier, now held, or 0 if all are held.
+ */
+int MessageIds_assign(messageIds* ids, int last);
+
+/*!
+ *  @abstract Hold an identifier not assigned by MessageIds_assign, such as one restored from persistence.
+ *
+ *  @param ids the identifiers of the client.
+ *  @param msgid the identifier; 0 and out of range values are ignored.
+ */
+void MessageIds_hold(messageIds* ids, int msgid);
+
+/*!
+ *  @abstract Release an identifier, whose flow has completed.
+ *
+ *  @param ids the identifiers of the client.
+ *  @param msgid the identifier; 0 and out of range values are ignored.
+ */
+void MessageIds_release(messageIds* ids, int msgid);
+
+/*!
+ *  @abstract Whether an identifier is held.
+ */
+bool MessageIds_isHeld(messageIds const* ids, int msgid);
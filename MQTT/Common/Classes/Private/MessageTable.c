@@ -0,0 +1,44 @@
+#include "MessageTable.h"   // Header
+#include "Log.h"            // MQTT (Utilities)
+
+#include <stdlib.h>         // C Standard
+#include <string.h>         // C Standard
+
+#include "Heap.h"           // MQTT (Utilities)
+
+#pragma mark - Public API
+
+ListElement* MessageTable_get(messageTable const* table, int msgid)
+{
+    if (msgid < 1 || msgid >= MESSAGETABLE_PAGES * MESSAGETABLE_PAGE_SIZE) { return NULL; }
+    ListElement** const page = table->pages[msgid / MESSAGETABLE_PAGE_SIZE];
+    return (page) ? page[msgid % MESSAGETABLE_PAGE_SIZE] : NULL;
+}
+
+bool MessageTable_set(messageTable* table, int msgid, ListElement* element)
+{
+    if (msgid < 1 || msgid >= MESSAGETABLE_PAGES * MESSAGETABLE_PAGE_SIZE) { return false; }
+    ListElement*** const page = &table->pages[msgid / MESSAGETABLE_PAGE_SIZE];
+    if (*page == NULL)
+    {
+        if (element == NULL) { return true; }
+        if ((*page = malloc(MESSAGETABLE_PAGE_SIZE * sizeof(ListElement*))) == NULL)
+        {
+            Log(LOG_ERROR, -1, "No memory to index message %d", msgid);
+            return false;
+        }
+        memset(*page, 0, MESSAGETABLE_PAGE_SIZE * sizeof(ListElement*));
+    }
+    (*page)[msgid % MESSAGETABLE_PAGE_SIZE] = element;
+    return true;
+}
+
+void MessageTable_reset(messageTable* table)
+{
+    for (int i = 0; i < MESSAGETABLE_PAGES; ++i)
+    {
+        if (table->pages[i] == NULL) { continue; }
+        free(table->pages[i]);
+        table->pages[i] = NULL;
+    }
+}
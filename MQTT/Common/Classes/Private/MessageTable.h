@@ -0,0 +1,56 @@
+/*!
+ *  @abstract Messages or commands in flight, indexed by message identifier.
+ *  @discussion The records stay in their lists, in the order retries and persistence rely on. The table points to the list element of each identifier, so that an acknowledgement finds its record, and takes it out of the list, without walking the list. Pages of the table are allocated as identifiers in their range are first used.
+ */
+#pragma once
+
+#include <stdbool.h>        // C Standard
+#include "LinkedList.h"     // MQTT (Utilities)
+
+#pragma mark Definitions
+
+/*!
+ *  @abstract Identifiers covered by a page of the table.
+ */
+#define MESSAGETABLE_PAGE_SIZE 256
+
+/*!
+ *  @abstract Pages of the table, covering the identifiers from 0 to 65535.
+ */
+#define MESSAGETABLE_PAGES (65536 / MESSAGETABLE_PAGE_SIZE)
+
+/*!
+ *  @abstract The list elements of the identifiers in flight. All zero is an empty table.
+ */
+typedef struct
+{
+    ListElement** pages[MESSAGETABLE_PAGES];
+} messageTable;
+
+#pragma mark Public API
+
+/*!
+ *  @abstract Get the list element of an identifier.
+ *
+ *  @param table the table.
+ *  @param msgid the identifier.
+ *  @return the element, or NULL if the identifier is not in flight.
+ */
+ListElement* MessageTable_get(messageTable const* table, int msgid);
+
+/*!
+ *  @abstract Record the list element of an identifier.
+ *
+ *  @param table the table.
+ *  @param msgid the identifier, from 1 to 65535.
+ *  @param element the element, or NULL to remove the identifier from the table.
+ *  @return false if the identifier is out of range or memory could not be allocated.
+ */
+bool MessageTable_set(messageTable* table, int msgid, ListElement* element);
+
+/*!
+ *  @abstract Empty the table, and free its pages.
+ *
+ *  @param table the table.
+ */
+void MessageTable_reset(messageTable* table);
@@ -0,0 +1,344 @@
+#include "PayloadCodecs.h"  // Header
+#include "Log.h"            // MQTT (Utilities)
+#include "StackTrace.h"     // MQTT (Utilities)
+
+#include <pthread.h>        // POSIX
+#include <stdlib.h>         // C Standard
+#include <string.h>         // C Standard
+#include <zlib.h>           // zlib
+
+#include "Heap.h"           // MQTT (Utilities)
+
+#pragma mark - Definitions
+
+/*!
+ *  @abstract The codec of a topic filter, with the filter right after it.
+ */
+typedef struct
+{
+    MQTTAsync_codec codec;
+    char filter[];
+} payloadCodec;
+
+/*!
+ *  @abstract Payloads shorter than this are not worth deflating.
+ */
+#define DEFLATE_MIN_LENGTH 32
+
+/*!
+ *  @abstract Bytes in front of the zlib stream of a deflated payload: the marker and the decoded length.
+ */
+#define DEFLATE_HEADER_LENGTH 8
+
+/*!
+ *  @abstract Bytes a decoded payload is given first, unless it is declared shorter, before its buffer grows with what the stream really decodes to.
+ */
+#define DEFLATE_INITIAL_CAPACITY 4096
+
+/*!
+ *  @abstract The zlib streams of a thread, kept between messages as setting them up costs far more than a small payload takes to compress.
+ */
+typedef struct
+{
+    z_stream deflater;
+    z_stream inflater;
+    bool deflating;     // Whether deflater has been initialized.
+    bool inflating;     // Whether inflater has been initialized.
+} deflateStreams;
+
+static _Thread_local deflateStreams streams;
+static pthread_key_t streams_key;
+static pthread_once_t streams_once = PTHREAD_ONCE_INIT;
+
+#pragma mark - Private prototypes
+
+bool PayloadCodecs_matches(char const* filter, char const* topic, size_t topiclen);
+MQTTAsync_codec const* PayloadCodecs_find(List const* codecs, char const* topic, size_t topiclen);
+deflateStreams* PayloadCodecs_streams(void);
+void PayloadCodecs_createKey(void);
+void PayloadCodecs_endStreams(void* streams);
+void PayloadCodecs_limits(void const* context, size_t* maxLength, size_t* maxRatio);
+int PayloadCodecs_deflate(void* context, void const* data, size_t datalen, void** output, size_t* outputlen);
+int PayloadCodecs_inflate(void* context, void const* data, size_t datalen, void** output, size_t* outputlen);
+
+#pragma mark - Variables
+
+MQTTAsync_codec const MQTTAsync_deflateCodec =
+{
+    {'M', 'Q', 'C', 'C'}, 0, {0, 'M', 'Q', 'Z'}, PayloadCodecs_deflate, PayloadCodecs_inflate, NULL
+};
+
+#pragma mark - Public API
+
+bool PayloadCodecs_set(List* codecs, char const* topicFilter, MQTTAsync_codec const* codec)
+{
+    int rc = false;
+
+    FUNC_ENTRY;
+    for (ListElement* elem = codecs->first; elem; elem = elem->next)
+    {
+        if (strcmp(((payloadCodec*)elem->content)->filter, topicFilter) == 0)
+        {
+            ListRemove(codecs, elem->content);
+            break;
+        }
+    }
+
+    if (codec)
+    {
+        size_t const filterlen = strlen(topicFilter);
+        payloadCodec* entry = malloc(sizeof(payloadCodec) + filterlen + 1);
+        if (entry == NULL) { goto exit; }
+        entry->codec = *codec;
+        memcpy(entry->filter, topicFilter, filterlen + 1);
+        ListAppend(codecs, entry, sizeof(payloadCodec) + filterlen + 1);
+    }
+    rc = true;
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+bool PayloadCodecs_encode(List const* codecs, char const* topic, size_t topiclen, void const* payload, size_t payloadlen, void** encoded, size_t* encodedlen)
+{
+    int rc = false;
+
+    FUNC_ENTRY;
+    MQTTAsync_codec const* codec = PayloadCodecs_find(codecs, topic, topiclen);
+    if (codec == NULL || codec->encode == NULL) { goto exit; }
+    if ((*codec->encode)(codec->context, payload, payloadlen, encoded, encodedlen) != 1) { goto exit; }
+
+    if (*encodedlen < sizeof(codec->marker) || memcmp(*encoded, codec->marker, sizeof(codec->marker)) != 0)
+    {   // It could not be told from a payload published as it is.
+        Log(LOG_ERROR, -1, "Payload encoded for topic %s does not start with the codec marker, published as it is", topic);
+        free(*encoded);
+        goto exit;
+    }
+    rc = true;
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+bool PayloadCodecs_decode(List const* codecs, char const* topic, size_t topiclen, void const* payload, size_t payloadlen, void** decoded, size_t* decodedlen)
+{
+    int rc = false;
+
+    FUNC_ENTRY;
+    MQTTAsync_codec const* codec = PayloadCodecs_find(codecs, topic, topiclen);
+    if (codec == NULL || codec->decode == NULL) { goto exit; }
+    if (payloadlen < sizeof(codec->marker) || memcmp(payload, codec->marker, sizeof(codec->marker)) != 0) { goto exit; }
+
+    if ((*codec->decode)(codec->context, payload, payloadlen, decoded, decodedlen) != 1)
+    {
+        Log(LOG_ERROR, -1, "Payload received on topic %.*s could not be decoded, delivered as it is", (int)topiclen, topic);
+        goto exit;
+    }
+    rc = true;
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+void PayloadCodecs_release(void* context __attribute__((unused)), void* payload)
+{
+    free(payload);
+}
+
+#pragma mark - Private functionality
+
+/*!
+ *  @abstract Whether a topic matches a topic filter.
+ *  @discussion '+' matches one topic level, and a trailing '#' any number of them, including none. Wildcards at the start of a filter do not match topics starting with '$'.
+ *
+ *  @param filter the null terminated topic filter.
+ *  @param topic the topic, not necessarily null terminated.
+ *  @param topiclen the length of the topic.
+ *  @return whether the topic matches.
+ */
+bool PayloadCodecs_matches(char const* filter, char const* topic, size_t topiclen)
+{
+    char const* const end = topic + topiclen;
+    if ((*filter == '+' || *filter == '#') && topiclen > 0 && *topic == '$') { return false; }
+
+    while (*filter)
+    {
+        if (*filter == '#') { return true; }
+        if (*filter == '+')
+        {   // Skip the level of the topic.
+            while (topic < end && *topic != '/') { ++topic; }
+            ++filter;
+        }
+        else
+        {
+            while (*filter && *filter != '/' && topic < end && *filter == *topic) { ++filter; ++topic; }
+            if (*filter && *filter != '/') { return false; }
+            if (topic < end && *topic != '/') { return false; }
+        }
+
+        if (*filter == '\0') { return topic == end; }
+        // Both are at a level separator, or the topic has run out of levels: "a/#" still matches "a".
+        if (topic == end) { return strcmp(filter, "/#") == 0; }
+        ++filter;
+        ++topic;
+    }
+    return topic == end;
+}
+
+/*!
+ *  @abstract Get the codec of the first topic filter a topic matches.
+ *  @discussion The list is walked without ListNextElement, which moves the current element of the list: several threads may look up codecs at once.
+ *
+ *  @return the codec, or NULL if none applies.
+ */
+MQTTAsync_codec const* PayloadCodecs_find(List const* codecs, char const* topic, size_t topiclen)
+{
+    for (ListElement const* elem = codecs->first; elem; elem = elem->next)
+    {
+        payloadCodec const* entry = elem->content;
+        if (PayloadCodecs_matches(entry->filter, topic, topiclen)) { return &entry->codec; }
+    }
+    return NULL;
+}
+
+/*!
+ *  @abstract Get the zlib streams of the calling thread, which are ended when the thread exits.
+ */
+deflateStreams* PayloadCodecs_streams(void)
+{
+    if (!streams.deflating && !streams.inflating)
+    {
+        pthread_once(&streams_once, PayloadCodecs_createKey);
+        pthread_setspecific(streams_key, &streams);
+    }
+    return &streams;
+}
+
+void PayloadCodecs_createKey(void)
+{
+    pthread_key_create(&streams_key, PayloadCodecs_endStreams);
+}
+
+/*!
+ *  @abstract End the zlib streams of a thread as it exits.
+ */
+void PayloadCodecs_endStreams(void* threadStreams)
+{
+    deflateStreams* s = threadStreams;
+    if (s->deflating) { deflateEnd(&s->deflater); }
+    if (s->inflating) { inflateEnd(&s->inflater); }
+    s->deflating = s->inflating = false;
+}
+
+/*!
+ *  @abstract Encode a payload for MQTTAsync_deflateCodec.
+ */
+int PayloadCodecs_deflate(void* context, void const* data, size_t datalen, void** output, size_t* outputlen)
+{
+    int rc = 0;
+    size_t maxLength, maxRatio;
+
+    FUNC_ENTRY;
+    PayloadCodecs_limits(context, &maxLength, &maxRatio);
+    if (datalen < DEFLATE_MIN_LENGTH || datalen > maxLength) { goto exit; }
+
+    deflateStreams* s = PayloadCodecs_streams();
+    if (s->deflating) {
+        deflateReset(&s->deflater);
+    } else {
+        memset(&s->deflater, 0, sizeof(z_stream));
+        if (deflateInit(&s->deflater, Z_DEFAULT_COMPRESSION) != Z_OK) { goto exit; }
+        s->deflating = true;
+    }
+
+    // Only an output smaller than the input is of any use, so the stream is given no more room than that.
+    unsigned char* buffer = malloc(datalen);
+    if (buffer == NULL) { goto exit; }
+    memcpy(buffer, MQTTAsync_deflateCodec.marker, sizeof(MQTTAsync_deflateCodec.marker));
+    buffer[4] = (unsigned char)(datalen >> 24);
+    buffer[5] = (unsigned char)(datalen >> 16);
+    buffer[6] = (unsigned char)(datalen >> 8);
+    buffer[7] = (unsigned char)datalen;
+    s->deflater.next_in = (Bytef*)data;
+    s->deflater.avail_in = (uInt)datalen;
+    s->deflater.next_out = buffer + DEFLATE_HEADER_LENGTH;
+    s->deflater.avail_out = (uInt)(datalen - DEFLATE_HEADER_LENGTH);
+    // A payload compressed beyond the ratio would not be decoded by the receivers.
+    if (deflate(&s->deflater, Z_FINISH) != Z_STREAM_END || datalen > s->deflater.total_out * maxRatio)
+    {
+        free(buffer);
+        goto exit;
+    }
+    *output = buffer;
+    *outputlen = DEFLATE_HEADER_LENGTH + s->deflater.total_out;
+    rc = 1;
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+/*!
+ *  @abstract Decode a payload of MQTTAsync_deflateCodec.
+ *  @discussion The decoded length in the header is only trusted as a limit: the buffer starts small and grows as the stream really decodes, so that a payload claiming a large length costs no more than it decodes to.
+ */
+int PayloadCodecs_inflate(void* context, void const* data, size_t datalen, void** output, size_t* outputlen)
+{
+    int rc = 0;
+    unsigned char const* header = data;
+    unsigned char* buffer = NULL;
+    size_t maxLength, maxRatio;
+
+    FUNC_ENTRY;
+    if (datalen < DEFLATE_HEADER_LENGTH) { goto exit; }
+    size_t const length = ((size_t)header[4] << 24) | ((size_t)header[5] << 16) | ((size_t)header[6] << 8) | header[7];
+    PayloadCodecs_limits(context, &maxLength, &maxRatio);
+    if (length > maxLength || length > (datalen - DEFLATE_HEADER_LENGTH) * maxRatio) { goto exit; }
+
+    deflateStreams* s = PayloadCodecs_streams();
+    if (s->inflating) {
+        inflateReset(&s->inflater);
+    } else {
+        memset(&s->inflater, 0, sizeof(z_stream));
+        if (inflateInit(&s->inflater) != Z_OK) { goto exit; }
+        s->inflating = true;
+    }
+
+    size_t capacity = (length < DEFLATE_INITIAL_CAPACITY) ? length : DEFLATE_INITIAL_CAPACITY;
+    if ((buffer = malloc((capacity > 0) ? capacity : 1)) == NULL) { goto exit; }
+    s->inflater.next_in = (Bytef*)header + DEFLATE_HEADER_LENGTH;
+    s->inflater.avail_in = (uInt)(datalen - DEFLATE_HEADER_LENGTH);
+    for (;;)
+    {
+        s->inflater.next_out = buffer + s->inflater.total_out;
+        s->inflater.avail_out = (uInt)(capacity - s->inflater.total_out);
+        int const z = inflate(&s->inflater, Z_NO_FLUSH);
+        if (z == Z_STREAM_END) { break; }
+        // Room left means the stream is corrupt or cut short; no room left at the declared length, that it decodes to more.
+        if ((z != Z_OK && z != Z_BUF_ERROR) || s->inflater.avail_out > 0 || capacity >= length) { goto exit; }
+
+        capacity = (capacity > length / 2) ? length : capacity * 2;
+        unsigned char* grown = realloc(buffer, capacity);
+        if (grown == NULL) { goto exit; }
+        buffer = grown;
+    }
+    if (s->inflater.total_out != length) { goto exit; }
+    *output = buffer;
+    *outputlen = length;
+    buffer = NULL;
+    rc = 1;
+exit:
+    if (buffer) { free(buffer); }
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+/*!
+ *  @abstract Get the limits of MQTTAsync_deflateCodec, from its context if set to MQTTAsync_deflateOptions.
+ */
+void PayloadCodecs_limits(void const* context, size_t* maxLength, size_t* maxRatio)
+{
+    MQTTAsync_deflateOptions const* options = context;
+    bool const valid = (options && strncmp(options->struct_id, "MQDO", 4) == 0 && options->struct_version == 0);
+    *maxLength = (valid && options->maxLength > 0) ? options->maxLength : MQTTASYNC_DEFLATE_MAX_LENGTH;
+    *maxRatio = (valid && options->maxRatio > 0) ? options->maxRatio : MQTTASYNC_DEFLATE_MAX_RATIO;
+}
@@ -0,0 +1,58 @@
+/*!
+ *  @abstract Payload codecs of a client, by topic filter (see MQTTAsync_setCodec).
+ *  @discussion The codecs are only changed while the client is disconnected, so they are looked up without locking: encoding runs on the threads publishing, outside of the client library mutexes.
+ */
+#pragma once
+
+#include <stdbool.h>        // C Standard
+#include <stddef.h>         // C Standard
+#include "MQTTAsync.h"      // MQTT (Public)
+#include "LinkedList.h"     // MQTT (Utilities)
+
+#pragma mark Public API
+
+/*!
+ *  @abstract Set or remove the codec of a topic filter.
+ *
+ *  @param codecs the list of codecs of the client.
+ *  @param topicFilter the topic filter.
+ *  @param codec the codec, which is copied, or NULL to remove the one of the filter.
+ *  @return false if memory could not be allocated.
+ */
+bool PayloadCodecs_set(List* codecs, char const* topicFilter, MQTTAsync_codec const* codec);
+
+/*!
+ *  @abstract Encode the payload of a message to be published, if a codec applies to its topic.
+ *
+ *  @param codecs the list of codecs of the client.
+ *  @param topic the topic of the message.
+ *  @param topiclen the length of the topic.
+ *  @param payload the payload.
+ *  @param payloadlen the length of the payload.
+ *  @param encoded returns the encoded payload, to be freed.
+ *  @param encodedlen returns the length of the encoded payload.
+ *  @return true if the payload was encoded, false if it is to be published as it is.
+ */
+bool PayloadCodecs_encode(List const* codecs, char const* topic, size_t topiclen, void const* payload, size_t payloadlen, void** encoded, size_t* encodedlen);
+
+/*!
+ *  @abstract Decode the payload of a message received, if a codec applies to its topic and the payload carries its marker.
+ *
+ *  @param codecs the list of codecs of the client.
+ *  @param topic the topic of the message.
+ *  @param topiclen the length of the topic.
+ *  @param payload the payload.
+ *  @param payloadlen the length of the payload.
+ *  @param decoded returns the decoded payload, to be freed.
+ *  @param decodedlen returns the length of the decoded payload.
+ *  @return true if the payload was decoded, false if it is to be delivered as it is.
+ */
+bool PayloadCodecs_decode(List const* codecs, char const* topic, size_t topiclen, void const* payload, size_t payloadlen, void** decoded, size_t* decodedlen);
+
+/*!
+ *  @abstract Give back a payload encoded by PayloadCodecs_encode, once it has been published (a payloadLender release function).
+ *
+ *  @param context unused.
+ *  @param payload the encoded payload.
+ */
+void PayloadCodecs_release(void* context, void* payload);
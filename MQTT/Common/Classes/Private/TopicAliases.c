@@ -0,0 +1,196 @@
+#include "TopicAliases.h"   // Header
+#include "StackTrace.h"     // MQTT (Utilities)
+
+#include <stdlib.h>         // C Standard
+#include <string.h>         // C Standard
+
+#include "Heap.h"           // MQTT (Utilities)
+
+#pragma mark - Definitions
+
+/*!
+ *  @abstract A topic with an alias.
+ *  @discussion The topic is kept after the structure, so that it is never the start of an allocation (see Heap_findItem in MQTTProtocol_storePublication).
+ */
+struct topicAlias
+{
+    int alias;
+    unsigned int hash;
+    topicAlias* chain;      // Next outbound topic in the same hash bucket.
+    topicAlias* newer;      // Outbound topics used more recently, and less recently.
+    topicAlias* older;
+    size_t topiclen;
+    char topic[];
+};
+
+#pragma mark - Private prototypes
+
+unsigned int TopicAliases_hash(char const* topic, size_t topiclen);
+topicAlias* TopicAliases_new(int alias, char const* topic, size_t topiclen);
+void TopicAliases_unchain(topicAliases* aliases, topicAlias* entry);
+void TopicAliases_use(topicAliases* aliases, topicAlias* entry);
+
+#pragma mark - Public API
+
+void TopicAliases_reset(topicAliases* aliases, int maximum)
+{
+    FUNC_ENTRY;
+    for (int i = 0; aliases->aliases && i < aliases->maximum; ++i)
+    {
+        if (aliases->aliases[i]) { free(aliases->aliases[i]); }
+    }
+    if (aliases->aliases) { free(aliases->aliases); }
+    if (aliases->buckets) { free(aliases->buckets); }
+    memset(aliases, 0, sizeof(topicAliases));
+    // Not calloc: Heap.h tracks malloc, and its free only releases what it tracks.
+    if (maximum > 0 && (aliases->aliases = malloc((size_t)maximum * sizeof(topicAlias*))) != NULL)
+    {
+        memset(aliases->aliases, 0, (size_t)maximum * sizeof(topicAlias*));
+        aliases->maximum = maximum;
+    }
+    FUNC_EXIT;
+}
+
+int TopicAliases_assign(topicAliases* aliases, char const* topic, size_t topiclen, bool* known)
+{
+    int alias = 0;
+
+    FUNC_ENTRY;
+    *known = false;
+    if (aliases->maximum == 0) { goto exit; }
+    if (aliases->buckets == NULL)
+    {   // A power of two at least twice the number of aliases keeps the chains short.
+        unsigned int buckets = 2;
+        while (buckets < 2 * (unsigned int)aliases->maximum) { buckets *= 2; }
+        if ((aliases->buckets = malloc(buckets * sizeof(topicAlias*))) == NULL) { goto exit; }
+        memset(aliases->buckets, 0, buckets * sizeof(topicAlias*));
+        aliases->mask = buckets - 1;
+    }
+
+    unsigned int const hash = TopicAliases_hash(topic, topiclen);
+    topicAlias* entry = aliases->buckets[hash & aliases->mask];
+    while (entry && (entry->hash != hash || entry->topiclen != topiclen || memcmp(entry->topic, topic, topiclen) != 0))
+    {
+        entry = entry->chain;
+    }
+
+    if (entry)
+    {
+        *known = true;
+    }
+    else
+    {   // Take a new alias while there are some left, and the least recently used one after that.
+        bool const fresh = (aliases->count < aliases->maximum);
+        if ((entry = TopicAliases_new((fresh) ? aliases->count + 1 : aliases->oldest->alias, topic, topiclen)) == NULL) { goto exit; }
+        if (fresh) { ++aliases->count; }
+        entry->hash = hash;
+        topicAlias* const old = aliases->aliases[entry->alias - 1];
+        if (old)
+        {
+            TopicAliases_unchain(aliases, old);
+            free(old);
+        }
+        aliases->aliases[entry->alias - 1] = entry;
+        entry->chain = aliases->buckets[hash & aliases->mask];
+        aliases->buckets[hash & aliases->mask] = entry;
+    }
+    TopicAliases_use(aliases, entry);
+    alias = entry->alias;
+exit:
+    FUNC_EXIT_RC(alias);
+    return alias;
+}
+
+bool TopicAliases_set(topicAliases* aliases, int alias, char const* topic, size_t topiclen)
+{
+    int rc = false;
+
+    FUNC_ENTRY;
+    if (alias < 1 || alias > aliases->maximum) { goto exit; }
+
+    topicAlias* entry = aliases->aliases[alias - 1];
+    if (entry && entry->topiclen == topiclen && memcmp(entry->topic, topic, topiclen) == 0)
+    {
+        rc = true;  // The server sends the topic again with an alias it already set.
+        goto exit;
+    }
+    if ((entry = TopicAliases_new(alias, topic, topiclen)) == NULL) { goto exit; }
+    if (aliases->aliases[alias - 1]) { free(aliases->aliases[alias - 1]); }
+    aliases->aliases[alias - 1] = entry;
+    rc = true;
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+char* TopicAliases_get(topicAliases const* aliases, int alias, size_t* topiclen)
+{
+    if (alias < 1 || alias > aliases->maximum || aliases->aliases[alias - 1] == NULL) { return NULL; }
+
+    topicAlias* const entry = aliases->aliases[alias - 1];
+    *topiclen = entry->topiclen;
+    return entry->topic;
+}
+
+#pragma mark - Private functionality
+
+/*!
+ *  @abstract FNV-1a hash of a topic.
+ */
+unsigned int TopicAliases_hash(char const* topic, size_t topiclen)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < topiclen; ++i)
+    {
+        hash = (hash ^ (unsigned char)topic[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*!
+ *  @abstract Allocate a topic with an alias, null terminated.
+ *
+ *  @return the topic, or NULL if memory could not be allocated.
+ */
+topicAlias* TopicAliases_new(int alias, char const* topic, size_t topiclen)
+{
+    topicAlias* entry = malloc(sizeof(topicAlias) + topiclen + 1);
+    if (entry == NULL) { return NULL; }
+
+    memset(entry, 0, sizeof(topicAlias));
+    entry->alias = alias;
+    entry->topiclen = topiclen;
+    memcpy(entry->topic, topic, topiclen);
+    entry->topic[topiclen] = '\0';
+    return entry;
+}
+
+/*!
+ *  @abstract Take an outbound topic out of its hash bucket and out of the recently used list.
+ */
+void TopicAliases_unchain(topicAliases* aliases, topicAlias* entry)
+{
+    topicAlias** link = &aliases->buckets[entry->hash & aliases->mask];
+    while (*link != entry) { link = &(*link)->chain; }
+    *link = entry->chain;
+
+    if (entry->newer) { entry->newer->older = entry->older; } else { aliases->newest = entry->older; }
+    if (entry->older) { entry->older->newer = entry->newer; } else { aliases->oldest = entry->newer; }
+    entry->newer = entry->older = NULL;
+}
+
+/*!
+ *  @abstract Move an outbound topic to the front of the recently used list.
+ */
+void TopicAliases_use(topicAliases* aliases, topicAlias* entry)
+{
+    if (aliases->newest == entry) { return; }
+
+    if (entry->newer) { entry->newer->older = entry->older; }
+    if (entry->older) { entry->older->newer = entry->newer; } else if (aliases->oldest == entry) { aliases->oldest = entry->newer; }
+    entry->newer = NULL;
+    entry->older = aliases->newest;
+    if (aliases->newest) { aliases->newest->newer = entry; }
+    aliases->newest = entry;
+    if (aliases->oldest == NULL) { aliases->oldest = entry; }
+}
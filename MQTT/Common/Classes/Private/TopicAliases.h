@@ -0,0 +1,70 @@
+/*!
+ *  @abstract Topic aliases of an MQTT 5 connection.
+ *  @discussion A topic alias is a number standing in for a topic name in PUBLISH packets. The first packet using an alias carries both, and later ones only the number, until the alias is given to another topic. Aliases only last as long as the connection, and each direction has its own, limited by the Topic Alias Maximum of the receiving side.
+ */
+#pragma once
+
+#include <stdbool.h>    // C Standard
+#include <stddef.h>     // C Standard
+
+#pragma mark Definitions
+
+typedef struct topicAlias topicAlias;
+
+/*!
+ *  @abstract The topic aliases of one direction of a connection.
+ *  @discussion Outbound aliases go to the topics most recently published: once they are all taken, the one least recently used is given to the new topic. Inbound aliases are whatever the server set them to.
+ */
+typedef struct
+{
+    int maximum;            // Highest alias that may be used, 0 for none.
+    topicAlias** aliases;   // The topic of each alias, indexed by alias - 1.
+    topicAlias** buckets;   // Hash table of the outbound topics.
+    unsigned int mask;      // Number of buckets - 1.
+    int count;              // Outbound aliases given so far.
+    topicAlias* newest;     // Outbound topics, most recently used first.
+    topicAlias* oldest;
+} topicAliases;
+
+#pragma mark Public API
+
+/*!
+ *  @abstract Forget all aliases, as a new connection starts.
+ *
+ *  @param aliases the aliases of one direction of the connection.
+ *  @param maximum the highest alias the other side accepts from now on, 0 for none.
+ */
+void TopicAliases_reset(topicAliases* aliases, int maximum);
+
+/*!
+ *  @abstract Get the alias to publish a topic with.
+ *
+ *  @param aliases the outbound aliases.
+ *  @param topic the topic.
+ *  @param topiclen the length of the topic.
+ *  @param known returns whether the server already knows the alias, so that the topic can be left out of the packet.
+ *  @return the alias, or 0 to publish without one.
+ */
+int TopicAliases_assign(topicAliases* aliases, char const* topic, size_t topiclen, bool* known);
+
+/*!
+ *  @abstract Record the topic the server gave an alias to.
+ *
+ *  @param aliases the inbound aliases.
+ *  @param alias the alias.
+ *  @param topic the topic.
+ *  @param topiclen the length of the topic.
+ *  @return false if the alias is out of range (a protocol error) or memory could not be allocated.
+ */
+bool TopicAliases_set(topicAliases* aliases, int alias, char const* topic, size_t topiclen);
+
+/*!
+ *  @abstract Get the topic of an inbound alias.
+ *  @discussion The topic stays valid until the alias is set again or the aliases are reset.
+ *
+ *  @param aliases the inbound aliases.
+ *  @param alias the alias.
+ *  @param topiclen returns the length of the topic.
+ *  @return the null terminated topic, or NULL if the server never set the alias (a protocol error).
+ */
+char* TopicAliases_get(topicAliases const* aliases, int alias, size_t* topiclen);
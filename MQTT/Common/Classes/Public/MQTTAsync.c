@@ -14,6 +14,7 @@
 #include "MQTTProtocolOut.h"    // MQTT (Public)
 #include "Thread.h"             // MQTT (Utilities)
 #include "SocketBuffer.h"       // MQTT (Web)
+#include "PayloadCodecs.h"      // MQTT (Private)
 #include "StackTrace.h"         // MQTT (Web)
 #include "Heap.h"               // MQTT (Utilities)
 
@@ -21,6 +22,14 @@
 #define BUILD_TIMESTAMP "##MQTTCLIENT_BUILD_TAG##"
 #define CLIENT_VERSION  "##MQTTCLIENT_VERSION_TAG##"
 
+#if !defined(min)
+    #define min(A,B) ( (A) < (B) ? (A):(B))
+#endif
+
+#if !defined(max)
+    #define max(A,B) ( (A) > (B) ? (A):(B))
+#endif
+
 #pragma mark - Definitions
 
 /*!
@@ -34,6 +43,7 @@ typedef struct
     MQTTAsync_token token;
     void* context;
     struct timeval start_time;
+    int timeout;    // Time (ms) to wait for the response once sent, 0 for no limit (see MQTTAsync_responseOptions).
     union
     {
         struct
@@ -41,19 +51,27 @@ typedef struct
             int count;
             char** topics;
             int* qoss;
+            MQTTAsync_token next;   // Token of the next command coalesced into the same packet (whose message id is the token of the first), 0 for the last.
+            int first;              // Index of the first topic in that packet, and in the QoS list of its SUBACK.
         } sub;
         struct
         {
             int count;
             char** topics;
+            MQTTAsync_token next;   // Token of the next command coalesced into the same packet (whose message id is the token of the first), 0 for the last.
         } unsub;
         struct
         {
             char* destinationName;
+            size_t topiclen;        // Length of destinationName, worked out once when the command is queued.
             size_t payloadlen;
             void* payload;
+            int inlined;            // destinationName, and payload unless it is lent, are stored right after the command, and freed with it.
+            payloadLender lender;   // Set while the command holds a payload lent by the application, given back when the command is freed.
+            SocketBuffer_stream const* stream;  // Set if the payload is streamed (see MQTTAsync_sendStream), lent like a payload, and payload is NULL.
             int qos;
             int retained;
+            unsigned long write;    // Id of the queued packet, while a QoS 0 publish is still being written (see SocketBuffer_lastWriteId).
         } pub;
         struct
         {
@@ -79,14 +97,21 @@ typedef struct
  *  @field c Data related to one client.
  *  @field cl Callback for connection lost.
  *  @field ma Callback for message arrived.
+ *  @field mca Callback for a chunk of a large message arrived (see MQTTAsync_setChunkedDelivery).
  *  @field dc Callback for message delivery completed
  *  @field context The context to be associated with the main callbacks.
  *  @field connect Connect operation properties.
  *  @field disconnect Disconnect operation properties.
- *  @field pending_write Is there a socket write pending?
+ *  @field connectTimer Expires as the connect operation times out.
+ *  @field disconnectTimer Expires as the disconnect operation stops waiting for the messages in flight.
+ *  @field commands The commands of the client waiting to be processed, in order.
+ *  @field runnable Whether the client is in the run queue of the send thread, or taking its turn there.
+ *  @field turn Links the client into the run queue.
  *  @field responses <#discussion#>
+ *  @field responseIndex The elements of responses by token, for the commands which have one.
  *  @field command_seqno <#discussion#>
  *  @field pack <#discussion#>
+ *  @field codecs Payload codecs by topic filter (see MQTTAsync_setCodec), NULL until one is set.
  */
 typedef struct MQTTAsync_struct
 {
@@ -95,14 +120,21 @@ typedef struct MQTTAsync_struct
     Clients* c;
     MQTTAsync_connectionLost* cl;
     MQTTAsync_messageArrived* ma;
+    MQTTAsync_messageChunkArrived* mca;
     MQTTAsync_deliveryComplete* dc;
     void* context;
     MQTTAsync_command connect;
     MQTTAsync_command disconnect;
-    MQTTAsync_command* pending_write;
+    timer connectTimer;
+    timer disconnectTimer;
+    List* commands;
+    bool runnable;
+    ListElement turn;
     List* responses;
+    messageTable responseIndex;
     unsigned int command_seqno;
     MQTTPacket* pack;
+    List* codecs;
 } MQTTAsyncs;
 
 typedef struct
@@ -118,8 +150,46 @@ typedef struct
     MQTTAsync_command command;
     MQTTAsyncs* client;
     unsigned int seqno; // Only used on restore
+    timer responseTimer;    // Expires as the command has waited its timeout for a response; only scheduled while it is in the responses of its client.
+    ListElement element;    // Links the command into the commands or the responses of its client, or the unused commands, one at a time.
+    ListElement part;       // Links the command into the commands sent in one packet, while it is being sent.
+    size_t capacity;        // Bytes after the command in its block, for the topic and payload of a publish command kept for reuse once freed, otherwise 0.
 } MQTTAsync_queuedCommand;
 
+/*!
+ *  @abstract A received message delivered without copying (see zeroCopy in MQTTAsync_connectOptions).
+ *  @discussion The application only sees message, whose topic and payload point into slab. MQTTAsync_freeMessage recognizes it by its eyecatcher (MQTTASYNC_VIEW_ID), releases the slab and keeps the view for the next message.
+ */
+typedef struct MQTTAsync_view
+{
+    MQTTAsync_message message;      // Must come first
+    SocketBuffer_slab* slab;
+    struct MQTTAsync_view* next;    // Next unused view, while in the pool
+} MQTTAsync_view;
+
+#define MQTTASYNC_VIEW_ID "MQTV"        // Eyecatcher of the messages that are views
+#define MQTTASYNC_MAX_FREE_VIEWS 256    // Most unused views kept for reuse
+
+/*!
+ *  @abstract A payload streamed with MQTTAsync_sendStream, lent to the message it is published with.
+ *  @discussion It is the context of the lender of the message, whose release calls onRelease and frees it.
+ */
+typedef struct
+{
+    SocketBuffer_stream stream;     // Must come first
+    MQTTAsync_onRelease* onRelease;
+    void* releaseContext;
+} MQTTAsync_streamed;
+
+#define MQTTASYNC_MAX_REMAINING_LENGTH 268435455    // Largest remaining length of an MQTT packet
+
+#define MQTTASYNC_SEND_WAIT 1000    // Longest time (ms) the send thread waits for commands
+
+#define MQTTASYNC_SEND_BATCH 16     // Most commands of a client the send thread processes in one turn
+
+#define MQTTASYNC_MAX_FREE_COMMANDS 256     // Most unused publish commands kept for reuse
+#define MQTTASYNC_MAX_POOLED_INLINE 4096    // Largest topic and payload a publish command kept for reuse holds
+
 #pragma mark - Variables
 
 static pthread_mutex_t mqttasync_mutex_store = PTHREAD_MUTEX_INITIALIZER;
@@ -127,7 +197,7 @@ static pthread_mutex_t* mqttasync_mutex = &mqttasync_mutex_store;       // Point
 static pthread_mutex_t mqttcommand_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t* mqttcommand_mutex = &mqttcommand_mutex_store;   // Pointer to mutex that reign over command related functionality.
 
-static cond_type_struct send_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+static cond_type_struct send_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, 0 };
 static cond_type_struct* send_cond = &send_cond_store;                  // Pointer to condition variable used in the <i>sending</i> thread.
 
 enum MQTTAsync_threadStates { STOPPED, STARTING, RUNNING, STOPPING };   // Possible thread states.
@@ -136,12 +206,21 @@ enum MQTTAsync_threadStates sendThread_state = STOPPED;
 static pthread_t receiveThread_id = 0;      // Thread used to receive MQTT packages
 enum MQTTAsync_threadStates receiveThread_state = STOPPED;
 
-static ClientStates ClientState = { CLIENT_VERSION, NULL }; // { Version, Client list }
+static ClientStates ClientState = { .version = CLIENT_VERSION, .clients = NULL, .timers = { 0 } };   // No client, no timer scheduled
 ClientStates* bstate = &ClientState;        // The state of all the MQTTAsync handles in the system
 static List* handles = NULL;                // All MQTTAsync handles
-static List* commands = NULL;               // List of all commands to be processed
+static List* runnable = NULL;               // Run queue of the send thread: the handles with commands to be processed, in turn
 static volatile bool initialized = false;   // Whether the MQTTAsync has been previously initialised
 
+static MQTTAsync_view* free_views = NULL;   // Unused views, so that delivering a message does not allocate memory
+static int free_view_count = 0;
+static pthread_mutex_t view_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t* view_mutex = &view_mutex_store;    // Guards free_views: views are freed by the application threads.
+
+static List free_commands;                  // Unused publish commands, so that queueing a message does not allocate memory
+static pthread_mutex_t command_pool_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t* command_pool_mutex = &command_pool_mutex_store;    // Guards free_commands: commands are queued by the application threads.
+
 static int tostop = 0;  // It communicates when the user wants to stop the whole MQTT service
 extern Sockets s;
 MQTTProtocol state;
@@ -159,6 +238,7 @@ int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* o
 int MQTTAsync_disconnect_internal(MQTTAsync handle, int timeout);
 void MQTTAsync_terminate(void);
 void MQTTAsync_stop();
+MQTTAsyncs* MQTTAsync_findSocket(int socket);
 
 // Connection
 int MQTTAsync_checkConn(MQTTAsync_command* command, MQTTAsyncs* client);
@@ -168,16 +248,36 @@ void MQTTAsync_freeConnect(MQTTAsync_command command);
 
 // Commands
 int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size);
-void MQTTAsync_processCommand();
+int MQTTAsync_queuePublish(MQTTAsyncs* m, char const* destinationName, size_t payloadlen, void* payload, int qos, int retained, payloadLender const* lender, SocketBuffer_stream const* stream, MQTTAsync_responseOptions* response);
+void MQTTAsync_releaseStream(void* context, void* payload);
+bool MQTTAsync_isStreamed(MQTTAsync_queuedCommand const* command);
+long MQTTAsync_processCommands(int* processed);
+bool MQTTAsync_processCommand(MQTTAsyncs* m, long* wait);
+void MQTTAsync_makeRunnable(MQTTAsyncs* m, bool first);
+int MQTTAsync_topicCount(MQTTAsync_queuedCommand const* command);
+bool MQTTAsync_holdCoalesced(ListElement const* elem, long* wait);
+void MQTTAsync_takeCoalesced(MQTTAsync_queuedCommand* command, List* parts);
 void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m);
+void MQTTAsync_addResponse(MQTTAsync_queuedCommand* command);
+void MQTTAsync_scheduleResponse(MQTTAsync_queuedCommand* command, List const* parts);
+MQTTAsync_queuedCommand* MQTTAsync_takeResponse(MQTTAsyncs* m, MQTTAsync_token token, int type);
 void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command);
 void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command);
-void MQTTAsync_checkTimeouts();
+MQTTAsync_queuedCommand* MQTTAsync_newPublish(size_t inlined);
+void MQTTAsync_recycleCommand(MQTTAsync_queuedCommand* command);
+void MQTTAsync_connectTimeout(void* context, void* target);
+void MQTTAsync_disconnectTimeout(void* context, void* target);
+void MQTTAsync_scheduleTimeout(timer* t, MQTTAsync_command const* command, long timeout);
+void MQTTAsync_responseTimeout(void* context, void* target);
 
 // Messages
 int MQTTAsync_assignMsgId(MQTTAsyncs* m);
 int MQTTAsync_deliverMessage(MQTTAsyncs* m, char const* topicName, size_t topicLen, MQTTAsync_message* mm);
 void MQTTAsync_emptyMessageQueue(Clients* client);
+MQTTAsync_message* MQTTAsync_newView(Publish const* publish, int socket);
+void MQTTAsync_freeView(MQTTAsync_view* view);
+bool MQTTAsync_isView(MQTTAsync_message const* message);
+bool MQTTAsync_windowFull(Clients const* client);
 
 // Threads, mutexes, and clocks
 void MQTTAsync_lock_mutex(pthread_mutex_t* amutex);
@@ -185,16 +285,16 @@ void MQTTAsync_unlock_mutex(pthread_mutex_t* amutex);
 struct timeval MQTTAsync_start_clock(void);
 long MQTTAsync_elapsed(struct timeval start);
 void* MQTTAsync_sendThread(void* n);
+void MQTTAsync_flushAll(void);
 void* MQTTAsync_receiveThread(void* n);
 
 // Comparison functions
-bool clientSockCompare(void const* a, void const* b);
 bool clientStructCompare(void const* a, void const* b);
 bool cmdMessageIDCompare(void const* a, void const* b);
 
 // File related functions
-void MQTTAsync_writeComplete(int socket);
-void MQTTProtocol_checkPendingWrites();
+void MQTTAsync_writeComplete(int socket, pending_writes* pw);
+void MQTTProtocol_checkPendingWrites(pending_writes const* done);
 
 #if !defined(NO_PERSISTENCE)
 int MQTTAsync_unpersistCommand(MQTTAsync_queuedCommand* qcmd);
@@ -229,7 +329,7 @@ MQTTCode MQTTAsync_create(MQTTAsync* handle, char const* restrict serverURI, cha
         Socket_outInitialize();
         Socket_setWriteCompleteCallback(MQTTAsync_writeComplete);
         handles = ListInitialize();
-        commands = ListInitialize();
+        runnable = ListInitialize();
         #if defined(OPENSSL)
         SSLSocket_initialize();
         #endif
@@ -238,6 +338,8 @@ MQTTCode MQTTAsync_create(MQTTAsync* handle, char const* restrict serverURI, cha
     
     MQTTAsyncs* asyncClient = malloc(sizeof(MQTTAsyncs));
     memset(asyncClient, '\0', sizeof(MQTTAsyncs));
+    TimerWheel_initTimer(&asyncClient->connectTimer, MQTTAsync_connectTimeout, asyncClient, NULL);
+    TimerWheel_initTimer(&asyncClient->disconnectTimer, MQTTAsync_disconnectTimeout, asyncClient, NULL);
     *handle = asyncClient;
     
     if (strncmp(URI_TCP, serverURI, strlen(URI_TCP)) == 0)
@@ -252,6 +354,7 @@ MQTTCode MQTTAsync_create(MQTTAsync* handle, char const* restrict serverURI, cha
     }
     #endif
     asyncClient->serverURI = MQTTStrdup(serverURI);
+    asyncClient->commands = ListInitialize();
     asyncClient->responses = ListInitialize();
     ListAppend(handles, asyncClient, sizeof(MQTTAsyncs));
     
@@ -308,6 +411,53 @@ int MQTTAsync_setCallbacks(MQTTAsync handle, void* context, MQTTAsync_connection
     return rc;
 }
 
+int MQTTAsync_setCodec(MQTTAsync handle, char const* topicFilter, MQTTAsync_codec const* codec)
+{
+    int rc = MQTTCODE_SUCCESS;
+    MQTTAsyncs* m = handle;
+    
+    FUNC_ENTRY;
+    MQTTAsync_lock_mutex(mqttasync_mutex);
+    
+    // The codecs are looked up without locking, so they must not change while messages flow.
+    if (m == NULL || topicFilter == NULL || m->c->connect_state != 0 || m->c->connected)
+        rc = MQTTCODE_FAILURE;
+    else if (codec && (strncmp(codec->struct_id, "MQCC", 4) != 0 || codec->struct_version != 0))
+        rc = MQTTCODE_BAD_STRUCTURE;
+    else if (m->codecs == NULL && (m->codecs = ListInitialize()) == NULL)
+        rc = MQTTCODE_FAILURE;
+    else if (!PayloadCodecs_set(m->codecs, topicFilter, codec))
+        rc = MQTTCODE_FAILURE;
+    
+    MQTTAsync_unlock_mutex(mqttasync_mutex);
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+int MQTTAsync_setChunkedDelivery(MQTTAsync handle, size_t threshold, MQTTAsync_messageChunkArrived* mca)
+{
+    int rc = MQTTCODE_SUCCESS;
+    MQTTAsyncs* m = handle;
+    
+    FUNC_ENTRY;
+    MQTTAsync_lock_mutex(mqttasync_mutex);
+    
+    // The threshold is handed to the packet parser of each new connection.
+    if (m == NULL || (threshold > 0 && mca == NULL) || m->c->connect_state != 0 || m->c->connected)
+    {
+        rc = MQTTCODE_FAILURE;
+    }
+    else
+    {
+        m->c->chunkThreshold = threshold;
+        m->mca = (threshold > 0) ? mca : NULL;
+    }
+    
+    MQTTAsync_unlock_mutex(mqttasync_mutex);
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
 int MQTTAsync_connect(MQTTAsync handle, MQTTAsync_connectOptions const* options)
 {
     int rc = MQTTCODE_SUCCESS;
@@ -315,7 +465,7 @@ int MQTTAsync_connect(MQTTAsync handle, MQTTAsync_connectOptions const* options)
     FUNC_ENTRY;
     if (options == NULL) { rc = MQTTCODE_NULL_PARAMETER; goto exit; }
     
-    if ( strncmp(options->struct_id, "MQTC", 4) != 0 || (options->struct_version != 0 && options->struct_version != 1 && options->struct_version != 2 && options->struct_version != 3) )
+    if ( strncmp(options->struct_id, "MQTC", 4) != 0 || (options->struct_version != 0 && options->struct_version != 1 && options->struct_version != 2 && options->struct_version != 3 && options->struct_version != 4 && options->struct_version != 5 && options->struct_version != 6 && options->struct_version != 7 && options->struct_version != 8) )
     { rc = MQTTCODE_BAD_STRUCTURE; goto exit; }
     
     if (options->will)  // Check validity of will options structure
@@ -329,6 +479,11 @@ int MQTTAsync_connect(MQTTAsync handle, MQTTAsync_connectOptions const* options)
         if (strncmp(options->ssl->struct_id, "MQTS", 4) != 0 || options->ssl->struct_version != 0) { rc = MQTTCODE_BAD_STRUCTURE; goto exit; }
     }
     
+    if (options->struct_version >= 5 && options->socket)    // Check validity of socket options structure
+    {
+        if (strncmp(options->socket->struct_id, "MQTN", 4) != 0 || options->socket->struct_version != 0) { rc = MQTTCODE_BAD_STRUCTURE; goto exit; }
+    }
+    
     if ( (options->username && !UTF8_validateString(options->username)) || (options->password && !UTF8_validateString(options->password)) ) { rc = MQTTCODE_BAD_UTF8_STRING; goto exit; }
     
     MQTTAsyncs* m = handle;
@@ -356,7 +511,26 @@ int MQTTAsync_connect(MQTTAsync handle, MQTTAsync_connectOptions const* options)
     m->c->keepAliveInterval = options->keepAliveInterval;
     m->c->cleansession = options->cleansession;
     m->c->maxInflightMessages = options->maxInflight;
-    m->c->MQTTVersion = (options->struct_version == 3) ? options->MQTTVersion : 0;
+    m->c->MQTTVersion = (options->struct_version >= 3) ? options->MQTTVersion : 0;
+    m->c->maxWriteDelay = (options->struct_version >= 4) ? options->maxWriteDelay : 0;
+    m->c->zeroCopy = (options->struct_version >= 6) ? options->zeroCopy : 0;
+    m->c->topicAliasMaximum = (options->struct_version >= 7 && options->topicAliasMaximum > 0) ? min(options->topicAliasMaximum, 65535) : 0;
+    m->c->coalesceDelay = (options->struct_version >= 8 && options->subscribeCoalesceDelay > 0) ? options->subscribeCoalesceDelay : 0;
+    m->c->coalesceTopics = (options->struct_version >= 8 && options->subscribeCoalesceTopics > 0) ? options->subscribeCoalesceTopics : 0;
+    memset(&m->c->sockopts, 0, sizeof(Socket_options));
+    if (options->struct_version >= 5 && options->socket)
+    {
+        MQTTAsync_socketOptions const* so = options->socket;
+        m->c->sockopts.nodelay = so->noDelay;
+        m->c->sockopts.sndbuf = so->sendBufferSize;
+        m->c->sockopts.rcvbuf = so->receiveBufferSize;
+        m->c->sockopts.usertimeout = so->userTimeout;
+        m->c->sockopts.keepalive = so->tcpKeepAlive;
+        m->c->sockopts.keepidle = so->tcpKeepAliveIdle;
+        m->c->sockopts.keepintvl = so->tcpKeepAliveInterval;
+        m->c->sockopts.keepcnt = so->tcpKeepAliveCount;
+        m->c->sockopts.quickack = so->quickAck;
+    }
     
     if (m->c->will)
     {
@@ -518,6 +692,7 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, int
         sub->command.onSuccess = response->onSuccess;
         sub->command.onFailure = response->onFailure;
         sub->command.context = response->context;
+        sub->command.timeout = (response->struct_version >= 1 && response->timeout > 0) ? response->timeout : 0;
         response->token = sub->command.token;
     }
     sub->command.type = SUBSCRIBE;
@@ -590,6 +765,7 @@ int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, M
         unsub->command.onSuccess = response->onSuccess;
         unsub->command.onFailure = response->onFailure;
         unsub->command.context = response->context;
+        unsub->command.timeout = (response->struct_version >= 1 && response->timeout > 0) ? response->timeout : 0;
         response->token = unsub->command.token;
     }
     unsub->command.details.unsub.count = count;
@@ -604,48 +780,42 @@ exit:
 }
 
 int MQTTAsync_send(MQTTAsync handle, const char* destinationName, size_t payloadlen, void* payload, int qos, int retained, MQTTAsync_responseOptions* response)
+{
+    return MQTTAsync_queuePublish(handle, destinationName, payloadlen, payload, qos, retained, NULL, NULL, response);
+}
+
+int MQTTAsync_sendOwned(MQTTAsync handle, char const* destinationName, size_t payloadlen, void* payload, int qos, int retained, MQTTAsync_onRelease* onRelease, void* releaseContext, MQTTAsync_responseOptions* response)
+{
+    if (onRelease == NULL) { return MQTTCODE_NULL_PARAMETER; }
+    
+    payloadLender const lender = { onRelease, releaseContext };
+    return MQTTAsync_queuePublish(handle, destinationName, payloadlen, payload, qos, retained, &lender, NULL, response);
+}
+
+int MQTTAsync_sendStream(MQTTAsync handle, char const* destinationName, MQTTAsync_stream const* stream, int qos, int retained, MQTTAsync_responseOptions* response)
 {
     int rc = MQTTCODE_SUCCESS;
-    MQTTAsyncs* m = handle;
-    MQTTAsync_queuedCommand* pub;
-    int msgid = 0;
     
     FUNC_ENTRY;
-    if (m == NULL || m->c == NULL)
-        rc = MQTTCODE_FAILURE;
-    else if (m->c->connected == 0)
-        rc = MQTTCODE_DISCONNECT;
-    else if (!UTF8_validateString(destinationName))
-        rc = MQTTCODE_BAD_UTF8_STRING;
-    else if (qos < 0 || qos > 2)
-        rc = MQTTCODE_BAD_QOS;
-    else if (qos > 0 && (msgid = MQTTAsync_assignMsgId(m)) == 0)
-        rc = MQTTCODE_NO_MORE_MSGIDS;
-    
-    if (rc != MQTTCODE_SUCCESS)
-        goto exit;
-    
-    /* Add publish request to operation queue */
-    pub = malloc(sizeof(MQTTAsync_queuedCommand));
-    memset(pub, '\0', sizeof(MQTTAsync_queuedCommand));
-    pub->client = m;
-    pub->command.type = PUBLISH;
-    pub->command.token = msgid;
-    if (response)
-    {
-        pub->command.onSuccess = response->onSuccess;
-        pub->command.onFailure = response->onFailure;
-        pub->command.context = response->context;
-        response->token = pub->command.token;
-    }
-    pub->command.details.pub.destinationName = MQTTStrdup(destinationName);
-    pub->command.details.pub.payloadlen = payloadlen;
-    pub->command.details.pub.payload = malloc(payloadlen);
-    memcpy(pub->command.details.pub.payload, payload, payloadlen);
-    pub->command.details.pub.qos = qos;
-    pub->command.details.pub.retained = retained;
-    rc = MQTTAsync_addCommand(pub, sizeof(pub));
-    
+    if (stream == NULL) { rc = MQTTCODE_NULL_PARAMETER; goto exit; }
+    if (strncmp(stream->struct_id, "MQST", 4) != 0 || stream->struct_version != 0) { rc = MQTTCODE_BAD_STRUCTURE; goto exit; }
+    if (stream->length < 0 || stream->length > MQTTASYNC_MAX_REMAINING_LENGTH) { rc = MQTTCODE_FAILURE; goto exit; }
+    if (stream->fd < 0 && stream->producer == NULL) { rc = MQTTCODE_NULL_PARAMETER; goto exit; }
+    
+    /* The stream travels with the message as a lent payload would, and is released with it */
+    MQTTAsync_streamed* streamed = malloc(sizeof(MQTTAsync_streamed));
+    if (streamed == NULL) { rc = MQTTCODE_FAILURE; goto exit; }
+    streamed->stream.length = stream->length;
+    streamed->stream.producer = stream->producer;
+    streamed->stream.context = stream->context;
+    streamed->stream.fd = stream->fd;
+    streamed->stream.fdoffset = stream->offset;
+    streamed->stream.chunksize = (stream->chunkSize > 0) ? stream->chunkSize : SOCKETBUFFER_CHUNK_SIZE;
+    streamed->onRelease = stream->onRelease;
+    streamed->releaseContext = stream->releaseContext;
+    
+    payloadLender const lender = { MQTTAsync_releaseStream, streamed };
+    if ((rc = MQTTAsync_queuePublish(handle, destinationName, (size_t)stream->length, NULL, qos, retained, &lender, &streamed->stream, response)) != MQTTCODE_SUCCESS) { free(streamed); }
 exit:
     FUNC_EXIT_RC(rc);
     return rc;
@@ -674,6 +844,20 @@ exit:
     return rc;
 }
 
+int MQTTAsync_getWriteStatistics(MQTTAsync handle, unsigned long* packets, unsigned long* writes)
+{
+    MQTTAsyncs* m = handle;
+    int rc = MQTTCODE_DISCONNECT;
+    
+    FUNC_ENTRY;
+    MQTTAsync_lock_mutex(mqttasync_mutex);
+    *packets = *writes = 0;
+    if (m && m->c && m->c->net.socket > 0 && Socket_getWriteStats(m->c->net.socket, packets, writes)) { rc = MQTTCODE_SUCCESS; }
+    MQTTAsync_unlock_mutex(mqttasync_mutex);
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
 int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 {
     int rc = MQTTCODE_SUCCESS;
@@ -692,29 +876,23 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
     }
     
     /* calculate the number of pending tokens - commands plus inflight */
-    while (ListNextElement(commands, &current))
-    {
-        MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
-        
-        if (cmd->client == m)
-            count++;
-    }
+    MQTTAsync_lock_mutex(mqttcommand_mutex);
+    count = m->commands->count;
     if (m->c)
         count += m->c->outboundMsgs->count;
     if (count == 0)
+    {
+        MQTTAsync_unlock_mutex(mqttcommand_mutex);
         goto exit; /* no tokens to return */
+    }
     *tokens = malloc(sizeof(MQTTAsync_token) * (count + 1));  /* add space for sentinel at end of list */
     
     /* First add the unprocessed commands to the pending tokens */
     current = NULL;
     count = 0;
-    while (ListNextElement(commands, &current))
-    {
-        MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
-        
-        if (cmd->client == m)
-            (*tokens)[count++] = cmd->command.token;
-    }
+    while (ListNextElement(m->commands, &current))
+        (*tokens)[count++] = ((MQTTAsync_queuedCommand*)(current->content))->command.token;
+    MQTTAsync_unlock_mutex(mqttcommand_mutex);
     
     /* Now add the inflight messages */
     if (m->c && m->c->outboundMsgs->count > 0)
@@ -751,25 +929,19 @@ int MQTTAsync_isComplete(MQTTAsync handle, MQTTAsync_token dt)
     
     /* First check unprocessed commands */
     current = NULL;
-    while (ListNextElement(commands, &current))
+    MQTTAsync_lock_mutex(mqttcommand_mutex);
+    while (ListNextElement(m->commands, &current))
     {
-        MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
-        
-        if (cmd->client == m && cmd->command.token == dt)
-            goto exit;
+        if (((MQTTAsync_queuedCommand*)(current->content))->command.token == dt)
+            break;
     }
+    MQTTAsync_unlock_mutex(mqttcommand_mutex);
+    if (current)
+        goto exit;
     
     /* Now check the inflight messages */
-    if (m->c && m->c->outboundMsgs->count > 0)
-    {
-        current = NULL;
-        while (ListNextElement(m->c->outboundMsgs, &current))
-        {
-            Messages* m = (Messages*)(current->content);
-            if (m->msgid == dt)
-                goto exit;
-        }
-    }
+    if (m->c && MessageTable_get(&m->c->outboundIndex, dt) != NULL)
+        goto exit;
     rc = MQTTASYNC_TRUE; /* Can't find it, so it must be complete */
     
 exit:
@@ -825,8 +997,12 @@ exit:
 void MQTTAsync_freeMessage(MQTTAsync_message** message)
 {
     FUNC_ENTRY;
-    free((*message)->payload);
-    free(*message);
+    if (MQTTAsync_isView(*message)) {
+        MQTTAsync_freeView((MQTTAsync_view*)*message);
+    } else {
+        free((*message)->payload);
+        free(*message);
+    }
     *message = NULL;
     FUNC_EXIT;
 }
@@ -839,6 +1015,16 @@ void MQTTAsync_free(void* memory)
     FUNC_EXIT;
 }
 
+void* MQTTAsync_malloc(size_t size)
+{
+    void* memory;
+    
+    FUNC_ENTRY;
+    memory = malloc(size);
+    FUNC_EXIT;
+    return memory;
+}
+
 void MQTTAsync_destroy(MQTTAsync* handle)
 {
     MQTTAsyncs* m = *handle;
@@ -850,7 +1036,14 @@ void MQTTAsync_destroy(MQTTAsync* handle)
         goto exit;
     
     MQTTAsync_removeResponsesAndCommands(m);
+    MQTTAsync_lock_mutex(mqttcommand_mutex);
+    if (m->runnable) { ListDetachElementNoFree(runnable, &m->turn); }
+    MQTTAsync_unlock_mutex(mqttcommand_mutex);
+    ListFree(m->commands);
     ListFree(m->responses);
+    MessageTable_reset(&m->responseIndex);
+    TimerWheel_cancel(&bstate->timers, &m->connectTimer);
+    TimerWheel_cancel(&bstate->timers, &m->disconnectTimer);
     
     if (m->c)
     {
@@ -869,6 +1062,7 @@ void MQTTAsync_destroy(MQTTAsync* handle)
     }
     
     if (m->serverURI) { free(m->serverURI); }
+    if (m->codecs) { ListFree(m->codecs); }
     if (!ListRemove(handles, m)) { Log(LOG_ERROR, -1, "free error"); }
     *handle = NULL;
     if (bstate->clients->count == 0) { MQTTAsync_terminate(); }
@@ -922,13 +1116,7 @@ int MQTTAsync_connecting(MQTTAsyncs* m)
     FUNC_ENTRY;
     if (m->c->connect_state == 1) /* TCP connect started - check for completion */
     {
-        int error;
-        socklen_t len = sizeof(error);
-        
-        if ((rc = getsockopt(m->c->net.socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len)) == 0)
-            rc = error;
-        
-        if (rc != 0)
+        if ((rc = Socket_connectError(m->c->net.socket)) != 0)
             goto exit;
         
         Socket_clearPendingWrite(m->c->net.socket);
@@ -1028,19 +1216,8 @@ exit:
 
 void MQTTAsync_retry(void)
 {
-    static time_t last = 0L;
-    time_t now;
-    
     FUNC_ENTRY;
-    time(&(now));
-    if (difftime(now, last) > 5)
-    {
-        time(&(last));
-        MQTTProtocol_keepalive(now);
-        MQTTProtocol_retry(now, 1, 0);
-    }
-    else
-        MQTTProtocol_retry(now, 0, 0);
+    TimerWheel_advance(&bstate->timers, TimerWheel_now());
     FUNC_EXIT;
 }
 
@@ -1049,7 +1226,6 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
     struct timeval tp = {0L, 0L};
     static Ack ack;
     MQTTPacket* pack = NULL;
-    static int nosockets_count = 0;
     
     FUNC_ENTRY;
     if (timeout > 0L)
@@ -1062,20 +1238,9 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
     if ((*sock = SSLSocket_getPendingRead()) == -1)
     {
     #endif
-        /* 0 from getReadySocket indicates no work to do, -1 == error, but can happen normally */
+        /* 0 from getReadySocket indicates no work to do, -1 == error, but can happen normally.
+           It blocks until a socket is ready, the timeout expires, or Socket_wakeup is called. */
         *sock = Socket_getReadySocket(0, &tp);
-        if (!tostop && *sock == 0 && (tp.tv_sec > 0L || tp.tv_usec > 0L))
-        {
-            MQTTAsync_sleep(100L);
-            #if 0
-            if (s.clientsds->count == 0)
-            {
-                // 5 seconds with no sockets
-                if (++nosockets_count == 50) { tostop = 1; }
-            }
-            #endif
-        }
-        else { nosockets_count = 0; }
     #if defined(OPENSSL)
     }
     #endif
@@ -1083,8 +1248,7 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
     MQTTAsync_lock_mutex(mqttasync_mutex);
     if (*sock > 0)
     {
-        MQTTAsyncs* m = NULL;
-        if (ListFindItem(handles, sock, clientSockCompare) != NULL) { m = (MQTTAsync)(handles->current->content); }
+        MQTTAsyncs* m = MQTTAsync_findSocket(*sock);
         if (m != NULL)
         {
             if (m->c->connect_state == 1 || m->c->connect_state == 2) {
@@ -1134,13 +1298,15 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
                 
                 ack = (pack->header.bits.type == PUBCOMP) ? *(Pubcomp*)pack : *(Puback*)pack;
                 msgid = ack.msgId;
+                bool const wasFull = (m && MQTTAsync_windowFull(m->c));
                 *rc = (pack->header.bits.type == PUBCOMP) ?
                 MQTTProtocol_handlePubcomps(pack, *sock) : MQTTProtocol_handlePubacks(pack, *sock);
+                if (wasFull && !MQTTAsync_windowFull(m->c)) { Thread_signal_cond(send_cond); }  // A publish may be waiting for the room.
                 if (!m)
                     Log(LOG_ERROR, -1, "PUBCOMP or PUBACK received for no client, msgid %d", msgid);
                 if (m)
                 {
-                    ListElement* current = NULL;
+                    MQTTAsync_queuedCommand* command = NULL;
                     
                     if (m->dc)
                     {
@@ -1148,29 +1314,27 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
                         (*(m->dc))(m->context, msgid);
                     }
                     /* use the msgid to find the callback to be called */
-                    while (ListNextElement(m->responses, &current))
+                    if ((command = MQTTAsync_takeResponse(m, msgid, PUBLISH)) != NULL)
                     {
-                        MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
-                        if (command->command.token == msgid)
+                        if (command->command.onSuccess)
                         {
-                            if (!ListDetach(m->responses, command)) /* then remove the response from the list */
-                                Log(LOG_ERROR, -1, "Publish command not removed from command list");
-                            if (command->command.onSuccess)
-                            {
-                                MQTTAsync_successData data;
-                                
-                                data.token = command->command.token;
-                                data.alt.pub.destinationName = command->command.details.pub.destinationName;
-                                data.alt.pub.message.payload = command->command.details.pub.payload;
-                                data.alt.pub.message.payloadlen = command->command.details.pub.payloadlen;
-                                data.alt.pub.message.qos = command->command.details.pub.qos;
-                                data.alt.pub.message.retained = command->command.details.pub.retained;
-                                Log(TRACE_MIN, -1, "Calling publish success for client %s", m->c->clientID);
-                                (*(command->command.onSuccess))(command->command.context, &data);
-                            }
-                            MQTTAsync_freeCommand(command);
-                            break;
+                            MQTTAsync_successData data;
+                            
+                            data.token = command->command.token;
+                            data.alt.pub.destinationName = command->command.details.pub.destinationName;
+                            data.alt.pub.message.payload = command->command.details.pub.payload;
+                            data.alt.pub.message.payloadlen = command->command.details.pub.payloadlen;
+                            data.alt.pub.message.qos = command->command.details.pub.qos;
+                            data.alt.pub.message.retained = command->command.details.pub.retained;
+                            Log(TRACE_MIN, -1, "Calling publish success for client %s", m->c->clientID);
+                            (*(command->command.onSuccess))(command->command.context, &data);
                         }
+                        MQTTAsync_freeCommand(command);
+                    }
+                    if (m->c->connect_state == -2 && m->c->outboundMsgs->count == 0)
+                    {   // A disconnect was waiting for the last message in flight.
+                        TimerWheel_cancel(&bstate->timers, &m->disconnectTimer);
+                        MQTTAsync_checkDisconnect(m, &m->disconnect);
                     }
                 }
             } else if (pack->header.bits.type == PUBREC) {
@@ -1199,6 +1363,18 @@ void MQTTAsync_sleep(unsigned int const milliseconds)
     FUNC_EXIT;
 }
 
+/*!
+ *  @abstract Find the handle using a socket, through the socket table.
+ *
+ *  @param socket the socket.
+ *  @return the handle, or NULL if no client is using the socket.
+ */
+MQTTAsyncs* MQTTAsync_findSocket(int socket)
+{
+    Clients* client = (Clients*)Socket_getClient(socket);
+    return (client) ? (MQTTAsyncs*)(client->context) : NULL;
+}
+
 void MQTTAsync_closeOnly(Clients* client)
 {
     FUNC_ENTRY;
@@ -1239,8 +1415,8 @@ int MQTTAsync_cleanSession(Clients* client)
 #if !defined(NO_PERSISTENCE)
     rc = MQTTPersistence_clear(client);
 #endif
-    MQTTProtocol_emptyMessageList(client->inboundMsgs);
-    MQTTProtocol_emptyMessageList(client->outboundMsgs);
+    MQTTProtocol_emptyMessageList(client->inboundMsgs, &client->inboundIndex);
+    MQTTProtocol_emptyMessageList(client->outboundMsgs, &client->outboundIndex);
     MQTTAsync_emptyMessageQueue(client);
     client->msgID = 0;
     
@@ -1281,6 +1457,8 @@ void MQTTAsync_stop()
         {
             int count = 0;
             tostop = 1;
+            Socket_wakeup();    // Neither thread has to wait out its timeout to notice.
+            Thread_signal_cond(send_cond);
             while ((sendThread_state != STOPPED || receiveThread_state != STOPPED) && ++count < 100)
             {
                 MQTTAsync_unlock_mutex(mqttasync_mutex);
@@ -1350,10 +1528,33 @@ void MQTTAsync_terminate(void)
     {
         ListElement* elem = NULL;
         ListFree(bstate->clients);
+        while (ListNextElement(handles, &elem))
+        {
+            MQTTAsyncs* m = (MQTTAsyncs*)(elem->content);
+            MQTTAsync_queuedCommand* command;
+            while ((command = ListDetachHeadNoFree(m->commands)) != NULL)
+            {
+                MQTTAsync_freeCommand1(command);
+                free(command);
+            }
+            free(m->commands);
+        }
         ListFree(handles);
-        while (ListNextElement(commands, &elem)) { MQTTAsync_freeCommand1((MQTTAsync_queuedCommand*)(elem->content)); }
-        ListFree(commands);
+        free(runnable);     // Its elements are the turns of the handles.
         handles = NULL;
+        MQTTAsync_lock_mutex(command_pool_mutex);
+        MQTTAsync_queuedCommand* command;
+        while ((command = ListDetachHeadNoFree(&free_commands)) != NULL) { free(command); }
+        MQTTAsync_unlock_mutex(command_pool_mutex);
+        MQTTAsync_lock_mutex(view_mutex);
+        while (free_views)
+        {
+            MQTTAsync_view* view = free_views;
+            free_views = view->next;
+            free(view);
+        }
+        free_view_count = 0;
+        MQTTAsync_unlock_mutex(view_mutex);
         Socket_outTerminate();
         #if defined(OPENSSL)
         SSLSocket_terminate();
@@ -1382,22 +1583,34 @@ void MQTTAsync_setTraceCallback(MQTTAsync_traceCallback* callback)
 void Protocol_processPublication(Publish* publish, Clients* client)
 {
     int rc = 0;
+    MQTTAsync_message* mm = NULL;
+    char* topic = publish->topic;
+    List const* codecs = ((MQTTAsyncs*)client->context)->codecs;
+    void* decoded = NULL;
+    size_t decodedlen = 0;
     
     FUNC_ENTRY;
-    MQTTAsync_message* mm = malloc(sizeof(MQTTAsync_message));
-    
-    // If the message is QoS 2, then we have already stored the incoming payload in an allocated buffer, so we don't need to copy again.
-    if (publish->header.bits.qos == 2)
-    {
-        mm->payload = publish->payload;
-    }
-    else
-    {
-        mm->payload = malloc(publish->payloadlen);
-        memcpy(mm->payload, publish->payload, publish->payloadlen);
+    bool const isDecoded = (codecs && PayloadCodecs_decode(codecs, publish->topic, publish->topiclen, publish->payload, publish->payloadlen, &decoded, &decodedlen));
+    // If the message is QoS 2, then we have already stored the incoming topic and payload in allocated buffers, so we don't need to copy again. A decoded payload is a copy already.
+    if (publish->header.bits.qos != 2 && client->zeroCopy && !isDecoded) { mm = MQTTAsync_newView(publish, client->net.socket); }
+    if (mm == NULL)
+    {
+        mm = malloc(sizeof(MQTTAsync_message));
+        memcpy(mm->struct_id, "MQTM", 4);
+        mm->struct_version = 0;
+        if (publish->header.bits.qos != 2) { topic = MQTTPacket_copyTopic(publish); }
+        if (isDecoded) {
+            if (publish->header.bits.qos == 2) { free(publish->payload); }
+            mm->payload = decoded;
+        } else if (publish->header.bits.qos == 2) {
+            mm->payload = publish->payload;
+        } else {
+            mm->payload = malloc(publish->payloadlen);
+            memcpy(mm->payload, publish->payload, publish->payloadlen);
+        }
     }
     
-    mm->payloadlen = publish->payloadlen;
+    mm->payloadlen = (isDecoded) ? decodedlen : publish->payloadlen;
     mm->qos = publish->header.bits.qos;
     mm->retained = publish->header.bits.retain;
     if (publish->header.bits.qos == 2) {
@@ -1416,7 +1629,7 @@ void Protocol_processPublication(Publish* publish, Clients* client)
         else
         {
             MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
-            if (m->ma) { rc = MQTTAsync_deliverMessage(m, publish->topic, publish->topiclen, mm); }
+            if (m->ma) { rc = MQTTAsync_deliverMessage(m, topic, publish->topiclen, mm); }
         }
     }
     
@@ -1424,7 +1637,7 @@ void Protocol_processPublication(Publish* publish, Clients* client)
     {
         qEntry* qe = malloc(sizeof(qEntry));
         qe->msg = mm;
-        qe->topicName = publish->topic;
+        qe->topicName = topic;
         qe->topicLen = publish->topiclen;
         ListAppend(client->messageQueue, qe, sizeof(qe) + sizeof(mm) + mm->payloadlen + strlen(qe->topicName)+1);
 #if !defined(NO_PERSISTENCE)
@@ -1435,6 +1648,24 @@ void Protocol_processPublication(Publish* publish, Clients* client)
     FUNC_EXIT;
 }
 
+void Protocol_processPublicationChunk(Publish* publish, Clients* client)
+{
+    MQTTAsyncs* m = client->context;
+    
+    FUNC_ENTRY;
+    MQTTAsync_messageChunk chunk = MQTTAsync_messageChunk_initializer;
+    chunk.payloadlen = publish->totallen;
+    chunk.offset = publish->payloadoffset;
+    chunk.data = publish->payload;
+    chunk.datalen = publish->payloadlen;
+    chunk.qos = publish->header.bits.qos;
+    chunk.retained = publish->header.bits.retain;
+    chunk.dup = (publish->header.bits.qos == 2) ? 0 : publish->header.bits.dup;   // A QoS 2 message is never handed over twice.
+    chunk.msgid = publish->msgId;
+    if (m->mca) { (*(m->mca))(m->context, publish->topic, publish->topiclen, &chunk); }
+    FUNC_EXIT;
+}
+
 void MQTTProtocol_closeSession(Clients* c, int sendwill)
 {
     MQTTAsync_disconnect_internal((MQTTAsync)c->context, 0);
@@ -1464,21 +1695,21 @@ int MQTTAsync_completeConnection(MQTTAsyncs* m, MQTTPacket* pack)
         Log(LOG_PROTOCOL, 1, NULL, m->c->net.socket, m->c->clientID, connack->rc);
         if ((rc = connack->rc) == MQTTCODE_SUCCESS)
         {
+            if (m->c->net.MQTTVersion >= MQTTVERSION_5)
+            {   // Limits the server sets for this connection.
+                m->c->net.receiveMaximum = connack->properties.receiveMaximum;
+                TopicAliases_reset(&m->c->net.aliasesOut, min(connack->properties.topicAliasMaximum, m->c->topicAliasMaximum));
+            }
             m->c->connected = 1;
             m->c->good = 1;
             m->c->connect_state = 0;
+            TimerWheel_cancel(&bstate->timers, &m->connectTimer);
+            MQTTProtocol_startKeepalive(m->c);
             if (m->c->cleansession) { rc = MQTTAsync_cleanSession(m->c); }
             
             if (m->c->outboundMsgs->count > 0)
             {
-                ListElement* outcurrent = NULL;
-                
-                while (ListNextElement(m->c->outboundMsgs, &outcurrent))
-                {
-                    Messages* m = (Messages*)(outcurrent->content);
-                    m->lastTouch = 0;
-                }
-                MQTTProtocol_retry((time_t)0, 1, 1);
+                MQTTProtocol_retry(m->c);
                 if (m->c->connected != 1) { rc = MQTTCODE_DISCONNECT; }
             }
         }
@@ -1534,25 +1765,28 @@ int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
     
     FUNC_ENTRY;
     MQTTAsync_lock_mutex(mqttcommand_mutex);
+    List* queue = command->client->commands;
     command->command.start_time = MQTTAsync_start_clock();
     if (command->command.type == CONNECT || (command->command.type == DISCONNECT && command->command.details.dis.internal))
     {
         MQTTAsync_queuedCommand* head = NULL;
         
-        if (commands->first) { head = (MQTTAsync_queuedCommand*)(commands->first->content); }
+        if (queue->first) { head = (MQTTAsync_queuedCommand*)(queue->first->content); }
         
-        if (head != NULL && head->client == command->client && head->command.type == command->command.type) {
+        if (head != NULL && head->command.type == command->command.type) {
             MQTTAsync_freeCommand(command); // Ignore duplicate connect or disconnect command
         } else {
-            ListInsert(commands, command, command_size, commands->first);   // Add to the head of the list
+            ListInsertNoMalloc(queue, command, &command->element, command_size, queue->first);   // Add to the head of the list
+            MQTTAsync_makeRunnable(command->client, true);
         }
     }
     else
     {
-        ListAppend(commands, command, command_size);
+        ListAppendNoMalloc(queue, command, &command->element, command_size);
         #if !defined(NO_PERSISTENCE)
-        if (command->client->c->persistence) { MQTTAsync_persistCommand(command); }
+        if (command->client->c->persistence && !MQTTAsync_isStreamed(command)) { MQTTAsync_persistCommand(command); }
         #endif
+        MQTTAsync_makeRunnable(command->client, false);
     }
     MQTTAsync_unlock_mutex(mqttcommand_mutex);
     Thread_signal_cond(send_cond);
@@ -1560,55 +1794,199 @@ int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
     return rc;
 }
 
-void MQTTAsync_processCommand()
+/*!
+ *  @abstract Queue a publish command.
+ *  @discussion The topic is copied into the same block as the command, and so is the payload unless it is lent. A payload a codec applies to is encoded first (see MQTTAsync_setCodec).
+ *
+ *  @param m the client.
+ *  @param destinationName the topic.
+ *  @param payloadlen the length of the payload.
+ *  @param payload the payload.
+ *  @param qos the QoS of the message.
+ *  @param retained the retained flag of the message.
+ *  @param lender who to give the payload back to, or NULL to copy it.
+ *  @param stream the streamed payload, lent by lender, or NULL.
+ *  @param response the response options, or NULL.
+ *  @return MQTTCODE_SUCCESS, or an error code if the message could not be queued (a lent payload then stays with the application).
+ */
+int MQTTAsync_queuePublish(MQTTAsyncs* m, char const* destinationName, size_t payloadlen, void* payload, int qos, int retained, payloadLender const* lender, SocketBuffer_stream const* stream, MQTTAsync_responseOptions* response)
 {
-    int rc = 0;
-    MQTTAsync_queuedCommand* command = NULL;
-    ListElement* cur_command = NULL;
+    int rc = MQTTCODE_SUCCESS;
+    MQTTAsync_queuedCommand* pub;
+    int msgid = 0;
+    size_t topiclen = 0;
     
     FUNC_ENTRY;
-    MQTTAsync_lock_mutex(mqttasync_mutex);
-    MQTTAsync_lock_mutex(mqttcommand_mutex);
+    if (m == NULL || m->c == NULL)
+        rc = MQTTCODE_FAILURE;
+    else if (m->c->connected == 0)
+        rc = MQTTCODE_DISCONNECT;
+    else if (!UTF8_validateStringLength(destinationName, &topiclen))
+        rc = MQTTCODE_BAD_UTF8_STRING;
+    else if (qos < 0 || qos > 2)
+        rc = MQTTCODE_BAD_QOS;
+    else if (stream && payloadlen + topiclen + 8 > MQTTASYNC_MAX_REMAINING_LENGTH)  /* topic length, message id and MQTT 5 properties */
+        rc = MQTTCODE_FAILURE;
+    else if (qos > 0 && (msgid = MQTTAsync_assignMsgId(m)) == 0)
+        rc = MQTTCODE_NO_MORE_MSGIDS;
     
-    // Only the first command in the list must be processed for any particular client, so if we skip a command for a client, we must skip all following commands for that client.  Use a list of ignored clients to keep track
-    List* ignored_clients = ListInitialize();
+    if (rc != MQTTCODE_SUCCESS)
+        goto exit;
     
-    // Don't try a command until there isn't a pending write for that client, and we are not connecting
-    while (ListNextElement(commands, &cur_command))
+    /* Encode the payload on the calling thread, before any lock is taken. The command holds the encoded copy, lent to it, and a payload lent by the application is given back once queued */
+    static payloadLender const encodedLender = { PayloadCodecs_release, NULL };
+    payloadLender const* given = NULL;
+    void* const original = payload;
+    void* encoded = NULL;
+    size_t encodedlen = 0;
+    if (m->codecs && stream == NULL && PayloadCodecs_encode(m->codecs, destinationName, topiclen, payload, payloadlen, &encoded, &encodedlen))
     {
-        MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(cur_command->content);
-        
-        if (ListFind(ignored_clients, cmd->client)) { continue; }
-        
-        if (cmd->command.type == CONNECT || cmd->command.type == DISCONNECT || (cmd->client->c->connected && cmd->client->c->connect_state == 0 && Socket_noPendingWrites(cmd->client->c->net.socket)))
-        {
-            if ((cmd->command.type == PUBLISH || cmd->command.type == SUBSCRIBE || cmd->command.type == UNSUBSCRIBE) && cmd->client->c->outboundMsgs->count >= MAX_MSG_ID - 1)
-                ; /* no more message ids available */
-            else
-            {
-                command = cmd;
-                break;
-            }
-        }
-        ListAppend(ignored_clients, cmd->client, sizeof(cmd->client));
+        given = lender;
+        lender = &encodedLender;
+        payload = encoded;
+        payloadlen = encodedlen;
     }
     
-    ListFreeNoContent(ignored_clients);
-    if (command)
+    /* Add publish request to operation queue, with its topic and (unless lent) payload in the same block */
+    pub = MQTTAsync_newPublish(topiclen + 1 + ((lender) ? 0 : payloadlen));
+    pub->client = m;
+    pub->command.type = PUBLISH;
+    pub->command.token = msgid;
+    if (response)
     {
-        ListDetach(commands, command);
-        #if !defined(NO_PERSISTENCE)
-        if (command->client->c->persistence) { MQTTAsync_unpersistCommand(command); }
-        #endif
+        pub->command.onSuccess = response->onSuccess;
+        pub->command.onFailure = response->onFailure;
+        pub->command.context = response->context;
+        pub->command.timeout = (response->struct_version >= 1 && response->timeout > 0) ? response->timeout : 0;
+        response->token = pub->command.token;
     }
-    MQTTAsync_unlock_mutex(mqttcommand_mutex);
+    pub->command.details.pub.destinationName = (char*)(pub + 1);
+    pub->command.details.pub.topiclen = topiclen;
+    memcpy(pub->command.details.pub.destinationName, destinationName, topiclen + 1);
+    pub->command.details.pub.payloadlen = payloadlen;
+    if (lender)
+    {
+        pub->command.details.pub.payload = payload;
+        pub->command.details.pub.lender = *lender;
+        pub->command.details.pub.stream = stream;
+    }
+    else
+    {
+        pub->command.details.pub.payload = pub->command.details.pub.destinationName + topiclen + 1;
+        memcpy(pub->command.details.pub.payload, payload, payloadlen);
+    }
+    pub->command.details.pub.inlined = 1;
+    pub->command.details.pub.qos = qos;
+    pub->command.details.pub.retained = retained;
+    rc = MQTTAsync_addCommand(pub, sizeof(pub));
+    if (given) { (*given->release)(given->context, original); }
     
-    if (!command) { goto exit; }
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+/*!
+ *  @abstract Give every client in the run queue a turn, in which the send thread processes its commands, up to MQTTASYNC_SEND_BATCH of them.
+ *  @discussion A turn stops at the first command that cannot go ahead yet, and only the first command of a client is ever looked at, so a client held up costs its turn and nothing more. The client goes back at the end of the run queue while it has commands left.
+ *
+ *  @param processed returns the number of commands processed.
+ *  @return the time (ms) until a command held back is due, at most MQTTASYNC_SEND_WAIT.
+ */
+long MQTTAsync_processCommands(int* processed)
+{
+    long wait = MQTTASYNC_SEND_WAIT;
     
-    if (command->command.type == CONNECT)
-    {
-        if (command->client->c->connect_state != 0 || command->client->c->connected)
-        {
+    FUNC_ENTRY;
+    *processed = 0;
+    MQTTAsync_lock_mutex(mqttcommand_mutex);
+    int turns = runnable->count;    // The clients made runnable during the pass wait for the next one.
+    MQTTAsync_unlock_mutex(mqttcommand_mutex);
+    
+    for (; turns > 0 && !tostop; --turns)
+    {
+        MQTTAsync_lock_mutex(mqttasync_mutex);
+        MQTTAsync_lock_mutex(mqttcommand_mutex);
+        MQTTAsyncs* m = ListDetachHeadNoFree(runnable);
+        MQTTAsync_unlock_mutex(mqttcommand_mutex);
+        
+        if (m)
+        {
+            for (int n = 0; n < MQTTASYNC_SEND_BATCH && MQTTAsync_processCommand(m, &wait); ++n) { ++*processed; }
+            
+            MQTTAsync_lock_mutex(mqttcommand_mutex);
+            if (m->commands->count > 0) { ListAppendNoMalloc(runnable, m, &m->turn, sizeof(m)); }
+            else { m->runnable = false; }
+            MQTTAsync_unlock_mutex(mqttcommand_mutex);
+        }
+        MQTTAsync_unlock_mutex(mqttasync_mutex);
+    }
+    FUNC_EXIT;
+    return wait;
+}
+
+/*!
+ *  @abstract Put a client in the run queue of the send thread, unless it is there already; called with the command mutex locked.
+ *
+ *  @param m the client, with commands to be processed.
+ *  @param first whether it goes to the head of the run queue, for a connect or disconnect command.
+ */
+void MQTTAsync_makeRunnable(MQTTAsyncs* m, bool first)
+{
+    if (m->runnable) { return; }
+    m->runnable = true;
+    ListInsertNoMalloc(runnable, m, &m->turn, sizeof(m), (first) ? runnable->first : NULL);
+}
+
+/*!
+ *  @abstract Process the first command of a client, if it can go ahead; called with the MQTTAsync mutex locked.
+ *  @discussion A subscribe or unsubscribe command is sent together with the ones of its client of the same kind queued right after it (see subscribeCoalesceDelay in MQTTAsync_connectOptions), and held back while more may join it.
+ *
+ *  @param m the client.
+ *  @param wait the time (ms) until a command held back is due, lowered if this one is held back.
+ *  @return whether a command was processed.
+ */
+bool MQTTAsync_processCommand(MQTTAsyncs* m, long* wait)
+{
+    int rc = 0;
+    MQTTAsync_queuedCommand* command = NULL;
+    List parts_store;   // The command, followed by the commands coalesced into its packet.
+    List* parts = &parts_store;
+    ListZero(parts);
+    
+    FUNC_ENTRY;
+    MQTTAsync_lock_mutex(mqttcommand_mutex);
+    
+    // Only the first command of a client may go ahead. Don't try it until the write queue of that client has room, and we are not connecting
+    ListElement* head = m->commands->first;
+    MQTTAsync_queuedCommand* cmd = (head) ? (MQTTAsync_queuedCommand*)(head->content) : NULL;
+    if (cmd == NULL)
+        ; /* nothing left to do */
+    else if (cmd->command.type != CONNECT && cmd->command.type != DISCONNECT && (!m->c->connected || m->c->connect_state != 0 || Socket_queueFull(m->c->net.socket)))
+        ; /* not ready to write */
+    else if ((cmd->command.type == PUBLISH || cmd->command.type == SUBSCRIBE || cmd->command.type == UNSUBSCRIBE) && m->c->outboundMsgs->count >= MAX_MSG_ID - 1)
+        ; /* no more message ids available */
+    else if (cmd->command.type == PUBLISH && cmd->command.details.pub.qos > 0 && MQTTAsync_windowFull(m->c))
+        ; /* as many QoS 1 and 2 messages in flight as the server takes */
+    else if ((cmd->command.type == SUBSCRIBE || cmd->command.type == UNSUBSCRIBE) && MQTTAsync_holdCoalesced(head, wait))
+        ; /* more requests may join its packet */
+    else
+    {
+        command = cmd;
+        ListDetachHeadNoFree(m->commands);
+        #if !defined(NO_PERSISTENCE)
+        if (m->c->persistence && !MQTTAsync_isStreamed(command)) { MQTTAsync_unpersistCommand(command); }
+        #endif
+        MQTTAsync_takeCoalesced(command, parts);
+    }
+    MQTTAsync_unlock_mutex(mqttcommand_mutex);
+    
+    if (!command) { goto exit; }
+    
+    if (command->command.type == CONNECT)
+    {
+        if (command->client->c->connect_state != 0 || command->client->c->connected)
+        {
             rc = 0;
         }
         else
@@ -1667,11 +2045,21 @@ void MQTTAsync_processCommand()
     {
         List* topics = ListInitialize();
         List* qoss = ListInitialize();
+        ListElement* elem = NULL;
+        MQTTAsync_command* previous = NULL;
         
-        for (int i = 0; i < command->command.details.sub.count; i++)
+        while (ListNextElement(parts, &elem))
         {
-            ListAppend(topics, command->command.details.sub.topics[i], strlen(command->command.details.sub.topics[i]));
-            ListAppend(qoss, &command->command.details.sub.qoss[i], sizeof(int));
+            MQTTAsync_command* part = &((MQTTAsync_queuedCommand*)(elem->content))->command;
+            if (previous) { previous->details.sub.next = part->token; }
+            previous = part;
+            part->details.sub.next = 0;
+            part->details.sub.first = topics->count;
+            for (int i = 0; i < part->details.sub.count; i++)
+            {
+                ListAppend(topics, part->details.sub.topics[i], strlen(part->details.sub.topics[i]));
+                ListAppend(qoss, &part->details.sub.qoss[i], sizeof(int));
+            }
         }
         rc = MQTTProtocol_subscribe(command->client->c, topics, qoss, command->command.token);
         ListFreeNoContent(topics);
@@ -1680,27 +2068,35 @@ void MQTTAsync_processCommand()
     else if (command->command.type == UNSUBSCRIBE)
     {
         List* topics = ListInitialize();
-        int i;
-        
-        for (i = 0; i < command->command.details.unsub.count; i++)
-            ListAppend(topics, command->command.details.unsub.topics[i], strlen(command->command.details.unsub.topics[i]));
+        ListElement* elem = NULL;
+        MQTTAsync_command* previous = NULL;
         
+        while (ListNextElement(parts, &elem))
+        {
+            MQTTAsync_command* part = &((MQTTAsync_queuedCommand*)(elem->content))->command;
+            if (previous) { previous->details.unsub.next = part->token; }
+            previous = part;
+            part->details.unsub.next = 0;
+            for (int i = 0; i < part->details.unsub.count; i++)
+                ListAppend(topics, part->details.unsub.topics[i], strlen(part->details.unsub.topics[i]));
+        }
         rc = MQTTProtocol_unsubscribe(command->client->c, topics, command->command.token);
         ListFreeNoContent(topics);
     }
     else if (command->command.type == PUBLISH)
     {
         Messages* msg = NULL;
-        Publish* p = NULL;
-        
-        p = malloc(sizeof(Publish));
+        Publish p;
         
-        p->payload = command->command.details.pub.payload;
-        p->payloadlen = command->command.details.pub.payloadlen;
-        p->topic = command->command.details.pub.destinationName;
-        p->msgId = command->command.token;
+        p.payload = command->command.details.pub.payload;
+        p.payloadlen = command->command.details.pub.payloadlen;
+        p.topic = command->command.details.pub.destinationName;
+        p.topiclen = command->command.details.pub.topiclen;
+        p.msgId = command->command.token;
+        p.lender = command->command.details.pub.lender;
+        p.stream = command->command.details.pub.stream;
         
-        rc = MQTTProtocol_startPublish(command->client->c, p, command->command.details.pub.qos, command->command.details.pub.retained, &msg);
+        rc = MQTTProtocol_startPublish(command->client->c, &p, command->command.details.pub.qos, command->command.details.pub.retained, &msg);
         
         if (command->command.details.pub.qos == 0)
         {
@@ -1722,13 +2118,18 @@ void MQTTAsync_processCommand()
             }
             else
             {
-                command->command.details.pub.destinationName = NULL; /* this will be freed by the protocol code */
-                command->client->pending_write = &command->command;
+                if (!command->command.details.pub.inlined)
+                    command->command.details.pub.destinationName = NULL; /* this will be freed by the protocol code */
+                command->command.details.pub.lender.release = NULL; /* the payload is given back by the protocol code too */
+                command->command.details.pub.write = SocketBuffer_lastWriteId(command->client->c->net.socket);
             }
         }
         else
-            command->command.details.pub.destinationName = NULL; /* this will be freed by the protocol code */
-        free(p); /* should this be done if the write isn't complete? */
+        {
+            if (!command->command.details.pub.inlined)
+                command->command.details.pub.destinationName = NULL; /* this will be freed by the protocol code */
+            command->command.details.pub.lender.release = NULL; /* the payload is given back by the protocol code too */
+        }
     }
     else if (command->command.type == DISCONNECT)
     {
@@ -1739,20 +2140,24 @@ void MQTTAsync_processCommand()
         }
     }
     
+    ListDetachHeadNoFree(parts);    // The command itself, which may be freed below: its part is in its block.
     if (command->command.type == CONNECT && rc != SOCKET_ERROR && rc != MQTTCODE_PERSISTANCE_ERROR)
     {
         command->client->connect = command->command;
+        MQTTAsync_scheduleTimeout(&command->client->connectTimer, &command->client->connect, command->client->connect.details.conn.timeout * 1000);
         MQTTAsync_freeCommand(command);
     }
     else if (command->command.type == DISCONNECT)
     {
         command->client->disconnect = command->command;
+        if (command->client->c->connect_state == -2)    // Still waiting for the messages in flight
+            MQTTAsync_scheduleTimeout(&command->client->disconnectTimer, &command->client->disconnect, command->client->disconnect.details.dis.timeout);
         MQTTAsync_freeCommand(command);
     }
     else if (command->command.type == PUBLISH && command->command.details.pub.qos == 0)
     {
         if (rc == TCPSOCKET_INTERRUPTED)
-            ListAppend(command->client->responses, command, sizeof(command));
+            ListAppendNoMalloc(command->client->responses, command, &command->element, sizeof(command));
         else
             MQTTAsync_freeCommand(command);
     }
@@ -1784,54 +2189,215 @@ void MQTTAsync_processCommand()
         }
     }
     else /* put the command into a waiting for response queue for each client, indexed by msgid */
-        ListAppend(command->client->responses, command, sizeof(command));
+    {
+        MQTTAsync_addResponse(command);
+        MQTTAsync_scheduleResponse(command, parts);
+    }
+    
+    // The commands coalesced into the packet of the command share its fate.
+    MQTTAsync_queuedCommand* part;
+    while ((part = ListDetachHeadNoFree(parts)) != NULL)
+    {
+        if (rc == SOCKET_ERROR || rc == MQTTCODE_PERSISTANCE_ERROR)
+        {
+            if (part->command.onFailure)
+            {
+                Log(TRACE_MIN, -1, "Calling command failure for client %s", part->client->c->clientID);
+                (*(part->command.onFailure))(part->command.context, NULL);
+            }
+            MQTTAsync_freeCommand(part);
+        }
+        else
+            MQTTAsync_addResponse(part);
+    }
     
 exit:
-    MQTTAsync_unlock_mutex(mqttasync_mutex);
     FUNC_EXIT;
+    return command != NULL;
+}
+
+/*!
+ *  @abstract Get the number of topics of a subscribe or unsubscribe command.
+ */
+int MQTTAsync_topicCount(MQTTAsync_queuedCommand const* command)
+{
+    return (command->command.type == SUBSCRIBE) ? command->command.details.sub.count : command->command.details.unsub.count;
+}
+
+/*!
+ *  @abstract Whether a subscribe or unsubscribe command is to be held back, for more requests to join its packet.
+ *  @discussion It is, unless its client does not coalesce requests, the command has waited long enough, the requests queued after it fill a packet, or a different kind of command of its client is queued after them, so no more can join.
+ *
+ *  @param elem the element of the command, the first in the commands of its client.
+ *  @param wait the time (ms) until a command held back is due, lowered to the time left for this one if it is held back.
+ *  @return whether the command is held back.
+ */
+bool MQTTAsync_holdCoalesced(ListElement const* elem, long* wait)
+{
+    MQTTAsync_queuedCommand const* command = elem->content;
+    Clients const* client = command->client->c;
+    int topics = 0;
+    
+    if (client->coalesceDelay == 0) { return false; }
+    for (; elem; elem = elem->next)
+    {
+        MQTTAsync_queuedCommand const* cmd = elem->content;
+        if (cmd->command.type != command->command.type) { return false; }
+        topics += MQTTAsync_topicCount(cmd);
+        if (client->coalesceTopics > 0 && topics >= client->coalesceTopics) { return false; }
+    }
+    
+    long const left = client->coalesceDelay - MQTTAsync_elapsed(command->command.start_time);
+    if (left <= 0) { return false; }
+    *wait = min(*wait, left);
+    return true;
+}
+
+/*!
+ *  @abstract Take the commands to be sent in the packet of a command out of the commands of its client, called with the command mutex locked.
+ *  @discussion Those are the subscribe (or unsubscribe) commands of its client queued right after a subscribe (or unsubscribe) command, as many as fit in a packet (see subscribeCoalesceTopics in MQTTAsync_connectOptions).
+ *
+ *  @param command the command, already taken out of the list.
+ *  @param parts returns the command, followed by the commands taken.
+ */
+void MQTTAsync_takeCoalesced(MQTTAsync_queuedCommand* command, List* parts)
+{
+    Clients const* client = command->client->c;
+    
+    FUNC_ENTRY;
+    ListAppendNoMalloc(parts, command, &command->part, sizeof(command));
+    if ((command->command.type != SUBSCRIBE && command->command.type != UNSUBSCRIBE) || client->coalesceDelay == 0) { goto exit; }
+    
+    int topics = MQTTAsync_topicCount(command);
+    List* queue = command->client->commands;
+    while (queue->first)
+    {
+        MQTTAsync_queuedCommand* cmd = queue->first->content;
+        if (cmd->command.type != command->command.type) { break; }
+        if (client->coalesceTopics > 0 && topics + MQTTAsync_topicCount(cmd) > client->coalesceTopics) { break; }
+        
+        topics += MQTTAsync_topicCount(cmd);
+        ListDetachHeadNoFree(queue);
+        #if !defined(NO_PERSISTENCE)
+        if (client->persistence) { MQTTAsync_unpersistCommand(cmd); }
+        #endif
+        ListAppendNoMalloc(parts, cmd, &cmd->part, sizeof(cmd));
+    }
+exit:
+    FUNC_EXIT;
+}
+
+/*!
+ *  @abstract Put a command into the list of its client waiting for a response, indexed by its token if it has one.
+ */
+void MQTTAsync_addResponse(MQTTAsync_queuedCommand* command)
+{
+    MQTTAsyncs* m = command->client;
+    
+    ListAppendNoMalloc(m->responses, command, &command->element, sizeof(command));
+    if (command->command.token > 0) { MessageTable_set(&m->responseIndex, command->command.token, m->responses->last); }
+}
+
+/*!
+ *  @abstract Take the command with a token out of the list of a client waiting for a response.
+ *
+ *  @param m the client.
+ *  @param token the token, the message id of the acknowledgement received.
+ *  @param type the type of command the acknowledgement is for.
+ *  @return the command, or NULL if none of that type is waiting with the token.
+ */
+MQTTAsync_queuedCommand* MQTTAsync_takeResponse(MQTTAsyncs* m, MQTTAsync_token token, int type)
+{
+    ListElement* elem = MessageTable_get(&m->responseIndex, token);
+    if (elem == NULL) { return NULL; }
+    
+    MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(elem->content);
+    if (command->command.type != type)
+    {
+        Log(LOG_ERROR, -1, "Acknowledgement %d for client %s does not match its command", token, m->c->clientID);
+        return NULL;
+    }
+    MessageTable_set(&m->responseIndex, token, NULL);
+    ListDetachElementNoFree(m->responses, elem);
+    TimerWheel_cancel(&bstate->timers, &command->responseTimer);
+    return command;
+}
+
+/*!
+ *  @abstract Schedule the response timer of a command just sent, at the shortest timeout of the commands sent in its packet, which share its response.
+ *
+ *  @param command the command, waiting for its response.
+ *  @param parts the commands coalesced into its packet, after it.
+ */
+void MQTTAsync_scheduleResponse(MQTTAsync_queuedCommand* command, List const* parts)
+{
+    int timeout = command->command.timeout;
+    for (ListElement const* elem = parts->first; elem != NULL; elem = elem->next)
+    {
+        int const t = ((MQTTAsync_queuedCommand const*)(elem->content))->command.timeout;
+        if (t > 0 && (timeout == 0 || t < timeout)) { timeout = t; }
+    }
+    if (timeout == 0 || command->command.token <= 0) { return; }
+    
+    TimerWheel_initTimer(&command->responseTimer, MQTTAsync_responseTimeout, command->client, command);
+    TimerWheel_schedule(&bstate->timers, &command->responseTimer, TimerWheel_now() + (uint64_t)timeout);
 }
 
 void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m)
 {
     int count = 0;
-    ListElement* current = NULL;
-    ListElement *next = NULL;
     
     FUNC_ENTRY;
     if (m->responses)
     {
-        ListElement* elem = NULL;
+        MQTTAsync_queuedCommand* command;
         
-        while (ListNextElement(m->responses, &elem))
+        while ((command = ListDetachHeadNoFree(m->responses)) != NULL)
         {
-            MQTTAsync_freeCommand1((MQTTAsync_queuedCommand*) (elem->content));
+            if (command->command.token > 0) { MessageIds_release(&m->c->msgIds, command->command.token); }
+            TimerWheel_cancel(&bstate->timers, &command->responseTimer);
+            MQTTAsync_freeCommand1(command);
+            MQTTAsync_recycleCommand(command);
             count++;
         }
     }
-    ListEmpty(m->responses);
+    MessageTable_reset(&m->responseIndex);
     Log(TRACE_MINIMUM, -1, "%d responses removed for client %s", count, m->c->clientID);
     
-    /* remove commands in the command queue relating to this client */
-    count = 0;
-    current = ListNextElement(commands, &next);
-    ListNextElement(commands, &next);
-    while (current)
-    {
-        MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
-        
-        if (cmd->client == m)
-        {
-            ListDetach(commands, cmd);
-            MQTTAsync_freeCommand(cmd);
-            count++;
-        }
-        current = next;
-        ListNextElement(commands, &next);
-    }
+    /* remove the commands of this client, taken out of its queue first as freeing them may call back the application */
+    MQTTAsync_lock_mutex(mqttcommand_mutex);
+    List queue = *m->commands;
+    ListZero(m->commands);
+    MQTTAsync_unlock_mutex(mqttcommand_mutex);
+    
+    MQTTAsync_queuedCommand* cmd;
+    for (count = 0; (cmd = ListDetachHeadNoFree(&queue)) != NULL; count++)
+        MQTTAsync_freeCommand(cmd);
     Log(TRACE_MINIMUM, -1, "%d commands removed for client %s", count, m->c->clientID);
     FUNC_EXIT;
 }
 
+/*!
+ *  @abstract Release a payload streamed with MQTTAsync_sendStream once the message no longer needs it (the release function of its lender).
+ *
+ *  @param context the MQTTAsync_streamed.
+ *  @param payload unused: the payload of a streamed message is NULL.
+ */
+void MQTTAsync_releaseStream(void* context, void* payload)
+{
+    MQTTAsync_streamed* streamed = context;
+    if (streamed->onRelease) { (*streamed->onRelease)(streamed->releaseContext, streamed->stream.context); }
+    free(streamed);
+}
+
+/*!
+ *  @abstract Whether a command publishes a streamed payload, which is not persisted as there is nothing in memory to persist.
+ */
+bool MQTTAsync_isStreamed(MQTTAsync_queuedCommand const* command)
+{
+    return command->command.type == PUBLISH && command->command.details.pub.stream != NULL;
+}
+
 void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
 {
     if (command->command.type == SUBSCRIBE)
@@ -1855,104 +2421,214 @@ void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
     }
     else if (command->command.type == PUBLISH)
     {
-        /* qos 1 and 2 topics are freed in the protocol code when the flows are completed */
-        if (command->command.details.pub.destinationName)
-            free(command->command.details.pub.destinationName);
-        free(command->command.details.pub.payload);
+        payloadLender const* lender = &command->command.details.pub.lender;
+        if (lender->release)
+            (*lender->release)(lender->context, command->command.details.pub.payload);
+        if (!command->command.details.pub.inlined)  /* inlined data is freed with the command */
+        {
+            /* qos 1 and 2 topics are freed in the protocol code when the flows are completed */
+            if (command->command.details.pub.destinationName)
+                free(command->command.details.pub.destinationName);
+            free(command->command.details.pub.payload);
+        }
     }
 }
 
 void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command)
 {
+    if (command->command.token > 0) { MessageIds_release(&command->client->c->msgIds, command->command.token); }
     MQTTAsync_freeCommand1(command);
-    free(command);
+    MQTTAsync_recycleCommand(command);
 }
 
-void MQTTAsync_checkTimeouts()
+/*!
+ *  @abstract Allocate a publish command, zeroed, with room after it for its topic and payload.
+ *  @discussion The block of a command freed earlier is reused when one is left, so that queueing small messages does not allocate memory once the client is warmed up. Blocks are rounded up to a power of two, so that they fit messages of about the same size.
+ *
+ *  @param inlined the bytes needed after the command.
+ *  @return the command.
+ */
+MQTTAsync_queuedCommand* MQTTAsync_newPublish(size_t inlined)
 {
-    ListElement* current = NULL;
-    static time_t last = 0L;
-    time_t now;
+    MQTTAsync_queuedCommand* command = NULL;
+    size_t capacity = inlined;
+    
+    if (inlined <= MQTTASYNC_MAX_POOLED_INLINE)
+    {
+        for (capacity = 64; capacity < inlined; capacity *= 2);
+        MQTTAsync_lock_mutex(command_pool_mutex);
+        command = ListDetachHeadNoFree(&free_commands);
+        MQTTAsync_unlock_mutex(command_pool_mutex);
+        if (command != NULL && command->capacity < inlined)
+        {
+            free(command);
+            command = NULL;
+        }
+        else if (command != NULL) { capacity = command->capacity; }
+    }
+    if (command == NULL) { command = malloc(sizeof(MQTTAsync_queuedCommand) + capacity); }
+    memset(command, '\0', sizeof(MQTTAsync_queuedCommand));
+    command->capacity = (inlined <= MQTTASYNC_MAX_POOLED_INLINE) ? capacity : 0;
+    return command;
+}
+
+/*!
+ *  @abstract Free the block of a command, already out of every list, or keep it for the next publish command (see MQTTAsync_newPublish).
+ */
+void MQTTAsync_recycleCommand(MQTTAsync_queuedCommand* command)
+{
+    if (command->capacity > 0)
+    {
+        MQTTAsync_lock_mutex(command_pool_mutex);
+        if (free_commands.count < MQTTASYNC_MAX_FREE_COMMANDS)
+        {
+            ListInsertNoMalloc(&free_commands, command, &command->element, 0, free_commands.first);
+            command = NULL;
+        }
+        MQTTAsync_unlock_mutex(command_pool_mutex);
+    }
+    if (command) { free(command); }
+}
+
+/*!
+ *  @abstract Schedule the timer of a command timing out, the timeout after the command was queued.
+ *
+ *  @param t the timer.
+ *  @param command the command.
+ *  @param timeout the timeout (ms).
+ */
+void MQTTAsync_scheduleTimeout(timer* t, MQTTAsync_command const* command, long timeout)
+{
+    long const left = timeout - MQTTAsync_elapsed(command->start_time);
+    TimerWheel_schedule(&bstate->timers, t, TimerWheel_now() + (uint64_t)max(left, 1));
+}
+
+/*!
+ *  @abstract Expiry of the connect timer: try the next server URI, if any, or else fail the connect.
+ *
+ *  @param context the handle.
+ *  @param target unused.
+ */
+void MQTTAsync_connectTimeout(void* context, void* target)
+{
+    MQTTAsyncs* m = (MQTTAsyncs*)context;
     
     FUNC_ENTRY;
-    time(&(now));
-    if (difftime(now, last) < 3)
+    if (m->c->connect_state <= 0)   // Connected, or given up, in the meantime.
+        goto exit;
+    if (MQTTAsync_elapsed(m->connect.start_time) <= (m->connect.details.conn.timeout * 1000))
+    {   // The wall clock the timeout is measured with may lag the monotonic one of the timer.
+        MQTTAsync_scheduleTimeout(&m->connectTimer, &m->connect, m->connect.details.conn.timeout * 1000 + 1);
         goto exit;
+    }
     
-    MQTTAsync_lock_mutex(mqttasync_mutex);
-    last = now;
-    while (ListNextElement(handles, &current))		/* for each client */
+    if (MQTTAsync_checkConn(&m->connect, m))
     {
-        ListElement* cur_response = NULL;
-        int i = 0,
-        timed_out_count = 0;
+        MQTTAsync_queuedCommand* conn;
         
-        MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
-        
-        /* check connect timeout */
-        if (m->c->connect_state != 0 && MQTTAsync_elapsed(m->connect.start_time) > (m->connect.details.conn.timeout * 1000))
+        MQTTAsync_closeOnly(m->c);
+        /* put the connect command back to the head of the command queue, using the next serverURI */
+        conn = malloc(sizeof(MQTTAsync_queuedCommand));
+        memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+        conn->client = m;
+        conn->command = m->connect;
+        Log(TRACE_MIN, -1, "Connect failed with timeout, more to try");
+        MQTTAsync_addCommand(conn, sizeof(m->connect));
+    }
+    else
+    {
+        MQTTAsync_closeSession(m->c);
+        MQTTAsync_freeConnect(m->connect);
+        if (m->connect.onFailure)
         {
-            if (MQTTAsync_checkConn(&m->connect, m))
-            {
-                MQTTAsync_queuedCommand* conn;
-                
-                MQTTAsync_closeOnly(m->c);
-                /* put the connect command back to the head of the command queue, using the next serverURI */
-                conn = malloc(sizeof(MQTTAsync_queuedCommand));
-                memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
-                conn->client = m;
-                conn->command = m->connect;
-                Log(TRACE_MIN, -1, "Connect failed with timeout, more to try");
-                MQTTAsync_addCommand(conn, sizeof(m->connect));
-            }
-            else
-            {
-                MQTTAsync_closeSession(m->c);
-                MQTTAsync_freeConnect(m->connect);
-                if (m->connect.onFailure)
-                {
-                    Log(TRACE_MIN, -1, "Calling connect failure for client %s", m->c->clientID);
-                    (*(m->connect.onFailure))(m->connect.context, NULL);
-                }
-            }
-            continue;
+            Log(TRACE_MIN, -1, "Calling connect failure for client %s", m->c->clientID);
+            (*(m->connect.onFailure))(m->connect.context, NULL);
         }
+    }
+exit:
+    FUNC_EXIT;
+}
+
+/*!
+ *  @abstract Expiry of the response timer of a command: fail it, with the commands coalesced into its packet, as their response is taken to be lost.
+ *  @discussion A publish in flight is abandoned with its command, so that it is no longer sent again, and its message id is released.
+ *
+ *  @param context the handle.
+ *  @param target the command, the first of its packet.
+ */
+void MQTTAsync_responseTimeout(void* context, void* target)
+{
+    MQTTAsyncs* m = (MQTTAsyncs*)context;
+    MQTTAsync_queuedCommand const* first = (MQTTAsync_queuedCommand const*)target;
+    int const type = first->command.type;
+    
+    FUNC_ENTRY;
+    MQTTAsync_queuedCommand* command = MQTTAsync_takeResponse(m, first->command.token, type);
+    while (command)
+    {
+        MQTTAsync_token const token = command->command.token;
+        Log(TRACE_MIN, -1, "Response %d timed out for client %s", token, m->c->clientID);
         
-        /* check disconnect timeout */
-        if (m->c->connect_state == -2)
-            MQTTAsync_checkDisconnect(m, &m->disconnect);
+        ListElement* found = (type == PUBLISH) ? MessageTable_get(&m->c->outboundIndex, token) : NULL;
+        if (found)
+        {
+            Messages* msg = (Messages*)(found->content);
+            bool const wasFull = MQTTAsync_windowFull(m->c);
+#if !defined(NO_PERSISTENCE)
+            MQTTPersistence_remove(m->c, PERSISTENCE_PUBLISH_SENT, msg->qos, token);
+#endif
+            MQTTProtocol_removePublication(msg->publish);
+            MQTTProtocol_removeMessage(m->c->outboundMsgs, &m->c->outboundIndex, found);
+            if (wasFull) { Thread_signal_cond(send_cond); }    // A publish may be waiting for the room.
+        }
         
-        timed_out_count = 0;
-        /* check response timeouts */
-        while (ListNextElement(m->responses, &cur_response))
+        if (command->command.onFailure)
         {
-            //MQTTAsync_queuedCommand* com = (MQTTAsync_queuedCommand*)(cur_response->content);
+            MQTTAsync_failureData data;
             
-            if (1 /*MQTTAsync_elapsed(com->command.start_time) < 120000*/)
-                break; /* command has not timed out */
-            /*else
-             {
-             if (com->command.onFailure)
-             {
-             Log(TRACE_MIN, -1, "Calling %s failure for client %s",
-             MQTTPacket_name(com->command.type), m->c->clientID);
-             (*(com->command.onFailure))(com->command.context, NULL);
-             }
-             timed_out_count++;
-             }*/
+            data.token = token;
+            data.code = MQTTCODE_TIMEOUT;
+            data.message = NULL;
+            Log(TRACE_MIN, -1, "Calling command failure for client %s", m->c->clientID);
+            (*(command->command.onFailure))(command->command.context, &data);
         }
-        for (i = 0; i < timed_out_count; ++i)
-            ListRemoveHead(m->responses);	/* remove the first response in the list */
+        MQTTAsync_token const next = (type == SUBSCRIBE) ? command->command.details.sub.next : (type == UNSUBSCRIBE) ? command->command.details.unsub.next : 0;
+        MQTTAsync_freeCommand(command);
+        command = (next > 0) ? MQTTAsync_takeResponse(m, next, type) : NULL;
+    }
+    
+    if (type == PUBLISH && m->c->connect_state == -2 && m->c->outboundMsgs->count == 0)
+    {   // A disconnect was waiting for the last message in flight.
+        TimerWheel_cancel(&bstate->timers, &m->disconnectTimer);
+        MQTTAsync_checkDisconnect(m, &m->disconnect);
+    }
+    FUNC_EXIT;
+}
+
+/*!
+ *  @abstract Expiry of the disconnect timer: close the session, even though messages are still in flight.
+ *
+ *  @param context the handle.
+ *  @param target unused.
+ */
+void MQTTAsync_disconnectTimeout(void* context, void* target)
+{
+    MQTTAsyncs* m = (MQTTAsyncs*)context;
+    
+    FUNC_ENTRY;
+    if (m->c->connect_state == -2)
+    {
+        MQTTAsync_checkDisconnect(m, &m->disconnect);
+        if (m->c->connect_state == -2)  // See MQTTAsync_connectTimeout
+            MQTTAsync_scheduleTimeout(&m->disconnectTimer, &m->disconnect, m->disconnect.details.dis.timeout + 1);
     }
-    MQTTAsync_unlock_mutex(mqttasync_mutex);
-exit:
     FUNC_EXIT;
 }
 
 #pragma mark Messages
 
 /*!
- *  @abstract Assign a new message id for a client.  Make sure it isn't already being used and does not exceed the maximum.
+ *  @abstract Assign a new message id for a client.  Make sure it isn't already being used (by a queued command or one waiting for its response) and does not exceed the maximum.
  *
  *  @param m a client structure
  *  @return the next message id to use, or 0 if none available
@@ -1964,7 +2640,6 @@ int MQTTAsync_assignMsgId(MQTTAsyncs* m)
     pthread_t thread_id = 0;
     int locked = 0;
     
-    /* need to check: commands list and response list for a client */
     FUNC_ENTRY;
     /* We might be called in a callback. In which case, this mutex will be already locked. */
     thread_id = Thread_getid();
@@ -1974,17 +2649,8 @@ int MQTTAsync_assignMsgId(MQTTAsyncs* m)
         locked = 1;
     }
     
-    msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-    while (ListFindItem(commands, &msgid, cmdMessageIDCompare) ||
-           ListFindItem(m->responses, &msgid, cmdMessageIDCompare))
-    {
-        msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-        if (msgid == start_msgid)
-        { /* we've tried them all - none free */
-            msgid = 0;
-            break;
-        }
-    }
+    /* the identifier is held until its command is freed */
+    msgid = MessageIds_assign(&m->c->msgIds, start_msgid);
     if (msgid != 0)
         m->c->msgID = msgid;
     if (locked)
@@ -2013,15 +2679,84 @@ void MQTTAsync_emptyMessageQueue(Clients* client)
         while (ListNextElement(client->messageQueue, &current))
         {
             qEntry* qe = (qEntry*)(current->content);
-            free(qe->topicName);
-            free(qe->msg->payload);
-            free(qe->msg);
+            if (!MQTTAsync_isView(qe->msg)) { free(qe->topicName); }     // The topic of a view is in its slab.
+            MQTTAsync_freeMessage(&qe->msg);
         }
         ListEmpty(client->messageQueue);
     }
     FUNC_EXIT;
 }
 
+/*!
+ *  @abstract Make a message of a received QoS 0 or 1 publish without copying its topic or payload, which stay in the read buffer of the socket.
+ *
+ *  @param publish the publish packet, straight out of MQTTPacket_Factory.
+ *  @param socket the socket it was received on.
+ *  @return the message, with payload set, or NULL if the read buffer can not be kept (the message must then be copied).
+ */
+MQTTAsync_message* MQTTAsync_newView(Publish const* publish, int socket)
+{
+    MQTTAsync_view* view = NULL;
+    SocketBuffer_slab* slab = SocketBuffer_retain(socket, publish->topic);
+    
+    if (slab == NULL) { return NULL; }
+    MQTTAsync_lock_mutex(view_mutex);
+    if ((view = free_views) != NULL)
+    {
+        free_views = view->next;
+        --free_view_count;
+    }
+    MQTTAsync_unlock_mutex(view_mutex);
+    
+    if (view == NULL && (view = malloc(sizeof(MQTTAsync_view))) == NULL)
+    {
+        SocketBuffer_release(slab);
+        return NULL;
+    }
+    memcpy(view->message.struct_id, MQTTASYNC_VIEW_ID, 4);
+    view->message.struct_version = 0;
+    view->message.payload = publish->payload;
+    view->slab = slab;
+    return &view->message;
+}
+
+/*!
+ *  @abstract Release the read buffer a view points into, and keep the view for reuse.
+ *
+ *  @param view the view.
+ */
+void MQTTAsync_freeView(MQTTAsync_view* view)
+{
+    SocketBuffer_release(view->slab);
+    view->slab = NULL;
+    MQTTAsync_lock_mutex(view_mutex);
+    if (free_view_count < MQTTASYNC_MAX_FREE_VIEWS)
+    {
+        view->next = free_views;
+        free_views = view;
+        ++free_view_count;
+        view = NULL;
+    }
+    MQTTAsync_unlock_mutex(view_mutex);
+    if (view) { free(view); }
+}
+
+/*!
+ *  @abstract Whether a message was delivered without copying (see MQTTAsync_newView).
+ */
+bool MQTTAsync_isView(MQTTAsync_message const* message)
+{
+    return memcmp(message->struct_id, MQTTASYNC_VIEW_ID, 4) == 0;
+}
+
+/*!
+ *  @abstract Whether a client has as many QoS 1 and 2 messages in flight as the server takes (its MQTT 5 Receive Maximum), so that no more can be sent until some are acknowledged.
+ */
+bool MQTTAsync_windowFull(Clients const* client)
+{
+    return client->net.receiveMaximum > 0 && client->outboundMsgs->count >= client->net.receiveMaximum;
+}
+
 #pragma mark Threads, mutexes, and clocks
 
 /*!
@@ -2079,18 +2814,15 @@ void* MQTTAsync_sendThread(void* n)
     
     while (!tostop)
     {
-        while (commands->count > 0)
-        {
-            int before = commands->count;
-            MQTTAsync_processCommand();
-            if (before == commands->count) { break; }  // No commands were processed, so go into a wait.
-        }
-        int rc =  Thread_wait_cond(send_cond, 1);
-        if ((rc = Thread_wait_cond(send_cond, 1)) != 0 && rc != ETIMEDOUT)
+        long wait = MQTTASYNC_SEND_WAIT;
+        int processed = 0;
+        do { wait = MQTTAsync_processCommands(&processed); } while (processed > 0 && !tostop);  // Once a pass processes no command, go into a wait.
+        MQTTAsync_flushAll();
+        int rc;
+        if ((rc = Thread_wait_cond(send_cond, wait)) != 0 && rc != ETIMEDOUT)
         {
             Log(LOG_ERROR, -1, "Error %d waiting for condition variable", rc);
         }
-        MQTTAsync_checkTimeouts();
     }
     sendThread_state = STOPPING;
     
@@ -2102,6 +2834,22 @@ void* MQTTAsync_sendThread(void* n)
     return 0;
 }
 
+/*!
+ *  @abstract Write out the packets every client held back while the send thread processed its last batch of commands (see maxWriteDelay in MQTTAsync_connectOptions).
+ */
+void MQTTAsync_flushAll(void)
+{
+    ListElement* current = NULL;
+    
+    MQTTAsync_lock_mutex(mqttasync_mutex);
+    while (ListNextElement(handles, &current))
+    {
+        MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+        if (m->c && m->c->maxWriteDelay > 0 && m->c->net.socket > 0) { Socket_flush(m->c->net.socket); }
+    }
+    MQTTAsync_unlock_mutex(mqttasync_mutex);
+}
+
 /*!
  *  @abstract This is the thread function that handles the calling of callback functions (if any is set).
  */
@@ -2117,6 +2865,9 @@ void* MQTTAsync_receiveThread(void* n)
     {
         int sock = -1;
         int rc = SOCKET_ERROR;
+        uint64_t const next = TimerWheel_next(&bstate->timers);   // Wake up in time for the next timer.
+        uint64_t const now = TimerWheel_now();
+        if (next < now + (uint64_t)timeout) { timeout = (next > now) ? (long)(next - now) : 1L; }
         MQTTAsync_unlock_mutex(mqttasync_mutex);
         MQTTPacket* pack = MQTTAsync_cycle(&sock, timeout, &rc);
         MQTTAsync_lock_mutex(mqttasync_mutex);
@@ -2127,17 +2878,10 @@ void* MQTTAsync_receiveThread(void* n)
         if (sock == 0) { continue; }
         
         // Find client corresponding to socket
-        if (ListFindItem(handles, &sock, clientSockCompare) == NULL)
-        {
-            Log(TRACE_MINIMUM, -1, "Could not find client corresponding to socket %d", sock);
-            continue;
-        }
-        
-        MQTTAsyncs* m = (MQTTAsyncs*)(handles->current->content);
+        MQTTAsyncs* m = MQTTAsync_findSocket(sock);
         if (m == NULL)
         {
-            Log(LOG_ERROR, -1, "Client structure was NULL for socket %d - removing socket", sock);
-            Socket_close(sock);
+            Log(TRACE_MINIMUM, -1, "Could not find client corresponding to socket %d", sock);
             continue;
         }
         
@@ -2234,88 +2978,91 @@ void* MQTTAsync_receiveThread(void* n)
                 }
                 else if (pack->header.bits.type == SUBACK)
                 {
-                    ListElement* current = NULL;
+                    Suback* sub = (Suback*)pack;
+                    int* qoss = malloc(((sub->qoss->count > 0) ? sub->qoss->count : 1) * sizeof(int));
+                    int* element = qoss;
+                    ListElement* cur_qos = NULL;
                     
-                    /* use the msgid to find the callback to be called */
-                    while (ListNextElement(m->responses, &current))
+                    if (qoss)
                     {
-                        MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
-                        if (command->command.token == ((Suback*)pack)->msgId)
+                        while (ListNextElement(sub->qoss, &cur_qos))
+                            *element++ = *(int*)(cur_qos->content);
+                    }
+                    
+                    /* use the msgid to find the callbacks to be called: those of every subscribe request sent in the packet */
+                    MQTTAsync_queuedCommand* command = MQTTAsync_takeResponse(m, sub->msgId, SUBSCRIBE);
+                    while (command)
+                    {
+                        /* The request gets the slice of the QoS list of its own topics, where a code missing counts as a failure.
+                         * Call the failure callback if the request has one subscription and its return code is 0x80 (failure).
+                         * If it has >1 subscription, then we call onSuccess with the list of returned QoSs, which inelegantly,
+                         * could include some failures, or worse, the whole list could have failed.
+                         */
+                        int const first = command->command.details.sub.first;
+                        int const count = command->command.details.sub.count;
+                        int* granted = malloc(((count > 0) ? count : 1) * sizeof(int));
+                        for (int i = 0; granted && i < count; i++)
+                            granted[i] = (qoss && first + i < sub->qoss->count) ? qoss[first + i] : MQTT_BAD_SUBSCRIBE;
+                        
+                        if (count == 1 && (granted == NULL || granted[0] == MQTT_BAD_SUBSCRIBE))
                         {
-                            Suback* sub = (Suback*)pack;
-                            if (!ListDetach(m->responses, command)) /* remove the response from the list */
-                                Log(LOG_ERROR, -1, "Subscribe command not removed from command list");
-                            
-                            /* Call the failure callback if there is one subscribe in the MQTT packet and
-                             * the return code is 0x80 (failure).  If the MQTT packet contains >1 subscription
-                             * request, then we call onSuccess with the list of returned QoSs, which inelegantly,
-                             * could include some failures, or worse, the whole list could have failed.
-                             */
-                            if (sub->qoss->count == 1 && *(int*)(sub->qoss->first->content) == MQTT_BAD_SUBSCRIBE)
+                            if (command->command.onFailure)
                             {
-                                if (command->command.onFailure)
-                                {
-                                    MQTTAsync_failureData data;
-                                    
-                                    data.token = command->command.token;
-                                    data.code = *(int*)(sub->qoss->first->content);
-                                    Log(TRACE_MIN, -1, "Calling subscribe failure for client %s", m->c->clientID);
-                                    (*(command->command.onFailure))(command->command.context, &data);
-                                }
-                            }
-                            else if (command->command.onSuccess)
-                            {
-                                MQTTAsync_successData data;
-                                int* array = NULL;
+                                MQTTAsync_failureData data;
                                 
-                                if (sub->qoss->count == 1)
-                                    data.alt.qos = *(int*)(sub->qoss->first->content);
-                                else if (sub->qoss->count > 1)
-                                {
-                                    ListElement* cur_qos = NULL;
-                                    int* element = array = data.alt.qosList = malloc(sub->qoss->count * sizeof(int));
-                                    while (ListNextElement(sub->qoss, &cur_qos))
-                                        *element++ = *(int*)(cur_qos->content);
-                                }
                                 data.token = command->command.token;
-                                Log(TRACE_MIN, -1, "Calling subscribe success for client %s", m->c->clientID);
-                                (*(command->command.onSuccess))(command->command.context, &data);
-                                if (array)
-                                    free(array);
+                                data.code = MQTT_BAD_SUBSCRIBE;
+                                Log(TRACE_MIN, -1, "Calling subscribe failure for client %s", m->c->clientID);
+                                (*(command->command.onFailure))(command->command.context, &data);
                             }
-                            MQTTAsync_freeCommand(command);
-                            break;
                         }
+                        else if (command->command.onSuccess)
+                        {
+                            MQTTAsync_successData data;
+                            
+                            if (count == 1)
+                                data.alt.qos = granted[0];
+                            else if (count > 1)
+                                data.alt.qosList = granted;
+                            data.token = command->command.token;
+                            Log(TRACE_MIN, -1, "Calling subscribe success for client %s", m->c->clientID);
+                            (*(command->command.onSuccess))(command->command.context, &data);
+                        }
+                        if (granted)
+                            free(granted);
+                        MQTTAsync_token const next = command->command.details.sub.next;
+                        MQTTAsync_freeCommand(command);
+                        command = (next > 0) ? MQTTAsync_takeResponse(m, next, SUBSCRIBE) : NULL;
                     }
+                    if (qoss)
+                        free(qoss);
                     rc = MQTTProtocol_handleSubacks(pack, m->c->net.socket);
                 }
                 else if (pack->header.bits.type == UNSUBACK)
                 {
-                    ListElement* current = NULL;
-                    int handleCalled = 0;
+                    int const msgId = ((Unsuback*)pack)->msgId;
                     
-                    /* use the msgid to find the callback to be called */
-                    while (ListNextElement(m->responses, &current))
+                    rc = MQTTProtocol_handleUnsubacks(pack, m->c->net.socket);
+                    /* use the msgid to find the callbacks to be called: those of every unsubscribe request sent in the packet */
+                    MQTTAsync_queuedCommand* command = MQTTAsync_takeResponse(m, msgId, UNSUBSCRIBE);
+                    while (command)
                     {
-                        MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
-                        if (command->command.token == ((Unsuback*)pack)->msgId)
+                        if (command->command.onSuccess)
                         {
-                            if (!ListDetach(m->responses, command)) /* remove the response from the list */
-                                Log(LOG_ERROR, -1, "Unsubscribe command not removed from command list");
-                            if (command->command.onSuccess)
-                            {
-                                rc = MQTTProtocol_handleUnsubacks(pack, m->c->net.socket);
-                                handleCalled = 1;
-                                Log(TRACE_MIN, -1, "Calling unsubscribe success for client %s", m->c->clientID);
-                                (*(command->command.onSuccess))(command->command.context, NULL);
-                            }
-                            MQTTAsync_freeCommand(command);
-                            break;
+                            Log(TRACE_MIN, -1, "Calling unsubscribe success for client %s", m->c->clientID);
+                            (*(command->command.onSuccess))(command->command.context, NULL);
                         }
+                        MQTTAsync_token const next = command->command.details.unsub.next;
+                        MQTTAsync_freeCommand(command);
+                        command = (next > 0) ? MQTTAsync_takeResponse(m, next, UNSUBSCRIBE) : NULL;
                     }
-                    if (!handleCalled) { rc = MQTTProtocol_handleUnsubacks(pack, m->c->net.socket); }
                 }
             }
+            
+            // The acknowledgements of everything read so far go out together, once no packet is left buffered.
+            size_t buffered = 0;
+            SocketBuffer_getQueuedData(sock, &buffered);
+            if (buffered == 0) { Socket_flush(sock); }
         }
     } // End: while(!tostop)
     
@@ -2329,19 +3076,6 @@ void* MQTTAsync_receiveThread(void* n)
 
 #pragma mark Comparison functions
 
-/*!
- *  @abstract List callback function for comparing clients by socket.
- *
- *  @param a First integer value.
- *  @param b Second integer value.
- *  @return Boolean indicating whether a and b are equal.
- */
-bool clientSockCompare(void const* a, void const* b)
-{
-    MQTTAsyncs* m = (MQTTAsyncs*)a;
-    return m->c->net.socket == *(int*)b;
-}
-
 /*!
  *  @abstract List callback function for comparing clients by client structure.
  *
@@ -2370,37 +3104,38 @@ bool cmdMessageIDCompare(void const* a, void const* b)
 
 #pragma mark File related functions
 
-void MQTTAsync_writeComplete(int socket)
+void MQTTAsync_writeComplete(int socket, pending_writes* pw)
 {
-    ListElement* found = NULL;
+    MQTTAsyncs* m = NULL;
     
     FUNC_ENTRY;
-    /* a partial write is now complete for a socket - this will be on a publish*/
+    /* a queued write is now complete for a socket - for a QoS 0 publish, its response can be called */
     
-    MQTTProtocol_checkPendingWrites();
+    /* called from the receive thread while it waits for sockets, so take the lock the send thread holds while it records the pending write */
+    MQTTAsync_lock_mutex(mqttasync_mutex);
+    MQTTProtocol_checkPendingWrites(pw);
     
     /* find the client using this socket */
-    if ((found = ListFindItem(handles, &socket, clientSockCompare)) != NULL)
+    if ((m = MQTTAsync_findSocket(socket)) != NULL)
     {
-        MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
+        ListElement* cur_response = NULL;
+        MQTTAsync_queuedCommand* com = NULL;
         
-        time(&(m->c->net.lastSent));
+        m->c->net.lastSent = TimerWheel_now();
         
-        /* see if there is a pending write flagged */
-        if (m->pending_write)
+        /* see if a QoS 0 publish was waiting for this packet */
+        while (ListNextElement(m->responses, &cur_response))
         {
-            ListElement* cur_response = NULL;
-            MQTTAsync_command* command = m->pending_write;
-            MQTTAsync_queuedCommand* com = NULL;
-            
-            while (ListNextElement(m->responses, &cur_response))
-            {
-                com = (MQTTAsync_queuedCommand*)(cur_response->content);
-                if (com->client->pending_write == m->pending_write)
-                    break;
-            }
+            com = (MQTTAsync_queuedCommand*)(cur_response->content);
+            if (com->command.type == PUBLISH && com->command.details.pub.qos == 0 && com->command.details.pub.write == pw->id)
+                break;
+        }
+        
+        if (cur_response)
+        {
+            MQTTAsync_command* command = &com->command;
             
-            if (cur_response && command->onSuccess)
+            if (command->onSuccess)
             {
                 MQTTAsync_successData data;
                 
@@ -2413,20 +3148,22 @@ void MQTTAsync_writeComplete(int socket)
                 Log(TRACE_MIN, -1, "Calling publish success for client %s", m->c->clientID);
                 (*(command->onSuccess))(command->context, &data);
             }
-            m->pending_write = NULL;
             
-            ListDetach(m->responses, com);
+            ListDetachElementNoFree(m->responses, cur_response);
             MQTTAsync_freeCommand(com);
         }
     }
+    MQTTAsync_unlock_mutex(mqttasync_mutex);
     FUNC_EXIT;
 }
 
 /*!
  *  @abstract See if any pending writes have been completed, and cleanup if so.
  *  @discussion Cleaning up means removing any publication data that was stored because the write did not originally complete.
+ *
+ *  @param done the packet that has just been written.
  */
-void MQTTProtocol_checkPendingWrites()
+void MQTTProtocol_checkPendingWrites(pending_writes const* done)
 {
     FUNC_ENTRY;
     if (state.pending_writes.count > 0)
@@ -2434,9 +3171,10 @@ void MQTTProtocol_checkPendingWrites()
         ListElement* le = state.pending_writes.first;
         while (le)
         {
-            if (Socket_noPendingWrites(((pending_write*)(le->content))->socket))
+            pending_write* pw = (pending_write*)(le->content);
+            if ((pw->socket == done->socket && pw->id == done->id) || Socket_noPendingWrites(pw->socket))
             {
-                MQTTProtocol_removePublication(((pending_write*)(le->content))->p);
+                MQTTProtocol_removePublication(pw->p);
                 state.pending_writes.current = le;
                 ListRemove(&(state.pending_writes), le->content); /* does NextElement itself */
                 le = state.pending_writes.current;
@@ -2621,6 +3359,7 @@ MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int buflen)
             
         case PUBLISH:
             data_size = strlen(ptr) + 1;
+            command->details.pub.topiclen = data_size - 1;
             command->details.pub.destinationName = malloc(data_size);
             strcpy(command->details.pub.destinationName, ptr);
             ptr += data_size;
@@ -2663,7 +3402,7 @@ void MQTTAsync_insertInOrder(List* list, void* content, int size)
             index = current;
     }
     
-    ListInsert(list, content, size, index);
+    ListInsertNoMalloc(list, content, &((MQTTAsync_queuedCommand*)content)->element, size, index);
     FUNC_EXIT;
 }
 
@@ -2695,7 +3434,8 @@ int MQTTAsync_restoreCommands(MQTTAsyncs* client)
                 {
                     cmd->client = client;
                     cmd->seqno = atoi(msgkeys[i]+2);
-                    MQTTPersistence_insertInOrder(commands, cmd, sizeof(MQTTAsync_queuedCommand));
+                    MessageIds_hold(&c->msgIds, cmd->command.token);
+                    MQTTAsync_insertInOrder(client->commands, cmd, sizeof(MQTTAsync_queuedCommand));
                     free(buffer);
                     client->command_seqno = max(client->command_seqno, cmd->seqno);
                     commands_restored++;
@@ -2708,6 +3448,12 @@ int MQTTAsync_restoreCommands(MQTTAsyncs* client)
         if (msgkeys != NULL)
             free(msgkeys);
     }
+    if (commands_restored > 0)
+    {
+        MQTTAsync_lock_mutex(mqttcommand_mutex);
+        MQTTAsync_makeRunnable(client, false);
+        MQTTAsync_unlock_mutex(mqttcommand_mutex);
+    }
     Log(TRACE_MINIMUM, -1, "%d commands restored for client %s", commands_restored, c->clientID);
     FUNC_EXIT_RC(rc);
     return rc;
@@ -55,6 +55,7 @@
 #pragma once
 
 #include <stdio.h>                      // C Standard
+#include <sys/types.h>                  // POSIX
 
 #if !defined(NO_PERSISTENCE)
     #include "MQTTClientPersistence.h"  // MQTT (Public)
@@ -77,6 +78,7 @@
  *  @constant MQTTCODE_BAD_STRUCTURE A structure parameter does not have the correct eyecatcher and version number.
  *  @constant MQTTCODE_BAD_QOS A qos parameter is not 0, 1 or 2.
  *  @constant MQTTCODE_NO_MORE_MSGIDS All 65535 MQTT msgids are being used.
+ *  @constant MQTTCODE_TIMEOUT The response to a request did not arrive within the timeout set in its MQTTAsync_responseOptions.
  */
 typedef enum MQTTCODE {
     MQTTCODE_SUCCESS = 0,
@@ -89,7 +91,8 @@ typedef enum MQTTCODE {
     MQTTCODE_TOPICNAME_TRUNCATED = -7,
     MQTTCODE_BAD_STRUCTURE = -8,
     MQTTCODE_BAD_QOS = -9,
-    MQTTCODE_NO_MORE_MSGIDS = -10
+    MQTTCODE_NO_MORE_MSGIDS = -10,
+    MQTTCODE_TIMEOUT = -11
 } MQTTCode;
 
 /*!
@@ -104,6 +107,10 @@ typedef enum MQTTCODE {
  *  @abstract MQTT version to connect with: 3.1.1
  */
 #define MQTTVERSION_3_1_1   4
+/*!
+ *  @abstract MQTT version to connect with: 5
+ */
+#define MQTTVERSION_5       5
 /*!
  *  @abstract Bad return code from subscribe, as defined in the 3.1.1 specification
  */
@@ -166,6 +173,47 @@ typedef struct
  */
 typedef int MQTTAsync_messageArrived(void* context, char const* topicName, size_t topicLen, MQTTAsync_message* message);
 
+/*!
+ *  @abstract A chunk of the payload of a large message, handed to the application as it arrives (see MQTTAsync_setChunkedDelivery()).
+ *
+ *  @field struct_id The eyecatcher for this structure: MQCK.
+ *  @field struct_version The version number of this structure. Must be 0.
+ *  @field payloadlen The length of the whole payload of the message.
+ *  @field offset The offset of this chunk in the payload. The chunks of a message are handed over in order, from offset 0 to the last one, which ends at <i>payloadlen</i>.
+ *  @field data The bytes of this chunk, only valid for the duration of the callback.
+ *  @field datalen The length of <i>data</i>, never 0.
+ *  @field qos The quality of service of the message (see MQTTAsync_message).
+ *  @field retained Whether the message is a retained one (see MQTTAsync_message).
+ *  @field dup Whether the message may be a duplicate (see MQTTAsync_message).
+ *  @field msgid The message identifier.
+ */
+typedef struct
+{
+	char struct_id[4];
+	int struct_version;
+	size_t payloadlen;
+	size_t offset;
+	void const* data;
+	size_t datalen;
+	int qos;
+	int retained;
+	int dup;
+	int msgid;
+} MQTTAsync_messageChunk;
+
+#define MQTTAsync_messageChunk_initializer { {'M', 'Q', 'C', 'K'}, 0, 0, 0, NULL, 0, 0, 0, 0, 0 }
+
+/*!
+ *  @abstract Callback function for a chunk of a large message received.
+ *  @discussion The function is registered with the client library by passing it to MQTTAsync_setChunkedDelivery(). It is called on the thread receiving messages, which it holds up: nothing else is received for the client until it returns.
+ *
+ *  @param context A pointer to the <i>context</i> value originally passed to MQTTAsync_setCallbacks().
+ *  @param topicName The null terminated topic of the message, only valid for the duration of the callback.
+ *  @param topicLen The length of the topic.
+ *  @param chunk The chunk and the attributes of its message.
+ */
+typedef void MQTTAsync_messageChunkArrived(void* context, char const* topicName, size_t topicLen, MQTTAsync_messageChunk const* chunk);
+
 /*!
  *  @abstract Callback function for a message delivered.
  *  @discussion The client application must provide an implementation of this function to enable asynchronous notification of delivery of messages to the server. The function is registered with the client library by passing it as an argument to MQTTAsync_setCallbacks(). It is called by the client library after the client application has published a message to the server. It indicates that the necessary handshaking and acknowledgements for the requested quality of service (see MQTTAsync_message.qos) have been completed. This function is executed on a separate thread to the one on which the client application is running.
@@ -205,7 +253,7 @@ typedef struct
  *  @field alt A union of the different values that can be returned for subscribe, unsubscribe and publish.
  *      @field qos For subscribe, the granted QoS of the subscription returned by the server.
  *      @field qosList For subscribeMany, the list of granted QoSs of the subscriptions returned by the server.
- *      @field pub For publish, the message being sent to the server.
+ *      @field pub For publish, the message being sent to the server. If a codec encoded it (see MQTTAsync_setCodec()), the payload must not be used, as it may already be freed.
  *      @field connect For connect, the server connected to, MQTT version used, and sessionPresentation flag.
  */
 typedef struct
@@ -245,15 +293,142 @@ typedef void MQTTAsync_onSuccess(void* context, MQTTAsync_successData* response)
  */
 typedef void MQTTAsync_onFailure(void* context,  MQTTAsync_failureData* response);
 
+/*!
+ *  @abstract This is a callback function. It gives a payload lent with MQTTAsync_sendOwned() back to the client application, once the client library no longer needs it.
+ *  @discussion It is called on one of the client library threads, and must not block nor call the client library.
+ *
+ *  @param context A pointer to the <i>releaseContext</i> value originally passed to MQTTAsync_sendOwned().
+ *  @param payload The payload lent.
+ */
+typedef void MQTTAsync_onRelease(void* context, void* payload);
+
+/*!
+ *  @abstract This is a callback function. It produces part of a payload streamed with MQTTAsync_sendStream().
+ *  @discussion It is called on the client library thread writing to sockets, while no other socket is written to, so it should not wait on anything but reading the data. A message is sent again from the start of its payload after a reconnect, so any part of the payload must be produced again on request. It must not call the client library.
+ *
+ *  @param context A pointer to the <i>context</i> value of the MQTTAsync_stream.
+ *  @param buffer Where to put the bytes produced.
+ *  @param size The most bytes to produce, never more than the chunk size of the stream.
+ *  @param offset The offset in the payload of the first byte to produce.
+ *  @return The number of bytes produced, at least 1, or a negative value if the payload can not be produced, which drops the connection.
+ */
+typedef long MQTTAsync_payloadProducer(void* context, void* buffer, size_t size, size_t offset);
+
+/*!
+ *  @abstract MQTTAsync_stream defines a payload written to the network as it is read, a chunk at a time, so that payloads larger than memory can be published (see MQTTAsync_sendStream()).
+ *  @discussion The payload is read from <i>fd</i>, or produced by <i>producer</i> if <i>fd</i> is negative. Over plain TCP a file is sent with sendfile() where the system has it, which does not copy it through the process at all.
+ *
+ *  @field struct_id The eyecatcher for this structure. Must be MQST.
+ *  @field struct_version The version number of this structure. Must be 0.
+ *  @field length The length of the payload in bytes.
+ *  @field producer A pointer to the function producing the payload, used when <i>fd</i> is negative.
+ *  @field context A pointer to any application-specific context, passed to <i>producer</i> and to <i>onRelease</i>.
+ *  @field fd A file descriptor to read the payload from with pread(), or -1 to use <i>producer</i>. It must stay open until the stream is released.
+ *  @field offset The offset of the payload in <i>fd</i>.
+ *  @field chunkSize The most bytes of the payload held in memory at once, or 0 for 64 KiB.
+ *  @field onRelease A pointer to the function called, with <i>context</i> as its payload, once the payload is no longer needed. Can be set to NULL.
+ *  @field releaseContext A pointer to any application-specific context, passed to <i>onRelease</i>.
+ */
+typedef struct
+{
+    char struct_id[4];
+    int struct_version;
+    long length;
+    MQTTAsync_payloadProducer* producer;
+    void* context;
+    int fd;
+    off_t offset;
+    size_t chunkSize;
+    MQTTAsync_onRelease* onRelease;
+    void* releaseContext;
+} MQTTAsync_stream;
+
+#define MQTTAsync_stream_initializer { {'M', 'Q', 'S', 'T'}, 0, 0, NULL, NULL, -1, 0, 0, NULL, NULL }
+
+/*!
+ *  @abstract This is a callback function. It encodes or decodes a message payload for an MQTTAsync_codec.
+ *  @discussion Encoding is called on the thread publishing the message, and decoding on the thread delivering it, so it must be safe to call from several threads at once. It must not call the client library, except for MQTTAsync_malloc().
+ *
+ *  @param context A pointer to the <i>context</i> value of the codec.
+ *  @param data The payload to transform.
+ *  @param datalen The length of the payload in bytes.
+ *  @param output Set to the transformed payload, allocated with MQTTAsync_malloc(). The client library frees it.
+ *  @param outputlen Set to the length of the transformed payload in bytes.
+ *  @return 1 if the payload was transformed, 0 to leave it as it is (when encoding would not make it any smaller, or the data can not be decoded).
+ */
+typedef int MQTTAsync_codecTransform(void* context, void const* data, size_t datalen, void** output, size_t* outputlen);
+
+/*!
+ *  @abstract MQTTAsync_codec defines how the payloads of the messages on some topics are encoded before they are published, and decoded as they arrive (see MQTTAsync_setCodec()).
+ *  @discussion Every encoded payload starts with the marker of its codec, so that payloads published without encoding (by other clients, or because encoding did not pay off) are told apart and delivered as they are.
+ *
+ *  @field struct_id The eyecatcher for this structure. Must be MQCC.
+ *  @field struct_version The version number of this structure. Must be 0.
+ *  @field marker The first four bytes of every payload the codec encodes. <i>encode</i> must write them, and <i>decode</i> is only called on payloads starting with them.
+ *  @field encode A pointer to the function encoding payloads, or NULL to publish them as they are.
+ *  @field decode A pointer to the function decoding payloads, or NULL to deliver them as they are.
+ *  @field context A pointer to any application-specific context, passed to <i>encode</i> and <i>decode</i>.
+ */
+typedef struct
+{
+    char struct_id[4];
+    int struct_version;
+    unsigned char marker[4];
+    MQTTAsync_codecTransform* encode;
+    MQTTAsync_codecTransform* decode;
+    void* context;
+} MQTTAsync_codec;
+
+#define MQTTAsync_codec_initializer { {'M', 'Q', 'C', 'C'}, 0, {0, 0, 0, 0}, NULL, NULL, NULL }
+
+/*!
+ *  @abstract A codec compressing payloads with deflate (zlib), for text such as JSON.
+ *  @discussion Its payloads are the marker {0, 'M', 'Q', 'Z'}, the decoded length (four bytes, most significant first) and a zlib stream. Payloads shorter than 32 bytes, or which do not shrink, are published as they are. The application must be linked with zlib (-lz).
+ *
+ *  A payload received is only decoded within the limits of MQTTAsync_deflateOptions, and its buffer grows as the stream is decoded, so that a publisher can not make the client allocate more than the payload really decodes to. To change the limits, copy the codec and set its <i>context</i> to the options.
+ */
+extern MQTTAsync_codec const MQTTAsync_deflateCodec
+    __attribute__( (visibility("default")) );
+
+/*!
+ *  @abstract The largest decoded payload of MQTTAsync_deflateCodec by default: the largest payload an MQTT packet can carry.
+ */
+#define MQTTASYNC_DEFLATE_MAX_LENGTH 268435455
+
+/*!
+ *  @abstract The most a payload of MQTTAsync_deflateCodec may grow by decoding, by default: the most deflate can compress.
+ */
+#define MQTTASYNC_DEFLATE_MAX_RATIO 1032
+
+/*!
+ *  @abstract Limits of MQTTAsync_deflateCodec, set as the <i>context</i> of a copy of the codec, which must stay valid as long as the codec is set.
+ *  @discussion Payloads beyond the limits are published, or delivered, as they are.
+ *
+ *  @field struct_id The eyecatcher for this structure. Must be MQDO.
+ *  @field struct_version The version number of this structure. Must be 0.
+ *  @field maxLength The largest decoded payload in bytes, 0 for MQTTASYNC_DEFLATE_MAX_LENGTH.
+ *  @field maxRatio The largest decoded payload as a multiple of the length of the encoded one, 0 for MQTTASYNC_DEFLATE_MAX_RATIO.
+ */
+typedef struct
+{
+    char struct_id[4];
+    int struct_version;
+    size_t maxLength;
+    unsigned int maxRatio;
+} MQTTAsync_deflateOptions;
+
+#define MQTTAsync_deflateOptions_initializer { {'M', 'Q', 'D', 'O'}, 0, 0, 0 }
+
 /*!
  *  @abstract Structure to define callbacks from an MQTT API call.
  *
  *  @field struct_id The eyecatcher for this structure. Must be MQTR.
- *  @field struct_version The version number of this structure. Must be 0.
+ *  @field struct_version The version number of this structure. Must be 0 or 1. 0 signifies no timeout.
  *  @field onSuccess A pointer to a callback function to be called if the API call successfully completes. Can be set to NULL, in which case no indication of successful completion will be received.
  *  @field onFailure A pointer to a callback function to be called if the API call fails. Can be set to NULL, in which case no indication of unsuccessful completion will be received.
  *  @field context A pointer to any application-specific context. The <i>context</i> pointer is passed to success or failure callback functions to provide access to the context information in the callback.
  *  @field token Output.
+ *  @field timeout Time (ms) to wait for the response once the request is sent, 0 to wait as long as the session lasts. A publish of QoS 0 has no response to wait for. If it expires, the request is abandoned and onFailure is called with the code MQTTCODE_TIMEOUT. Requests sent together in one packet (see subscribeCoalesceDelay in MQTTAsync_connectOptions) share one response, and time out together at the shortest of their timeouts.
  */
 typedef struct
 {
@@ -263,9 +438,10 @@ typedef struct
     MQTTAsync_onFailure* onFailure;
     void* context;
     MQTTAsync_token token;
+    int timeout;
 } MQTTAsync_responseOptions;
 
-#define MQTTAsync_responseOptions_initializer { {'M', 'Q', 'T', 'R'}, 0, NULL, NULL, 0, 0 }
+#define MQTTAsync_responseOptions_initializer { {'M', 'Q', 'T', 'R'}, 1, NULL, NULL, 0, 0, 0 }
 
 /*!
  *  @abstract MQTTAsync_willOptions defines the MQTT "Last Will and Testament" (LWT) settings for the client. In the event that a client unexpectedly loses its connection to the server, the server publishes the LWT message to the LWT topic on behalf of the client. This allows other clients (subscribed to the LWT topic) to be made aware that the client has disconnected. To enable the LWT function for a specific client, a valid pointer to an MQTTAsync_willOptions structure is passed in the MQTTAsync_connectOptions structure used in the MQTTAsync_connect() call that connects the client to the server. The pointer to MQTTAsync_willOptions can be set to NULL if the LWT function is not required.
@@ -319,14 +495,52 @@ typedef struct
 
 #define MQTTAsync_SSLOptions_initializer { {'M', 'Q', 'T', 'S'}, 0, NULL, NULL, NULL, NULL, NULL, 1 }
 
+/*!
+ *  @abstract MQTTAsync_socketOptions tunes the network connections of a client. The options are set on every socket the client creates, before it connects, so they also apply to the connections made by reconnects. 0 leaves a setting at the system default.
+ *  @discussion A latency sensitive client (e.g. one exchanging small control messages) typically wants noDelay. A client streaming bulk data wants large buffers. Options the platform does not support are ignored, and only the buffer sizes apply to unix:// connections.
+ *
+ *  @field struct_id The eyecatcher for this structure.  Must be MQTN.
+ *  @field struct_version The version number of this structure.  Must be 0.
+ *  @field noDelay True/False option to turn Nagle's algorithm off (TCP_NODELAY), so small packets are sent without waiting for the acknowledgement of earlier data.
+ *  @field sendBufferSize The size in bytes of the kernel send buffer of the socket (SO_SNDBUF).
+ *  @field receiveBufferSize The size in bytes of the kernel receive buffer of the socket (SO_RCVBUF).
+ *  @field userTimeout The longest time in milliseconds sent data may stay unacknowledged before the connection is considered broken (TCP_USER_TIMEOUT, Linux only).
+ *  @field tcpKeepAlive True/False option to send TCP keepalive probes on an idle connection (SO_KEEPALIVE). Independent of the MQTT keepAliveInterval.
+ *  @field tcpKeepAliveIdle The time in seconds a connection is idle before the first keepalive probe.
+ *  @field tcpKeepAliveInterval The time in seconds between keepalive probes.
+ *  @field tcpKeepAliveCount The number of unanswered keepalive probes after which the connection is considered broken.
+ *  @field quickAck True/False option to acknowledge received data straight away instead of delaying the acknowledgement (TCP_QUICKACK, Linux only).
+ */
+typedef struct
+{
+    char const struct_id[4];
+    int struct_version;
+    int noDelay;
+    int sendBufferSize;
+    int receiveBufferSize;
+    int userTimeout;
+    int tcpKeepAlive;
+    int tcpKeepAliveIdle;
+    int tcpKeepAliveInterval;
+    int tcpKeepAliveCount;
+    int quickAck;
+} MQTTAsync_socketOptions;
+
+#define MQTTAsync_socketOptions_initializer { {'M', 'Q', 'T', 'N'}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+
 /*!
  *  @abstract MQTTAsync_connectOptions defines several settings that control the way the client connects to an MQTT server.  Default values are set in MQTTAsync_connectOptions_initializer.
  *
  *  @field struct_id The eyecatcher for this structure. Must be MQTC.
- *  @field struct_version The version number of this structure.  Must be 0, 1 or 2.
+ *  @field struct_version The version number of this structure.  Must be 0, 1, 2, 3, 4, 5, 6, 7 or 8.
  *      0 signifies no SSL options and no serverURIs
  *      1 signifies no serverURIs
  *      2 signifies no MQTTVersion
+ *      3 signifies no maxWriteDelay
+ *      4 signifies no socket options
+ *      5 signifies no zeroCopy
+ *      6 signifies no topicAliasMaximum
+ *      7 signifies no subscribeCoalesceDelay or subscribeCoalesceTopics
  *  @field keepAliveInterval The "keep alive" interval, measured in seconds, defines the maximum time that should pass without communication between the client and the server. The client will ensure that at least one message travels across the network within each keep alive period.  In the absence of a data-related message during the time period, the client sends a very small MQTT "ping" message, which the server will acknowledge. The keep alive interval enables the client to detect when the server is no longer available without having to wait for the long TCP/IP timeout. Set to 0 if you do not want any keep alive processing.
  *  @field cleansession This is a boolean value. The cleansession setting controls the behaviour of both the client and the server at connection and disconnection time. The client and server both maintain session state information. This information is used to ensure "at least once" and "exactly once" delivery, and "exactly once" receipt of messages. Session state also includes subscriptions created by an MQTT client. You can choose to maintain or discard state information between sessions.
  *      When cleansession is true, the state information is discarded at connect and disconnect. Setting cleansession to false keeps the state information. When you connect an MQTT client application with MQTTAsync_connect(), the client identifies the connection using the client identifier and the address of the server. The server checks whether session information for this client has been saved from a previous connection to the server. If a previous session still exists, and cleansession=true, then the previous session information at the client and server is cleared. If cleansession=false, the previous session is resumed. If no previous session exists, a new session is started.
@@ -341,11 +555,18 @@ typedef struct
  *  @field onFailure A pointer to a callback function to be called if the connect fails. Can be set to NULL, in which case no indication of unsuccessful completion will be received.
  *  @field context A pointer to any application-specific context. The the <i>context</i> pointer is passed to success or failure callback functions to provide access to the context information in the callback.
  *  @field serverURIcount The number of entries in the serverURIs array.
- *  @field serverURIs An array of null-terminated strings specifying the servers to which the client will connect. Each string takes the form <i>protocol://host:port</i>. <i>protocol</i> must be <i>tcp</i> or <i>ssl</i>. For <i>host</i>, you can specify either an IP address or a domain name. For instance, to connect to a server running on the local machines with the default MQTT port, specify <i>tcp://localhost:1883</i>.
+ *  @field serverURIs An array of null-terminated strings specifying the servers to which the client will connect. Each string takes the form <i>protocol://host:port</i>. <i>protocol</i> must be <i>tcp</i> or <i>ssl</i>. For <i>host</i>, you can specify either an IP address or a domain name. For instance, to connect to a server running on the local machines with the default MQTT port, specify <i>tcp://localhost:1883</i>. A broker on the same host can also be reached through a Unix domain socket with <i>unix://path</i>, e.g. <i>unix:///var/run/mqtt.sock</i> (SSL options are ignored for it).
  *  @field MQTTVersion Sets the version of MQTT to be used on the connect.
  *      MQTTVERSION_DEFAULT (0) = default: start with 3.1.1, and if that fails, fall back to 3.1
  *      MQTTVERSION_3_1 (3) = only try version 3.1
  *      MQTTVERSION_3_1_1 (4) = only try version 3.1.1
+ *      MQTTVERSION_5 (5) = only try version 5. The client then keeps at most as many QoS 1 and 2 messages in flight as the server's Receive Maximum, and uses topic aliases (see topicAliasMaximum). No other MQTT 5 feature is exposed.
+ *  @field maxWriteDelay The longest time in milliseconds an outgoing packet may be held back, so that the packets the client produces in one go (a batch of commands, the acknowledgements of a batch of incoming messages) are written to the socket with a single system call. 0 (the default) writes every packet straight away. See MQTTAsync_getWriteStatistics().
+ *  @field socket This is a pointer to an MQTTAsync_socketOptions structure. Set this pointer to NULL to keep the system defaults.
+ *  @field zeroCopy True/False option to deliver QoS 0 and 1 messages without copying them: the topic and payload handed to MQTTAsync_messageArrived() point into the buffer the message was received in, which is kept until MQTTAsync_freeMessage() is called. The topic must then <b>not</b> be freed with MQTTAsync_free(), and must not be used after the message is freed. Holding on to messages keeps their receive buffers allocated. False (the default) copies every message.
+ *  @field topicAliasMaximum With MQTTVERSION_5, the number of topic aliases the client uses in each direction, up to 65535. Publishing, the client gives aliases to the topics it published to most recently (no more than the server accepts), and leaves out the topic of a message whose alias the server already knows. Receiving, the server may use that many aliases. Messages whose topic came as an alias are copied even with zeroCopy. 0 (the default) uses none.
+ *  @field subscribeCoalesceDelay The longest time in milliseconds a subscribe (or unsubscribe) request may be held back, so that the requests made in quick succession go to the server in a single SUBSCRIBE (or UNSUBSCRIBE) packet. A request is only merged with requests of the same kind queued right after it, and each still gets its own token and its own onSuccess or onFailure call, with the granted QoS of its own topics. 0 (the default) sends every request in a packet of its own.
+ *  @field subscribeCoalesceTopics The most topics a packet of merged requests carries: once as many are queued, they are sent without waiting for subscribeCoalesceDelay. A single request with more topics is still sent whole. 0 (the default) sets no limit.
  */
 typedef struct
 {
@@ -366,10 +587,16 @@ typedef struct
     int serverURIcount;
     char* const* serverURIs;
     int MQTTVersion;
+    int maxWriteDelay;
+    MQTTAsync_socketOptions* socket;
+    int zeroCopy;
+    int topicAliasMaximum;
+    int subscribeCoalesceDelay;
+    int subscribeCoalesceTopics;
 } MQTTAsync_connectOptions;
 
 
-#define MQTTAsync_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 3, 60, 1, 10, NULL, NULL, NULL, 30, 0, NULL, NULL, NULL, NULL, 0, NULL, 0}
+#define MQTTAsync_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 8, 60, 1, 10, NULL, NULL, NULL, 30, 0, NULL, NULL, NULL, NULL, 0, NULL, 0, 0, NULL, 0, 0, 0, 0}
 
 /*!
  *  @abstract Structure indicating the callbacks for disconnection.
@@ -416,7 +643,7 @@ typedef struct
  *  @abstract This function creates an MQTT client ready for connection to the specified server and using the specified persistent storage (@link MQTTAsync_persistence @/link).
  *
  *  @param handle A pointer to an MQTTAsync handle. The handle is populated with a valid client reference following a successful return from this function.
- *  @param serverURI A null-terminated string specifying the server to which the client will connect. It takes the form <code>protocol://host:port</code>. The <code>protocol</code> must be <code>tcp</code> or <code>ssl</code>. For <code>host</code>, you can specify either an IP address or a domain name. For instance, to connect to a server running on the local machines with the default MQTT port, specify <code>tcp://localhost:1883</code>.
+ *  @param serverURI A null-terminated string specifying the server to which the client will connect. It takes the form <code>protocol://host:port</code>. The <code>protocol</code> must be <code>tcp</code> or <code>ssl</code>. For <code>host</code>, you can specify either an IP address or a domain name. For instance, to connect to a server running on the local machines with the default MQTT port, specify <code>tcp://localhost:1883</code>. A broker on the same host can also be reached through a Unix domain socket with <code>unix://path</code>, e.g. <code>unix:///var/run/mqtt.sock</code>.
  *  @param clientId The client identifier passed to the server when the client connects to it. It is a null-terminated UTF-8 encoded string. ClientIDs must be no longer than 23 characters according to the MQTT specification.
  *  @param persistence_type The type of persistence to be used by the client:
  *  <ul>
@@ -447,6 +674,34 @@ MQTTCode MQTTAsync_create(MQTTAsync* handle, char const* restrict serverURI, cha
 int MQTTAsync_setCallbacks(MQTTAsync handle, void* context, MQTTAsync_connectionLost* cl, MQTTAsync_messageArrived* ma, MQTTAsync_deliveryComplete* dc)
     __attribute__( (visibility("default")) );
 
+/*!
+ *  @abstract This function sets the codec of the messages whose topic matches a topic filter (see MQTTAsync_codec).
+ *  @discussion Messages published to a matching topic are encoded before they are queued, so that the encoded payload is what is persisted and sent. Messages received on a matching topic are decoded before they are handed to MQTTAsync_messageArrived(). When several filters match a topic, the one set first is used. Messages on topics no filter matches are published and delivered as they are.
+ *
+ *  @note The MQTT client must be disconnected when this function is called.
+ *  @param handle A valid client handle from a successful call to MQTTAsync_create().
+ *  @param topicFilter The topic filter, which may include wildcards (see @ref wildcard).
+ *  @param codec A pointer to the codec, which is copied (e.g. &MQTTAsync_deflateCodec), or NULL to remove the codec of the filter.
+ *  @return MQTTCODE_SUCCESS if the codec was set, MQTTCODE_FAILURE if an error occurred.
+ */
+int MQTTAsync_setCodec(MQTTAsync handle, char const* topicFilter, MQTTAsync_codec const* codec)
+    __attribute__( (visibility("default")) );
+
+/*!
+ *  @abstract This function has the messages with a large payload handed to the application in chunks, as they arrive.
+ *  @discussion A message is otherwise only handed to MQTTAsync_messageArrived() once all of it has been received, into a buffer as large as the message, which may take up to 256 MB. A message whose payload is at least <i>threshold</i> bytes long is instead handed to <i>mca</i> a chunk at a time, as it is read from the network: the memory it takes is bounded by the read buffer, and its first bytes reach the application before its last ones arrive. Smaller messages are delivered as usual.
+ *
+ *      A chunked message is acknowledged once its last chunk has been handed over. A QoS 2 message is handed over as it arrives rather than when the server releases it, and not handed over again if the server sends it again before releasing it. If the connection is lost in the middle of a message, its last chunk never comes: the server sends a QoS 1 or 2 message again from the start once the client reconnects. Chunked messages are neither decoded (see MQTTAsync_setCodec()), persisted, nor queued, so they may be handed over ahead of smaller messages still waiting for MQTTAsync_messageArrived() to accept them.
+ *
+ *  @note The MQTT client must be disconnected when this function is called.
+ *  @param handle A valid client handle from a successful call to MQTTAsync_create().
+ *  @param threshold The length of the smallest payload handed over in chunks, or 0 to deliver every message whole (the default).
+ *  @param mca A pointer to an MQTTAsync_messageChunkArrived() callback function, which is given the <i>context</i> passed to MQTTAsync_setCallbacks(). Only NULL if <i>threshold</i> is 0.
+ *  @return MQTTCODE_SUCCESS if chunked delivery was set, MQTTCODE_FAILURE if an error occurred.
+ */
+int MQTTAsync_setChunkedDelivery(MQTTAsync handle, size_t threshold, MQTTAsync_messageChunkArrived* mca)
+    __attribute__( (visibility("default")) );
+
 /*!
  *  @abstract This function attempts to connect a previously-created client (see MQTTAsync_create()) to an MQTT server using the specified options. If you want to enable asynchronous message and status notifications, you must call MQTTAsync_setCallbacks() prior to MQTTAsync_connect().
  *
@@ -548,6 +803,39 @@ int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, M
 int MQTTAsync_send(MQTTAsync handle, char const* destinationName, size_t payloadlen, void* payload, int qos, int retained, MQTTAsync_responseOptions* response)
     __attribute__( (visibility("default")) );
 
+/*!
+ *  @abstract This function attempts to publish a message to a given topic without copying its payload (see also MQTTAsync_send()).
+ *  @discussion The payload is lent to the client library, and must be left untouched until it is given back through <i>onRelease</i>: once it has been written for QoS 0, or acknowledged by the server for QoS 1 and 2. The payload is also given back if the message is dropped, at the latest when the client is destroyed. Release may happen before or after the MQTTAsync_onSuccess() callback of the message, so the payload in its success data must not be used. A payload encoded by a codec (see MQTTAsync_setCodec()) is given back before the function returns, as only the encoded copy is sent. If the function fails, the payload stays with the client application and <i>onRelease</i> is not called.
+ *
+ *  @param handle A valid client handle from a successful call to MQTTAsync_create().
+ *  @param destinationName The topic associated with this message.
+ *  @param payloadlen The length of the payload in bytes.
+ *  @param payload A pointer to the byte array payload of the message.
+ *  @param qos The @ref qos of the message.
+ *  @param retained The retained flag for the message.
+ *  @param onRelease The function giving the payload back.
+ *  @param releaseContext A pointer to any application-specific context, passed to <i>onRelease</i>.
+ *  @param response A pointer to an MQTTAsync_responseOptions structure. Used to set callback functions. This is optional and can be set to NULL.
+ *  @return MQTTCODE_SUCCESS if the message is accepted for publication. An error code is returned if there was a problem accepting the message.
+ */
+int MQTTAsync_sendOwned(MQTTAsync handle, char const* destinationName, size_t payloadlen, void* payload, int qos, int retained, MQTTAsync_onRelease* onRelease, void* releaseContext, MQTTAsync_responseOptions* response)
+    __attribute__( (visibility("default")) );
+
+/*!
+ *  @abstract This function attempts to publish a message to a given topic, streaming its payload rather than holding it in memory (see also MQTTAsync_sendOwned()).
+ *  @discussion The PUBLISH header is encoded up front, and the payload read and written a chunk at a time as the socket takes it, so no more than the chunk size of the payload is in memory at once. The stream structure is copied, and the source it reads from released through its <i>onRelease</i> as a payload lent with MQTTAsync_sendOwned() is. Streamed messages are neither persisted nor encoded by codecs, and the payload in their success data is NULL. If the function fails, <i>onRelease</i> is not called.
+ *
+ *  @param handle A valid client handle from a successful call to MQTTAsync_create().
+ *  @param destinationName The topic associated with this message.
+ *  @param stream A pointer to the MQTTAsync_stream describing the payload.
+ *  @param qos The @ref qos of the message.
+ *  @param retained The retained flag for the message.
+ *  @param response A pointer to an MQTTAsync_responseOptions structure. Used to set callback functions. This is optional and can be set to NULL.
+ *  @return MQTTCODE_SUCCESS if the message is accepted for publication. An error code is returned if there was a problem accepting the message.
+ */
+int MQTTAsync_sendStream(MQTTAsync handle, char const* destinationName, MQTTAsync_stream const* stream, int qos, int retained, MQTTAsync_responseOptions* response)
+    __attribute__( (visibility("default")) );
+
 
 /*!
  *  @abstract This function attempts to publish a message to a given topic (see also MQTTAsync_publish()). An MQTTAsync_token is issued when this function returns successfully. If the client application needs to test for successful delivery of messages, a callback should be set (see MQTTAsync_onSuccess() and MQTTAsync_deliveryComplete()).
@@ -573,6 +861,17 @@ int MQTTAsync_sendMessage(MQTTAsync handle, char const* destinationName, MQTTAsy
 int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
     __attribute__( (visibility("default")) );
 
+/*!
+ *  @abstract This function reports how well the packets of the current connection are being coalesced into socket writes (see maxWriteDelay in MQTTAsync_connectOptions).
+ *
+ *  @param handle A valid client handle from a successful call to MQTTAsync_create().
+ *  @param packets Set to the number of MQTT packets sent since the connection was opened.
+ *  @param writes Set to the number of write system calls made to send them. packets / writes is the average number of packets per system call.
+ *  @return MQTTCODE_SUCCESS if the counters were returned, MQTTCODE_DISCONNECT if the client has no connection open.
+ */
+int MQTTAsync_getWriteStatistics(MQTTAsync handle, unsigned long* packets, unsigned long* writes)
+    __attribute__( (visibility("default")) );
+
 #define MQTTASYNC_TRUE 1
 
 int MQTTAsync_isComplete(MQTTAsync handle, MQTTAsync_token dt)
@@ -583,7 +882,7 @@ int MQTTAsync_waitForCompletion(MQTTAsync handle, MQTTAsync_token dt, unsigned l
 
 
 /*!
- *  @abstract This function frees memory allocated to an MQTT message, including the additional memory allocated to the message payload. The client application calls this function when the message has been fully processed. <b>Important note:</b> This function does not free the memory allocated to a message topic string. It is the responsibility of the client application to free this memory using the MQTTAsync_free() library function.
+ *  @abstract This function frees memory allocated to an MQTT message, including the additional memory allocated to the message payload. The client application calls this function when the message has been fully processed. <b>Important note:</b> This function does not free the memory allocated to a message topic string. It is the responsibility of the client application to free this memory using the MQTTAsync_free() library function. Messages delivered without copying (see zeroCopy in MQTTAsync_connectOptions) are the exception: freeing the message releases the buffer holding both its payload and its topic.
  *
  *  @param msg The address of a pointer to the MQTTAsync_message structure to be freed.
  */
@@ -598,6 +897,15 @@ void MQTTAsync_freeMessage(MQTTAsync_message** msg)
 void MQTTAsync_free(void* ptr)
     __attribute__( (visibility("default")) );
 
+/*!
+ *  @abstract This function allocates memory the MQTT C client library is to free, such as the output of an MQTTAsync_codecTransform().
+ *
+ *  @param size The number of bytes to allocate.
+ *  @return A pointer to the memory, or NULL if it could not be allocated.
+ */
+void* MQTTAsync_malloc(size_t size)
+    __attribute__( (visibility("default")) );
+
 /*!
  *  @abstract This function frees the memory allocated to an MQTT client (see MQTTAsync_create()). It should be called when the client is no longer required.
  *
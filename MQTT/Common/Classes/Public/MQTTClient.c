@@ -35,8 +35,9 @@ char* client_version_eye = "MQTTClientV3_Version " CLIENT_VERSION;
 
 static ClientStates ClientState =
 {
-	CLIENT_VERSION, /* version */
-	NULL /* client list */
+	.version = CLIENT_VERSION,
+	.clients = NULL,
+	.timers = { 0 } /* no timer scheduled */
 };
 
 ClientStates* bstate = &ClientState;
@@ -63,7 +64,6 @@ void MQTTClient_init()
 
 static volatile int initialized = 0;
 static List* handles = NULL;
-static time_t last;
 static int running = 0;
 static int tostop = 0;
 static pthread_t run_id = 0;
@@ -74,7 +74,7 @@ int MQTTClient_cleanSession(Clients* client);
 void MQTTClient_stop();
 int MQTTClient_disconnect_internal(MQTTClient handle, int timeout);
 int MQTTClient_disconnect1(MQTTClient handle, int timeout, int internal, int stop);
-void MQTTClient_writeComplete(int socket);
+void MQTTClient_writeComplete(int socket, pending_writes* pw);
 
 typedef struct
 {
@@ -106,6 +106,8 @@ typedef struct
 
 } MQTTClients;
 
+MQTTClients* MQTTClient_findSocket(int socket);
+
 void MQTTClient_sleep(long milliseconds)
 {
 	FUNC_ENTRY;
@@ -199,7 +201,13 @@ int MQTTClient_create(MQTTClient* handle, const char* serverURI, const char* cli
 	{
 		rc = MQTTPersistence_initialize(m->c, m->serverURI);
 		if (rc == 0)
+		{
+			ListElement* current = NULL;
+
 			MQTTPersistence_restoreMessageQueue(m->c);
+			while (ListNextElement(m->c->outboundMsgs, &current))	/* the ids of restored messages are still in flight */
+				MessageIds_hold(&m->c->msgIds, ((Messages*)(current->content))->msgid);
+		}
 	}
 #endif
 	ListAppend(bstate->clients, m->c, sizeof(Clients) + 3*sizeof(List));
@@ -336,15 +344,14 @@ int MQTTClient_deliverMessage(int rc, MQTTClients* m, char** topicName, int* top
 
 
 /**
- * List callback function for comparing clients by socket
- * @param a first integer value
- * @param b second integer value
- * @return boolean indicating whether a and b are equal
+ * Find the client using a socket, through the socket table
+ * @param socket the socket
+ * @return the client, or NULL if no client is using the socket
  */
-int clientSockCompare(void* a, void* b)
+MQTTClients* MQTTClient_findSocket(int socket)
 {
-	MQTTClients* m = (MQTTClients*)a;
-	return m->c->net.socket == *(int*)b;
+	Clients* client = (Clients*)Socket_getClient(socket);
+	return (client) ? (MQTTClients*)(client->context) : NULL;
 }
 
 
@@ -388,13 +395,7 @@ void* MQTTClient_run(void* n)
 		timeout = 1000L;
 
 		/* find client corresponding to socket */
-		if (ListFindItem(handles, &sock, clientSockCompare) == NULL)
-		{
-			/* assert: should not happen */
-			continue;
-		}
-		m = (MQTTClient)(handles->current->content);
-		if (m == NULL)
+		if ((m = MQTTClient_findSocket(sock)) == NULL)
 		{
 			/* assert: should not happen */
 			continue;
@@ -469,11 +470,7 @@ void* MQTTClient_run(void* n)
 			}
 			else if (m->c->connect_state == 1 && !Thread_check_sem(m->connect_sem))
 			{
-				int error;
-				socklen_t len = sizeof(error);
-
-				if ((m->rc = getsockopt(m->c->net.socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len)) == 0)
-					m->rc = error;
+				m->rc = Socket_connectError(m->c->net.socket);
 				Log(TRACE_MIN, -1, "Posting connect semaphore for client %s rc %d", m->c->clientID, m->rc);
 				Thread_post_sem(m->connect_sem);
 			}
@@ -606,10 +603,11 @@ int MQTTClient_cleanSession(Clients* client)
 #if !defined(NO_PERSISTENCE)
 	rc = MQTTPersistence_clear(client);
 #endif
-	MQTTProtocol_emptyMessageList(client->inboundMsgs);
-	MQTTProtocol_emptyMessageList(client->outboundMsgs);
+	MQTTProtocol_emptyMessageList(client->inboundMsgs, &client->inboundIndex);
+	MQTTProtocol_emptyMessageList(client->outboundMsgs, &client->outboundIndex);
 	MQTTClient_emptyMessageQueue(client);
 	client->msgID = 0;
+	MessageIds_reset(&client->msgIds);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -626,20 +624,23 @@ void Protocol_processPublication(Publish* publish, Clients* client)
 
 	qe->msg = mm;
 
-	qe->topicName = publish->topic;
 	qe->topicLen = publish->topiclen;
-	publish->topic = NULL;
 
-	/* If the message is QoS 2, then we have already stored the incoming payload
-	 * in an allocated buffer, so we don't need to copy again.
+	/* If the message is QoS 2, then we have already stored the incoming topic and payload
+	 * in allocated buffers, so we don't need to copy again.
 	 */
 	if (publish->header.bits.qos == 2)
+	{
+		qe->topicName = publish->topic;
 		mm->payload = publish->payload;
+	}
 	else
 	{
+		qe->topicName = MQTTPacket_copyTopic(publish);
 		mm->payload = malloc(publish->payloadlen);
 		memcpy(mm->payload, publish->payload, publish->payloadlen);
 	}
+	publish->topic = NULL;
 
 	mm->payloadlen = publish->payloadlen;
 	mm->qos = publish->header.bits.qos;
@@ -659,6 +660,12 @@ void Protocol_processPublication(Publish* publish, Clients* client)
 }
 
 
+void Protocol_processPublicationChunk(Publish* publish, Clients* client)
+{
+	/* publishes are never received in chunks, as no chunk threshold is set for synchronous clients */
+}
+
+
 int MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions* options, const char* serverURI, int MQTTVersion,
 	START_TIME_TYPE start, long millisecsTimeout)
 {
@@ -793,20 +800,14 @@ int MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions* o
 				m->c->connected = 1;
 				m->c->good = 1;
 				m->c->connect_state = 0;
+				MQTTProtocol_startKeepalive(m->c);
 				if (MQTTVersion == 4)
 					sessionPresent = connack->flags.bits.sessionPresent;
 				if (m->c->cleansession)
 					rc = MQTTClient_cleanSession(m->c);
 				if (m->c->outboundMsgs->count > 0)
 				{
-					ListElement* outcurrent = NULL;
-
-					while (ListNextElement(m->c->outboundMsgs, &outcurrent))
-					{
-						Messages* m = (Messages*)(outcurrent->content);
-						m->lastTouch = 0;
-					}
-					MQTTProtocol_retry((time_t)0, 1, 1);
+					MQTTProtocol_retry(m->c);
 					if (m->c->connected != 1)
 						rc = MQTTCLIENT_DISCONNECTED;
 				}
@@ -818,7 +819,7 @@ int MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions* o
 exit:
 	if (rc == MQTTCLIENT_SUCCESS)
 	{
-		if (options->struct_version == 4) /* means we have to fill out return values */
+		if (options->struct_version >= 4) /* means we have to fill out return values */
 		{
 			options->returned.serverURI = serverURI;
 			options->returned.MQTTVersion = MQTTVersion;
@@ -852,6 +853,21 @@ int MQTTClient_connectURI(MQTTClient handle, MQTTClient_connectOptions* options,
 	m->c->cleansession = options->cleansession;
 	m->c->maxInflightMessages = (options->reliable) ? 1 : 10;
 
+	memset(&m->c->sockopts, 0, sizeof(Socket_options));
+	if (options->struct_version >= 5 && options->socket)
+	{
+		MQTTClient_socketOptions const* so = options->socket;
+		m->c->sockopts.nodelay = so->noDelay;
+		m->c->sockopts.sndbuf = so->sendBufferSize;
+		m->c->sockopts.rcvbuf = so->receiveBufferSize;
+		m->c->sockopts.usertimeout = so->userTimeout;
+		m->c->sockopts.keepalive = so->tcpKeepAlive;
+		m->c->sockopts.keepidle = so->tcpKeepAliveIdle;
+		m->c->sockopts.keepintvl = so->tcpKeepAliveInterval;
+		m->c->sockopts.keepcnt = so->tcpKeepAliveCount;
+		m->c->sockopts.quickack = so->quickAck;
+	}
+
 	if (m->c->will)
 	{
 		free(m->c->will->msg);
@@ -942,7 +958,7 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 
 	if (strncmp(options->struct_id, "MQTC", 4) != 0 ||
 		(options->struct_version != 0 && options->struct_version != 1 && options->struct_version != 2
-			&& options->struct_version != 3 && options->struct_version != 4))
+			&& options->struct_version != 3 && options->struct_version != 4 && options->struct_version != 5))
 	{
 		rc = MQTTCLIENT_BAD_STRUCTURE;
 		goto exit;
@@ -957,6 +973,15 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 		}
 	}
 
+	if (options->struct_version >= 5 && options->socket) /* check validity of socket options structure */
+	{
+		if (strncmp(options->socket->struct_id, "MQTN", 4) != 0 || options->socket->struct_version != 0)
+		{
+			rc = MQTTCLIENT_BAD_STRUCTURE;
+			goto exit;
+		}
+	}
+
 #if defined(OPENSSL)
 	if (options->struct_version != 0 && options->ssl) /* check validity of SSL options structure */
 	{
@@ -1178,6 +1203,7 @@ int MQTTClient_subscribeMany(MQTTClient handle, int count, char* const* topic, i
 		else
 			rc = SOCKET_ERROR;
 	}
+	MessageIds_release(&m->c->msgIds, msgid);
 
 	if (rc == SOCKET_ERROR)
 	{
@@ -1264,6 +1290,7 @@ int MQTTClient_unsubscribeMany(MQTTClient handle, int count, char* const* topic)
 		else
 			rc = SOCKET_ERROR;
 	}
+	MessageIds_release(&m->c->msgIds, msgid);
 
 	if (rc == SOCKET_ERROR)
 	{
@@ -1314,7 +1341,7 @@ int MQTTClient_publish(MQTTClient handle, const char* topicName, int payloadlen,
 
 	/* If outbound queue is full, block until it is not */
 	while (m->c->outboundMsgs->count >= m->c->maxInflightMessages ||
-         Socket_noPendingWrites(m->c->net.socket) == 0) /* wait until the socket is free of large packets being written */
+         Socket_queueFull(m->c->net.socket)) /* wait until the socket has written enough of the packets queued for it */
 	{
 		if (blocked == 0)
 		{
@@ -1343,7 +1370,10 @@ int MQTTClient_publish(MQTTClient handle, const char* topicName, int payloadlen,
 	p->payload = payload;
 	p->payloadlen = payloadlen;
 	p->topic = (char*)topicName;
+	p->topiclen = strlen(topicName);
 	p->msgId = msgid;
+	p->lender.release = NULL;
+	p->stream = NULL;
 
 	rc = MQTTProtocol_startPublish(m->c, p, qos, retained, &msg);
 
@@ -1354,7 +1384,7 @@ int MQTTClient_publish(MQTTClient handle, const char* topicName, int payloadlen,
 	 */
 	if (rc == TCPSOCKET_INTERRUPTED)
 	{
-		while (m->c->connected == 1 && SocketBuffer_getWrite(m->c->net.socket))
+		while (m->c->connected == 1 && !Socket_noPendingWrites(m->c->net.socket))
 		{
 			Thread_unlock_mutex(mqttclient_mutex);
 			MQTTClient_yield();
@@ -1413,18 +1443,8 @@ exit:
 
 void MQTTClient_retry(void)
 {
-	time_t now;
-
 	FUNC_ENTRY;
-	time(&(now));
-	if (difftime(now, last) > 5)
-	{
-		time(&(last));
-		MQTTProtocol_keepalive(now);
-		MQTTProtocol_retry(now, 1, 0);
-	}
-	else
-		MQTTProtocol_retry(now, 0, 0);
+	TimerWheel_advance(&bstate->timers, TimerWheel_now());
 	FUNC_EXIT;
 }
 
@@ -1456,9 +1476,7 @@ MQTTPacket* MQTTClient_cycle(int* sock, unsigned long timeout, int* rc)
 	Thread_lock_mutex(mqttclient_mutex);
 	if (*sock > 0)
 	{
-		MQTTClients* m = NULL;
-		if (ListFindItem(handles, sock, clientSockCompare) != NULL)
-			m = (MQTTClient)(handles->current->content);
+		MQTTClients* m = MQTTClient_findSocket(*sock);
 		if (m != NULL)
 		{
 			if (m->c->connect_state == 1 || m->c->connect_state == 2)
@@ -1480,11 +1498,14 @@ MQTTPacket* MQTTClient_cycle(int* sock, unsigned long timeout, int* rc)
 			else if (pack->header.bits.type == PUBACK || pack->header.bits.type == PUBCOMP)
 			{
 				int msgid;
+				int inflight = (m) ? m->c->outboundMsgs->count : 0;
 
 				ack = (pack->header.bits.type == PUBCOMP) ? *(Pubcomp*)pack : *(Puback*)pack;
 				msgid = ack.msgId;
 				*rc = (pack->header.bits.type == PUBCOMP) ?
 						MQTTProtocol_handlePubcomps(pack, *sock) : MQTTProtocol_handlePubacks(pack, *sock);
+				if (m && m->c->outboundMsgs->count < inflight)	/* the flow of the message completed */
+					MessageIds_release(&m->c->msgIds, msgid);
 				if (m && m->dc)
 				{
 					Log(TRACE_MIN, -1, "Calling deliveryComplete for client %s, msgid %d", m->c->clientID, msgid);
@@ -1555,11 +1576,7 @@ MQTTPacket* MQTTClient_waitfor(MQTTClient handle, int packet_type, int* rc, long
 					break;
 				if (m->c->connect_state == 1)
 				{
-					int error;
-					socklen_t len = sizeof(error);
-
-					if ((*rc = getsockopt(m->c->net.socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len)) == 0)
-						*rc = error;
+					*rc = Socket_connectError(m->c->net.socket);
 					break;
 				}
 #if defined(OPENSSL)
@@ -1640,8 +1657,7 @@ int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTC
 
 		if (rc == SOCKET_ERROR)
 		{
-			if (ListFindItem(handles, &sock, clientSockCompare) && 	/* find client corresponding to socket */
-			  (MQTTClient)(handles->current->content) == handle)
+			if (MQTTClient_findSocket(sock) == handle) 	/* find client corresponding to socket */
 				break; /* there was an error on the socket we are interested in */
 		}
 		elapsed = MQTTClient_elapsed(start);
@@ -1679,9 +1695,9 @@ void MQTTClient_yield(void)
 	{
 		int sock = -1;
 		MQTTClient_cycle(&sock, (timeout > elapsed) ? timeout - elapsed : 0L, &rc);
-		if (rc == SOCKET_ERROR && ListFindItem(handles, &sock, clientSockCompare))
+		MQTTClients* m = NULL;
+		if (rc == SOCKET_ERROR && (m = MQTTClient_findSocket(sock)) != NULL)
 		{
-			MQTTClients* m = (MQTTClient)(handles->current->content);
 			if (m->c->connect_state != -2)
 				MQTTClient_disconnect_internal(m, 0);
 		}
@@ -1721,7 +1737,7 @@ int MQTTClient_waitForCompletion(MQTTClient handle, MQTTClient_deliveryToken mdt
 		goto exit;
 	}
 
-	if (ListFindItem(m->c->outboundMsgs, &mdt, messageIDCompare) == NULL)
+	if (MessageTable_get(&m->c->outboundIndex, mdt) == NULL)
 	{
 		rc = MQTTCLIENT_SUCCESS; /* well we couldn't find it */
 		goto exit;
@@ -1733,7 +1749,7 @@ int MQTTClient_waitForCompletion(MQTTClient handle, MQTTClient_deliveryToken mdt
 		Thread_unlock_mutex(mqttclient_mutex);
 		MQTTClient_yield();
 		Thread_lock_mutex(mqttclient_mutex);
-		if (ListFindItem(m->c->outboundMsgs, &mdt, messageIDCompare) == NULL)
+		if (MessageTable_get(&m->c->outboundIndex, mdt) == NULL)
 		{
 			rc = MQTTCLIENT_SUCCESS; /* well we couldn't find it */
 			goto exit;
@@ -1824,8 +1840,9 @@ MQTTClient_nameValue* MQTTClient_getVersionInfo()
  * See if any pending writes have been completed, and cleanup if so.
  * Cleaning up means removing any publication data that was stored because the write did
  * not originally complete.
+ * @param done the packet that has just been written
  */
-void MQTTProtocol_checkPendingWrites()
+void MQTTProtocol_checkPendingWrites(pending_writes const* done)
 {
 	FUNC_ENTRY;
 	if (state.pending_writes.count > 0)
@@ -1833,9 +1850,10 @@ void MQTTProtocol_checkPendingWrites()
 		ListElement* le = state.pending_writes.first;
 		while (le)
 		{
-			if (Socket_noPendingWrites(((pending_write*)(le->content))->socket))
+			pending_write* pw = (pending_write*)(le->content);
+			if ((pw->socket == done->socket && pw->id == done->id) || Socket_noPendingWrites(pw->socket))
 			{
-				MQTTProtocol_removePublication(((pending_write*)(le->content))->p);
+				MQTTProtocol_removePublication(pw->p);
 				state.pending_writes.current = le;
 				ListRemove(&(state.pending_writes), le->content); /* does NextElement itself */
 				le = state.pending_writes.current;
@@ -1848,21 +1866,19 @@ void MQTTProtocol_checkPendingWrites()
 }
 
 
-void MQTTClient_writeComplete(int socket)
+void MQTTClient_writeComplete(int socket, pending_writes* pw)
 {
-	ListElement* found = NULL;
+	MQTTClients* m = NULL;
 
 	FUNC_ENTRY;
-	/* a partial write is now complete for a socket - this will be on a publish*/
+	/* a queued write is now complete for a socket */
 
-	MQTTProtocol_checkPendingWrites();
+	MQTTProtocol_checkPendingWrites(pw);
 
 	/* find the client using this socket */
-	if ((found = ListFindItem(handles, &socket, clientSockCompare)) != NULL)
+	if ((m = MQTTClient_findSocket(socket)) != NULL)
 	{
-		MQTTClients* m = (MQTTClients*)(found->content);
-
-		time(&(m->c->net.lastSent));
+		m->c->net.lastSent = TimerWheel_now();
 	}
 	FUNC_EXIT;
 }
@@ -344,7 +344,9 @@ DLLExport int MQTTClient_setCallbacks(MQTTClient handle, void* context, MQTTClie
  * Currently, <i>protocol</i> must be <i>tcp</i>. For <i>host</i>, you can
  * specify either an IP address or a domain name. For instance, to connect to
  * a server running on the local machines with the default MQTT port, specify
- * <i>tcp://localhost:1883</i>.
+ * <i>tcp://localhost:1883</i>. A server on the same host can also be reached
+ * through a Unix domain socket with <i>unix://path</i>, e.g.
+ * <i>unix:///var/run/mqtt.sock</i>.
  * @param clientId The client identifier passed to the server when the
  * client connects to it. It is a null-terminated UTF-8 encoded string.
  * ClientIDs must be no longer than 23 characters according to the MQTT
@@ -464,6 +466,46 @@ typedef struct
 
 #define MQTTClient_SSLOptions_initializer { {'M', 'Q', 'T', 'S'}, 0, NULL, NULL, NULL, NULL, NULL, 1 }
 
+/**
+ * MQTTClient_socketOptions tunes the network connections of a client. The
+ * options are set on every socket the client creates, before it connects, so
+ * they also apply to the connections made when reconnecting. 0 leaves a
+ * setting at the system default. Options the platform does not support are
+ * ignored, and only the buffer sizes apply to <i>unix://</i> connections.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQTN */
+	const char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/** True/False option to turn Nagle's algorithm off (TCP_NODELAY), so small
+	 * packets are sent without waiting for the acknowledgement of earlier data */
+	int noDelay;
+	/** The size in bytes of the kernel send buffer of the socket (SO_SNDBUF) */
+	int sendBufferSize;
+	/** The size in bytes of the kernel receive buffer of the socket (SO_RCVBUF) */
+	int receiveBufferSize;
+	/** The longest time in milliseconds sent data may stay unacknowledged
+	 * before the connection is considered broken (TCP_USER_TIMEOUT, Linux only) */
+	int userTimeout;
+	/** True/False option to send TCP keepalive probes on an idle connection
+	 * (SO_KEEPALIVE). Independent of the MQTT #keepAliveInterval */
+	int tcpKeepAlive;
+	/** The time in seconds a connection is idle before the first keepalive probe */
+	int tcpKeepAliveIdle;
+	/** The time in seconds between keepalive probes */
+	int tcpKeepAliveInterval;
+	/** The number of unanswered keepalive probes after which the connection
+	 * is considered broken */
+	int tcpKeepAliveCount;
+	/** True/False option to acknowledge received data straight away instead of
+	 * delaying the acknowledgement (TCP_QUICKACK, Linux only) */
+	int quickAck;
+} MQTTClient_socketOptions;
+
+#define MQTTClient_socketOptions_initializer { {'M', 'Q', 'T', 'N'}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+
 /**
  * MQTTClient_connectOptions defines several settings that control the way the
  * client connects to an MQTT server.
@@ -482,11 +524,12 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  must be MQTC. */
 	const char struct_id[4];
-	/** The version number of this structure.  Must be 0, 1, 2, 3 or 4.
+	/** The version number of this structure.  Must be 0, 1, 2, 3, 4 or 5.
 	 * 0 signifies no SSL options and no serverURIs
 	 * 1 signifies no serverURIs
 	 * 2 signifies no MQTTVersion
 	 * 3 signifies no returned values
+	 * 4 signifies no socket options
 	 */
 	int struct_version;
 	/** The "keep alive" interval, measured in seconds, defines the maximum time
@@ -572,7 +615,7 @@ typedef struct
    * <i>protocol</i> must be <i>tcp</i> or <i>ssl</i>. For <i>host</i>, you can
    * specify either an IP address or a host name. For instance, to connect to
    * a server running on the local machines with the default MQTT port, specify
-   * <i>tcp://localhost:1883</i>.
+   * <i>tcp://localhost:1883</i>, or <i>unix://path</i> for a Unix domain socket.
    * If this list is empty (the default), the server URI specified on MQTTClient_create()
    * is used.
    */
@@ -593,9 +636,14 @@ typedef struct
 		int MQTTVersion;     /**< the MQTT version used to connect with */
 		int sessionPresent;  /**< if the MQTT version is 3.1.1, the value of sessionPresent returned in the connack */
 	} returned;
+	/**
+   * This is a pointer to an MQTTClient_socketOptions structure. Set this
+   * pointer to NULL to keep the system defaults.
+   */
+	MQTTClient_socketOptions* socket;
 } MQTTClient_connectOptions;
 
-#define MQTTClient_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 4, 60, 1, 1, NULL, NULL, NULL, 30, 20, NULL, 0, NULL, 0}
+#define MQTTClient_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 5, 60, 1, 1, NULL, NULL, NULL, 30, 20, NULL, 0, NULL, 0, {NULL, 0, 0}, NULL}
 
 /**
   * MQTTClient_libraryInfo is used to store details relating to the currently used
@@ -5,6 +5,8 @@
 #endif
 #include "Messages.h"           // MQTT (Private)
 #include "StackTrace.h"         // MQTT (Utilities)
+#include "SocketBuffer.h"       // MQTT (Web)
+#include "TopicAliases.h"       // MQTT (Private)
 #include "Heap.h"               // MQTT (Utilities)
 
 #include <stdlib.h>             // C Standard
@@ -16,6 +18,8 @@
     #define min(A,B) ( (A) < (B) ? (A):(B))
 #endif
 
+#define MQTTPACKET_HEADER_SIZE 5    // Longest fixed header: the header byte and a 4 byte remaining length.
+
 /*!
  *  @abstract List of the predefined MQTT v3 packet names.
  */
@@ -49,85 +53,132 @@ pf new_packets[] = {
 	MQTTPacket_header_only  // DISCONNECT
 };
 
+/*!
+ *  @abstract How the values of MQTT 5 properties are encoded.
+ */
+enum propertyTypes
+{
+	PROPERTY_UNKNOWN, PROPERTY_BYTE, PROPERTY_TWO_BYTE_INTEGER, PROPERTY_FOUR_BYTE_INTEGER,
+	PROPERTY_VARIABLE_BYTE_INTEGER, PROPERTY_BINARY, PROPERTY_STRING_PAIR
+};
+
+/*!
+ *  @abstract Encoding of every MQTT 5 property, indexed by identifier, so that the ones the client does not act on can be skipped. Strings are encoded as binary data.
+ */
+static char const property_types[] =
+{
+	[0x01] = PROPERTY_BYTE,                 // Payload Format Indicator
+	[0x02] = PROPERTY_FOUR_BYTE_INTEGER,    // Message Expiry Interval
+	[0x03] = PROPERTY_BINARY,               // Content Type
+	[0x08] = PROPERTY_BINARY,               // Response Topic
+	[0x09] = PROPERTY_BINARY,               // Correlation Data
+	[0x0B] = PROPERTY_VARIABLE_BYTE_INTEGER,// Subscription Identifier
+	[0x11] = PROPERTY_FOUR_BYTE_INTEGER,    // Session Expiry Interval
+	[0x12] = PROPERTY_BINARY,               // Assigned Client Identifier
+	[0x13] = PROPERTY_TWO_BYTE_INTEGER,     // Server Keep Alive
+	[0x15] = PROPERTY_BINARY,               // Authentication Method
+	[0x16] = PROPERTY_BINARY,               // Authentication Data
+	[0x17] = PROPERTY_BYTE,                 // Request Problem Information
+	[0x18] = PROPERTY_FOUR_BYTE_INTEGER,    // Will Delay Interval
+	[0x19] = PROPERTY_BYTE,                 // Request Response Information
+	[0x1A] = PROPERTY_BINARY,               // Response Information
+	[0x1C] = PROPERTY_BINARY,               // Server Reference
+	[0x1F] = PROPERTY_BINARY,               // Reason String
+	[RECEIVE_MAXIMUM] = PROPERTY_TWO_BYTE_INTEGER,
+	[TOPIC_ALIAS_MAXIMUM] = PROPERTY_TWO_BYTE_INTEGER,
+	[TOPIC_ALIAS] = PROPERTY_TWO_BYTE_INTEGER,
+	[0x24] = PROPERTY_BYTE,                 // Maximum QoS
+	[0x25] = PROPERTY_BYTE,                 // Retain Available
+	[0x26] = PROPERTY_STRING_PAIR,          // User Property
+	[0x27] = PROPERTY_FOUR_BYTE_INTEGER,    // Maximum Packet Size
+	[0x28] = PROPERTY_BYTE,                 // Wildcard Subscription Available
+	[0x29] = PROPERTY_BYTE,                 // Subscription Identifier Available
+	[0x2A] = PROPERTY_BYTE                  // Shared Subscription Available
+};
+
 #pragma mark - Private prototypes
 
 char* readUTFlen(char** pptr, char* enddata, size_t* len);
 int MQTTPacket_send_ack(int type, int msgid, int dup, networkHandles *net);
+int MQTTPacket_nextFrame(networkHandles* net, MQTTPacketParser_frame const** frame, size_t* needed);
+int MQTTPacket_putdatas(networkHandles* net, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees, SocketBuffer_stream const* stream);
+bool MQTTPacket_resolveTopicAlias(networkHandles* net, Publish* publish);
+Publish* MQTTPacket_publishChunk(networkHandles* net, MQTTPacketParser_frame const* frame);
+size_t MQTTPacket_binaryLength(char const* ptr, char const* enddata);
 
 #pragma mark - Public API
 
 void* MQTTPacket_Factory(networkHandles* net, int* error)
 {
-	static Header header;
+	Header header;
 	int ptype;
 	void* pack = NULL;
+	MQTTPacketParser_frame const* frame = NULL;
+	size_t needed = 0;
 
 	FUNC_ENTRY;
-	*error = SOCKET_ERROR;  // Indicate whether an error occurred, or not
-
-	/* read the packet data from the socket */
-    #if defined(OPENSSL)
-	*error = (net->ssl) ? SSLSocket_getch(net->ssl, net->socket, &header.byte) : Socket_getch(net->socket, &header.byte); 
-    #else
-	*error = Socket_getch(net->socket, &header.byte);
-    #endif
+	/* take the next packet parsed out of the socket read buffer, reading from the socket only if none is left */
+	if ((*error = MQTTPacket_nextFrame(net, &frame, &needed)) == TCPSOCKET_INTERRUPTED)
+	{
+        #if defined(OPENSSL)
+		*error = (net->ssl) ? SSLSocket_read(net->ssl, net->socket, needed) : Socket_read(net->socket, needed);
+        #else
+		*error = Socket_read(net->socket, needed);
+        #endif
+		if (*error == TCPSOCKET_COMPLETE) { *error = MQTTPacket_nextFrame(net, &frame, &needed); }
+	}
     
 	if (*error != TCPSOCKET_COMPLETE)
-    {   // First byte is the header byte
+    {
         goto exit;  // packet not read, *error indicates whether SOCKET_ERROR occurred.
     }
 
-	// Now read the remaining length, so we know how much more to read
-    size_t remaining_length;
-    
-    if ((*error = MQTTPacket_decode(net, &remaining_length)) != TCPSOCKET_COMPLETE) {
-        goto exit; // Packet not read, *error indicates whether SOCKET_ERROR occurred.
-    }
-
-	// Now read the rest, the variable header and payload.
-    size_t actual_len = 0;
-    
-    #if defined(OPENSSL)
-	char* data = (net->ssl) ? SSLSocket_getdata(net->ssl, net->socket, remaining_length, &actual_len) :  Socket_getdata(net->socket, remaining_length, &actual_len);
-    #else
-	char* data = Socket_getdata(net->socket, remaining_length, &actual_len);
-    #endif
-    
-	if (data == NULL)
+	if (frame->chunked)
 	{
-		*error = SOCKET_ERROR;
-		goto exit; // Socket error
+		if ((pack = MQTTPacket_publishChunk(net, frame)) == NULL) {
+			*error = BAD_MQTT_PACKET;
+		} else {
+			net->lastReceived = TimerWheel_now();
+		}
+		goto exit;
 	}
 
-	if (actual_len != remaining_length)
-    {
-		*error = TCPSOCKET_INTERRUPTED;
-    }
-	else
+	header.byte = frame->header;
+	char* data = frame->data;
+	size_t const remaining_length = frame->remaining_length;
+
+	ptype = header.bits.type;
+	if (ptype < CONNECT || ptype > DISCONNECT || new_packets[ptype] == NULL)
+		Log(TRACE_MIN, 2, NULL, ptype);
+	else if ((pack = (*new_packets[ptype])(net->MQTTVersion, header.byte, data, remaining_length)) == NULL)
+		*error = BAD_MQTT_PACKET;
+	else if (ptype == PUBLISH)
 	{
-		ptype = header.bits.type;
-		if (ptype < CONNECT || ptype > DISCONNECT || new_packets[ptype] == NULL)
-			Log(TRACE_MIN, 2, NULL, ptype);
-		else
+		Publish* publish = (Publish*)pack;
+		if (!MQTTPacket_resolveTopicAlias(net, publish))
 		{
-			if ((pack = (*new_packets[ptype])(header.byte, data, remaining_length)) == NULL)
-				*error = BAD_MQTT_PACKET;
-            #if !defined(NO_PERSISTENCE)
-			else if (header.bits.type == PUBLISH && header.bits.qos == 2)
-			{
-				int buf0len;
-				char *buf = malloc(10);
-				buf[0] = header.byte;
-				buf0len = 1 + MQTTPacket_encode(&buf[1], remaining_length);
-				size_t remaining_length_new = remaining_length;
-				*error = MQTTPersistence_put(net->socket, buf, buf0len, 1, &data, &remaining_length_new, header.bits.type, ((Publish *)pack)->msgId, 1);
-				free(buf);
-			}
-            #endif
+			MQTTPacket_freePublish(publish);
+			pack = NULL;
+			*error = BAD_MQTT_PACKET;
 		}
+        #if !defined(NO_PERSISTENCE)
+		else if (header.bits.qos == 2)
+		{	/* the topic may come from an alias, or has been moved over its length bytes (see MQTTPacket_publish), so it is written out again in front of the rest */
+			size_t const received_topiclen = (publish->topic == data) ? publish->topiclen : 0;	/* a topic from an alias was received empty */
+			size_t const restlen = remaining_length - 2 - received_topiclen;
+			char buf[MQTTPACKET_HEADER_SIZE + 2];
+			char *ptr = buf;
+			writeChar(&ptr, header.byte);
+			ptr += MQTTPacket_encode(ptr, 2 + publish->topiclen + restlen);
+			writeInt(&ptr, (int)publish->topiclen);
+			char* buffers[2] = { publish->topic, data + 2 + received_topiclen };
+			size_t buflens[2] = { publish->topiclen, restlen };
+			*error = MQTTPersistence_put(net->socket, buf, (size_t)(ptr - buf), 2, buffers, buflens, header.bits.type, publish->msgId, 1);
+		}
+        #endif
 	}
 	if (pack)
-		time(&(net->lastReceived));
+		net->lastReceived = TimerWheel_now();
 exit:
 	FUNC_EXIT_RC(*error);
 	return pack;
@@ -150,32 +201,29 @@ int MQTTPacket_encode(char* buf, size_t length)
     return rc;
 }
 
-int MQTTPacket_decode(networkHandles* net, size_t* value)
+int MQTTPacket_decode(char const* buf, size_t buflen, size_t* value)
 {
-    int rc = SOCKET_ERROR;
-    char c;
-    int multiplier = 1;
-    int len = 0;
+    int rc = 0;
+    size_t multiplier = 1;
     #define MAX_NO_OF_REMAINING_LENGTH_BYTES 4
     
     FUNC_ENTRY;
     *value = 0;
     do
     {
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+        if (rc == MAX_NO_OF_REMAINING_LENGTH_BYTES)
         {
             rc = SOCKET_ERROR;	/* bad data */
             goto exit;
         }
-        #if defined(OPENSSL)
-        rc = (net->ssl) ? SSLSocket_getch(net->ssl, net->socket, &c) : Socket_getch(net->socket, &c);
-        #else
-        rc = Socket_getch(net->socket, &c);
-        #endif
-        if (rc != TCPSOCKET_COMPLETE) { goto exit; }
-        *value += (c & 127) * multiplier;
+        if ((size_t)rc == buflen)
+        {
+            rc = 0;             /* not all there yet */
+            goto exit;
+        }
+        *value += (buf[rc] & 127) * multiplier;
         multiplier *= 128;
-    } while ((c & 128) != 0);
+    } while ((buf[rc++] & 128) != 0);
 
 exit:
     FUNC_EXIT_RC(rc);
@@ -196,6 +244,62 @@ char* readUTF(char** pptr, char* enddata)
     return readUTFlen(pptr, enddata, &len);
 }
 
+bool readProperties(char** pptr, char* enddata, MQTTProperties* properties)
+{
+    int rc = false;
+    size_t len = 0;
+    
+    FUNC_ENTRY;
+    properties->receiveMaximum = 65535;
+    properties->topicAliasMaximum = 0;
+    properties->topicAlias = 0;
+    int const lenlen = (enddata > *pptr) ? MQTTPacket_decode(*pptr, (size_t)(enddata - *pptr), &len) : 0;
+    if (lenlen <= 0 || len > (size_t)(enddata - *pptr - lenlen)) { goto exit; }
+    
+    char* ptr = *pptr + lenlen;
+    char* const end = ptr + len;
+    while (ptr < end)
+    {
+        unsigned char const identifier = readChar(&ptr);
+        size_t size = 0;    // Length of the value
+        switch ((identifier < sizeof(property_types)) ? property_types[identifier] : PROPERTY_UNKNOWN)
+        {
+            case PROPERTY_BYTE: size = 1; break;
+            case PROPERTY_TWO_BYTE_INTEGER: size = 2; break;
+            case PROPERTY_FOUR_BYTE_INTEGER: size = 4; break;
+            case PROPERTY_VARIABLE_BYTE_INTEGER:
+            {
+                size_t value;
+                int const bytes = MQTTPacket_decode(ptr, (size_t)(end - ptr), &value);
+                if (bytes <= 0) { goto exit; }
+                size = (size_t)bytes;
+                break;
+            }
+            case PROPERTY_BINARY: size = MQTTPacket_binaryLength(ptr, end); break;
+            case PROPERTY_STRING_PAIR:
+                if ((size = MQTTPacket_binaryLength(ptr, end)) > 0)
+                {
+                    size_t const second = MQTTPacket_binaryLength(ptr + size, end);
+                    size = (second > 0) ? size + second : 0;
+                }
+                break;
+            default: goto exit;
+        }
+        if (size == 0 || size > (size_t)(end - ptr)) { goto exit; }
+        
+        char* value = ptr;
+        if (identifier == RECEIVE_MAXIMUM) { properties->receiveMaximum = readInt(&value); }
+        else if (identifier == TOPIC_ALIAS_MAXIMUM) { properties->topicAliasMaximum = readInt(&value); }
+        else if (identifier == TOPIC_ALIAS) { properties->topicAlias = readInt(&value); }
+        ptr += size;
+    }
+    *pptr = end;
+    rc = true;
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
 unsigned char readChar(char** pptr)
 {
     unsigned char c = **pptr;
@@ -233,9 +337,9 @@ char* MQTTPacket_name(int ptype)
 int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buflen, int free)
 {
 	int rc;
+	char buf[MQTTPACKET_HEADER_SIZE];
 
 	FUNC_ENTRY;
-	char* buf = malloc(10);
 	buf[0] = header.byte;
 	size_t buf0len = 1 + MQTTPacket_encode(&buf[1], buflen);
     #if !defined(NO_PERSISTENCE)
@@ -248,57 +352,28 @@ int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buf
 	}
     #endif
 
-    #if defined(OPENSSL)
-    if (net->ssl) {
-		rc = SSLSocket_putdatas(net->ssl, net->socket, buf, buf0len, 1, &buffer, &buflen, &free);
-    } else
-    #endif
-		rc = Socket_putdatas(net->socket, buf, buf0len, 1, &buffer, &buflen, &free);
-		
-    if (rc == TCPSOCKET_COMPLETE) { time(&(net->lastSent)); }
-    if (rc != TCPSOCKET_INTERRUPTED) { free(buf); }
-
+	rc = MQTTPacket_putdatas(net, buf, buf0len, 1, &buffer, &buflen, &free, NULL);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 int MQTTPacket_sends(networkHandles* net, Header header, int count, char** buffers, size_t* buflens, int* frees)
 {
-	int i, rc, buf0len, total = 0;
-	char *buf;
+	int i, rc;
+	size_t total = 0;
+	char buf[MQTTPACKET_HEADER_SIZE];
 
 	FUNC_ENTRY;
-	buf = malloc(10);
 	buf[0] = header.byte;
 	for (i = 0; i < count; i++)
 		total += buflens[i];
-	buf0len = 1 + MQTTPacket_encode(&buf[1], total);
-    #if !defined(NO_PERSISTENCE)
-	if (header.bits.type == PUBLISH && header.bits.qos != 0)
-	{   // Persist PUBLISH QoS1 and Qo2
-		char *ptraux = buffers[2];
-		int msgId = readInt(&ptraux);
-		rc = MQTTPersistence_put(net->socket, buf, buf0len, count, buffers, buflens,
-			header.bits.type, msgId, 0);
-	}
-    #endif
-    #if defined(OPENSSL)
-	if (net->ssl)
-		rc = SSLSocket_putdatas(net->ssl, net->socket, buf, buf0len, count, buffers, buflens, frees);
-	else
-    #endif
-		rc = Socket_putdatas(net->socket, buf, buf0len, count, buffers, buflens, frees);
-		
-	if (rc == TCPSOCKET_COMPLETE)
-		time(&(net->lastSent));
-	
-	if (rc != TCPSOCKET_INTERRUPTED)
-	  free(buf);
+	size_t buf0len = 1 + MQTTPacket_encode(&buf[1], total);
+	rc = MQTTPacket_putdatas(net, buf, buf0len, count, buffers, buflens, frees, NULL);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
-void* MQTTPacket_header_only(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_header_only(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
     static unsigned char header = 0;
     header = aHeader;
@@ -319,7 +394,7 @@ int MQTTPacket_send_disconnect(networkHandles *net, const char* clientID)
     return rc;
 }
 
-void* MQTTPacket_publish(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
     Publish* pack = malloc(sizeof(Publish));
     char* curdata = data;
@@ -327,16 +402,36 @@ void* MQTTPacket_publish(unsigned char aHeader, char* data, size_t datalen)
     
     FUNC_ENTRY;
     pack->header.byte = aHeader;
-    if ((pack->topic = readUTFlen(&curdata, enddata, &pack->topiclen)) == NULL) // Topic name on which to publish.
+    pack->lender.release = NULL;
+    pack->stream = NULL;
+    pack->chunked = false;
+    pack->payloadoffset = pack->totallen = 0;
+    if (enddata - curdata < 2 || (pack->topiclen = (size_t)readInt(&curdata)) > (size_t)(enddata - curdata))  // Topic name on which to publish.
     {
         free(pack);
         pack = NULL;
         goto exit;
     }
+    // Move the topic over its length bytes, so that it can be null terminated without being copied.
+    pack->topic = memmove(curdata - 2, curdata, pack->topiclen);
+    pack->topic[pack->topiclen] = '\0';
+    curdata += pack->topiclen;
     if (pack->header.bits.qos > 0)  // Msgid only exists for QoS 1 or 2
         pack->msgId = readInt(&curdata);
     else
         pack->msgId = 0;
+    pack->topicAlias = 0;
+    if (MQTTVersion >= MQTTVERSION_5)
+    {
+        MQTTProperties properties;
+        if (!readProperties(&curdata, enddata, &properties))
+        {
+            free(pack);
+            pack = NULL;
+            goto exit;
+        }
+        pack->topicAlias = properties.topicAlias;
+    }
     pack->payload = curdata;
     pack->payloadlen = datalen-(curdata-data);
     
@@ -348,58 +443,108 @@ exit:
 void MQTTPacket_freePublish(Publish* pack)
 {
     FUNC_ENTRY;
-    if (pack->topic != NULL)
-        free(pack->topic);
     free(pack);
     FUNC_EXIT;
 }
 
+void MQTTPacket_freeChunked(networkHandles* net)
+{
+    free(net->chunked.topic);
+    net->chunked.topic = NULL;
+}
+
+char* MQTTPacket_copyTopic(Publish const* pack)
+{
+    char* topic = malloc(pack->topiclen + 1);
+    memcpy(topic, pack->topic, pack->topiclen);
+    topic[pack->topiclen] = '\0';
+    return topic;
+}
+
 
 int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, networkHandles* net, char const* clientID)
 {
     Header header;
-    char *topiclen;
+    char buf[MQTTPACKET_HEADER_SIZE + 2];   // Fixed header and topic length
+    char msgid[2];
+    char properties[4];                     // Properties length, and topic alias
+    char* bufs[4];
+    size_t lens[4];
+    int frees[4] = {0, 0, 0, 0};
+    int count = 0;
     int rc = -1;
     
     FUNC_ENTRY;
-    topiclen = malloc(2);
-    
     header.bits.type = PUBLISH;
     header.bits.dup = dup;
     header.bits.qos = qos;
     header.bits.retain = retained;
-    if (qos > 0)
+    
+    size_t topiclen = pack->topiclen;
+    size_t propertieslen = 0;
+    if (net->MQTTVersion >= MQTTVERSION_5)
+    {   // Once the server knows the alias of the topic, the topic itself is left out.
+        bool known = false;
+        int const alias = TopicAliases_assign(&net->aliasesOut, pack->topic, pack->topiclen, &known);
+        char* ptr = properties;
+        writeChar(&ptr, (alias) ? 3 : 0);
+        if (alias)
+        {
+            writeChar(&ptr, TOPIC_ALIAS);
+            writeInt(&ptr, alias);
+        }
+        propertieslen = (size_t)(ptr - properties);
+        if (known) { topiclen = 0; }
+    }
+    
+    bufs[count] = pack->topic;
+    lens[count++] = topiclen;
+    if (qos > 0)    // Msgid only exists for QoS 1 or 2
     {
-        char *buf = malloc(2);
-        char *ptr = buf;
-        char* bufs[4] = {topiclen, pack->topic, buf, pack->payload};
-        size_t lens[4] = {2, strlen(pack->topic), 2, pack->payloadlen};
-        int frees[4] = {1, 0, 1, 0};
-        
+        char* ptr = msgid;
         writeInt(&ptr, pack->msgId);
-        ptr = topiclen;
-        writeInt(&ptr, (int)(lens[1]));
-        rc = MQTTPacket_sends(net, header, 4, bufs, lens, frees);
-        if (rc != TCPSOCKET_INTERRUPTED)
-            free(buf);
+        bufs[count] = msgid;
+        lens[count] = sizeof(msgid);
+        frees[count++] = SOCKETBUFFER_COPY;
     }
-    else
+    if (propertieslen > 0)
     {
-        char* ptr = topiclen;
-        char* bufs[3] = {topiclen, pack->topic, pack->payload};
-        size_t lens[3] = {2, strlen(pack->topic), pack->payloadlen};
-        int frees[3] = {1, 0, 0};
-        
-        writeInt(&ptr, (int)(lens[1]));
-        rc = MQTTPacket_sends(net, header, 3, bufs, lens, frees);
+        bufs[count] = properties;
+        lens[count] = propertieslen;
+        frees[count++] = SOCKETBUFFER_COPY;
     }
-    if (rc != TCPSOCKET_INTERRUPTED)
-        free(topiclen);
+    if (pack->stream == NULL)
+    {
+        bufs[count] = pack->payload;
+        lens[count++] = pack->payloadlen;
+    }
+    
+    char* ptr = buf;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, 2 + topiclen + ((qos > 0) ? 2 : 0) + propertieslen + pack->payloadlen);
+    writeInt(&ptr, (int)topiclen);
+    size_t const buflen = (size_t)(ptr - buf);
+    #if !defined(NO_PERSISTENCE)
+    if (qos > 0 && pack->stream == NULL)
+    {   // Persist PUBLISH QoS1 and Qo2, with the whole topic and no alias, as aliases do not outlast the connection.
+        char pbuf[MQTTPACKET_HEADER_SIZE + 2];
+        char noproperties = 0;
+        char* pbufs[4] = { pack->topic, msgid, &noproperties, pack->payload };
+        size_t plens[4] = { pack->topiclen, sizeof(msgid), (propertieslen > 0) ? 1 : 0, pack->payloadlen };
+        char* pptr = pbuf;
+        writeChar(&pptr, header.byte);
+        pptr += MQTTPacket_encode(pptr, 2 + plens[0] + plens[1] + plens[2] + plens[3]);
+        writeInt(&pptr, (int)pack->topiclen);
+        rc = MQTTPersistence_put(net->socket, pbuf, (size_t)(pptr - pbuf), 4, pbufs, plens, PUBLISH, pack->msgId, 0);
+    }
+    #endif
+    rc = MQTTPacket_putdatas(net, buf, buflen, count, bufs, lens, frees, pack->stream);
+    
     if (qos == 0)
         Log(LOG_PROTOCOL, 27, NULL, net->socket, clientID, retained, rc);
     else
         Log(LOG_PROTOCOL, 10, NULL, net->socket, clientID, pack->msgId, qos, retained, rc,
-            min(20, pack->payloadlen), pack->payload);
+            (pack->stream) ? 0 : min(20, pack->payloadlen), (pack->stream) ? "" : pack->payload);
     FUNC_EXIT_RC(rc);
     return rc;
 }
@@ -415,7 +560,7 @@ int MQTTPacket_send_puback(int msgid, networkHandles* net, const char* clientID)
     return rc;
 }
 
-void* MQTTPacket_ack(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_ack(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
     Ack* pack = malloc(sizeof(Ack));
     char* curdata = data;
@@ -485,6 +630,154 @@ void MQTTPacket_free_packet(MQTTPacket* pack)
 
 #pragma mark - Private functionality
 
+/*!
+ *  @abstract Get the next complete packet received on a connection, parsing the read buffer of its socket once the packets parsed before are all handed out.
+ *  @discussion The packet data stays valid until the next read from the socket, which only happens once every packet parsed has been handed out.
+ *
+ *  @param net the connection.
+ *  @param frame the packet, returned.
+ *  @param needed the number of bytes that must be buffered to make progress, returned if no packet is all there yet.
+ *  @return TCPSOCKET_COMPLETE, TCPSOCKET_INTERRUPTED if more data must be read, or SOCKET_ERROR for a bad remaining length.
+ */
+int MQTTPacket_nextFrame(networkHandles* net, MQTTPacketParser_frame const** frame, size_t* needed)
+{
+    int rc = TCPSOCKET_INTERRUPTED;
+    
+    FUNC_ENTRY;
+    *needed = 0;
+    if ((*frame = MQTTPacketParser_next(&net->parser)) == NULL)
+    {
+        size_t buflen = 0;
+        size_t consumed = 0;
+        char* buf = SocketBuffer_getQueuedData(net->socket, &buflen);
+        if (MQTTPacketParser_parse(&net->parser, buf, buflen, &consumed, needed) == SOCKET_ERROR)
+        {
+            rc = SOCKET_ERROR;
+            goto exit;
+        }
+        SocketBuffer_consume(net->socket, consumed);
+        *frame = MQTTPacketParser_next(&net->parser);
+    }
+    if (*frame) { rc = TCPSOCKET_COMPLETE; }
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+/*!
+ *  @abstract Make a publish of a chunk handed out by the parser.
+ *  @discussion The first chunk is parsed like a whole publish, and its header, message id and topic are kept in the connection for the chunks after it, which only carry payload.
+ *
+ *  @param net the connection.
+ *  @param frame the chunk.
+ *  @return the publish, whose topic belongs to the connection (see MQTTPacket_freeChunked), or NULL if the chunk is bad.
+ */
+Publish* MQTTPacket_publishChunk(networkHandles* net, MQTTPacketParser_frame const* frame)
+{
+    Publish* pack = NULL;
+
+    FUNC_ENTRY;
+    if (frame->offset == 0)
+    {
+        if ((pack = MQTTPacket_publish(net->MQTTVersion, frame->header, frame->data, frame->remaining_length)) == NULL) { goto exit; }
+        if (!MQTTPacket_resolveTopicAlias(net, pack))
+        {
+            MQTTPacket_freePublish(pack);
+            pack = NULL;
+            goto exit;
+        }
+        MQTTPacket_freeChunked(net);
+        net->chunked.header = frame->header;
+        net->chunked.topic = MQTTPacket_copyTopic(pack);
+        net->chunked.topiclen = pack->topiclen;
+        net->chunked.msgId = pack->msgId;
+        net->chunked.payloadlen = frame->packet_length - (size_t)(pack->payload - frame->data);
+        pack->topic = net->chunked.topic;
+        pack->payloadoffset = 0;
+    }
+    else
+    {
+        if (net->chunked.topic == NULL) { goto exit; }
+        pack = malloc(sizeof(Publish));
+        pack->header.byte = net->chunked.header;
+        pack->topic = net->chunked.topic;
+        pack->topiclen = net->chunked.topiclen;
+        pack->topicAlias = 0;
+        pack->msgId = net->chunked.msgId;
+        pack->payload = frame->data;
+        pack->payloadlen = frame->remaining_length;
+        pack->lender.release = NULL;
+        pack->stream = NULL;
+        pack->payloadoffset = frame->offset - (frame->packet_length - net->chunked.payloadlen);
+    }
+    pack->chunked = true;
+    pack->totallen = net->chunked.payloadlen;
+exit:
+    FUNC_EXIT;
+    return pack;
+}
+
+/*!
+ *  @abstract Write a packet to a connection, over SSL if it uses it.
+ *
+ *  @param net the connection.
+ *  @param buf0 the fixed header (and whatever else is encoded with it), copied if the packet has to be queued.
+ *  @param buf0len the length of buf0.
+ *  @param count the number of buffers following buf0.
+ *  @param buffers the buffers.
+ *  @param buflens the lengths of the buffers.
+ *  @param frees whether each buffer is freed once written, or SOCKETBUFFER_COPY (see Socket_putdatas).
+ *  @param stream the payload streamed after the buffers, or NULL.
+ *  @return the completion code (TCPSOCKET_COMPLETE etc).
+ */
+int MQTTPacket_putdatas(networkHandles* net, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees, SocketBuffer_stream const* stream)
+{
+	int rc;
+
+    #if defined(OPENSSL)
+	if (net->ssl)
+		rc = SSLSocket_putdatas(net->ssl, net->socket, buf0, buf0len, count, buffers, buflens, frees, stream);
+	else
+    #endif
+		rc = Socket_putdatas(net->socket, buf0, buf0len, count, buffers, buflens, frees, stream);
+	if (rc == TCPSOCKET_COMPLETE)
+		net->lastSent = TimerWheel_now();
+	return rc;
+}
+
+/*!
+ *  @abstract Replace the topic alias of a received publish by its topic, or record the topic the alias is given to.
+ *  @discussion A topic from an alias is not in the packet data, so the message is copied even if the client delivers messages without copying.
+ *
+ *  @param net the connection the publish was received on.
+ *  @param publish the publish.
+ *  @return false if the alias is out of range or was never given a topic, which are protocol errors.
+ */
+bool MQTTPacket_resolveTopicAlias(networkHandles* net, Publish* publish)
+{
+	if (publish->topicAlias == 0) { return true; }
+	if (publish->topiclen > 0) { return TopicAliases_set(&net->aliasesIn, publish->topicAlias, publish->topic, publish->topiclen); }
+
+	char* const topic = TopicAliases_get(&net->aliasesIn, publish->topicAlias, &publish->topiclen);
+	if (topic == NULL) { return false; }
+	publish->topic = topic;
+	return true;
+}
+
+/*!
+ *  @abstract Get the length of length delimited data (a "UTF" string or binary data) in the input buffer, length bytes included.
+ *
+ *  @param ptr the start of the data.
+ *  @param enddata pointer to the end of the buffer not to be read beyond.
+ *  @return the length, or 0 if the data runs past enddata.
+ */
+size_t MQTTPacket_binaryLength(char const* ptr, char const* enddata)
+{
+	if (enddata - ptr < 2) { return 0; }
+	size_t const len = 2 + 256 * (size_t)(unsigned char)ptr[0] + (unsigned char)ptr[1];
+	return (len <= (size_t)(enddata - ptr)) ? len : 0;
+}
+
 /*!
  *  @abstract Reads a "UTF" string from the input buffer.  UTF as in the MQTT v3 spec which really means
  * a length delimited string.  So it reads the two byte length then the data according to
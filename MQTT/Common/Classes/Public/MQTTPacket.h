@@ -14,10 +14,14 @@
 #pragma mark Definitions
 
 typedef unsigned int uint_bool;
-typedef void* (*pf)(unsigned char, char*, size_t);
+typedef void* (*pf)(int, unsigned char, char*, size_t);
 
 #define BAD_MQTT_PACKET -4
 
+#if !defined(MQTTVERSION_5)
+	#define MQTTVERSION_5 5
+#endif
+
 enum msgTypes
 {
 	CONNECT = 1, CONNACK, PUBLISH, PUBACK, PUBREC, PUBREL,
@@ -25,6 +29,23 @@ enum msgTypes
 	PINGREQ, PINGRESP, DISCONNECT
 };
 
+/*!
+ *  @abstract Identifiers of the MQTT 5 properties the client sends or acts on.
+ */
+enum propertyCodes
+{
+	RECEIVE_MAXIMUM = 0x21, TOPIC_ALIAS_MAXIMUM = 0x22, TOPIC_ALIAS = 0x23
+};
+
+/*!
+ *  @abstract The values of the MQTT 5 properties the client acts on. Any other property received is skipped.
+ */
+typedef struct
+{
+	int receiveMaximum;     // Receive Maximum (CONNACK), 65535 if absent
+	int topicAliasMaximum;  // Topic Alias Maximum (CONNACK), 0 if absent
+	int topicAlias;         // Topic Alias (PUBLISH), 0 if absent
+} MQTTProperties;
 
 /*!
  *  @abstract Bitfields for the MQTT header byte.
@@ -120,6 +141,7 @@ typedef struct
         #endif
 	} flags;	 // connack flags byte 
 	char rc; // connack return code 
+	MQTTProperties properties;	// MQTT 5 only
 } Connack;
 
 
@@ -176,9 +198,15 @@ typedef struct
 	Header header;	// MQTT header byte 
 	char* topic;	// topic string 
 	size_t topiclen;
+	int topicAlias;	// MQTT 5 topic alias, 0 for none
 	int msgId;		// MQTT message id 
 	char* payload;	// binary payload, length delimited 
 	size_t payloadlen;	// payload length
+	payloadLender lender;	// set if payload is lent by the application, to be stored without copying
+	SocketBuffer_stream const* stream;	// set if the payload is streamed rather than in payload, which is then NULL (outbound only)
+	bool chunked;	// set if payload is only a chunk of the whole payload, received as it arrives (inbound only)
+	size_t payloadoffset;	// offset of payload in the whole payload, for a chunk
+	size_t totallen;	// length of the whole payload, for a chunk
 } Publish;
 
 
@@ -201,8 +229,9 @@ typedef Ack Unsuback;
 
 /*!
  *  @abstract Reads one MQTT packet from a socket.
+ *  @discussion All the packets already received are parsed in one go (see MQTTPacketParser), and handed out one per call before the socket is read again. Connections can be read by different threads at the same time.
  *
- *  @param socket a socket from which to read an MQTT packet
+ *  @param net the connection from which to read an MQTT packet
  *  @param error pointer to the error code which is completed if no packet is returned
  *  @return the packet structure or NULL if there was an error
  */
@@ -220,11 +249,12 @@ int MQTTPacket_encode(char* buf, size_t length);
 /*!
  *  @abstract Decodes the message length according to the MQTT algorithm.
  *
- *  @param socket the socket from which to read the bytes.
+ *  @param buf the buffer holding the encoded length.
+ *  @param buflen the number of bytes available in buf.
  *  @param value the decoded length returned.
- *  @return the number of bytes read from the socket.
+ *  @return the number of bytes the encoded length takes, 0 if buf does not hold all of it yet, or SOCKET_ERROR if it is too long.
  */
-int MQTTPacket_decode(networkHandles* net, size_t* value);
+int MQTTPacket_decode(char const* buf, size_t buflen, size_t* value);
 
 /*!
  *  @abstract Calculates an integer from two bytes read from the input buffer
@@ -246,6 +276,16 @@ int readInt(char** pptr);
  */
 char* readUTF(char** pptr, char* enddata);
 
+/*!
+ *  @abstract Reads the MQTT 5 properties of a packet from the input buffer: their length, then the properties themselves.
+ *
+ *  @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
+ *  @param enddata pointer to the end of the buffer not to be read beyond
+ *  @param properties the values of the properties the client acts on, returned
+ *  @return false if the properties are malformed or run past enddata
+ */
+bool readProperties(char** pptr, char* enddata, MQTTProperties* properties);
+
 /*!
  *  @abstract Reads one character from the input buffer.
  *
@@ -312,12 +352,13 @@ int MQTTPacket_sends(networkHandles* net, Header header, int count, char** buffe
 /*!
  *  @abstract Function used in the new packets table to create packets which have only a header.
  *
+ *  @param MQTTVersion the protocol version of the connection
  *  @param aHeader the MQTT header byte
  *  @param data the rest of the packet
  *  @param datalen the length of the rest of the packet
  *  @return pointer to the packet structure
  */
-void* MQTTPacket_header_only(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_header_only(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 
 /*!
  *  @abstract Send an MQTT disconnect packet down a socket.
@@ -329,21 +370,39 @@ int MQTTPacket_send_disconnect(networkHandles* net, char const* clientID);
 
 /*!
  *  @abstract Function used in the new packets table to create publish packets.
+ *  @discussion Neither the topic nor the payload are copied: both point into data. The topic is moved over its length bytes to be null terminated in place. A topic alias is only read, not resolved (see MQTTPacket_Factory).
  *
+ *  @param MQTTVersion the protocol version of the connection
  *  @param aHeader the MQTT header byte
  *  @param data the rest of the packet
  *  @param datalen the length of the rest of the packet
  *  @return pointer to the packet structure
  */
-void* MQTTPacket_publish(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 
 /*!
  *  @abstract Free allocated storage for a publish packet.
+ *  @discussion The topic and payload point into the packet data, so they are left alone.
  *
  *  @param pack pointer to the publish packet structure
  */
 void MQTTPacket_freePublish(Publish* pack);
 
+/*!
+ *  @abstract Copy the topic of a received publish packet, so that it outlives the packet data.
+ *
+ *  @param pack pointer to the publish packet structure
+ *  @return the allocated, null terminated topic (which may hold embedded nulls, see topiclen)
+ */
+char* MQTTPacket_copyTopic(Publish const* pack);
+
+/*!
+ *  @abstract Drop the publish a connection is receiving in chunks, if any, freeing its topic.
+ *
+ *  @param net the connection.
+ */
+void MQTTPacket_freeChunked(networkHandles* net);
+
 /*!
  *  @abstract Send an MQTT PUBLISH packet down a socket.
  *
@@ -369,13 +428,15 @@ int MQTTPacket_send_puback(int msgid, networkHandles* net, char const* clientID)
 
 /*!
  *  @abstract Function used in the new packets table to create acknowledgement packets.
+ *  @discussion The MQTT 5 reason code and properties that may follow the message id are ignored.
  *
+ *  @param MQTTVersion the protocol version of the connection
  *  @param aHeader the MQTT header byte
  *  @param data the rest of the packet
  *  @param datalen the length of the rest of the packet
  *  @return pointer to the packet structure
  */
-void* MQTTPacket_ack(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_ack(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 
 /*!
  *  @abstract Free allocated storage for a suback packet.
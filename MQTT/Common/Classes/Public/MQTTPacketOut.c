@@ -18,7 +18,9 @@ int MQTTPacket_send_connect(Clients* client, int MQTTVersion)
 	packet.header.byte = 0;
 	packet.header.bits.type = CONNECT;
 
+	size_t const propertieslen = (client->topicAliasMaximum > 0) ? 3 : 0;   // Topic Alias Maximum (MQTT 5)
 	size_t len = ((MQTTVersion == 3) ? 12 : 10) + strlen(client->clientID)+2;
+    if (MQTTVersion >= MQTTVERSION_5) { len += 1 + propertieslen + ((client->will) ? 1 : 0); }
     if (client->will) { len += strlen(client->will->topic)+2 + strlen(client->will->msg)+2; }
     if (client->username) { len += strlen(client->username)+2; }
     if (client->password) { len += strlen(client->password)+2; }
@@ -30,10 +32,10 @@ int MQTTPacket_send_connect(Clients* client, int MQTTVersion)
 		writeUTF(&ptr, "MQIsdp");
 		writeChar(&ptr, (char)3);
 	}
-	else if (MQTTVersion == 4)
+	else if (MQTTVersion == 4 || MQTTVersion == MQTTVERSION_5)
 	{
 		writeUTF(&ptr, "MQTT");
-		writeChar(&ptr, (char)4);
+		writeChar(&ptr, (char)MQTTVersion);
 	}
     else { goto exit; }
 
@@ -51,15 +53,30 @@ int MQTTPacket_send_connect(Clients* client, int MQTTVersion)
 
 	writeChar(&ptr, packet.flags.all);
 	writeInt(&ptr, client->keepAliveInterval);
+	if (MQTTVersion >= MQTTVERSION_5)
+	{
+		writeChar(&ptr, (char)propertieslen);
+		if (propertieslen > 0)
+		{
+			writeChar(&ptr, TOPIC_ALIAS_MAXIMUM);
+			writeInt(&ptr, client->topicAliasMaximum);
+		}
+	}
 	writeUTF(&ptr, client->clientID);
 	if (client->will)
 	{
+		if (MQTTVersion >= MQTTVERSION_5) { writeChar(&ptr, 0); }  // No will properties
 		writeUTF(&ptr, client->will->topic);
 		writeUTF(&ptr, client->will->msg);
 	}
     if (client->username) { writeUTF(&ptr, client->username); }
     if (client->password) { writeUTF(&ptr, client->password); }
 
+	// The topic aliases and the limits of the previous connection, if any, are gone. The server announces its own in CONNACK.
+	client->net.MQTTVersion = MQTTVersion;
+	client->net.receiveMaximum = 0;
+	TopicAliases_reset(&client->net.aliasesOut, 0);
+	TopicAliases_reset(&client->net.aliasesIn, (MQTTVersion >= MQTTVERSION_5) ? client->topicAliasMaximum : 0);
 	rc = MQTTPacket_send(&client->net, packet.header, buf, len, 1);
 	Log(LOG_PROTOCOL, 0, NULL, client->net.socket, client->clientID, client->cleansession, rc);
 exit:
@@ -68,7 +85,7 @@ exit:
 	return rc;
 }
 
-void* MQTTPacket_connack(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_connack(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
 	Connack* pack = malloc(sizeof(Connack));
 	char* curdata = data;
@@ -77,6 +94,13 @@ void* MQTTPacket_connack(unsigned char aHeader, char* data, size_t datalen)
 	pack->header.byte = aHeader;
 	pack->flags.all = readChar(&curdata);
 	pack->rc = readChar(&curdata);
+	memset(&pack->properties, 0, sizeof(MQTTProperties));
+	// A server refusing MQTT 5 may answer with a CONNACK of an older version, which has no properties.
+	if (MQTTVersion >= MQTTVERSION_5 && datalen > 2 && !readProperties(&curdata, data + datalen, &pack->properties))
+	{
+		free(pack);
+		pack = NULL;
+	}
 	FUNC_EXIT;
 	return pack;
 }
@@ -111,11 +135,15 @@ int MQTTPacket_send_subscribe(List* topics, List* qoss, int msgid, int dup, netw
 	header.bits.retain = 0;
 
 	datalen = 2 + topics->count * 3; // utf length + char qos == 3
+	if (net->MQTTVersion >= MQTTVERSION_5)
+		datalen += 1;	// no properties
 	while (ListNextElement(topics, &elem))
 		datalen += strlen((char*)(elem->content));
 	ptr = data = malloc(datalen);
 
 	writeInt(&ptr, msgid);
+	if (net->MQTTVersion >= MQTTVERSION_5)
+		writeChar(&ptr, 0);
 	elem = NULL;
 	while (ListNextElement(topics, &elem))
 	{
@@ -131,22 +159,32 @@ int MQTTPacket_send_subscribe(List* topics, List* qoss, int msgid, int dup, netw
 	return rc;
 }
 
-void* MQTTPacket_suback(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_suback(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
 	Suback* pack = malloc(sizeof(Suback));
 	char* curdata = data;
+	MQTTProperties properties;
 
 	FUNC_ENTRY;
 	pack->header.byte = aHeader;
 	pack->msgId = readInt(&curdata);
+	if (MQTTVersion >= MQTTVERSION_5 && !readProperties(&curdata, data + datalen, &properties))
+	{
+		free(pack);
+		pack = NULL;
+		goto exit;
+	}
 	pack->qoss = ListInitialize();
 	while ((size_t)(curdata - data) < datalen)
 	{
 		int* newint;
 		newint = malloc(sizeof(int));
 		*newint = (int)readChar(&curdata);
+		if (*newint > MQTT_BAD_SUBSCRIBE)
+			*newint = MQTT_BAD_SUBSCRIBE;	/* MQTT 5 says why the subscription failed, 3.1.1 only that it did */
 		ListAppend(pack->qoss, newint, sizeof(int));
 	}
+exit:
 	FUNC_EXIT;
 	return pack;
 }
@@ -166,11 +204,15 @@ int MQTTPacket_send_unsubscribe(List* topics, int msgid, int dup, networkHandles
 	header.bits.retain = 0;
 
 	datalen = 2 + topics->count * 2; // utf length == 2
+	if (net->MQTTVersion >= MQTTVERSION_5)
+		datalen += 1;	// no properties
 	while (ListNextElement(topics, &elem))
 		datalen += strlen((char*)(elem->content));
 	ptr = data = malloc(datalen);
 
 	writeInt(&ptr, msgid);
+	if (net->MQTTVersion >= MQTTVERSION_5)
+		writeChar(&ptr, 0);
 	elem = NULL;
 	while (ListNextElement(topics, &elem))
 		writeUTF(&ptr, (char*)(elem->content));
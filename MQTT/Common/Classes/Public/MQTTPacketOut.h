@@ -18,12 +18,13 @@ int MQTTPacket_send_connect(Clients* client, int MQTTVersion);
 /*!
  *  @abstract Function used in the new packets table to create connack packets.
  *
+ *  @param MQTTVersion the protocol version of the connection
  *  @param aHeader the MQTT header byte
  *  @param data the rest of the packet
  *  @param datalen the length of the rest of the packet
  *  @return pointer to the packet structure
  */
-void* MQTTPacket_connack(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_connack(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 
 /*!
  *  @abstract Send an MQTT PINGREQ packet down a socket.
@@ -50,12 +51,13 @@ int MQTTPacket_send_subscribe(List* topics, List* qoss, int msgid, int dup, netw
 /*!
  *  @abstract Function used in the new packets table to create suback packets.
  *
+ *  @param MQTTVersion the protocol version of the connection
  *  @param aHeader the MQTT header byte
  *  @param data the rest of the packet
  *  @param datalen the length of the rest of the packet
  *  @return pointer to the packet structure
  */
-void* MQTTPacket_suback(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_suback(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 
 /*!
  *  @abstract Send an MQTT unsubscribe packet down a socket.
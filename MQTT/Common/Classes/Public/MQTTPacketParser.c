@@ -0,0 +1,187 @@
+#include "MQTTPacketParser.h"   // Header
+#include "MQTTPacket.h"         // MQTT (Public)
+#include "Socket.h"             // MQTT (Web)
+#include "StackTrace.h"         // MQTT (Utilities)
+
+#pragma mark - Definitions
+
+#define MQTTPACKETPARSER_HEADER 0   // Expecting the header byte of a packet.
+#define MQTTPACKETPARSER_LENGTH 1   // Decoding the remaining length.
+#define MQTTPACKETPARSER_BODY   2   // Waiting for the whole variable header and payload.
+#define MQTTPACKETPARSER_HEAD   3   // Waiting for the variable header of a publish, to tell whether it is handed out in chunks.
+#define MQTTPACKETPARSER_CHUNKS 4   // Handing out a publish in chunks.
+
+#define MQTTPACKETPARSER_MAX_LENGTH_BYTES 4 // Longest encoding of a remaining length.
+
+#pragma mark - Private prototypes
+
+int MQTTPacketParser_headLength(MQTTPacketParser const* parser, char const* buf, size_t len, size_t* headlen);
+
+#pragma mark - Public API
+
+void MQTTPacketParser_reset(MQTTPacketParser* parser)
+{
+    parser->state = MQTTPACKETPARSER_HEADER;
+    parser->header = 0;
+    parser->remaining_length = 0;
+    parser->multiplier = 1;
+    parser->lenbytes = 0;
+    parser->headlen = parser->offset = 0;
+    parser->count = parser->next = 0;
+}
+
+int MQTTPacketParser_parse(MQTTPacketParser* parser, char* buf, size_t len, size_t* consumed, size_t* needed)
+{
+    size_t used = 0;
+    int rc = 0;
+
+    FUNC_ENTRY;
+    parser->count = parser->next = 0;
+    *needed = 0;
+    while (parser->count < MQTTPACKETPARSER_BATCH)
+    {
+        if (parser->state == MQTTPACKETPARSER_BODY)
+        {
+            if (len - used < parser->remaining_length)
+            {
+                *needed = parser->remaining_length;
+                break;
+            }
+            MQTTPacketParser_frame* frame = &parser->frames[parser->count++];
+            frame->header = parser->header;
+            frame->data = buf + used;
+            frame->remaining_length = frame->packet_length = parser->remaining_length;
+            frame->chunked = false;
+            frame->offset = 0;
+            used += parser->remaining_length;
+            parser->state = MQTTPACKETPARSER_HEADER;
+            continue;
+        }
+
+        if (parser->state == MQTTPACKETPARSER_HEAD)
+        {
+            int const found = MQTTPacketParser_headLength(parser, buf + used, len - used, &parser->headlen);
+            if (found == SOCKET_ERROR)
+            {
+                rc = SOCKET_ERROR;  // bad data
+                goto exit;
+            }
+            if (found == 0)
+            {
+                *needed = parser->headlen;
+                break;
+            }
+            parser->state = (parser->remaining_length - parser->headlen >= parser->chunkThreshold) ? MQTTPACKETPARSER_CHUNKS : MQTTPACKETPARSER_BODY;
+            parser->offset = 0;
+            continue;
+        }
+
+        if (parser->state == MQTTPACKETPARSER_CHUNKS)
+        {   // The first chunk carries the variable header, and some payload not to be empty.
+            size_t const least = (parser->offset == 0) ? parser->headlen + 1 : 1;
+            if (len - used < least)
+            {
+                *needed = least;
+                break;
+            }
+            MQTTPacketParser_frame* frame = &parser->frames[parser->count++];
+            frame->header = parser->header;
+            frame->data = buf + used;
+            frame->remaining_length = min(len - used, parser->remaining_length - parser->offset);
+            frame->chunked = true;
+            frame->offset = parser->offset;
+            frame->packet_length = parser->remaining_length;
+            used += frame->remaining_length;
+            parser->offset += frame->remaining_length;
+            if (parser->offset == parser->remaining_length) { parser->state = MQTTPACKETPARSER_HEADER; }
+            continue;
+        }
+
+        if (used == len)
+        {
+            *needed = 1;
+            break;
+        }
+
+        unsigned char const byte = (unsigned char)buf[used++];
+        if (parser->state == MQTTPACKETPARSER_HEADER)
+        {
+            parser->header = byte;
+            parser->remaining_length = 0;
+            parser->multiplier = 1;
+            parser->lenbytes = 0;
+            parser->state = MQTTPACKETPARSER_LENGTH;
+            continue;
+        }
+
+        parser->remaining_length += (byte & 127) * parser->multiplier;
+        parser->multiplier *= 128;
+        ++parser->lenbytes;
+        if ((byte & 128) == 0) {
+            bool const chunkable = parser->chunkThreshold > 0 && (parser->header >> 4) == PUBLISH && parser->remaining_length > parser->chunkThreshold;
+            parser->state = (chunkable) ? MQTTPACKETPARSER_HEAD : MQTTPACKETPARSER_BODY;
+        } else if (parser->lenbytes == MQTTPACKETPARSER_MAX_LENGTH_BYTES) {
+            rc = SOCKET_ERROR;  // bad data
+            goto exit;
+        }
+    }
+    rc = parser->count;
+exit:
+    *consumed = used;
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+MQTTPacketParser_frame const* MQTTPacketParser_next(MQTTPacketParser* parser)
+{
+    return (parser->next < parser->count) ? &parser->frames[parser->next++] : NULL;
+}
+
+#pragma mark - Private functionality
+
+/*!
+ *  @abstract Find the length of the variable header of the publish being parsed: topic, message id and properties.
+ *
+ *  @param parser the parser, past the remaining length of the publish.
+ *  @param buf the input, starting with the variable header.
+ *  @param len the length of the input.
+ *  @param headlen returns the length of the variable header if it is all in the input, otherwise the number of bytes needed to get further.
+ *  @return 1 if the variable header is all in the input, 0 if more is needed, or SOCKET_ERROR if it overruns the packet.
+ */
+int MQTTPacketParser_headLength(MQTTPacketParser const* parser, char const* buf, size_t len, size_t* headlen)
+{
+    unsigned char const* bytes = (unsigned char const*)buf;
+    size_t length = 2;
+
+    if (len < length) { goto more; }
+    length += ((size_t)bytes[0] << 8) + bytes[1];
+    if (((parser->header >> 1) & 3) > 0) { length += 2; }  // Message id, for QoS 1 and 2.
+
+    if (parser->properties)
+    {
+        size_t propslen = 0;
+        size_t multiplier = 1;
+        for (int i = 0; ; ++i)
+        {
+            if (i == MQTTPACKETPARSER_MAX_LENGTH_BYTES || length >= parser->remaining_length) { return SOCKET_ERROR; }
+            if (len <= length)
+            {
+                ++length;
+                goto more;
+            }
+            unsigned char const byte = bytes[length++];
+            propslen += (byte & 127) * multiplier;
+            multiplier *= 128;
+            if ((byte & 128) == 0) { break; }
+        }
+        length += propslen;
+    }
+
+    if (length > parser->remaining_length) { return SOCKET_ERROR; }
+    if (len < length) { goto more; }
+    *headlen = length;
+    return 1;
+more:
+    *headlen = length;
+    return 0;
+}
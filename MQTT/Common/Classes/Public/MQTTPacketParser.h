@@ -0,0 +1,94 @@
+/*!
+ *  @abstract Incremental parser splitting received bytes into MQTT packets.
+ *  @discussion The parser keeps all its state in the MQTTPacketParser it is given (one per connection), so different connections can be parsed by different threads at the same time. The fixed header is taken in as it arrives, however the input is split. A packet body is only taken once it is all there, and is handed out where it lies in the input, without copying. A publish whose payload reaches the chunk threshold is handed out in chunks instead, as its bytes arrive.
+ */
+#pragma once
+
+#include <stdbool.h>        // C Standard
+#include <stddef.h>         // C Standard
+
+#pragma mark Definitions
+
+#define MQTTPACKETPARSER_BATCH 16   // Most packets taken out of the input in one go.
+
+/*!
+ *  @abstract A complete packet found in the input, or a chunk of a publish handed out as it arrives.
+ *
+ *  @field header The MQTT header byte.
+ *  @field data The variable header and payload, pointing into the input. For a chunk, the part of them at offset: the first chunk holds at least the whole variable header and one byte of payload, the others payload only.
+ *  @field remaining_length The length of data.
+ *  @field chunked Whether this is a chunk of a publish rather than a complete packet.
+ *  @field offset The offset of data in the variable header and payload, 0 for a complete packet.
+ *  @field packet_length The remaining length of the whole packet, the same as remaining_length for a complete packet.
+ */
+typedef struct
+{
+    unsigned char header;
+    char* data;
+    size_t remaining_length;
+    bool chunked;
+    size_t offset;
+    size_t packet_length;
+} MQTTPacketParser_frame;
+
+/*!
+ *  @abstract Parsing state of a connection.
+ *
+ *  @field state Part of the packet expected next (MQTTPACKETPARSER_* in MQTTPacketParser.c).
+ *  @field header The header byte of the packet being parsed.
+ *  @field remaining_length The remaining length of the packet being parsed, as far as it is decoded.
+ *  @field multiplier The weight of the next remaining length byte.
+ *  @field lenbytes Number of remaining length bytes decoded.
+ *  @field headlen The length of the variable header of the publish being handed out in chunks.
+ *  @field offset The bytes of the publish being handed out in chunks handed out so far.
+ *  @field chunkThreshold Publishes whose payload is at least this long are handed out in chunks, 0 for none. Kept by MQTTPacketParser_reset.
+ *  @field properties Whether publishes carry properties (MQTT 5), needed to find the end of their variable header. Kept by MQTTPacketParser_reset.
+ *  @field count Number of packets found by the last call to MQTTPacketParser_parse.
+ *  @field next Index of the next packet to be handed out by MQTTPacketParser_next.
+ *  @field frames The packets found by the last call to MQTTPacketParser_parse.
+ */
+typedef struct
+{
+    int state;
+    unsigned char header;
+    size_t remaining_length;
+    size_t multiplier;
+    int lenbytes;
+    size_t headlen;
+    size_t offset;
+    size_t chunkThreshold;
+    bool properties;
+    int count;
+    int next;
+    MQTTPacketParser_frame frames[MQTTPACKETPARSER_BATCH];
+} MQTTPacketParser;
+
+#pragma mark Public API
+
+/*!
+ *  @abstract Get a parser ready for a new connection, dropping any partial packet and any packet not handed out yet.
+ *
+ *  @param parser the parser.
+ */
+void MQTTPacketParser_reset(MQTTPacketParser* parser);
+
+/*!
+ *  @abstract Take as many complete packets as possible (up to MQTTPACKETPARSER_BATCH) out of the input.
+ *  @discussion The packets of the previous call are dropped, so hand them all out first (MQTTPacketParser_next). The bytes consumed are no longer needed: the fixed header of a packet is kept by the parser, and the packets found point into the input, which must stay in place until they have been handled. The bytes not consumed have to be passed in again, followed by more input.
+ *
+ *  @param parser the parser.
+ *  @param buf the input, starting with the first byte not consumed by the previous call.
+ *  @param len the length of the input.
+ *  @param consumed returns the number of bytes taken from the input.
+ *  @param needed returns the number of bytes, counted from the first one not consumed, that must be available to complete the next packet (or chunk). 0 if the batch is full.
+ *  @return the number of packets (and chunks) found, or SOCKET_ERROR if the input is not MQTT (bad remaining length, or a chunked publish whose variable header overruns it).
+ */
+int MQTTPacketParser_parse(MQTTPacketParser* parser, char* buf, size_t len, size_t* consumed, size_t* needed);
+
+/*!
+ *  @abstract Hand out the next packet found by MQTTPacketParser_parse.
+ *
+ *  @param parser the parser.
+ *  @return the packet, or NULL if they have all been handed out.
+ */
+MQTTPacketParser_frame const* MQTTPacketParser_next(MQTTPacketParser* parser);
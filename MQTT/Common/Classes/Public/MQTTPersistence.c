@@ -133,7 +133,7 @@ int MQTTPersistence_restore(Clients *c)
 				;
 			else if ((rc = c->persistence->pget(c->phandle, msgkeys[i], &buffer, &buflen)) == 0)
 			{
-				MQTTPacket* pack = MQTTPersistence_restorePacket(buffer, buflen);
+				MQTTPacket* pack = MQTTPersistence_restorePacket(c->MQTTVersion, buffer, buflen);
 				if ( pack != NULL )
 				{
 					if ( strstr(msgkeys[i],PERSISTENCE_PUBLISH_RECEIVED) != NULL )
@@ -197,12 +197,14 @@ int MQTTPersistence_restore(Clients *c)
 	Log(TRACE_MINIMUM, -1, "%d sent messages and %d received messages restored for client %s\n", 
 		msgs_sent, msgs_rcvd, c->clientID);
 	MQTTPersistence_wrapMsgID(c);
+	MQTTProtocol_indexMessages(c->outboundMsgs, &c->outboundIndex);
+	MQTTProtocol_indexMessages(c->inboundMsgs, &c->inboundIndex);
 
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
-void* MQTTPersistence_restorePacket(char* buffer, size_t buflen)
+void* MQTTPersistence_restorePacket(int MQTTVersion, char* buffer, size_t buflen)
 {
 	void* pack = NULL;
 	Header header;
@@ -226,7 +228,7 @@ void* MQTTPersistence_restorePacket(char* buffer, size_t buflen)
 	{
 		ptype = header.bits.type;
 		if (ptype >= CONNECT && ptype <= DISCONNECT && new_packets[ptype] != NULL)
-			pack = (*new_packets[ptype])(header.byte, ++buffer, remaining_length);
+			pack = (*new_packets[ptype])(MQTTVersion, header.byte, ++buffer, remaining_length);
 	}
 
 	FUNC_EXIT;
@@ -251,11 +253,10 @@ void MQTTPersistence_insertInOrder(List* list, void* content, size_t size)
 
 int MQTTPersistence_put(int socket, char* buf0, size_t buf0len, size_t count, char** buffers, size_t* buflens, int htype, int msgId, int scr )
 {
-	extern ClientStates* bstate;
     int rc = 0;
 
 	FUNC_ENTRY;
-	Clients* client = (Clients*)(ListFindItem(bstate->clients, &socket, clientSocketCompare)->content);
+	Clients* client = (Clients*)Socket_getClient(socket);
 	if (client->persistence != NULL)
 	{
 		char* key = malloc(MESSAGE_FILENAME_LENGTH + 1);
@@ -87,10 +87,11 @@ int MQTTPersistence_restore(Clients* c);
 /*!
  *  @abstract Returns a MQTT packet restored from persisted data.
  *
+ *  @param MQTTVersion the protocol version the packet was persisted with.
  *  @param buffer the persisted data.
  *  @param buflen the number of bytes of the data buffer.
  */
-void* MQTTPersistence_restorePacket(char* buffer, size_t buflen);
+void* MQTTPersistence_restorePacket(int MQTTVersion, char* buffer, size_t buflen);
 
 /*!
  *  @abstract Inserts the specified message into the list, maintaining message ID order.
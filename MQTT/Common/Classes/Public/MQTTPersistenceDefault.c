@@ -37,7 +37,12 @@ int pstopen(void **handle, const char* clientID, const char* serverURI, void* co
     perserverURI = malloc(strlen(serverURI) + 1);
     strcpy(perserverURI, serverURI);
     ptraux = strstr(perserverURI, ":");
-    *ptraux = '-' ;
+    if (ptraux) { *ptraux = '-'; }
+    /* unix://path URIs keep their scheme: flatten the path into a single directory name */
+    for (ptraux = perserverURI; *ptraux; ++ptraux)
+    {
+        if (*ptraux == '/') { *ptraux = '-'; }
+    }
     
     /* consider '/'  +  '-'  +  '\0' */
     clientDir = malloc(strlen(dataDir) + strlen(clientID) + strlen(perserverURI) + 3);
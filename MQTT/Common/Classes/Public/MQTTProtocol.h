@@ -10,6 +10,7 @@
 typedef struct
 {
 	int socket;
+	unsigned long id;       // Id of the queued packet (see SocketBuffer_lastWriteId)
 	Publications* p;
 } pending_write;
 
@@ -14,6 +14,15 @@
 #define min(A,B) ( (A) < (B) ? (A):(B))
 #endif
 
+#if !defined(max)
+#define max(A,B) ( (A) > (B) ? (A):(B))
+#endif
+
+/*!
+ *  @abstract Time (ms) before looking again at a client whose output is stacked up on its socket, to send a ping or a retry.
+ */
+#define MQTTPROTOCOL_RECHECK 1000
+
 #pragma mark - Variables
 
 extern MQTTProtocol state;
@@ -24,10 +33,15 @@ extern ClientStates* bstate;
 
 void MQTTProtocol_storeQoS0(Clients* pubclient, Publish* publish);
 int MQTTProtocol_startPublishCommon(Clients* pubclient, Publish* publish, int qos, int retained);
-void MQTTProtocol_retries(time_t now, Clients* client, int regardless);
+bool MQTTProtocol_retransmit(Clients* client, Messages* m);
+void MQTTProtocol_scheduleRetry(Clients* client, Messages* m);
+void MQTTProtocol_retryMessage(void* context, void* target);
+void MQTTProtocol_keepalive(void* context, void* target);
+int MQTTProtocol_handlePublishChunk(Publish* publish, Clients* client);
 
 // MQTTAsync private functions
 void Protocol_processPublication(Publish* publish, Clients* client);
+void Protocol_processPublicationChunk(Publish* publish, Clients* client);
 void MQTTProtocol_closeSession(Clients* client, int sendwill);
 
 #pragma mark - Public API
@@ -41,7 +55,8 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
     if (qos > 0)
     {
         *mm = MQTTProtocol_createMessage(publish, mm, qos, retained);
-        ListAppend(pubclient->outboundMsgs, *mm, (*mm)->len);
+        MQTTProtocol_appendMessage(pubclient->outboundMsgs, &pubclient->outboundIndex, *mm, (*mm)->len);
+        MQTTProtocol_scheduleRetry(pubclient, *mm);
         /* we change these pointers to the saved message location just in case the packet could not be written
          entirely; the socket buffer will use these locations to finish writing the packet */
         p.payload = (*mm)->publish->payload;
@@ -73,9 +88,11 @@ Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, i
     m->msgid = publish->msgId;
     m->qos = qos;
     m->retain = retained;
-    time(&(m->lastTouch));
+    m->lastTouch = TimerWheel_now();
+    TimerWheel_initTimer(&m->retryTimer, MQTTProtocol_retryMessage, NULL, m);
     if (qos == 2)
         m->nextMessageType = PUBREC;
+    m->delivered = false;
     FUNC_EXIT;
     return m;
 }
@@ -87,21 +104,28 @@ Publications* MQTTProtocol_storePublication(Publish* publish, size_t* len)
     FUNC_ENTRY;
     p->refcount = 1;
     
-    *len = strlen(publish->topic)+1;
+    *len = publish->topiclen+1;
     if (Heap_findItem(publish->topic))
         p->topic = publish->topic;
     else
     {
         p->topic = malloc(*len);
-        strcpy(p->topic, publish->topic);
+        memcpy(p->topic, publish->topic, *len);
     }
     *len += sizeof(Publications);
     
     p->topiclen = publish->topiclen;
     p->payloadlen = publish->payloadlen;
-    p->payload = malloc(publish->payloadlen);
-    memcpy(p->payload, publish->payload, p->payloadlen);
-    *len += publish->payloadlen;
+    p->lender = publish->lender;
+    p->stream = publish->stream;
+    if (p->lender.release)
+        p->payload = publish->payload;	/* lent by the application, which gets it back once the publication is removed */
+    else
+    {
+        p->payload = malloc(publish->payloadlen);
+        memcpy(p->payload, publish->payload, p->payloadlen);
+        *len += publish->payloadlen;
+    }
     
     ListAppend(&(state.publications), p, *len);
     FUNC_EXIT;
@@ -113,7 +137,10 @@ void MQTTProtocol_removePublication(Publications* p)
     FUNC_ENTRY;
     if (--(p->refcount) == 0)
     {
-        free(p->payload);
+        if (p->lender.release)
+            (*p->lender.release)(p->lender.context, p->payload);
+        else
+            free(p->payload);
         free(p->topic);
         ListRemove(&(state.publications), p);
     }
@@ -122,20 +149,10 @@ void MQTTProtocol_removePublication(Publications* p)
 
 int MQTTProtocol_assignMsgId(Clients* client)
 {
-    int start_msgid = client->msgID;
-    int msgid = start_msgid;
+    int msgid = 0;
     
     FUNC_ENTRY;
-    msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-    while (ListFindItem(client->outboundMsgs, &msgid, messageIDCompare) != NULL)
-    {
-        msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-        if (msgid == start_msgid)
-        { /* we've tried them all - none free */
-            msgid = 0;
-            break;
-        }
-    }
+    msgid = MessageIds_assign(&client->msgIds, client->msgID);
     if (msgid != 0)
         client->msgID = msgid;
     FUNC_EXIT_RC(msgid);
@@ -150,12 +167,15 @@ int MQTTProtocol_handlePublishes(void* pack, int sock)
     int rc = TCPSOCKET_COMPLETE;
     
     FUNC_ENTRY;
-    client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+    client = (Clients*)Socket_getClient(sock);
     clientid = client->clientID;
-    Log(LOG_PROTOCOL, 11, NULL, sock, clientid, publish->msgId, publish->header.bits.qos,
-        publish->header.bits.retain, min(20, publish->payloadlen), publish->payload);
+    if (publish->payloadoffset == 0)
+        Log(LOG_PROTOCOL, 11, NULL, sock, clientid, publish->msgId, publish->header.bits.qos,
+            publish->header.bits.retain, min(20, publish->payloadlen), publish->payload);
     
-    if (publish->header.bits.qos == 0)
+    if (publish->chunked)
+        rc = MQTTProtocol_handlePublishChunk(publish, client);
+    else if (publish->header.bits.qos == 0)
         Protocol_processPublication(publish, client);
     else if (publish->header.bits.qos == 1)
     {
@@ -176,14 +196,17 @@ int MQTTProtocol_handlePublishes(void* pack, int sock)
         m->qos = publish->header.bits.qos;
         m->retain = publish->header.bits.retain;
         m->nextMessageType = PUBREL;
-        if ( ( listElem = ListFindItem(client->inboundMsgs, &(m->msgid), messageIDCompare) ) != NULL )
-        {   /* discard queued publication with same msgID that the current incoming message */
+        m->delivered = false;
+        TimerWheel_initTimer(&m->retryTimer, NULL, NULL, NULL);
+        if ( ( listElem = MessageTable_get(&client->inboundIndex, m->msgid) ) != NULL )
+        {   /* discard queued publication with same msgID that the current incoming message, which takes its place */
             Messages* msg = (Messages*)(listElem->content);
             MQTTProtocol_removePublication(msg->publish);
-            ListInsert(client->inboundMsgs, m, sizeof(Messages) + len, listElem);
-            ListRemove(client->inboundMsgs, msg);
+            listElem->content = m;
+            client->inboundMsgs->size += sizeof(Messages) + len;
+            free(msg);
         } else
-            ListAppend(client->inboundMsgs, m, sizeof(Messages) + len);
+            MQTTProtocol_appendMessage(client->inboundMsgs, &client->inboundIndex, m, sizeof(Messages) + len);
         rc = MQTTPacket_send_pubrec(publish->msgId, &client->net, client->clientID);
         publish->topic = NULL;
     }
@@ -199,15 +222,16 @@ int MQTTProtocol_handlePubacks(void* pack, int sock)
     int rc = TCPSOCKET_COMPLETE;
     
     FUNC_ENTRY;
-    client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+    client = (Clients*)Socket_getClient(sock);
     Log(LOG_PROTOCOL, 14, NULL, sock, client->clientID, puback->msgId);
     
     /* look for the message by message id in the records of outbound messages for this client */
-    if (ListFindItem(client->outboundMsgs, &(puback->msgId), messageIDCompare) == NULL)
+    ListElement* found = MessageTable_get(&client->outboundIndex, puback->msgId);
+    if (found == NULL)
         Log(TRACE_MIN, 3, NULL, "PUBACK", client->clientID, puback->msgId);
     else
     {
-        Messages* m = (Messages*)(client->outboundMsgs->current->content);
+        Messages* m = (Messages*)(found->content);
         if (m->qos != 1)
             Log(TRACE_MIN, 4, NULL, "PUBACK", client->clientID, puback->msgId, m->qos);
         else
@@ -217,7 +241,7 @@ int MQTTProtocol_handlePubacks(void* pack, int sock)
             rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_SENT, m->qos, puback->msgId);
 #endif
             MQTTProtocol_removePublication(m->publish);
-            ListRemove(client->outboundMsgs, m);
+            MQTTProtocol_removeMessage(client->outboundMsgs, &client->outboundIndex, found);
         }
     }
     free(pack);
@@ -232,19 +256,19 @@ int MQTTProtocol_handlePubrecs(void* pack, int sock)
     int rc = TCPSOCKET_COMPLETE;
     
     FUNC_ENTRY;
-    client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+    client = (Clients*)Socket_getClient(sock);
     Log(LOG_PROTOCOL, 15, NULL, sock, client->clientID, pubrec->msgId);
     
     /* look for the message by message id in the records of outbound messages for this client */
-    client->outboundMsgs->current = NULL;
-    if (ListFindItem(client->outboundMsgs, &(pubrec->msgId), messageIDCompare) == NULL)
+    ListElement* found = MessageTable_get(&client->outboundIndex, pubrec->msgId);
+    if (found == NULL)
     {
         if (pubrec->header.bits.dup == 0)
             Log(TRACE_MIN, 3, NULL, "PUBREC", client->clientID, pubrec->msgId);
     }
     else
     {
-        Messages* m = (Messages*)(client->outboundMsgs->current->content);
+        Messages* m = (Messages*)(found->content);
         if (m->qos != 2)
         {
             if (pubrec->header.bits.dup == 0)
@@ -259,7 +283,8 @@ int MQTTProtocol_handlePubrecs(void* pack, int sock)
         {
             rc = MQTTPacket_send_pubrel(pubrec->msgId, 0, &client->net, client->clientID);
             m->nextMessageType = PUBCOMP;
-            time(&(m->lastTouch));
+            m->lastTouch = TimerWheel_now();
+            MQTTProtocol_scheduleRetry(client, m);
         }
     }
     free(pack);
@@ -274,11 +299,12 @@ int MQTTProtocol_handlePubrels(void* pack, int sock)
     int rc = TCPSOCKET_COMPLETE;
     
     FUNC_ENTRY;
-    client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+    client = (Clients*)Socket_getClient(sock);
     Log(LOG_PROTOCOL, 17, NULL, sock, client->clientID, pubrel->msgId);
     
     /* look for the message by message id in the records of inbound messages for this client */
-    if (ListFindItem(client->inboundMsgs, &(pubrel->msgId), messageIDCompare) == NULL)
+    ListElement* found = MessageTable_get(&client->inboundIndex, pubrel->msgId);
+    if (found == NULL)
     {
         if (pubrel->header.bits.dup == 0)
             Log(TRACE_MIN, 3, NULL, "PUBREL", client->clientID, pubrel->msgId);
@@ -288,30 +314,36 @@ int MQTTProtocol_handlePubrels(void* pack, int sock)
     }
     else
     {
-        Messages* m = (Messages*)(client->inboundMsgs->current->content);
+        Messages* m = (Messages*)(found->content);
         if (m->qos != 2)
             Log(TRACE_MIN, 4, NULL, "PUBREL", client->clientID, pubrel->msgId, m->qos);
         else if (m->nextMessageType != PUBREL)
             Log(TRACE_MIN, 5, NULL, "PUBREL", client->clientID, pubrel->msgId);
         else
         {
-            Publish publish;
-            
             /* send pubcomp before processing the publications because a lot of return publications could fill up the socket buffer */
             rc = MQTTPacket_send_pubcomp(pubrel->msgId, &client->net, client->clientID);
-            publish.header.bits.qos = m->qos;
-            publish.header.bits.retain = m->retain;
-            publish.msgId = m->msgid;
-            publish.topic = m->publish->topic;
-            publish.topiclen = m->publish->topiclen;
-            publish.payload = m->publish->payload;
-            publish.payloadlen = m->publish->payloadlen;
-            Protocol_processPublication(&publish, client);
+            if (m->delivered)
+                MQTTProtocol_removePublication(m->publish);    // Handed to the application in chunks as it arrived, and never persisted.
+            else
+            {
+                Publish publish;
+                
+                publish.header.bits.qos = m->qos;
+                publish.header.bits.retain = m->retain;
+                publish.msgId = m->msgid;
+                publish.topic = m->publish->topic;
+                publish.topiclen = m->publish->topiclen;
+                publish.payload = m->publish->payload;
+                publish.payloadlen = m->publish->payloadlen;
+                publish.stream = NULL;
+                Protocol_processPublication(&publish, client);
 #if !defined(NO_PERSISTENCE)
-            rc += MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_RECEIVED, m->qos, pubrel->msgId);
+                rc += MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_RECEIVED, m->qos, pubrel->msgId);
 #endif
-            ListRemove(&(state.publications), m->publish);
-            ListRemove(client->inboundMsgs, m);
+                ListRemove(&(state.publications), m->publish);
+            }
+            MQTTProtocol_removeMessage(client->inboundMsgs, &client->inboundIndex, found);
             ++(state.msgs_received);
         }
     }
@@ -327,18 +359,19 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
     int rc = TCPSOCKET_COMPLETE;
     
     FUNC_ENTRY;
-    client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+    client = (Clients*)Socket_getClient(sock);
     Log(LOG_PROTOCOL, 19, NULL, sock, client->clientID, pubcomp->msgId);
     
     /* look for the message by message id in the records of outbound messages for this client */
-    if (ListFindItem(client->outboundMsgs, &(pubcomp->msgId), messageIDCompare) == NULL)
+    ListElement* found = MessageTable_get(&client->outboundIndex, pubcomp->msgId);
+    if (found == NULL)
     {
         if (pubcomp->header.bits.dup == 0)
             Log(TRACE_MIN, 3, NULL, "PUBCOMP", client->clientID, pubcomp->msgId);
     }
     else
     {
-        Messages* m = (Messages*)(client->outboundMsgs->current->content);
+        Messages* m = (Messages*)(found->content);
         if (m->qos != 2)
             Log(TRACE_MIN, 4, NULL, "PUBCOMP", client->clientID, pubcomp->msgId, m->qos);
         else
@@ -352,7 +385,7 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
                 rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_SENT, m->qos, pubcomp->msgId);
 #endif
                 MQTTProtocol_removePublication(m->publish);
-                ListRemove(client->outboundMsgs, m);
+                MQTTProtocol_removeMessage(client->outboundMsgs, &client->outboundIndex, found);
                 (++state.msgs_sent);
             }
         }
@@ -362,68 +395,29 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
     return rc;
 }
 
-void MQTTProtocol_keepalive(time_t now)
+void MQTTProtocol_startKeepalive(Clients* client)
 {
-    ListElement* current = NULL;
-    
     FUNC_ENTRY;
-    ListNextElement(bstate->clients, &current);
-    while (current)
+    TimerWheel_cancel(&bstate->timers, &client->keepaliveTimer);
+    if (client->keepAliveInterval > 0)
     {
-        Clients* client =	(Clients*)(current->content);
-        ListNextElement(bstate->clients, &current); 
-        if (client->connected && client->keepAliveInterval > 0 &&
-            (difftime(now, client->net.lastSent) >= client->keepAliveInterval ||
-             difftime(now, client->net.lastReceived) >= client->keepAliveInterval))
-        {
-            if (client->ping_outstanding == 0)
-            {
-                if (Socket_noPendingWrites(client->net.socket))
-                {
-                    if (MQTTPacket_send_pingreq(&client->net, client->clientID) != TCPSOCKET_COMPLETE)
-                    {
-                        Log(TRACE_PROTOCOL, -1, "Error sending PINGREQ for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
-                        MQTTProtocol_closeSession(client, 1);
-                    }
-                    else
-                    {
-                        client->net.lastSent = now;
-                        client->ping_outstanding = 1;
-                    }
-                }
-            }
-            else
-            {
-                Log(TRACE_PROTOCOL, -1, "PINGRESP not received in keepalive interval for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
-                MQTTProtocol_closeSession(client, 1);
-            }
-        }
+        TimerWheel_initTimer(&client->keepaliveTimer, MQTTProtocol_keepalive, client, NULL);
+        TimerWheel_schedule(&bstate->timers, &client->keepaliveTimer, min(client->net.lastSent, client->net.lastReceived) + (uint64_t)client->keepAliveInterval * 1000);
     }
     FUNC_EXIT;
 }
 
-void MQTTProtocol_retry(time_t now, int doRetry, int regardless)
+void MQTTProtocol_retry(Clients* client)
 {
     ListElement* current = NULL;
     
     FUNC_ENTRY;
-    ListNextElement(bstate->clients, &current);
-    /* look through the outbound message list of each client, checking to see if a retry is necessary */
-    while (current)
+    while (ListNextElement(client->outboundMsgs, &current) &&
+           client->connected && client->good &&         /* client is connected and has no errors */
+           Socket_noPendingWrites(client->net.socket))  /* there aren't any previous packets still stacked up on the socket */
     {
-        Clients* client = (Clients*)(current->content);
-        ListNextElement(bstate->clients, &current);
-        if (client->connected == 0)
-            continue;
-        if (client->good == 0)
-        {
-            MQTTProtocol_closeSession(client, 1);
-            continue;
-        }
-        if (Socket_noPendingWrites(client->net.socket) == 0)
-            continue;
-        if (doRetry)
-            MQTTProtocol_retries(now, client, regardless);
+        if (!MQTTProtocol_retransmit(client, (Messages*)(current->content)))
+            break;
     }
     FUNC_EXIT;
 }
@@ -432,9 +426,13 @@ void MQTTProtocol_freeClient(Clients* client)
 {
     FUNC_ENTRY;
     /* free up pending message lists here, and any other allocated data */
-    MQTTProtocol_freeMessageList(client->outboundMsgs);
-    MQTTProtocol_freeMessageList(client->inboundMsgs);
+    TimerWheel_cancel(&bstate->timers, &client->keepaliveTimer);
+    MQTTProtocol_freeMessageList(client->outboundMsgs, &client->outboundIndex);
+    MQTTProtocol_freeMessageList(client->inboundMsgs, &client->inboundIndex);
     ListFree(client->messageQueue);
+    TopicAliases_reset(&client->net.aliasesOut, 0);
+    TopicAliases_reset(&client->net.aliasesIn, 0);
+    MQTTPacket_freeChunked(&client->net);
     free(client->clientID);
     if (client->will)
     {
@@ -462,7 +460,7 @@ void MQTTProtocol_freeClient(Clients* client)
     FUNC_EXIT;
 }
 
-void MQTTProtocol_emptyMessageList(List* msgList)
+void MQTTProtocol_emptyMessageList(List* msgList, messageTable* index)
 {
     ListElement* current = NULL;
     
@@ -470,20 +468,47 @@ void MQTTProtocol_emptyMessageList(List* msgList)
     while (ListNextElement(msgList, &current))
     {
         Messages* m = (Messages*)(current->content);
+        TimerWheel_cancel(&bstate->timers, &m->retryTimer);
         MQTTProtocol_removePublication(m->publish);
     }
     ListEmpty(msgList);
+    MessageTable_reset(index);
     FUNC_EXIT;
 }
 
-void MQTTProtocol_freeMessageList(List* msgList)
+void MQTTProtocol_freeMessageList(List* msgList, messageTable* index)
 {
     FUNC_ENTRY;
-    MQTTProtocol_emptyMessageList(msgList);
+    MQTTProtocol_emptyMessageList(msgList, index);
     ListFree(msgList);
     FUNC_EXIT;
 }
 
+void MQTTProtocol_appendMessage(List* msgList, messageTable* index, Messages* m, size_t size)
+{
+    ListAppend(msgList, m, size);
+    MessageTable_set(index, m->msgid, msgList->last);
+}
+
+void MQTTProtocol_removeMessage(List* msgList, messageTable* index, ListElement* element)
+{
+    Messages* m = (Messages*)(element->content);
+    TimerWheel_cancel(&bstate->timers, &m->retryTimer);
+    MessageTable_set(index, m->msgid, NULL);
+    ListRemoveElement(msgList, element);
+}
+
+void MQTTProtocol_indexMessages(List* msgList, messageTable* index)
+{
+    ListElement* current = NULL;
+    
+    FUNC_ENTRY;
+    MessageTable_reset(index);
+    while (ListNextElement(msgList, &current))
+        MessageTable_set(index, ((Messages*)(current->content))->msgid, current);
+    FUNC_EXIT;
+}
+
 char* MQTTStrncpy(char *dest, const char *src, size_t dest_size)
 {
     size_t count = dest_size;
@@ -530,11 +555,16 @@ void MQTTProtocol_storeQoS0(Clients* pubclient, Publish* publish)
 	Log(TRACE_MIN, 12, NULL);
 	pw->p = MQTTProtocol_storePublication(publish, &len);
 	pw->socket = pubclient->net.socket;
-	ListAppend(&(state.pending_writes), pw, sizeof(pending_write)+len);
+	pw->id = SocketBuffer_lastWriteId(pw->socket);
 	/* we don't copy QoS 0 messages unless we have to, so now we have to tell the socket buffer where
 	the saved copy is */
-	if (SocketBuffer_updateWrite(pw->socket, pw->p->topic, pw->p->payload) == NULL)
-		Log(LOG_SEVERE, 0, "Error updating write");
+	if (SocketBuffer_updateWrite(pw->socket, pw->id, pw->p->topic, pw->p->payload) == NULL)
+	{	/* the rest of the packet went out in the meantime, so the copy isn't needed */
+		MQTTProtocol_removePublication(pw->p);
+		free(pw);
+	}
+	else
+		ListAppend(&(state.pending_writes), pw, sizeof(pending_write)+len);
 	FUNC_EXIT;
 }
 
@@ -560,71 +590,190 @@ int MQTTProtocol_startPublishCommon(Clients* pubclient, Publish* publish, int qo
 }
 
 /*!
- *  @abstract MQTT retry processing per client.
+ *  @abstract Send a message in flight again: the PUBLISH until it is acknowledged, then the PUBREL of QoS 2.
  *
- *  @param now current time.
- *  @param client - the client to which to apply the retry processing.
- *  @param regardless boolean - retry packets regardless of retry interval (used on reconnect).
+ *  @param client the client the message is in flight for.
+ *  @param m the message.
+ *  @return whether the client is still connected; on an error its session is closed.
  */
-void MQTTProtocol_retries(time_t now, Clients* client, int regardless)
+bool MQTTProtocol_retransmit(Clients* client, Messages* m)
 {
-	ListElement* outcurrent = NULL;
+	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
+	if (m->qos == 1 || (m->qos == 2 && m->nextMessageType == PUBREC))
+	{
+		Publish publish;
+
+		Log(TRACE_MIN, 7, NULL, "PUBLISH", client->clientID, client->net.socket, m->msgid);
+		publish.msgId = m->msgid;
+		publish.topic = m->publish->topic;
+		publish.topiclen = m->publish->topiclen;
+		publish.payload = m->publish->payload;
+		publish.payloadlen = m->publish->payloadlen;
+		publish.lender.release = NULL;	/* already stored */
+		publish.stream = m->publish->stream;
+		rc = MQTTPacket_send_publish(&publish, 1, m->qos, m->retain, &client->net, client->clientID);
+	}
+	else if (m->qos && m->nextMessageType == PUBCOMP)
+	{
+		Log(TRACE_MIN, 7, NULL, "PUBREL", client->clientID, client->net.socket, m->msgid);
+		rc = MQTTPacket_send_pubrel(m->msgid, 0, &client->net, client->clientID);
+	}
+	else
+		goto exit;
+
+	if (rc == SOCKET_ERROR)
+	{
+		client->good = 0;
+		Log(TRACE_PROTOCOL, 29, NULL, client->clientID, client->net.socket, Socket_getpeer(client->net.socket));
+		MQTTProtocol_closeSession(client, 1);
+	}
+	else
+	{
+		m->lastTouch = TimerWheel_now();
+		MQTTProtocol_scheduleRetry(client, m);
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc != SOCKET_ERROR;
+}
+
+/*!
+ *  @abstract Schedule the next retry of an outbound message, the retry interval (no less than 10 seconds) after it was last sent.
+ *  @discussion A retry interval of 0 or less turns retries off, except on reconnect.
+ */
+void MQTTProtocol_scheduleRetry(Clients* client, Messages* m)
+{
+	if (client->retryInterval <= 0) { return; }
+	m->retryTimer.context = client;
+	TimerWheel_schedule(&bstate->timers, &m->retryTimer, m->lastTouch + (uint64_t)max(client->retryInterval, 10) * 1000);
+}
+
+/*!
+ *  @abstract Expiry of the retry timer of an outbound message.
+ *  @discussion Nothing is sent while the client is disconnected, as every message in flight is sent again on reconnect.
+ *
+ *  @param context the client.
+ *  @param target the message.
+ */
+void MQTTProtocol_retryMessage(void* context, void* target)
+{
+	Clients* client = (Clients*)context;
+	Messages* m = (Messages*)target;
 
-	if (!regardless && client->retryInterval <= 0) /* 0 or -ive retryInterval turns off retry except on reconnect */
+	FUNC_ENTRY;
+	if (!client->connected || !client->good)
 		goto exit;
+	if (!Socket_noPendingWrites(client->net.socket))    /* wait for the previous packets stacked up on the socket */
+		TimerWheel_schedule(&bstate->timers, &m->retryTimer, TimerWheel_now() + MQTTPROTOCOL_RECHECK);
+	else
+		MQTTProtocol_retransmit(client, m);
+exit:
+	FUNC_EXIT;
+}
 
-	while (client && ListNextElement(client->outboundMsgs, &outcurrent) &&
-		   client->connected && client->good &&        /* client is connected and has no errors */
-		   Socket_noPendingWrites(client->net.socket)) /* there aren't any previous packets still stacked up on the socket */
+/*!
+ *  @abstract Expiry of the keepalive timer of a client: send a PINGREQ if the connection has been idle for the keepalive interval in either direction.
+ *  @discussion The session is closed if the PINGRESP of the previous PINGREQ has not been received within the keepalive interval.
+ *
+ *  @param context the client.
+ *  @param target unused.
+ */
+void MQTTProtocol_keepalive(void* context, void* target)
+{
+	Clients* client = (Clients*)context;
+	uint64_t const now = TimerWheel_now();
+	uint64_t const interval = (uint64_t)client->keepAliveInterval * 1000;
+	uint64_t const due = min(client->net.lastSent, client->net.lastReceived) + interval;
+
+	FUNC_ENTRY;
+	if (!client->connected || client->keepAliveInterval <= 0)
+		goto exit;
+	if (client->ping_outstanding)
+	{
+		Log(TRACE_PROTOCOL, -1, "PINGRESP not received in keepalive interval for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
+		MQTTProtocol_closeSession(client, 1);
+	}
+	else if (due > now)
+		TimerWheel_schedule(&bstate->timers, &client->keepaliveTimer, due);
+	else if (!Socket_noPendingWrites(client->net.socket))
+		TimerWheel_schedule(&bstate->timers, &client->keepaliveTimer, now + MQTTPROTOCOL_RECHECK);
+	else if (MQTTPacket_send_pingreq(&client->net, client->clientID) == SOCKET_ERROR)
 	{
-		Messages* m = (Messages*)(outcurrent->content);
-		if (regardless || difftime(now, m->lastTouch) > max(client->retryInterval, 10))
-		{
-			if (m->qos == 1 || (m->qos == 2 && m->nextMessageType == PUBREC))
-			{
-				Publish publish;
-				int rc;
-
-				Log(TRACE_MIN, 7, NULL, "PUBLISH", client->clientID, client->net.socket, m->msgid);
-				publish.msgId = m->msgid;
-				publish.topic = m->publish->topic;
-				publish.payload = m->publish->payload;
-				publish.payloadlen = m->publish->payloadlen;
-				rc = MQTTPacket_send_publish(&publish, 1, m->qos, m->retain, &client->net, client->clientID);
-				if (rc == SOCKET_ERROR)
-				{
-					client->good = 0;
-					Log(TRACE_PROTOCOL, 29, NULL, client->clientID, client->net.socket,
-												Socket_getpeer(client->net.socket));
-					MQTTProtocol_closeSession(client, 1);
-					client = NULL;
-				}
-				else
-				{
-					if (m->qos == 0 && rc == TCPSOCKET_INTERRUPTED)
-						MQTTProtocol_storeQoS0(client, &publish);
-					time(&(m->lastTouch));
-				}
-			}
-			else if (m->qos && m->nextMessageType == PUBCOMP)
-			{
-				Log(TRACE_MIN, 7, NULL, "PUBREL", client->clientID, client->net.socket, m->msgid);
-				if (MQTTPacket_send_pubrel(m->msgid, 0, &client->net, client->clientID) != TCPSOCKET_COMPLETE)
-				{
-					client->good = 0;
-					Log(TRACE_PROTOCOL, 29, NULL, client->clientID, client->net.socket,
-							Socket_getpeer(client->net.socket));
-					MQTTProtocol_closeSession(client, 1);
-					client = NULL;
-				}
-				else
-					time(&(m->lastTouch));
-			}
-			/* break; why not do all retries at once? */
-		}
+		Log(TRACE_PROTOCOL, -1, "Error sending PINGREQ for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
+		MQTTProtocol_closeSession(client, 1);
+	}
+	else
+	{
+		client->net.lastSent = now;
+		client->ping_outstanding = 1;
+		TimerWheel_schedule(&bstate->timers, &client->keepaliveTimer, now + interval);
 	}
 exit:
 	FUNC_EXIT;
 }
+
+/*!
+ *  @abstract Hand a chunk of a publish received in chunks to the application straight away.
+ *  @discussion The publish is acknowledged once its last chunk has been handed over. A QoS 2 publish is then recorded as delivered until it is released, so that its chunks are not handed over again if the server sends it again in the meantime.
+ *
+ *  @param publish the chunk, freed by the caller.
+ *  @param client the client receiving it.
+ *  @return the completion code of the acknowledgement, if one is sent.
+ */
+int MQTTProtocol_handlePublishChunk(Publish* publish, Clients* client)
+{
+    int rc = TCPSOCKET_COMPLETE;
+    int const qos = publish->header.bits.qos;
+    
+    FUNC_ENTRY;
+    ListElement* found = (qos == 2) ? MessageTable_get(&client->inboundIndex, publish->msgId) : NULL;
+    bool const redelivered = (found && ((Messages*)found->content)->delivered);
+    if (!redelivered)
+        Protocol_processPublicationChunk(publish, client);
+    else if (publish->payloadoffset == 0)
+        Log(TRACE_MIN, -1, "Publish %d for client %s sent again before it was released, not delivered again", publish->msgId, client->clientID);
+    if (publish->payloadoffset + publish->payloadlen < publish->totallen)
+        goto exit;
+    
+    if (qos == 1)
+        rc = MQTTPacket_send_puback(publish->msgId, &client->net, client->clientID);
+    else if (qos == 2)
+    {
+        if (!redelivered)
+        {   /* stands for the publication until PUBREL, without the payload the application already has */
+            Publish record = *publish;
+            size_t len;
+            Messages* m = malloc(sizeof(Messages));
+            record.payload = NULL;
+            record.payloadlen = 0;
+            m->publish = MQTTProtocol_storePublication(&record, &len);
+            if (m->publish->topic == client->net.chunked.topic)
+                client->net.chunked.topic = NULL;   /* taken over rather than copied */
+            m->msgid = publish->msgId;
+            m->qos = qos;
+            m->retain = publish->header.bits.retain;
+            m->nextMessageType = PUBREL;
+            m->delivered = true;
+            TimerWheel_initTimer(&m->retryTimer, NULL, NULL, NULL);
+            if (found)
+            {   /* discard the publication received whole with the same msgID, which would otherwise be delivered on PUBREL */
+                Messages* msg = (Messages*)(found->content);
+#if !defined(NO_PERSISTENCE)
+                MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_RECEIVED, msg->qos, msg->msgid);
+#endif
+                MQTTProtocol_removePublication(msg->publish);
+                found->content = m;
+                client->inboundMsgs->size += sizeof(Messages) + len;
+                free(msg);
+            } else
+                MQTTProtocol_appendMessage(client->inboundMsgs, &client->inboundIndex, m, sizeof(Messages) + len);
+        }
+        rc = MQTTPacket_send_pubrec(publish->msgId, &client->net, client->clientID);
+    }
+    MQTTPacket_freeChunked(&client->net);
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
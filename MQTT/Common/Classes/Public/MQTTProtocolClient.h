@@ -42,6 +42,7 @@ Messages* MQTTProtocol_createMessage(Publish* publish, Messages** mm, int qos, i
 
 /*!
  *  @abstract Store message data for possible retry.
+ *  @discussion The payload is copied, unless it is lent (publish->lender), in which case the publication takes over giving it back.
  *
  *  @param publish the publication data.
  *  @param len returned length of the data stored.
@@ -51,7 +52,7 @@ Publications* MQTTProtocol_storePublication(Publish* publish, size_t* len);
 
 /*!
  *  @abstract Remove stored message data.
- *  @discussion Opposite of storePublication.
+ *  @discussion Opposite of storePublication: once the last reference is gone, the payload is freed, or given back if it was lent.
  *
  *  @param p stored publication to remove.
  */
@@ -59,6 +60,7 @@ void MQTTProtocol_removePublication(Publications* p);
 
 /*!
  *  @abstract Assign a new message id for a client.  Make sure it isn't already being used and does not exceed the maximum.
+ *  @discussion The id is held in the msgIds of the client until the caller releases it, once its flow has completed.
  *
  *  @param client a client structure
  *  @return the next message id to use, or 0 if none available
@@ -110,20 +112,20 @@ int MQTTProtocol_handlePubrels(void* pack, int sock);
 int MQTTProtocol_handlePubcomps(void* pack, int sock);
 
 /*!
- *  @abstract MQTT protocol keepAlive processing.  Sends PINGREQ packets as required.
+ *  @abstract Start the keepalive of a client which has just connected.
+ *  @discussion A PINGREQ is sent whenever the connection has been idle for the keepalive interval, and the session is closed if its PINGRESP is not received within the interval.
  *
- *  @param now current time
+ *  @param client the client.
  */
-void MQTTProtocol_keepalive(time_t);
+void MQTTProtocol_startKeepalive(Clients* client);
 
 /*!
- *  @abstract MQTT retry protocol and socket pending writes processing.
+ *  @abstract Send again every message in flight of a client which has just reconnected, regardless of the retry interval.
+ *  @discussion Retries while connected are sent by the retry timer of each message, as the interval expires.
  *
- *  @param now current time.
- *  @param doRetry boolean - retries as well as pending writes?
- *  @param regardless boolean - retry packets regardless of retry interval (used on reconnect).
+ *  @param client the client.
  */
-void MQTTProtocol_retry(time_t, int, int);
+void MQTTProtocol_retry(Clients* client);
 
 /*!
  *  @abstract Free a client structure.
@@ -136,15 +138,44 @@ void MQTTProtocol_freeClient(Clients* client);
  *  @abstract Empty a message list, leaving it able to accept new messages.
  *
  *  @param msgList the message list to empty
+ *  @param index the index of the list, emptied too
  */
-void MQTTProtocol_emptyMessageList(List* msgList);
+void MQTTProtocol_emptyMessageList(List* msgList, messageTable* index);
 
 /*!
  *  @abstract Empty and free up all storage used by a message list
  *
  *  @param msgList the message list to empty and free
+ *  @param index the index of the list, emptied too
  */
-void MQTTProtocol_freeMessageList(List* msgList);
+void MQTTProtocol_freeMessageList(List* msgList, messageTable* index);
+
+/*!
+ *  @abstract Add a message to the end of a message list (inboundMsgs or outboundMsgs of a client) and to its index.
+ *
+ *  @param msgList the message list
+ *  @param index the index of the list
+ *  @param m the message
+ *  @param size the heap storage used by the message
+ */
+void MQTTProtocol_appendMessage(List* msgList, messageTable* index, Messages* m, size_t size);
+
+/*!
+ *  @abstract Remove a message from a message list and its index, and free it (but not its publication).
+ *
+ *  @param msgList the message list
+ *  @param index the index of the list
+ *  @param element the element of the message in the list, as found in the index
+ */
+void MQTTProtocol_removeMessage(List* msgList, messageTable* index, ListElement* element);
+
+/*!
+ *  @abstract Index all the messages of a message list, such as after they are restored from persistence.
+ *
+ *  @param msgList the message list
+ *  @param index the index of the list, replaced
+ */
+void MQTTProtocol_indexMessages(List* msgList, messageTable* index);
 
 /*!
  *  @abstract List callback function for comparing Message structures by message id
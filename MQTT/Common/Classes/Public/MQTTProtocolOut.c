@@ -1,12 +1,12 @@
 #include "MQTTProtocolOut.h"    // Header
 #include <stdlib.h>             // C Standard
+#include <string.h>             // C Standard
 #include "StackTrace.h"         // MQTT (Utilities)
 #include "Heap.h"               // MQTT (Utilities)
 
 #pragma mark - Variables
 
 extern MQTTProtocol state;
-extern ClientStates* bstate;
 
 #pragma mark - Private prototypes
 
@@ -21,13 +21,29 @@ int MQTTProtocol_connect(const char* ip_address, Clients* aClient, int MQTTVersi
 #endif
 {
     int rc, port;
-    char* addr;
+    char* addr = NULL;
     
     FUNC_ENTRY;
     aClient->good = 1;
     
-    addr = MQTTProtocol_addressPort(ip_address, &port);
-    rc = Socket_new(addr, port, &(aClient->net.socket));
+    if (strncmp(URI_UNIX, ip_address, strlen(URI_UNIX)) == 0)
+    {   // Local broker: no port to parse, and nothing for SSL to protect.
+        rc = Socket_newUnix(ip_address + strlen(URI_UNIX), &aClient->sockopts, &(aClient->net.socket));
+        #if defined(OPENSSL)
+        ssl = 0;
+        #endif
+    }
+    else
+    {
+        addr = MQTTProtocol_addressPort(ip_address, &port);
+        rc = Socket_new(addr, port, &aClient->sockopts, &(aClient->net.socket));
+    }
+    MQTTPacketParser_reset(&aClient->net.parser);
+    aClient->net.parser.chunkThreshold = aClient->chunkThreshold;
+    aClient->net.parser.properties = (MQTTVersion >= MQTTVERSION_5);
+    MQTTPacket_freeChunked(&aClient->net);     // A publish the previous connection was receiving in chunks is not going to be completed.
+    Socket_setClient(aClient->net.socket, aClient);
+    Socket_setMaxWriteDelay(aClient->net.socket, aClient->maxWriteDelay);
     if (rc == EINPROGRESS || rc == EWOULDBLOCK) {
         aClient->connect_state = 1; // TCP connect called - wait for connect completion
     }
@@ -48,16 +64,19 @@ int MQTTProtocol_connect(const char* ip_address, Clients* aClient, int MQTTVersi
         
         if (rc == 0)
         {
-            // Now send the MQTT connect packet
-            if ((rc = MQTTPacket_send_connect(aClient, MQTTVersion)) == 0) {
+            // Now send the MQTT connect packet. It may be queued rather than written straight away (held back, or a partial write).
+            if ((rc = MQTTPacket_send_connect(aClient, MQTTVersion)) != SOCKET_ERROR)
+            {
                 aClient->connect_state = 3;     // MQTT Connect sent - wait for CONNACK
-            } else {
+                rc = 0;
+            }
+            else {
                 aClient->connect_state = 0;
             }
         }
     }
     
-    if (addr != ip_address) { free(addr); }
+    if (addr && addr != ip_address) { free(addr); }
     
     FUNC_EXIT_RC(rc);
     return rc;
@@ -69,7 +88,7 @@ int MQTTProtocol_handlePingresps(void* pack, int sock)
     int rc = TCPSOCKET_COMPLETE;
     
     FUNC_ENTRY;
-    client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+    client = (Clients*)Socket_getClient(sock);
     Log(LOG_PROTOCOL, 21, NULL, sock, client->clientID);
     client->ping_outstanding = 0;
     FUNC_EXIT_RC(rc);
@@ -94,7 +113,7 @@ int MQTTProtocol_handleSubacks(void* pack, int sock)
     int rc = TCPSOCKET_COMPLETE;
     
     FUNC_ENTRY;
-    client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+    client = (Clients*)Socket_getClient(sock);
     Log(LOG_PROTOCOL, 23, NULL, sock, client->clientID, suback->msgId);
     MQTTPacket_freeSuback(suback);
     FUNC_EXIT_RC(rc);
@@ -119,7 +138,7 @@ int MQTTProtocol_handleUnsubacks(void* pack, int sock)
     int rc = TCPSOCKET_COMPLETE;
     
     FUNC_ENTRY;
-    client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+    client = (Clients*)Socket_getClient(sock);
     Log(LOG_PROTOCOL, 24, NULL, sock, client->clientID, unsuback->msgId);
     free(unsuback);
     FUNC_EXIT_RC(rc);
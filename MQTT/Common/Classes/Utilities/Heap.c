@@ -21,7 +21,7 @@ char* Broker_recordFFDC(char* symptoms);
 static pthread_mutex_t heap_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t* heap_mutex = &heap_mutex_store;
 
-static heap_info state = {0, 0}; /**< global heap state information */
+static heap_info state = {0, 0, 0}; /**< global heap state information */
 static int eyecatcher = 0x88888888;
 
 static Tree heap;   //Tree that holds the allocation records.
@@ -89,6 +89,7 @@ void* mymalloc(char* file, int line, size_t size)
     state.current_size += size;
     if (state.current_size > state.max_size)
         state.max_size = state.current_size;
+    ++state.allocations;
     Thread_unlock_mutex(heap_mutex);
     return ((int*)(s->ptr)) + 1;	/* skip start eyecatcher */
 }
@@ -112,6 +113,7 @@ void* myrealloc(char* file, int line, void* p, size_t size)
         state.current_size += size - s->size;
         if (state.current_size > state.max_size)
             state.max_size = state.current_size;
+        ++state.allocations;
         if ((s->ptr = realloc(s->ptr, size + 2*sizeof(int))) == NULL)
         {
             Log(LOG_ERROR, 13, errmsg);
@@ -47,6 +47,7 @@ typedef struct
 {
 	int current_size;	// Current size of the heap in bytes.
 	size_t max_size;	// Max size the heap has reached in bytes.
+	size_t allocations;	// Number of items allocated or reallocated so far.
 } heap_info;
 
 /*!
@@ -6,6 +6,7 @@
 #pragma mark - Private prototypes
 
 int ListUnlink(List* restrict list, void const* content, ListCallback callback, int const freeContent);
+void ListUnlinkElement(List* restrict list, ListElement* element, int const freeContent, bool const freeElement);
 
 #pragma mark - Public API
 
@@ -47,7 +48,11 @@ void ListAppendNoMalloc(List* restrict list, void const* restrict content, ListE
 void ListInsert(List* restrict list, void const* restrict content, size_t const size, ListElement* restrict index)
 {
 	ListElement* element = malloc(sizeof(ListElement));
+    ListInsertNoMalloc(list, content, element, size, index);
+}
 
+void ListInsertNoMalloc(List* restrict list, void const* restrict content, ListElement* restrict element, size_t const size, ListElement* restrict index)
+{
     if ( index == NULL )
     {
 		ListAppendNoMalloc(list, content, element, size);
@@ -114,7 +119,30 @@ int ListDetachItem(List* restrict list, void const* content, ListCallback callba
     return ListUnlink(list, content, callback, 0);
 }
 
+void ListDetachElement(List* restrict list, ListElement* element)
+{
+    ListUnlinkElement(list, element, 0, true);
+}
+
+void ListDetachElementNoFree(List* restrict list, ListElement* element)
+{
+    ListUnlinkElement(list, element, 0, false);
+}
+
+void ListRemoveElement(List* restrict list, ListElement* element)
+{
+    ListUnlinkElement(list, element, 1, true);
+}
+
 void* ListDetachHead(List* restrict list)
+{
+    ListElement* first = list->first;
+    void* content = ListDetachHeadNoFree(list);
+    if (first) { free(first); }
+    return content;
+}
+
+void* ListDetachHeadNoFree(List* restrict list)
 {
     if (list->count <= 0) { return NULL; }
     
@@ -129,7 +157,6 @@ void* ListDetachHead(List* restrict list)
     content = first->content;
     list->first = list->first->next;
     if (list->first) { list->first->prev = NULL; }
-    free(first);
     --(list->count);
     
     return content;
@@ -243,34 +270,41 @@ bool stringcompare(void const* a, void const* b)
  */
 int ListUnlink(List* restrict list, void const* content, ListCallback callback, int const freeContent)
 {
-	ListElement* next = NULL;
 	ListElement* saved = list->current;
-	int saveddeleted = 0;
 
     if ( !ListFindItem(list, content, callback) ) { return 0; }
 
-	if (list->current->prev == NULL)
+	ListElement* element = list->current;
+	list->current = saved;
+	ListUnlinkElement(list, element, freeContent, true);
+	return 1; /* successfully removed item */
+}
+
+/*!
+ *  @abstract Removes and optionally frees an element of a list, already found.
+ *
+ *  @param list The list the element is in.
+ *  @param element The element.
+ *  @param freeContent Boolean value to indicate whether the content of the element is to be freed.
+ *  @param freeElement Whether the element is to be freed, which it must not be if it was given to ListAppendNoMalloc.
+ */
+void ListUnlinkElement(List* restrict list, ListElement* element, int const freeContent, bool const freeElement)
+{
+	if (element->prev == NULL)
     {   // This is the first element, and we have to update the "first" pointer.
-		list->first = list->current->next;
+		list->first = element->next;
     } else {
-		list->current->prev->next = list->current->next;
+		element->prev->next = element->next;
     }
 
-    if (list->current->next == NULL) {
-		list->last = list->current->prev;
+    if (element->next == NULL) {
+		list->last = element->prev;
     } else {
-		list->current->next->prev = list->current->prev;
+		element->next->prev = element->prev;
     }
 
-	next = list->current->next;
-    if (freeContent) { free(list->current->content); }
-    if (saved == list->current) { saveddeleted = 1; }
-	free(list->current);
-    if (saveddeleted) {
-		list->current = next;
-    } else {
-		list->current = saved;
-    }
+    if (list->current == element) { list->current = element->next; }
+    if (freeContent) { free(element->content); }
+    if (freeElement) { free(element); }
 	--(list->count);
-	return 1; /* successfully removed item */
 }
@@ -115,6 +115,17 @@ void ListAppendNoMalloc(List* restrict list, void const* restrict content, ListE
  */
 void ListInsert(List* restrict list, void const* restrict content, size_t const size, ListElement* restrict index);
 
+/*!
+ *  @abstract Insert an already allocated ListElement and content to a list at a specific position.
+ *
+ *  @param list The list to which the item is to be added.
+ *  @param content The list item content itself.
+ *  @param element The ListElement to be used in adding the new item.
+ *  @param size The size of the element.
+ *  @param index The position in the list. If <code>NULL</code>, this function is equivalent to ListAppendNoMalloc.
+ */
+void ListInsertNoMalloc(List* restrict list, void const* restrict content, ListElement* restrict element, size_t const size, ListElement* restrict index);
+
 /*!
  *  @abstract Removes and frees an item in a list by comparing the pointer to the content.
  *  @param list The list from which the item is to be removed
@@ -167,6 +178,27 @@ int ListDetach(List* restrict list, void const* content);
  */
 int ListDetachItem(List* restrict list, void const* content, ListCallback callback);
 
+/*!
+ *  @abstract Removes but does not free an element of a list, without searching for it.
+ *  @param list The list the element is in.
+ *  @param element The element, which is freed.
+ */
+void ListDetachElement(List* restrict list, ListElement* element);
+
+/*!
+ *  @abstract Removes an element of a list given to ListAppendNoMalloc or ListInsertNoMalloc, without freeing the element or its content.
+ *  @param list The list the element is in.
+ *  @param element The element.
+ */
+void ListDetachElementNoFree(List* restrict list, ListElement* element);
+
+/*!
+ *  @abstract Removes and frees an element of a list and its content, without searching for it.
+ *  @param list The list the element is in.
+ *  @param element The element.
+ */
+void ListRemoveElement(List* restrict list, ListElement* element);
+
 /*!
  * @abstract Removes and frees an the first item in a list.
  * @param list The list from which the item is to be removed.
@@ -174,6 +206,13 @@ int ListDetachItem(List* restrict list, void const* content, ListCallback callba
  */
 void* ListDetachHead(List* restrict list);
 
+/*!
+ * @abstract Removes the first item of a list whose elements were given to ListAppendNoMalloc or ListInsertNoMalloc, without freeing the element or the item.
+ * @param list The list from which the item is to be removed.
+ * @return The item removed, or NULL if the list is empty.
+ */
+void* ListDetachHeadNoFree(List* restrict list);
+
 /*!
  *  @abstract Finds an element in a list by comparing the content pointers, rather than the contents.
  *
@@ -171,6 +171,7 @@ cond_type_struct* Thread_create_cond()
 	cond_type_struct* condvar = malloc(sizeof(cond_type_struct));
 	int rc = pthread_cond_init(&condvar->cond, NULL);
 	rc = pthread_mutex_init(&condvar->mutex, NULL);
+	condvar->signalled = 0;
 	FUNC_EXIT_RC(rc);
 	return condvar;
 }
@@ -178,24 +179,31 @@ cond_type_struct* Thread_create_cond()
 int Thread_signal_cond(cond_type_struct* condvar)
 {
 	pthread_mutex_lock(&condvar->mutex);
+	condvar->signalled = 1;
 	int rc = pthread_cond_signal(&condvar->cond);
 	pthread_mutex_unlock(&condvar->mutex);
 
 	return rc;
 }
 
-int Thread_wait_cond(cond_type_struct* condvar, int timeout)
+int Thread_wait_cond(cond_type_struct* condvar, long timeout)
 {
 	FUNC_ENTRY;
 	struct timeval cur_time;
 	gettimeofday(&cur_time, NULL);
 
     struct timespec cond_timeout;
-	cond_timeout.tv_sec = cur_time.tv_sec + timeout;
-	cond_timeout.tv_nsec = cur_time.tv_usec * 1000;
+	long const usec = cur_time.tv_usec + (timeout % 1000) * 1000;
+	cond_timeout.tv_sec = cur_time.tv_sec + timeout / 1000 + usec / 1000000;
+	cond_timeout.tv_nsec = (usec % 1000000) * 1000;
 
 	pthread_mutex_lock(&condvar->mutex);
-	int rc = pthread_cond_timedwait(&condvar->cond, &condvar->mutex, &cond_timeout);
+	int rc = 0;
+	while (!condvar->signalled && rc == 0)
+		rc = pthread_cond_timedwait(&condvar->cond, &condvar->mutex, &cond_timeout);
+	if (condvar->signalled)
+		rc = 0;
+	condvar->signalled = 0;
 	pthread_mutex_unlock(&condvar->mutex);
 
 	FUNC_EXIT_RC(rc);
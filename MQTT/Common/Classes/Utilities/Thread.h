@@ -8,6 +8,7 @@
 typedef struct {
     pthread_cond_t cond;
     pthread_mutex_t mutex;
+    int signalled;          // Set by Thread_signal_cond until a wait consumes it, so that a signal sent while nobody waits is not lost.
 } cond_type_struct;
 
 typedef void* (*thread_fn)(void*);
@@ -98,11 +99,14 @@ cond_type_struct* Thread_create_cond();
 int Thread_signal_cond(cond_type_struct*);
 
 /*!
- *  @abstract Wait with a timeout (seconds) for condition variable.
+ *  @abstract Wait with a timeout for condition variable.
+ *  @discussion Returns straight away if the condition variable was signalled since the last wait.
  *
- *  @return completion code.
+ *  @param condvar The condition variable.
+ *  @param timeout The maximum time to wait, in milliseconds.
+ *  @return completion code, ETIMEDOUT if it was not signalled in time.
  */
-int Thread_wait_cond(cond_type_struct* condvar, int timeout);
+int Thread_wait_cond(cond_type_struct* condvar, long timeout);
 
 /*!
  *  @abstract Destroy a condition variable.
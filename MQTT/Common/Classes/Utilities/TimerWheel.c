@@ -0,0 +1,170 @@
+#include "TimerWheel.h"     // Header
+
+#include <time.h>           // C Standard
+
+#pragma mark - Definitions
+
+/*!
+ *  @abstract Ticks (ms) covered by the whole wheel. Timers further off are queued at its end, and queued again as it is reached.
+ */
+#define TIMERWHEEL_RANGE ((uint64_t)1 << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))
+
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+
+#pragma mark - Private prototypes
+
+void TimerWheel_queue(timerWheel* wheel, timer* t);
+void TimerWheel_unlink(timerWheel* wheel, timer* t);
+void TimerWheel_push(timer** head, timer* t);
+void TimerWheel_tick(timerWheel* wheel, uint64_t tick);
+
+#pragma mark - Public API
+
+uint64_t TimerWheel_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void TimerWheel_initTimer(timer* t, timerExpiry expire, void* context, void* target)
+{
+    t->next = t->prev = NULL;
+    t->deadline = 0;
+    t->expire = expire;
+    t->context = context;
+    t->target = target;
+    t->level = t->slot = 0;
+    t->scheduled = false;
+}
+
+void TimerWheel_schedule(timerWheel* wheel, timer* t, uint64_t deadline)
+{
+    if (t->scheduled) { TimerWheel_unlink(wheel, t); }
+    else if (wheel->count++ == 0) { wheel->now = TimerWheel_now(); }    // An empty wheel is not advanced, so catch up first.
+    t->deadline = deadline;
+    t->scheduled = true;
+    TimerWheel_queue(wheel, t);
+}
+
+void TimerWheel_cancel(timerWheel* wheel, timer* t)
+{
+    if (!t->scheduled) { return; }
+    TimerWheel_unlink(wheel, t);
+    t->scheduled = false;
+    --wheel->count;
+}
+
+void TimerWheel_advance(timerWheel* wheel, uint64_t now)
+{
+    while (wheel->now < now)
+    {
+        if (wheel->count == 0) { wheel->now = now; break; }
+
+        // The next tick to visit: a slot of the first level holding timers, or else the end of its turn, where the levels above move down.
+        unsigned int const slot = (unsigned int)(wheel->now & TIMERWHEEL_MASK);
+        uint64_t const later = (slot == TIMERWHEEL_MASK) ? 0 : wheel->occupied[0] & (~(uint64_t)0 << (slot + 1));
+        uint64_t const tick = (later != 0) ? (wheel->now - slot) + (uint64_t)__builtin_ctzll(later) : (wheel->now | TIMERWHEEL_MASK) + 1;
+        if (tick > now) { wheel->now = now; break; }
+        TimerWheel_tick(wheel, tick);
+
+        // Called one at a time, as each may cancel or schedule others, the ones waiting here included.
+        timer* t;
+        while ((t = wheel->expired) != NULL)
+        {
+            TimerWheel_cancel(wheel, t);
+            t->expire(t->context, t->target);
+        }
+    }
+}
+
+uint64_t TimerWheel_next(timerWheel const* wheel)
+{
+    uint64_t next = UINT64_MAX;
+    for (unsigned int level = 0; level < TIMERWHEEL_LEVELS && wheel->count > 0; ++level)
+    {
+        uint64_t const occupied = wheel->occupied[level];
+        if (occupied == 0) { continue; }
+
+        // The first slot holding timers after the current one, going round into the next turn of the level if needed.
+        unsigned int const shift = TIMERWHEEL_BITS * level;
+        unsigned int const slot = (unsigned int)(wheel->now >> shift) & TIMERWHEEL_MASK;
+        uint64_t const later = (slot == TIMERWHEEL_MASK) ? 0 : occupied & (~(uint64_t)0 << (slot + 1));
+        uint64_t const turn = (wheel->now >> (shift + TIMERWHEEL_BITS)) << (shift + TIMERWHEEL_BITS);
+        uint64_t const at = (later != 0) ? turn + ((uint64_t)__builtin_ctzll(later) << shift)
+                                         : turn + ((uint64_t)1 << (shift + TIMERWHEEL_BITS)) + ((uint64_t)__builtin_ctzll(occupied) << shift);
+        if (at < next) { next = at; }
+    }
+    return next;
+}
+
+#pragma mark - Private functions
+
+/*!
+ *  @abstract Queue a scheduled timer in the slot matching its deadline.
+ *  @discussion The level is the lowest one above which the deadline and the time of the wheel agree, so the slot is reached after the wheel time and no later than the deadline.
+ */
+void TimerWheel_queue(timerWheel* wheel, timer* t)
+{
+    uint64_t at = (t->deadline > wheel->now) ? t->deadline : wheel->now + 1;
+    if (at - wheel->now >= TIMERWHEEL_RANGE) { at = wheel->now + TIMERWHEEL_RANGE - 1; }
+
+    unsigned int level = 0;
+    while (level < TIMERWHEEL_LEVELS - 1 && (at >> (TIMERWHEEL_BITS * (level + 1))) != (wheel->now >> (TIMERWHEEL_BITS * (level + 1)))) { ++level; }
+    unsigned int const slot = (unsigned int)(at >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+
+    t->level = (unsigned char)level;
+    t->slot = (unsigned char)slot;
+    TimerWheel_push(&wheel->slots[level][slot], t);
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+/*!
+ *  @abstract Take a scheduled timer out of its slot, or out of the expired ones.
+ */
+void TimerWheel_unlink(timerWheel* wheel, timer* t)
+{
+    bool const expired = (t->level == TIMERWHEEL_LEVELS);
+    timer** const head = (expired) ? &wheel->expired : &wheel->slots[t->level][t->slot];
+    if (t->prev) { t->prev->next = t->next; } else { *head = t->next; }
+    if (t->next) { t->next->prev = t->prev; }
+    t->next = t->prev = NULL;
+    if (!expired && *head == NULL) { wheel->occupied[t->level] &= ~((uint64_t)1 << t->slot); }
+}
+
+void TimerWheel_push(timer** head, timer* t)
+{
+    t->prev = NULL;
+    t->next = *head;
+    if (*head) { (*head)->prev = t; }
+    *head = t;
+}
+
+/*!
+ *  @abstract Visit a tick: move down the slots of the levels above whose turn it is, then take the timers of the first level slot as expired.
+ */
+void TimerWheel_tick(timerWheel* wheel, uint64_t tick)
+{
+    wheel->now = tick;
+    for (int level = TIMERWHEEL_LEVELS - 1; level >= 0; --level)
+    {
+        uint64_t const below = ((uint64_t)1 << (TIMERWHEEL_BITS * level)) - 1;
+        if ((tick & below) != 0) { continue; }   // Not the turn of a slot of this level.
+
+        unsigned int const slot = (unsigned int)(tick >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+        timer* t = wheel->slots[level][slot];
+        wheel->slots[level][slot] = NULL;
+        wheel->occupied[level] &= ~((uint64_t)1 << slot);
+        while (t != NULL)
+        {
+            timer* const next = t->next;
+            if (t->deadline <= tick)
+            {
+                t->level = TIMERWHEEL_LEVELS;
+                TimerWheel_push(&wheel->expired, t);
+            }
+            else { TimerWheel_queue(wheel, t); }
+            t = next;
+        }
+    }
+}
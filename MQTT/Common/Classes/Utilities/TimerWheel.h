@@ -0,0 +1,120 @@
+/*!
+ *  @abstract Timers on a hierarchical timing wheel, with millisecond resolution on a monotonic clock.
+ *  @discussion Each level of the wheel has a slot per tick of its resolution: 1 ms slots on the first level, 64 ms slots on the second, and so on. A timer is queued in the slot of the level matching how far off it expires, and moved down a level as time reaches its slot, so that scheduling, cancelling and expiring a timer cost the same whatever the number of timers. Advancing the wheel only visits the slots holding timers, and the boundaries where a level moves down.
+ *
+ *  Timers are embedded in the structures they time, and the wheel does no locking: every call for a wheel must be made under the same lock.
+ */
+#pragma once
+
+#include <stdbool.h>    // C Standard
+#include <stdint.h>     // C Standard
+
+#pragma mark Definitions
+
+/*!
+ *  @abstract Levels of the wheel.
+ */
+#define TIMERWHEEL_LEVELS 5
+
+/*!
+ *  @abstract Slots of each level, as a power of two.
+ */
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+
+/*!
+ *  @abstract Called as a timer expires, once it is no longer scheduled. It may schedule the timer again.
+ */
+typedef void (*timerExpiry)(void* context, void* target);
+
+/*!
+ *  @abstract A timer, which is scheduled on at most one wheel at a time.
+ *
+ *  @field next Next timer in the same slot.
+ *  @field prev Previous timer in the same slot.
+ *  @field deadline Monotonic time (ms) at which it expires.
+ *  @field expire Called as it expires.
+ *  @field context Passed to <code>expire</code>, such as the client the timer belongs to.
+ *  @field target Passed to <code>expire</code>, such as the message being timed.
+ *  @field level The level of the slot it is queued in, <code>TIMERWHEEL_LEVELS</code> once expired and waiting to be called.
+ *  @field slot The slot it is queued in.
+ *  @field scheduled Whether it is scheduled.
+ */
+typedef struct timer
+{
+    struct timer* next;
+    struct timer* prev;
+    uint64_t deadline;
+    timerExpiry expire;
+    void* context;
+    void* target;
+    unsigned char level;
+    unsigned char slot;
+    bool scheduled;
+} timer;
+
+/*!
+ *  @abstract A timing wheel. All zero is an empty wheel.
+ *
+ *  @field now The time (ms) the wheel has been advanced to.
+ *  @field slots The timers queued in each slot.
+ *  @field occupied A bit for each slot of each level holding timers.
+ *  @field expired The timers expired and waiting to be called.
+ *  @field count Number of timers scheduled.
+ */
+typedef struct
+{
+    uint64_t now;
+    timer* slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+    uint64_t occupied[TIMERWHEEL_LEVELS];
+    timer* expired;
+    unsigned int count;
+} timerWheel;
+
+#pragma mark Public API
+
+/*!
+ *  @abstract The current time (ms) on the monotonic clock timers are scheduled with.
+ */
+uint64_t TimerWheel_now(void);
+
+/*!
+ *  @abstract Set up a timer, not scheduled yet.
+ *
+ *  @param t the timer.
+ *  @param expire called as the timer expires.
+ *  @param context first argument of <code>expire</code>.
+ *  @param target second argument of <code>expire</code>.
+ */
+void TimerWheel_initTimer(timer* t, timerExpiry expire, void* context, void* target);
+
+/*!
+ *  @abstract Schedule a timer, or move it if it is already scheduled.
+ *
+ *  @param wheel the wheel.
+ *  @param t the timer, set up by <code>TimerWheel_initTimer</code>.
+ *  @param deadline the time (ms) at which it expires; a time already past expires it on the next advance.
+ */
+void TimerWheel_schedule(timerWheel* wheel, timer* t, uint64_t deadline);
+
+/*!
+ *  @abstract Cancel a timer, if it is scheduled.
+ *  @discussion A timer must be cancelled before the memory holding it is freed.
+ */
+void TimerWheel_cancel(timerWheel* wheel, timer* t);
+
+/*!
+ *  @abstract The time by which the wheel should next be advanced: the earliest deadline, or a time before it where timers move down a level.
+ *
+ *  @param wheel the wheel.
+ *  @return the time (ms), <code>UINT64_MAX</code> if no timer is scheduled.
+ */
+uint64_t TimerWheel_next(timerWheel const* wheel);
+
+/*!
+ *  @abstract Advance the wheel to a time, calling the timers expired by then.
+ *
+ *  @param wheel the wheel.
+ *  @param now the current time (ms), usually <code>TimerWheel_now()</code>.
+ */
+void TimerWheel_advance(timerWheel* wheel, uint64_t now);
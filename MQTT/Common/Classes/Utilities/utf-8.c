@@ -1,5 +1,6 @@
 #include "utf-8.h"      // Header
 #include <string.h>     // C Standard
+#include <stdint.h>     // C Standard
 #include "StackTrace.h" // MQTT (Utilities)
 
 // Macro to determine the number of elements in a single-dimension array
@@ -7,9 +8,112 @@
     #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 #endif
 
+#pragma mark - Definitions
+
+#if !defined(UTF8_NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+    #include <arm_neon.h>   // ARM (NEON)
+    #define UTF8_SIMD 1
+#elif !defined(UTF8_NO_SIMD) && defined(__SSSE3__)
+    #include <tmmintrin.h>  // x86 (SSSE3)
+    #define UTF8_SIMD 1
+#endif
+
+// Under the address sanitizers, reading past the terminating NUL is reported even within the block holding it.
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_HWADDRESS__)
+    #define UTF8_SANITIZED 1
+#elif defined(__has_feature)
+    #if __has_feature(address_sanitizer) || __has_feature(hwaddress_sanitizer)
+        #define UTF8_SANITIZED 1
+    #endif
+#endif
+
+#if defined(UTF8_SIMD)
+/*
+ *  The vector validator follows "Validating UTF-8 In Less Than One Instruction Per Byte" (Keiser, Lemire, 2021).
+ *  Each byte is classified together with the byte before it through three 16 entry lookup tables, whose entries are
+ *  bit sets of the errors the pair could be part of; a pair is bad if the three agree on an error. The remaining
+ *  errors (a continuation byte missing or in excess after a 3 or 4 byte lead) are found by comparing with the bytes
+ *  two and three positions back. Blocks of ASCII skip all that.
+ */
+#define UTF8_TOO_SHORT      (1 << 0)    // 11______ 0_______ or 11______ 11______
+#define UTF8_TOO_LONG       (1 << 1)    // 0_______ 10______
+#define UTF8_OVERLONG_3     (1 << 2)    // 11100000 100_____
+#define UTF8_TOO_LARGE      (1 << 3)    // 11110100 1001____ and above
+#define UTF8_SURROGATE      (1 << 4)    // 11101101 101_____
+#define UTF8_OVERLONG_2     (1 << 5)    // 1100000_ 10______
+#define UTF8_TOO_LARGE_1000 (1 << 6)    // 11110101 1000____ and above
+#define UTF8_OVERLONG_4     (1 << 6)    // 11110000 1000____
+#define UTF8_TWO_CONTS      (1 << 7)    // 10______ 10______
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define UTF8_BLOCK 16   // Bytes validated at once.
+
+#if defined(__aarch64__)
+    typedef uint8x16_t utf8_vector;
+    #define utf8_table(...)         ((uint8x16_t){ __VA_ARGS__ })
+    #define utf8_splat(x)           vdupq_n_u8(x)
+    #define utf8_load(p)            vld1q_u8(p)
+    #define utf8_lookup(t, v)       vqtbl1q_u8(t, v)
+    #define utf8_high(v)            vshrq_n_u8(v, 4)
+    #define utf8_low(v)             vandq_u8(v, vdupq_n_u8(0x0F))
+    #define utf8_and(a, b)          vandq_u8(a, b)
+    #define utf8_or(a, b)           vorrq_u8(a, b)
+    #define utf8_xor(a, b)          veorq_u8(a, b)
+    #define utf8_subs(a, b)         vqsubq_u8(a, b)
+    #define utf8_prev(v, prev, n)   vextq_u8(prev, v, UTF8_BLOCK - (n))
+    #define utf8_select(m, a, b)    vbslq_u8(m, a, b)
+    #define utf8_eq(a, b)           vceqq_u8(a, b)
+    #define utf8_any(v)             (vmaxvq_u8(v) != 0)
+    #define utf8_ascii(v)           (vmaxvq_u8(v) < 0x80)
+#else
+    typedef __m128i utf8_vector;
+    #define utf8_table(...)         _mm_setr_epi8(__VA_ARGS__)
+    #define utf8_splat(x)           _mm_set1_epi8((char)(x))
+    #define utf8_load(p)            _mm_loadu_si128((__m128i const*)(p))
+    #define utf8_lookup(t, v)       _mm_shuffle_epi8(t, v)
+    #define utf8_high(v)            _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F))
+    #define utf8_low(v)             _mm_and_si128(v, _mm_set1_epi8(0x0F))
+    #define utf8_and(a, b)          _mm_and_si128(a, b)
+    #define utf8_or(a, b)           _mm_or_si128(a, b)
+    #define utf8_xor(a, b)          _mm_xor_si128(a, b)
+    #define utf8_subs(a, b)         _mm_subs_epu8(a, b)
+    #define utf8_prev(v, prev, n)   _mm_alignr_epi8(v, prev, UTF8_BLOCK - (n))
+    #define utf8_select(m, a, b)    _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b))
+    #define utf8_eq(a, b)           _mm_cmpeq_epi8(a, b)
+    #define utf8_any(v)             (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+    #define utf8_ascii(v)           (_mm_movemask_epi8(v) == 0)
+#endif
+
+/*!
+ *  @abstract Progress of the vector validator through a string.
+ */
+typedef struct
+{
+    utf8_vector prev;       // The block validated last.
+    utf8_vector incomplete; // Non zero where prev ends with a character still missing bytes.
+    utf8_vector error;      // Non zero once an error has been found.
+} utf8_state;
+#endif
+
 #pragma mark - Private prototypes
 
 char const* UTF8_char_validate(size_t const len, char const* restrict data) __attribute__((pure));
+bool UTF8_scalar_validate(size_t const len, char const* restrict data) __attribute__((pure));
+#if defined(UTF8_SIMD)
+void UTF8_block_validate(utf8_state* state, utf8_vector input);
+#endif
+
+#pragma mark - Variables
+
+#if defined(UTF8_SIMD)
+static uint8_t const utf8_before[2 * UTF8_BLOCK] = {    // From offset 16-n, selects the first n bytes of a block.
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+static uint8_t const utf8_from[2 * UTF8_BLOCK] = {      // From offset 16-n, selects the bytes of a block from the n-th on.
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+#endif
 
 #pragma mark - Public API
 
@@ -23,15 +127,25 @@ bool UTF8_validate(size_t const len, char const* restrict data)
 		isValid = true;
 		goto exit;
 	}
-    
-	char const* curdata = UTF8_char_validate(len, data);
-    while (curdata && (curdata < data + len))
+
+    #if defined(UTF8_SIMD)
+    utf8_state state = { utf8_splat(0), utf8_splat(0), utf8_splat(0) };
+    size_t i = 0;
+    for (; i + UTF8_BLOCK <= len; i += UTF8_BLOCK)
     {
-        curdata = UTF8_char_validate(len, curdata);
+        UTF8_block_validate(&state, utf8_load((uint8_t const*)data + i));
+    }
+    if (i < len)
+    {   // The tail is padded with NULs, which make any character cut short an error.
+        uint8_t tail[UTF8_BLOCK] = { 0 };
+        memcpy(tail, data + i, len - i);
+        UTF8_block_validate(&state, utf8_load(tail));
     }
+    isValid = !utf8_any(utf8_or(state.error, state.incomplete));
+    #else
+    isValid = UTF8_scalar_validate(len, data);
+    #endif
 
-	isValid = (curdata != NULL);
-    
 exit:
 	FUNC_EXIT_RC(isValid);
 	return isValid;
@@ -39,8 +153,41 @@ exit:
 
 bool UTF8_validateString(char const* restrict string)
 {
+	size_t len;
+	return UTF8_validateStringLength(string, &len);
+}
+
+bool UTF8_validateStringLength(char const* restrict string, size_t* len)
+{
+	int rc = false;
+
 	FUNC_ENTRY;
-	int const rc = UTF8_validate(strlen(string), string);
+    #if defined(UTF8_SIMD) && !defined(UTF8_SANITIZED)
+    // Only aligned blocks are read, so reading up to the end of the block holding the terminating NUL never crosses into another page.
+    size_t const offset = (uintptr_t)string & (UTF8_BLOCK - 1);
+    uint8_t const* block = (uint8_t const*)string - offset;
+    utf8_state state = { utf8_splat(0), utf8_splat(0), utf8_splat(0) };
+    utf8_vector const zero = utf8_splat(0);
+
+    // The bytes before the string are replaced by some ASCII other than NUL.
+    utf8_vector input = utf8_select(utf8_load(utf8_from + UTF8_BLOCK - offset), utf8_load(block), utf8_splat(1));
+    while (!utf8_any(utf8_eq(input, zero)))
+    {
+        UTF8_block_validate(&state, input);
+        block += UTF8_BLOCK;
+        input = utf8_load(block);
+    }
+
+    size_t end = (block + offset == (uint8_t const*)string) ? offset : 0;
+    while (block[end] != 0) { ++end; }
+    // Whatever follows the NUL is dropped, so that any character it cuts short is an error.
+    UTF8_block_validate(&state, utf8_and(input, utf8_load(utf8_before + UTF8_BLOCK - end)));
+    *len = (size_t)((char const*)block + end - string);
+    rc = !utf8_any(utf8_or(state.error, state.incomplete));
+    #else
+    *len = strlen(string);
+    rc = UTF8_validate(*len, string);
+    #endif
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -81,16 +228,16 @@ static struct utf8_validRanges const valid_ranges[] = {
 char const* UTF8_char_validate(size_t const len, char const* restrict data)
 {
     char const* rc = NULL;
-    
+
     FUNC_ENTRY;
     // First work out how many bytes this char is encoded in.
     int const charlen = ((data[0] & 128) == 0) ? 1 :
                         ((data[0] & 0xF0) == 0xF0) ? 4 :
                         ((data[0] & 0xE0) == 0xE0) ? 3 : 2;
-    
+
     // Not enough characters in the string we were given
     if (charlen > len) { goto exit; }
-    
+
     int good = 0;
     for (int i = 0; i < ARRAY_SIZE(valid_ranges); ++i)
     {   // Just has to match one of these rows.
@@ -109,10 +256,118 @@ char const* UTF8_char_validate(size_t const len, char const* restrict data)
             if (good) { break; }
         }
     }
-    
+
     if (good) { rc = data + charlen; }
-    
+
 exit:
     FUNC_EXIT;
     return rc;
 }
+
+/*!
+ *  @abstract Validate a length-delimited string one character at a time.
+ *  @discussion Used where there is no vector unit. Always built, so that the vector validator can be checked against it.
+ *
+ *  @param len The length of the string in "data".
+ *  @param data The bytes to check for valid UTF-8 characters.
+ *  @return 1 (true) if the string has only UTF-8 characters, 0 (false) otherwise.
+ */
+bool UTF8_scalar_validate(size_t const len, char const* restrict data)
+{
+    char const* curdata = data;
+    char const* const enddata = data + len;
+    while (curdata && (curdata < enddata))
+    {
+        if ((*curdata & 128) == 0) {
+            ++curdata;  // ASCII, no need for the table
+        } else {
+            curdata = UTF8_char_validate((size_t)(enddata - curdata), curdata);
+        }
+    }
+    return (curdata != NULL);
+}
+
+#if defined(UTF8_SIMD)
+/*!
+ *  @abstract Validate the next block of a string.
+ *
+ *  @param state the progress through the string, updated.
+ *  @param input the block.
+ */
+void UTF8_block_validate(utf8_state* state, utf8_vector input)
+{
+    if (utf8_ascii(input))
+    {   // Only a character left incomplete by the previous block can be wrong.
+        state->error = utf8_or(state->error, state->incomplete);
+        state->incomplete = utf8_splat(0);
+        state->prev = input;
+        return;
+    }
+
+    utf8_vector const prev1 = utf8_prev(input, state->prev, 1);
+    utf8_vector const byte_1_high = utf8_lookup(utf8_table(
+        // 0_______ ________ <ASCII in byte 1>
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        // 10______ ________ <continuation in byte 1>
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        // 1100____ ________ <two byte lead in byte 1>
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        // 1101____ ________ <two byte lead in byte 1>
+        UTF8_TOO_SHORT,
+        // 1110____ ________ <three byte lead in byte 1>
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        // 1111____ ________ <four+ byte lead in byte 1>
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4), utf8_high(prev1));
+    utf8_vector const byte_1_low = utf8_lookup(utf8_table(
+        // ____0000 ________
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        // ____0001 ________
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        // ____001_ ________
+        UTF8_CARRY,
+        UTF8_CARRY,
+        // ____0100 ________
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        // ____0101 ________
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        // ____011_ ________
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        // ____1___ ________
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        // ____1101 ________
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), utf8_low(prev1));
+    utf8_vector const byte_2_high = utf8_lookup(utf8_table(
+        // ________ 0_______ <ASCII in byte 2>
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        // ________ 1000____
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        // ________ 1001____
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+        // ________ 101_____
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        // ________ 11______
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT), utf8_high(input));
+    utf8_vector const special = utf8_and(utf8_and(byte_1_high, byte_1_low), byte_2_high);
+
+    // A byte must be a continuation if it is the third after a 3 or 4 byte lead, or the fourth after a 4 byte lead: only then is the high bit set here.
+    utf8_vector const third = utf8_subs(utf8_prev(input, state->prev, 2), utf8_splat(0xE0 - 0x80));
+    utf8_vector const fourth = utf8_subs(utf8_prev(input, state->prev, 3), utf8_splat(0xF0 - 0x80));
+    utf8_vector const must23 = utf8_and(utf8_or(third, fourth), utf8_splat(0x80));
+    state->error = utf8_or(state->error, utf8_xor(must23, special));
+
+    // A lead byte in the last three bytes may still be waiting for continuations.
+    state->incomplete = utf8_subs(input, utf8_table(0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                                    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1));
+    state->prev = input;
+}
+#endif
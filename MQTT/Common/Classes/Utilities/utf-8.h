@@ -23,3 +23,13 @@ bool UTF8_validate(size_t const len, char const* restrict data);
  *  @return 1 (true) if the string has only UTF-8 characters, 0 (false) otherwise.
  */
 bool UTF8_validateString(char const* restrict string);
+
+/*!
+ *  @abstract Validate a null-terminated string has only UTF-8 characters, and measure it.
+ *  @discussion Cheaper than strlen followed by UTF8_validate, as the string is only read once.
+ *
+ *  @param string the string to check for valid UTF-8 characters.
+ *  @param len the length of the string, as strlen would return it. Returned whether the string is valid or not.
+ *  @return 1 (true) if the string has only UTF-8 characters, 0 (false) otherwise.
+ */
+bool UTF8_validateStringLength(char const* restrict string, size_t* len);
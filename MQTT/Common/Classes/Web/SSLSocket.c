@@ -12,9 +12,14 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/crypto.h>
+#include <limits.h>
 
 #pragma mark - Definitions
 
+#if !defined(min)
+    #define min(A,B) ( (A) < (B) ? (A):(B))
+#endif
+
 #if !defined(ARRAY_SIZE)
     // Macro to calculate the number of entries in an array
     #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
@@ -83,8 +88,6 @@ static struct
 
 #pragma mark - Variables
 
-extern Sockets s;
-
 static pthread_mutex_t* sslLocks = NULL;
 static pthread_mutex_t sslCoreMutex;
 
@@ -220,84 +223,42 @@ int SSLSocket_connect(SSL* ssl, int sock)
     return rc;
 }
 
-int SSLSocket_getch(SSL* ssl, int socket, char* c)
+int SSLSocket_read(SSL* ssl, int socket, size_t bytes)
 {
     int rc = SOCKET_ERROR;
+    size_t space = 0;
     
     FUNC_ENTRY;
-    if ((rc = SocketBuffer_getQueuedChar(socket, c)) != SOCKETBUFFER_INTERRUPTED)
+    char* buf = SocketBuffer_getReadSpace(socket, bytes, &space);
+    if (buf == NULL)
         goto exit;
     
-    if ((rc = SSL_read(ssl, c, (size_t)1)) < 0)
+    if ((rc = SSL_read(ssl, buf, (int)min(space, INT_MAX))) < 0)
     {
-        int err = SSLSocket_error("SSL_read - getch", ssl, socket, rc);
+        int err = SSLSocket_error("SSL_read - read", ssl, socket, rc);
+        rc = SOCKET_ERROR;
         if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
         {
             rc = TCPSOCKET_INTERRUPTED;
-            SocketBuffer_interrupted(socket, 0);
+            Socket_clearReadable(socket);
         }
     }
     else if (rc == 0)
-        rc = SOCKET_ERROR; 	/* The return value from recv is 0 when the peer has performed an orderly shutdown. */
-    else if (rc == 1)
-    {
-        SocketBuffer_queueChar(socket, *c);
-        rc = TCPSOCKET_COMPLETE;
-    }
-exit:
-    FUNC_EXIT_RC(rc);
-    return rc;
-}
-
-char *SSLSocket_getdata(SSL* ssl, int socket, size_t bytes, size_t* actual_len)
-{
-    int rc;
-    char* buf;
-    
-    FUNC_ENTRY;
-    if (bytes == 0)
-    {
-        buf = SocketBuffer_complete(socket);
-        goto exit;
-    }
-    
-    buf = SocketBuffer_getQueuedData(socket, bytes, actual_len);
-    
-    if ((rc = SSL_read(ssl, buf + (*actual_len), (size_t)(bytes - (*actual_len)))) < 0)
-    {
-        rc = SSLSocket_error("SSL_read - getdata", ssl, socket, rc);
-        if (rc != SSL_ERROR_WANT_READ && rc != SSL_ERROR_WANT_WRITE)
-        {
-            buf = NULL;
-            goto exit;
-        }
-    }
-    else if (rc == 0) /* rc 0 means the other end closed the socket */
-    {
-        buf = NULL;
-        goto exit;
-    }
+        rc = SOCKET_ERROR; 	/* The return value from SSL_read is 0 when the peer has performed an orderly shutdown. */
     else
-        *actual_len += rc;
-    
-    if (*actual_len == bytes)
     {
-        SocketBuffer_complete(socket);
-        /* if we read the whole packet, there might still be data waiting in the SSL buffer, which
-         isn't picked up by select.  So here we should check for any data remaining in the SSL buffer, and
-         if so, add this socket to a new "pending SSL reads" list.
+        SocketBuffer_received(socket, (size_t)rc);
+        rc = TCPSOCKET_COMPLETE;
+        /* there might still be data waiting in the SSL buffer, which isn't picked up by the readiness backend.
+         So here we should check for any data remaining in the SSL buffer, and if so, add this socket to a new
+         "pending SSL reads" list.
          */
         if (SSL_pending(ssl) > 0) /* return no of bytes pending */
             SSLSocket_addPendingRead(socket);
     }
-    else /* we didn't read the whole packet */
-    {
-        SocketBuffer_interrupted(socket, *actual_len);
-        Log(TRACE_MAX, -1, "SSL_read: %d bytes expected but %d bytes now received", bytes, *actual_len);
-    }
 exit:
-    FUNC_EXIT;
-    return buf;
+    FUNC_EXIT_RC(rc);
+    return rc;
 }
 
 int SSLSocket_getPendingRead()
@@ -313,7 +274,7 @@ int SSLSocket_getPendingRead()
 }
 
 /* No SSL_writev() provided by OpenSSL. Boo. */
-int SSLSocket_putdatas(SSL* ssl, int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees)
+int SSLSocket_putdatas(SSL* ssl, int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees, SocketBuffer_stream const* stream)
 {
     int rc = 0;
     int i;
@@ -335,40 +296,53 @@ int SSLSocket_putdatas(SSL* ssl, int socket, char* buf0, size_t buf0len, int cou
         ptr += buflens[i];
     }
     
+    SocketBuffer_lockWrites();
     SSL_lock_mutex(&sslCoreMutex);
-    if ((rc = SSL_write(ssl, iovec.iov_base, iovec.iov_len)) == iovec.iov_len)
-        rc = TCPSOCKET_COMPLETE;
+    write_queue* queue = SocketBuffer_getWrites(socket);
+    if (queue)
+        ++queue->packets;
+    if ((queue && queue->first) || stream)
+        sslerror = SSL_ERROR_WANT_WRITE;    /* packets must go out in order, so queue behind the earlier ones; a streamed payload is written from the queue */
     else
     {
-        sslerror = SSLSocket_error("SSL_write", ssl, socket, rc);
+        if (queue)
+            ++queue->writes;
+        if ((rc = SSL_write(ssl, iovec.iov_base, iovec.iov_len)) == iovec.iov_len)
+            sslerror = SSL_ERROR_NONE;
+        else
+            sslerror = SSLSocket_error("SSL_write", ssl, socket, rc);
+    }
+    
+    if (sslerror == SSL_ERROR_NONE)
+        rc = TCPSOCKET_COMPLETE;
+    else if (sslerror == SSL_ERROR_WANT_WRITE)
+    {
+        int free = 1;
+        size_t const total = iovec.iov_len + ((stream) ? (size_t)stream->length : 0);
         
-        if (sslerror == SSL_ERROR_WANT_WRITE)
+        Log(TRACE_MIN, -1, "Partial write: incomplete write of %d bytes on SSL socket %d",
+            total, socket);
+        if (SocketBuffer_pendingWrite(socket, ssl, 1, &iovec, &free, stream, total, 0) == NULL)
+            rc = SOCKET_ERROR;
+        else
         {
-            int* sockmem = (int*)malloc(sizeof(int));
-            int free = 1;
-            
-            Log(TRACE_MIN, -1, "Partial write: incomplete write of %d bytes on SSL socket %d",
-                iovec.iov_len, socket);
-            SocketBuffer_pendingWrite(socket, ssl, 1, &iovec, &free, iovec.iov_len, 0);
-            *sockmem = socket;
-            ListAppend(s.write_pending, sockmem, sizeof(int));
-            FD_SET(socket, &(s.pending_wset));
+            Socket_startPendingWrite(socket);
             rc = TCPSOCKET_INTERRUPTED;
         }
-        else
-            rc = SOCKET_ERROR;
     }
+    else
+        rc = SOCKET_ERROR;
     SSL_unlock_mutex(&sslCoreMutex);
+    SocketBuffer_unlockWrites();
     
     if (rc != TCPSOCKET_INTERRUPTED)
         free(iovec.iov_base);
     else
-    {
+    {   /* the buffers have been copied, so those handed over can go now */
         int i;
-        free(buf0);
         for (i = 0; i < count; ++i)
         {
-            if (frees[i])
+            if (frees[i] == 1)
                 free(buffers[i]);
         }
     }
@@ -381,10 +355,39 @@ int SSLSocket_continueWrite(pending_writes* pw)
     int rc = 0;
     
     FUNC_ENTRY;
+    write_queue* queue = SocketBuffer_getWrites(pw->socket);
+    if (pw->stream)
+    {   /* the header, then the payload a chunk at a time: an interrupted SSL_write is retried with the same buffer, which is only moved on once written */
+        while (pw->bytes < pw->total)
+        {
+            char* buf = (char*)pw->iovecs[0].iov_base + pw->bytes;
+            long len = (long)(pw->iovecs[0].iov_len - pw->bytes);
+            if (pw->bytes >= pw->iovecs[0].iov_len && (len = SocketBuffer_produce(pw, &buf)) <= 0)
+            {
+                rc = SOCKET_ERROR;
+                goto exit;
+            }
+            if (queue)
+                ++queue->writes;
+            if ((rc = SSL_write(pw->ssl, buf, (int)len)) != len)
+            {
+                int sslerror = SSLSocket_error("SSL_write", pw->ssl, pw->socket, rc);
+                rc = (sslerror == SSL_ERROR_WANT_WRITE) ? 0 : SOCKET_ERROR;
+                goto exit;
+            }
+            pw->bytes += (size_t)len;
+            if (queue)
+                queue->bytes -= (size_t)len;
+        }
+        Log(TRACE_MIN, -1, "SSL continueWrite: streamed payload of %ld bytes written for socket %d", pw->stream->length, pw->socket);
+        rc = 1;
+        goto exit;
+    }
+    
+    if (queue)
+        ++queue->writes;
     if ((rc = SSL_write(pw->ssl, pw->iovecs[0].iov_base, pw->iovecs[0].iov_len)) == pw->iovecs[0].iov_len)
-    {
-        /* topic and payload buffers are freed elsewhere, when all references to them have been removed */
-        free(pw->iovecs[0].iov_base);
+    {   /* the buffer is freed with the packet, by SocketBuffer_freeWrite */
         Log(TRACE_MIN, -1, "SSL continueWrite: partial write now complete for socket %d", pw->socket);
         rc = 1;
     }
@@ -394,6 +397,7 @@ int SSLSocket_continueWrite(pending_writes* pw)
         if (sslerror == SSL_ERROR_WANT_WRITE)
             rc = 0; /* indicate we haven't finished writing the payload yet */
     }
+exit:
     FUNC_EXIT_RC(rc);
     return rc;
 }
@@ -15,25 +15,15 @@ int SSLSocket_setSocketForSSL(networkHandles* net, MQTTClient_SSLOptions* opts);
 int SSLSocket_connect(SSL* ssl, int socket);
 
 /*!
- *  @abstract Reads one byte from a socket.
- *
- *  @param socket the socket to read from.
- *  @param c the character read, returned.
- *  @return completion code.
- */
-int SSLSocket_getch(SSL* ssl, int socket, char* c);
-
-/*!
- *  @abstract Attempts to read a number of bytes from a socket, non-blocking. If a previous read did not finish, then retrieve that data.
+ *  @abstract Reads as much data as is available from a socket into its read buffer (see SocketBuffer_getQueuedData), non-blocking and in one call.
  *
  *  @param socket The socket to read from.
- *  @param bytes The number of bytes to read.
- *  @param actual_len The actual number of bytes read.
- *  @return Completion code.
+ *  @param bytes The number of queued bytes the read buffer must be able to hold.
+ *  @return Completion code, TCPSOCKET_INTERRUPTED if no data was available.
  */
-char *SSLSocket_getdata(SSL* ssl, int socket, size_t bytes, size_t* actual_len);
+int SSLSocket_read(SSL* ssl, int socket, size_t bytes);
 
-int SSLSocket_putdatas(SSL* ssl, int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees);
+int SSLSocket_putdatas(SSL* ssl, int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees, SocketBuffer_stream const* stream);
 
 int SSLSocket_getPendingRead();
 
@@ -3,6 +3,7 @@
 #include "SocketBuffer.h"   // MQTT (Web)
 #include "Messages.h"       // MQTT (Private)
 #include "StackTrace.h"     // MQTT (Utilities)
+#include "Thread.h"         // MQTT (Utilities)
 #if defined(OPENSSL)
 #include "SSLSocket.h"      // OpenSSL
 #endif
@@ -11,6 +12,12 @@
 #include <string.h>         // C Standard
 #include <signal.h>         // C Standard
 #include <ctype.h>          // C Standard
+#include <limits.h>         // C Standard
+#include <sys/time.h>       // POSIX
+#if defined(__linux__)
+#include <sys/eventfd.h>    // Linux
+#include <sys/sendfile.h>   // Linux
+#endif
 
 #include "Heap.h"           // MQTT (Utilities)
 
@@ -18,19 +25,78 @@
 
 int Socket_addSocket(int newSd);
 int Socket_setnonblocking(int sock);
-int isReady(int socket, fd_set* read_set, fd_set* write_set);
+void Socket_setOptions(int sock, int family, Socket_options const* options);
+void Socket_setOption(int sock, int level, int name, int value, char const* description);
+Socket_entry* Socket_findEntry(int socket);
+unsigned char* Socket_getState(int socket);
+unsigned char* Socket_newState(int socket);
+bool Socket_isReady(unsigned char const state);
+void Socket_enqueueReady(int socket, unsigned char* state);
+int Socket_nextReady(void);
+void Socket_pruneReady(void);
+int Socket_poll(struct timeval* timeout);
 int Socket_error(char* aString, int sock);
 char* Socket_getaddrname(struct sockaddr* sa, int sock);
 int Socket_writev(int socket, iobuf* iovecs, int count, size_t* bytes);
-int Socket_continueWrites(fd_set* pwset);
-int Socket_continueWrite(int socket);
+int Socket_sendfile(int socket, pending_writes const* pw, size_t* len, size_t* bytes);
+void Socket_continuePendingWrite(int socket);
+int Socket_continueWrite(int socket, pending_writes** done);
 int Socket_close_only(int socket);
+bool Socket_holdsWrites(int socket);
+void Socket_holdPendingWrite(int socket);
+void Socket_release(int socket, Socket_entry* entry);
+void Socket_releaseHeld(struct timeval* timeout);
+long Socket_heldFor(Socket_entry const* entry, struct timeval const* now);
+void Socket_wantWrite(int socket);
+int Socket_openWakeup(void);
+void Socket_closeWakeup(void);
+void Socket_drainWakeup(void);
+int Socket_resolve(Socket_race* race);
+void Socket_runRaces(struct timeval* timeout);
+long Socket_advanceRace(Socket_race* race, struct timeval const* now);
+int Socket_startAttempt(Socket_race* race, struct timeval const* now);
+void Socket_attemptDone(int socket, Socket_entry* entry);
+void Socket_dropAttempt(int socket, Socket_entry* entry);
+void Socket_dropAttempts(Socket_race* race, int keep);
+void Socket_endRace(Socket_race* race, int winner);
+void Socket_freeRace(Socket_race* race);
+
+#pragma mark - Definitions
+
+#define SOCKET_STATE_OPEN       0x01    // Socket added to the readiness backend.
+#define SOCKET_STATE_READABLE   0x02    // Readable since the last read that would have blocked.
+#define SOCKET_STATE_QUEUED     0x04    // Socket is in s.ready.
+#define SOCKET_STATE_CONNECTING 0x08    // Non-blocking TCP connect in progress.
+#define SOCKET_STATE_CONNECTED  0x10    // TCP connect finished (or failed), not yet handed out.
+#define SOCKET_STATE_WRITING    0x20    // Packets queued for writing in SocketBuffer.
+#define SOCKET_STATE_FULL       0x40    // SOCKETBUFFER_MAX_QUEUED bytes or more queued for writing.
+#define SOCKET_STATE_HELD       0x80    // Queued output held back to be coalesced (see Socket_setMaxWriteDelay).
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+    #define SOCKET_MAX_IOVECS IOV_MAX   // Most buffers handed to a single writev when flushing a write queue.
+#else
+    #define SOCKET_MAX_IOVECS 1024
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+    #define SOCKET_SENDFILE 1           // Payloads streamed from files go from the file to the socket within the kernel.
+#endif
+
+#if !defined(SOCKET_CONNECT_DELAY)
+    #define SOCKET_CONNECT_DELAY 250    // Milliseconds between the starts of connects to different addresses of a host (RFC 8305 "Connection Attempt Delay").
+#endif
+
+#if !defined(SOCKET_COALESCE_BYTES)
+    #define SOCKET_COALESCE_BYTES 65536 // Held output, in bytes, that is written without waiting any longer.
+#endif
 
 #pragma mark - Variables
 
 Sockets s;          // Structure to hold all socket data for the module
-static fd_set wset; //
 static Socket_writeComplete* writecomplete = NULL;  // 
+static int wakeup_fds[2] = { -1, -1 };              // Read and write ends of the self-pipe (the same eventfd on Linux) registered with the readiness backend, to interrupt its wait.
+static pthread_mutex_t socket_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t* socket_mutex = &socket_mutex_store;   // Guards s.ready and s.entries: sockets are added and closed by the send thread while the receive thread waits for readiness.
 
 #pragma mark - Public API
 
@@ -39,25 +105,41 @@ void Socket_outInitialize()
     FUNC_ENTRY;
     signal(SIGPIPE, SIG_IGN);       // For historical reasons; programs expect signal's return value to be defined by <sys/signal.h>.
     
-    SocketBuffer_initialize();
-    s.clientsds = ListInitialize();
-    s.connect_pending = ListInitialize();
-    s.write_pending = ListInitialize();
-    s.cur_clientsds = NULL;
-    FD_ZERO(&(s.rset));            // Initialize the descriptor set
-    FD_ZERO(&(s.pending_wset));
-    s.maxfdp1 = 0;
-    memcpy((void*)&(s.rset_saved), (void*)&(s.rset), sizeof(s.rset_saved));
+    s.count = 0;
+    s.ready = ListInitialize();
+    s.served = 0;
+    s.entries = NULL;
+    s.entrieslen = 0;
+    s.poller = SocketPoll_initialize();
+    s.held = 0;
+    s.races = ListInitialize();
+    if (Socket_openWakeup() == SOCKET_ERROR) { Log(LOG_ERROR, -1, "Could not set up the wakeup descriptor: %s", strerror(errno)); }
     FUNC_EXIT;
 }
 
 void Socket_outTerminate()
 {
     FUNC_ENTRY;
-    ListFree(s.connect_pending);
-    ListFree(s.write_pending);
-    ListFree(s.clientsds);
-    SocketBuffer_terminate();
+    ListFree(s.ready);
+    for (int i = 0; i < s.entrieslen; ++i)
+    {
+        Socket_entry* entry = s.entries[i];
+        if (entry && entry->race && entry->race->socket == i) { Socket_freeRace(entry->race); }
+    }
+    ListFreeNoContent(s.races);
+    SocketResolver_terminate();
+    for (int i = 0; i < s.entrieslen; ++i)
+    {
+        if (s.entries[i] == NULL) { continue; }
+        SocketBuffer_cleanup(i);
+        free(s.entries[i]);
+    }
+    free(s.entries);
+    s.entries = NULL;
+    s.entrieslen = 0;
+    s.count = 0;
+    Socket_closeWakeup();
+    s.poller->terminate();
     FUNC_EXIT;
 }
 
@@ -69,68 +151,31 @@ int Socket_getReadySocket(int more_work, struct timeval *tp)
     struct timeval timeout = one;
     
     FUNC_ENTRY;
-    if (s.clientsds->count == 0) { goto exit; }
-    
     if (more_work) {
         timeout = zero;
     } else if (tp) {
         timeout = *tp;
     }
     
-    while (s.cur_clientsds != NULL)
-    {
-        if (isReady(*((int*)(s.cur_clientsds->content)), &(s.rset), &wset)) { break; }
-        ListNextElement(s.clientsds, &s.cur_clientsds);
-    }
+    Thread_lock_mutex(socket_mutex);
+    if (s.served < s.ready->count) { rc = Socket_nextReady(); }
+    Thread_unlock_mutex(socket_mutex);
     
-    if (s.cur_clientsds == NULL)
-    {
-        int rc1;
-        fd_set pwset;
-        
-        memcpy((void*)&(s.rset), (void*)&(s.rset_saved), sizeof(s.rset));
-        memcpy((void*)&(pwset), (void*)&(s.pending_wset), sizeof(pwset));
-        if ((rc = select(s.maxfdp1, &(s.rset), &pwset, NULL, &timeout)) == SOCKET_ERROR)
-        {
-            Socket_error("read select", 0);
-            goto exit;
-        }
-        Log(TRACE_MAX, -1, "Return code %d from read select", rc);
-        
-        if (Socket_continueWrites(&pwset) == SOCKET_ERROR)
-        {
-            rc = 0;
-            goto exit;
-        }
-        
-        memcpy((void*)&wset, (void*)&(s.rset_saved), sizeof(wset));
-        if ((rc1 = select(s.maxfdp1, NULL, &(wset), NULL, &zero)) == SOCKET_ERROR)
-        {
-            Socket_error("write select", 0);
-            rc = rc1;
-            goto exit;
-        }
-        Log(TRACE_MAX, -1, "Return code %d from write select", rc1);
+    if (rc == 0)
+    {   // Every queued socket had its turn: collect new readiness, without blocking if some sockets are still ready.
+        Thread_lock_mutex(socket_mutex);
+        Socket_pruneReady();
+        if (s.held > 0) { Socket_releaseHeld(&timeout); }
+        if (s.races->count > 0) { Socket_runRaces(&timeout); }
+        if (s.ready->count > 0) { timeout = zero; }
+        s.served = 0;
+        Thread_unlock_mutex(socket_mutex);
         
-        if (rc == 0 && rc1 == 0)
-            goto exit; /* no work to do */
+        if (Socket_poll(&timeout) == SOCKET_ERROR) { goto exit; }
         
-        s.cur_clientsds = s.clientsds->first;
-        while (s.cur_clientsds != NULL)
-        {
-            int cursock = *((int*)(s.cur_clientsds->content));
-            if (isReady(cursock, &(s.rset), &wset))
-                break;
-            ListNextElement(s.clientsds, &s.cur_clientsds);
-        }
-    }
-    
-    if (s.cur_clientsds == NULL)
-        rc = 0;
-    else
-    {
-        rc = *((int*)(s.cur_clientsds->content));
-        ListNextElement(s.clientsds, &s.cur_clientsds);
+        Thread_lock_mutex(socket_mutex);
+        rc = Socket_nextReady();
+        Thread_unlock_mutex(socket_mutex);
     }
     
 exit:
@@ -138,28 +183,30 @@ exit:
     return rc;
 }
 
-int Socket_getch(int socket, char* c)
+int Socket_read(int socket, size_t bytes)
 {
     int rc = SOCKET_ERROR;
+    size_t space = 0;
     
     FUNC_ENTRY;
-    if ((rc = SocketBuffer_getQueuedChar(socket, c)) != SOCKETBUFFER_INTERRUPTED)
-        goto exit;
+    char* buf = SocketBuffer_getReadSpace(socket, bytes, &space);
+    if (buf == NULL) { goto exit; }
     
-    if ((rc = (int)recv(socket, c, (size_t)1, 0)) == SOCKET_ERROR)
+    ssize_t const len = recv(socket, buf, space, 0);
+    if (len == SOCKET_ERROR)
     {
-        int err = Socket_error("recv - getch", socket);
+        int err = Socket_error("recv - read", socket);
         if (err == EWOULDBLOCK || err == EAGAIN)
         {
             rc = TCPSOCKET_INTERRUPTED;
-            SocketBuffer_interrupted(socket, 0);
+            Socket_clearReadable(socket);
         }
     }
-    else if (rc == 0)
-        rc = SOCKET_ERROR; 	// The return value from recv is 0 when the peer has performed an orderly shutdown.
-    else if (rc == 1)
+    else if (len == 0)
+        rc = SOCKET_ERROR;  // The return value from recv is 0 when the peer has performed an orderly shutdown.
+    else
     {
-        SocketBuffer_queueChar(socket, *c);
+        SocketBuffer_received(socket, (size_t)len);
         rc = TCPSOCKET_COMPLETE;
     }
 exit:
@@ -167,74 +214,21 @@ exit:
     return rc;
 }
 
-char* Socket_getdata(int socket, size_t bytes, size_t* actual_len)
-{
-    int rc;
-    
-    FUNC_ENTRY;
-    char* buf;
-    
-    if (bytes == 0)
-    {
-        buf = SocketBuffer_complete(socket);
-        goto exit;
-    }
-    
-    buf = SocketBuffer_getQueuedData(socket, bytes, actual_len);
-    
-    if ((rc = (int)recv(socket, buf + (*actual_len), (size_t)(bytes - (*actual_len)), 0)) == SOCKET_ERROR)
-    {
-        rc = Socket_error("recv - getdata", socket);
-        if (rc != EAGAIN && rc != EWOULDBLOCK)
-        {
-            buf = NULL;
-            goto exit;
-        }
-    }
-    else if (rc == 0) /* rc 0 means the other end closed the socket, albeit "gracefully" */
-    {
-        buf = NULL;
-        goto exit;
-    }
-    else
-        *actual_len += rc;
-    
-    if (*actual_len == bytes)
-    {
-        SocketBuffer_complete(socket);
-    }
-    else /* we didn't read the whole packet */
-    {
-        SocketBuffer_interrupted(socket, *actual_len);
-        Log(TRACE_MAX, -1, "%d bytes expected but %d bytes now received", bytes, *actual_len);
-    }
-exit:
-    FUNC_EXIT;
-    return buf;
-}
-
-int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees)
+int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees, SocketBuffer_stream const* stream)
 {
     size_t bytes = 0L;
-    size_t total = buf0len;
+    size_t total = buf0len + ((stream) ? (size_t)stream->length : 0);
     
     iobuf iovecs[5];
     int frees1[5];
     int rc = TCPSOCKET_INTERRUPTED;
     
     FUNC_ENTRY;
-    if (!Socket_noPendingWrites(socket))
-    {
-        Log(LOG_SEVERE, -1, "Trying to write to socket %d for which there is already pending output", socket);
-        rc = SOCKET_ERROR;
-        goto exit;
-    }
-    
     for (int i = 0; i < count; i++) { total += buflens[i]; }
     
     iovecs[0].iov_base = buf0;
     iovecs[0].iov_len = buf0len;
-    frees1[0] = 1;
+    frees1[0] = SOCKETBUFFER_COPY;
     for (int i = 0; i < count; i++)
     {
         iovecs[i+1].iov_base = buffers[i];
@@ -242,28 +236,36 @@ int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** bu
         frees1[i+1] = frees[i];
     }
     
-    if ((rc = Socket_writev(socket, iovecs, count+1, &bytes)) != SOCKET_ERROR)
+    SocketBuffer_lockWrites();
+    write_queue* queue = SocketBuffer_getWrites(socket);
+    if (queue) { ++queue->packets; }
+    
+    // Packets must go out in order, so nothing is written while earlier ones are still queued. A streamed payload is left to the thread writing queued packets.
+    bool const hold = Socket_holdsWrites(socket);
+    if (!hold && stream == NULL && SocketBuffer_getWrite(socket) == NULL && (rc = Socket_writev(socket, iovecs, count+1, &bytes)) == SOCKET_ERROR) { goto unlock; }
+    
+    if (bytes == total)
     {
-        if (bytes == total)
-        {
-            rc = TCPSOCKET_COMPLETE;
-        }
-        else
-        {
-            int* sockmem = (int*)malloc(sizeof(int));
-            Log(TRACE_MIN, -1, "Partial write: %ld bytes of %d actually written on socket %d", bytes, total, socket);
-            #if defined(OPENSSL)
-            SocketBuffer_pendingWrite(socket, NULL, count+1, iovecs, frees1, total, bytes);
-            #else
-            SocketBuffer_pendingWrite(socket, count+1, iovecs, frees1, total, bytes);
-            #endif
-            *sockmem = socket;
-            ListAppend(s.write_pending, sockmem, sizeof(int));
-            FD_SET(socket, &(s.pending_wset));
-            rc = TCPSOCKET_INTERRUPTED;
+        rc = TCPSOCKET_COMPLETE;
+    }
+    else
+    {
+        if (!hold && !stream) { Log(TRACE_MIN, -1, "Partial write: %ld bytes of %d actually written on socket %d", bytes, total, socket); }
+        #if defined(OPENSSL)
+        pending_writes* pw = SocketBuffer_pendingWrite(socket, NULL, count+1, iovecs, frees1, stream, total, bytes);
+        #else
+        pending_writes* pw = SocketBuffer_pendingWrite(socket, count+1, iovecs, frees1, stream, total, bytes);
+        #endif
+        if (pw == NULL) { rc = SOCKET_ERROR; goto unlock; }
+        if (hold) {
+            Socket_holdPendingWrite(socket);
+        } else {
+            Socket_startPendingWrite(socket);
         }
+        rc = TCPSOCKET_INTERRUPTED;
     }
-exit:
+unlock:
+    SocketBuffer_unlockWrites();
     FUNC_EXIT_RC(rc);
     return rc;
 }
@@ -271,154 +273,203 @@ exit:
 void Socket_close(int socket)
 {
     FUNC_ENTRY;
-    Socket_close_only(socket);
-    FD_CLR(socket, &(s.rset_saved));
-    if (FD_ISSET(socket, &(s.pending_wset))) { FD_CLR(socket, &(s.pending_wset)); }
-    if (s.cur_clientsds != NULL && *(int*)(s.cur_clientsds->content) == socket) { s.cur_clientsds = s.cur_clientsds->next; }
-    ListRemoveItem(s.connect_pending, &socket, intcompare);
-    ListRemoveItem(s.write_pending, &socket, intcompare);
+    int removed = 0;
+    
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry* entry = Socket_findEntry(socket);
+    if (entry && (entry->state & SOCKET_STATE_OPEN))
+    {   // Forget the socket before its descriptor can be reused.
+        if (entry->race) {
+            Socket_freeRace(entry->race);   // A placeholder, never watched by the readiness backend.
+        } else {
+            s.poller->remove(socket);
+        }
+        if (entry->state & SOCKET_STATE_QUEUED) { ListRemoveItem(s.ready, &socket, intcompare); }
+        if (entry->state & SOCKET_STATE_HELD) { --s.held; }
+        entry->state = 0;
+        entry->client = NULL;
+        --s.count;
+        removed = 1;
+    }
+    Thread_unlock_mutex(socket_mutex);
+    
     SocketBuffer_cleanup(socket);
+    Socket_close_only(socket);
     
-    if (ListRemoveItem(s.clientsds, &socket, intcompare)) {
+    if (removed) {
         Log(TRACE_MIN, -1, "Removed socket %d", socket);
     } else {
         Log(LOG_ERROR, -1, "Failed to remove socket %d", socket);
     }
-    
-    if (socket + 1 >= s.maxfdp1)
-    {
-        /* now we have to reset s.maxfdp1 */
-        ListElement* cur_clientsds = NULL;
-        
-        s.maxfdp1 = 0;
-        while (ListNextElement(s.clientsds, &cur_clientsds))
-            s.maxfdp1 = max(*((int*)(cur_clientsds->content)), s.maxfdp1);
-        ++(s.maxfdp1);
-        Log(TRACE_MAX, -1, "Reset max fdp1 to %d", s.maxfdp1);
-    }
     FUNC_EXIT;
 }
 
-int Socket_new(char* addr, int port, int* sock)
+int Socket_new(char* addr, int port, Socket_options const* options, int* sock)
 {
-    int type = SOCK_STREAM;
-    struct sockaddr_in address;
-    #if defined(AF_INET6)
-    struct sockaddr_in6 address6;
-    #endif
-    sa_family_t family = AF_INET;
+    Socket_race* race = NULL;
+    int rc = SOCKET_ERROR;
     
     FUNC_ENTRY;
     *sock = -1;
     
     if (addr[0] == '[') { ++addr; }
     
-    struct addrinfo *result = NULL;
-    struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
-    int rc = getaddrinfo(addr, NULL, &hints, &result);
-    if (rc == 0)
+    if ((race = malloc(sizeof(Socket_race))) == NULL || (race->host = malloc(strlen(addr) + 1)) == NULL)
     {
-        struct addrinfo* res = result;
-        
-        // Prefer ip4 addresses
-        while (res)
-        {
-            if (res->ai_family == AF_INET)
-            {
-                result = res;
-                break;
-            }
-            res = res->ai_next;
-        }
-        
-        if (result == NULL)
-            rc = -1;
-        else
-            #if defined(AF_INET6)
-            if (result->ai_family == AF_INET6)
-            {
-                address6.sin6_port = htons(port);
-                address6.sin6_family = family = AF_INET6;
-                address6.sin6_addr = ((struct sockaddr_in6*)(result->ai_addr))->sin6_addr;
-            }
-            else
-            #endif
-                if (result->ai_family == AF_INET)
-                {
-                    address.sin_port = htons(port);
-                    address.sin_family = family = AF_INET;
-                    address.sin_addr = ((struct sockaddr_in*)(result->ai_addr))->sin_addr;
-                    //address.sin_len = result->ai_addrlen;
-                }
-                else
-                    rc = -1;
+        if (race) { free(race); }
+        race = NULL;
+        goto exit;
+    }
+    strcpy(race->host, addr);
+    race->socket = -1;
+    race->port = port;
+    race->next = race->attempts = race->error = 0;
+    timerclear(&race->started);
+    if (options) {
+        race->options = *options;
+    } else {
+        memset(&race->options, 0, sizeof(Socket_options));
+    }
+    if (Socket_resolve(race) == SOCKET_ERROR)
+    {
+        Log(LOG_ERROR, -1, "%s is not a valid IP address", addr);
+        goto exit;
+    }
+    
+    // The caller gets a descriptor straight away. The connect that wins the race is moved onto it.
+    if ((*sock = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET)
+    {
+        Socket_error("socket", *sock);
+        goto exit;
+    }
+    
+    Thread_lock_mutex(socket_mutex);
+    unsigned char* state = Socket_newState(*sock);
+    if (state)
+    {
+        *state = SOCKET_STATE_OPEN | SOCKET_STATE_CONNECTING;
+        Socket_entry* entry = Socket_findEntry(*sock);
+        entry->race = race;
+        entry->quickack = (race->options.quickack != 0);
+        race->socket = *sock;
+        ++s.count;
+        ListAppend(s.races, race, sizeof(Socket_race));
+        Log(TRACE_MIN, -1, "New socket %d for %s, port %d", *sock, addr, port);
         
-        freeaddrinfo(result);
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        Socket_advanceRace(race, &now);     // Connect now if the addresses are known already.
+        Socket_wakeup();                    // The thread waiting for readiness has to know when the next connect of the race is due.
+        race = NULL;
+        rc = EINPROGRESS;
     }
-    else
-        Log(LOG_ERROR, -1, "getaddrinfo failed for addr %s with rc %d", addr, rc);
+    Thread_unlock_mutex(socket_mutex);
     
-    if (rc != 0)
-        Log(LOG_ERROR, -1, "%s is not a valid IP address", addr);
-    else
+    if (rc == SOCKET_ERROR)
     {
-        *sock =	socket(family, type, 0);
-        if (*sock == INVALID_SOCKET)
-        {
-            rc = Socket_error("socket", *sock);
-        }
-        else
-        {
-            #if defined(NOSIGPIPE)
-            int opt = 1;
-            
-            if (setsockopt(*sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
-                Log(LOG_ERROR, -1, "Could not set SO_NOSIGPIPE for socket %d", *sock);
-            #endif
-            
-            Log(TRACE_MIN, -1, "New socket %d for %s, port %d",	*sock, addr, port);
-            if (Socket_addSocket(*sock) == SOCKET_ERROR)
-                rc = Socket_error("setnonblocking", *sock);
-            else
-            {
-                /* this could complete immmediately, even though we are non-blocking */
-                if (family == AF_INET) {
-                    rc = connect(*sock, (struct sockaddr*)&address, sizeof(address));
-                }
-                #if defined(AF_INET6)
-                else {
-                    rc = connect(*sock, (struct sockaddr*)&address6, sizeof(address6));
-                }
-                #endif
-                
-                if (rc == SOCKET_ERROR)
-                {
-                    rc = (errno == EINPROGRESS || errno == EWOULDBLOCK) ? errno : Socket_error("connect", *sock);
-                }
-                
-                if (rc == EINPROGRESS || rc == EWOULDBLOCK)
-                {
-                    int* pnewSd = (int*)malloc(sizeof(int));
-                    *pnewSd = *sock;
-                    ListAppend(s.connect_pending, pnewSd, sizeof(int));
-                    Log(TRACE_MIN, 15, "Connect pending");
-                }
-            }
-        }
+        close(*sock);
+        *sock = -1;
+    }
+exit:
+    if (race)
+    {
+        free(race->host);
+        free(race);
+    }
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+int Socket_newUnix(char const* path, Socket_options const* options, int* sock)
+{
+    struct sockaddr_un address;
+    int rc = SOCKET_ERROR;
+    
+    FUNC_ENTRY;
+    *sock = -1;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        Log(LOG_ERROR, -1, "Unix socket path %s is too long", path);
+        goto exit;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    
+    if ((*sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET)
+    {
+        rc = Socket_error("socket", *sock);
+        goto exit;
+    }
+    
+    #if defined(NOSIGPIPE)
+    int opt = 1;
+    if (setsockopt(*sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
+        Log(LOG_ERROR, -1, "Could not set SO_NOSIGPIPE for socket %d", *sock);
+    #endif
+    Socket_setOptions(*sock, AF_UNIX, options);
+    
+    Log(TRACE_MIN, -1, "New socket %d for %s", *sock, path);
+    if (Socket_addSocket(*sock) == SOCKET_ERROR)
+    {
+        rc = Socket_error("setnonblocking", *sock);
+        goto exit;
     }
+    
+    // A full listen backlog is reported as EAGAIN, the same value as EWOULDBLOCK: unlike TCP, nothing is left in progress to wait for, so it fails like any other error, for the next server URI to be tried.
+    if ((rc = connect(*sock, (struct sockaddr*)&address, sizeof(address))) == SOCKET_ERROR) {
+        if ((rc = Socket_error("connect", *sock)) != EINPROGRESS) { rc = SOCKET_ERROR; }
+    }
+exit:
     FUNC_EXIT_RC(rc);
     return rc;
 }
 
+int Socket_connectError(int socket)
+{
+    int error = 0;
+    int raced = 0;
+    
+    FUNC_ENTRY;
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry const* entry = Socket_findEntry(socket);
+    if (entry && entry->race)
+    {   // Still racing, or every address failed.
+        error = (ListFind(s.races, entry->race)) ? EINPROGRESS : entry->race->error;
+        raced = 1;
+    }
+    Thread_unlock_mutex(socket_mutex);
+    
+    if (!raced)
+    {
+        socklen_t len = sizeof(error);
+        if (getsockopt(socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len) == SOCKET_ERROR) { error = Socket_error("getsockopt", socket); }
+    }
+    FUNC_EXIT_RC(error);
+    return error;
+}
+
 int Socket_noPendingWrites(int socket)
 {
-    int cursock = socket;
-    return ListFindItem(s.write_pending, &cursock, intcompare) == NULL;
+    Thread_lock_mutex(socket_mutex);
+    unsigned char const* state = Socket_getState(socket);
+    int const rc = (state == NULL || !(*state & SOCKET_STATE_WRITING));
+    Thread_unlock_mutex(socket_mutex);
+    return rc;
+}
+
+int Socket_queueFull(int socket)
+{
+    Thread_lock_mutex(socket_mutex);
+    unsigned char const* state = Socket_getState(socket);
+    int const rc = (state && (*state & SOCKET_STATE_FULL));
+    Thread_unlock_mutex(socket_mutex);
+    return rc;
 }
 
 char* Socket_getpeer(int sock)
 {
-    struct sockaddr_in6 sa;
+    struct sockaddr_storage sa;
     socklen_t sal = sizeof(sa);
     int rc;
     
@@ -433,13 +484,117 @@ char* Socket_getpeer(int sock)
 
 void Socket_addPendingWrite(int socket)
 {
-    FD_SET(socket, &(s.pending_wset));
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry const* entry = Socket_findEntry(socket);
+    if (entry && (entry->state & SOCKET_STATE_OPEN) && entry->race == NULL) { Socket_wantWrite(socket); }
+    Thread_unlock_mutex(socket_mutex);
 }
 
 void Socket_clearPendingWrite(int socket)
 {
-    if (FD_ISSET(socket, &(s.pending_wset)))
-        FD_CLR(socket, &(s.pending_wset));
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry const* entry = Socket_findEntry(socket);
+    if (entry && (entry->state & SOCKET_STATE_OPEN) && !(entry->state & (SOCKET_STATE_CONNECTING|SOCKET_STATE_WRITING)) && entry->race == NULL) {
+        s.poller->setWriteInterest(socket, 0);
+    }
+    Thread_unlock_mutex(socket_mutex);
+}
+
+void Socket_startPendingWrite(int socket)
+{
+    write_queue const* queue = SocketBuffer_getWrites(socket);
+    size_t const queued = (queue) ? queue->bytes : 0;
+    
+    Thread_lock_mutex(socket_mutex);
+    unsigned char* state = Socket_getState(socket);
+    if (state && (*state & SOCKET_STATE_OPEN))
+    {
+        *state |= SOCKET_STATE_WRITING;
+        if (queued >= SOCKETBUFFER_MAX_QUEUED) { *state |= SOCKET_STATE_FULL; }
+        if (*state & SOCKET_STATE_HELD) { Socket_release(socket, Socket_findEntry(socket)); }
+        Socket_wantWrite(socket);
+    }
+    Thread_unlock_mutex(socket_mutex);
+}
+
+void Socket_clearReadable(int socket)
+{
+    Thread_lock_mutex(socket_mutex);
+    unsigned char* state = Socket_getState(socket);
+    if (state) { *state &= ~SOCKET_STATE_READABLE; }
+    Thread_unlock_mutex(socket_mutex);
+}
+
+Socket_entry* Socket_getEntry(int socket)
+{
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry* entry = Socket_findEntry(socket);
+    Thread_unlock_mutex(socket_mutex);
+    return entry;
+}
+
+void Socket_setClient(int socket, void* client)
+{
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry* entry = Socket_findEntry(socket);
+    if (entry && (entry->state & SOCKET_STATE_OPEN)) { entry->client = client; }
+    Thread_unlock_mutex(socket_mutex);
+}
+
+void* Socket_getClient(int socket)
+{
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry* entry = Socket_findEntry(socket);
+    void* client = (entry && (entry->state & SOCKET_STATE_OPEN)) ? entry->client : NULL;
+    Thread_unlock_mutex(socket_mutex);
+    return client;
+}
+
+void Socket_setMaxWriteDelay(int socket, int maxdelay)
+{
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry* entry = Socket_findEntry(socket);
+    if (entry && (entry->state & SOCKET_STATE_OPEN)) { entry->maxdelay = max(maxdelay, 0); }
+    Thread_unlock_mutex(socket_mutex);
+}
+
+void Socket_flush(int socket)
+{
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry* entry = Socket_findEntry(socket);
+    if (entry && (entry->state & SOCKET_STATE_HELD)) { Socket_release(socket, entry); }
+    Thread_unlock_mutex(socket_mutex);
+}
+
+int Socket_getWriteStats(int socket, unsigned long* packets, unsigned long* writes)
+{
+    int rc = 0;
+    
+    *packets = *writes = 0;
+    SocketBuffer_lockWrites();
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry* entry = Socket_findEntry(socket);
+    if (entry && (entry->state & SOCKET_STATE_OPEN))
+    {
+        *packets = entry->writes.packets;
+        *writes = entry->writes.writes;
+        rc = 1;
+    }
+    Thread_unlock_mutex(socket_mutex);
+    SocketBuffer_unlockWrites();
+    return rc;
+}
+
+void Socket_wakeup(void)
+{
+    if (wakeup_fds[1] == -1) { return; }
+    
+    #if defined(__linux__)
+    uint64_t const one = 1;
+    #else
+    char const one = 0;
+    #endif
+    if (write(wakeup_fds[1], &one, sizeof(one)) == SOCKET_ERROR && errno != EAGAIN) { Socket_error("write - wakeup", wakeup_fds[1]); }  // A full pipe already holds a wakeup.
 }
 
 void Socket_setWriteCompleteCallback(Socket_writeComplete* mywritecomplete)
@@ -459,18 +614,26 @@ int Socket_addSocket(int newSd)
     int rc = 0;
     
     FUNC_ENTRY;
-    if (ListFindItem(s.clientsds, &newSd, intcompare) == NULL) /* make sure we don't add the same socket twice */
+    Thread_lock_mutex(socket_mutex);
+    unsigned char* state = Socket_getState(newSd);
+    if (state && (*state & SOCKET_STATE_OPEN)) /* make sure we don't add the same socket twice */
     {
-        int* pnewSd = (int*)malloc(sizeof(newSd));
-        *pnewSd = newSd;
-        ListAppend(s.clientsds, pnewSd, sizeof(newSd));
-        FD_SET(newSd, &(s.rset_saved));
-        s.maxfdp1 = max(s.maxfdp1, newSd + 1);
-        rc = Socket_setnonblocking(newSd);
-    }
-    else
         Log(LOG_ERROR, -1, "addSocket: socket %d already in the list", newSd);
+        Thread_unlock_mutex(socket_mutex);
+        goto exit;
+    }
+    
+    if ((state = Socket_newState(newSd)) == NULL || s.poller->add(newSd) == SOCKET_ERROR) {
+        rc = SOCKET_ERROR;
+    } else {
+        *state = SOCKET_STATE_OPEN;
+        ++s.count;
+        if (!s.poller->live_interest) { Socket_wakeup(); }
+    }
+    Thread_unlock_mutex(socket_mutex);
     
+    if (rc == 0) { rc = Socket_setnonblocking(newSd); }
+exit:
     FUNC_EXIT_RC(rc);
     return rc;
 }
@@ -496,43 +659,300 @@ int Socket_setnonblocking(int sock)
 }
 
 /*!
- *  @abstract Don't accept work from a client unless it is accepting work back, i.e. its socket is writeable this seems like a reasonable form of flow control, and practically, seems to work.
+ *  @abstract Apply the options of a connection to a new socket, before it connects.
+ *  @discussion A failure only leaves the socket less tuned than asked, so it is logged and otherwise ignored.
  *
- *  @param socket the socket to check
- *  @param read_set the socket read set (see select doc)
- *  @param write_set the socket write set (see select doc)
- *  @return boolean - is the socket ready to go?
+ *  @param sock the socket.
+ *  @param family the address family of the socket: the TCP options are skipped for AF_UNIX.
+ *  @param options the options, or NULL to leave the system defaults.
  */
-int isReady(int socket, fd_set* read_set, fd_set* write_set)
+void Socket_setOptions(int sock, int family, Socket_options const* options)
 {
-    int rc = 1;
+    if (options == NULL) { return; }
     
     FUNC_ENTRY;
-    if  (ListFindItem(s.connect_pending, &socket, intcompare) && FD_ISSET(socket, write_set))
-        ListRemoveItem(s.connect_pending, &socket, intcompare);
-    else
-        rc = FD_ISSET(socket, read_set) && FD_ISSET(socket, write_set) && Socket_noPendingWrites(socket);
-    FUNC_EXIT_RC(rc);
-    return rc;
+    if (options->sndbuf > 0) { Socket_setOption(sock, SOL_SOCKET, SO_SNDBUF, options->sndbuf, "SO_SNDBUF"); }
+    if (options->rcvbuf > 0) { Socket_setOption(sock, SOL_SOCKET, SO_RCVBUF, options->rcvbuf, "SO_RCVBUF"); }
+    if (family == AF_UNIX) { goto exit; }
+    
+    if (options->nodelay) { Socket_setOption(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY"); }
+    if (options->keepalive)
+    {
+        Socket_setOption(sock, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+        #if defined(TCP_KEEPIDLE)
+        if (options->keepidle > 0) { Socket_setOption(sock, IPPROTO_TCP, TCP_KEEPIDLE, options->keepidle, "TCP_KEEPIDLE"); }
+        #elif defined(TCP_KEEPALIVE)
+        if (options->keepidle > 0) { Socket_setOption(sock, IPPROTO_TCP, TCP_KEEPALIVE, options->keepidle, "TCP_KEEPALIVE"); }
+        #endif
+        #if defined(TCP_KEEPINTVL)
+        if (options->keepintvl > 0) { Socket_setOption(sock, IPPROTO_TCP, TCP_KEEPINTVL, options->keepintvl, "TCP_KEEPINTVL"); }
+        #endif
+        #if defined(TCP_KEEPCNT)
+        if (options->keepcnt > 0) { Socket_setOption(sock, IPPROTO_TCP, TCP_KEEPCNT, options->keepcnt, "TCP_KEEPCNT"); }
+        #endif
+    }
+    #if defined(TCP_USER_TIMEOUT)
+    if (options->usertimeout > 0) { Socket_setOption(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, options->usertimeout, "TCP_USER_TIMEOUT"); }
+    #endif
+    #if defined(TCP_QUICKACK)
+    if (options->quickack) { Socket_setOption(sock, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK"); }
+    #endif
+exit:
+    FUNC_EXIT;
 }
 
 /*!
- *  @abstract Gets the specific error corresponding to SOCKET_ERROR
+ *  @abstract Set an integer socket option, logging a failure.
  *
- *  @param aString the function that was being used when the error occurred
- *  @param sock the socket on which the error occurred
- *  @return the specific TCP error code
+ *  @param sock the socket.
+ *  @param level the protocol level (SOL_SOCKET, IPPROTO_TCP).
+ *  @param name the option.
+ *  @param value the value.
+ *  @param description the name of the option to log.
  */
-int Socket_error(char* aString, int sock)
+void Socket_setOption(int sock, int level, int name, int value, char const* description)
 {
+    if (setsockopt(sock, level, name, (void*)&value, sizeof(value)) != 0)
+        Log(LOG_ERROR, -1, "Could not set %s to %d for socket %d", description, value, sock);
+}
 
-	FUNC_ENTRY;
-	if (errno != EINTR && errno != EAGAIN && errno != EINPROGRESS && errno != EWOULDBLOCK)
-	{
-		if (strcmp(aString, "shutdown") != 0 || (errno != ENOTCONN && errno != ECONNRESET))
-			Log(TRACE_MINIMUM, -1, "Socket error %s in %s for socket %d", strerror(errno), aString, sock);
-	}
-	FUNC_EXIT_RC(errno);
+/*!
+ *  @abstract Get the table entry of a socket.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param socket the socket.
+ *  @return the entry, or NULL if the socket was never added.
+ */
+Socket_entry* Socket_findEntry(int socket)
+{
+    return (socket >= 0 && socket < s.entrieslen) ? s.entries[socket] : NULL;
+}
+
+/*!
+ *  @abstract Get the state flags of a socket.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param socket the socket.
+ *  @return pointer to the state flags, or NULL if the socket was never added.
+ */
+unsigned char* Socket_getState(int socket)
+{
+    Socket_entry* entry = Socket_findEntry(socket);
+    return (entry) ? &entry->state : NULL;
+}
+
+/*!
+ *  @abstract Get the state flags of a socket being added, growing the socket table if needed.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param socket the socket.
+ *  @return pointer to the (zeroed) state flags, or NULL if memory could not be allocated.
+ */
+unsigned char* Socket_newState(int socket)
+{
+    if (socket < 0) { return NULL; }
+    
+    if (socket >= s.entrieslen)
+    {
+        int newlen = max(s.entrieslen * 2, 64);
+        while (newlen <= socket) { newlen *= 2; }
+        
+        size_t const size = (size_t)newlen * sizeof(Socket_entry*);
+        Socket_entry** entries = (s.entries) ? realloc(s.entries, size) : malloc(size);
+        if (entries == NULL) { return NULL; }
+        memset(entries + s.entrieslen, 0, (size_t)(newlen - s.entrieslen) * sizeof(Socket_entry*));
+        s.entries = entries;
+        s.entrieslen = newlen;
+    }
+    
+    Socket_entry* entry = s.entries[socket];
+    if (entry == NULL)
+    {
+        if ((entry = malloc(sizeof(Socket_entry))) == NULL) { return NULL; }
+        entry->queue = NULL;
+        entry->writes.first = entry->writes.last = NULL;
+        entry->writes.bytes = 0;
+        entry->writes.segments = 0;
+        entry->writes.ids = 0;  // Kept when the socket number is reused, so packet ids stay unique.
+        s.entries[socket] = entry;
+    }
+    entry->state = 0;
+    entry->maxdelay = 0;
+    entry->writes.packets = entry->writes.writes = 0;
+    entry->client = NULL;
+    entry->race = NULL;
+    entry->quickack = 0;
+    return &entry->state;
+}
+
+/*!
+ *  @abstract Don't accept work from a client unless it is accepting work back, i.e. its write queue is not full. This seems like a reasonable form of flow control, and practically, seems to work.
+ *
+ *  @param state the socket state flags.
+ *  @return boolean - is the socket ready to go?
+ */
+bool Socket_isReady(unsigned char const state)
+{
+    if (state & SOCKET_STATE_CONNECTED) { return true; }
+    return (state & SOCKET_STATE_READABLE) && !(state & (SOCKET_STATE_CONNECTING|SOCKET_STATE_FULL));
+}
+
+/*!
+ *  @abstract Put a socket at the back of the ready list, unless it is already there.
+ *  @note Call with socket_mutex held.
+ */
+void Socket_enqueueReady(int socket, unsigned char* state)
+{
+    if (*state & SOCKET_STATE_QUEUED) { return; }
+    
+    int* psocket = (int*)malloc(sizeof(int));
+    *psocket = socket;
+    ListAppend(s.ready, psocket, sizeof(int));
+    *state |= SOCKET_STATE_QUEUED;
+}
+
+/*!
+ *  @abstract Take the next socket that is ready from the front of the ready list.
+ *  @discussion A socket that is still readable goes to the back of the list, so ready sockets are served round robin. Sockets that are not ready any more are dropped from the list.
+ *  @note Call with socket_mutex held.
+ *
+ *  @return the socket, or 0 if none is ready.
+ */
+int Socket_nextReady(void)
+{
+    int* psocket;
+    
+    while ((psocket = ListDetachHead(s.ready)) != NULL)
+    {
+        int const socket = *psocket;
+        unsigned char* state = Socket_getState(socket);
+        
+        if (state == NULL || !Socket_isReady(*state))
+        {
+            if (state) { *state &= ~SOCKET_STATE_QUEUED; }
+            free(psocket);
+            continue;
+        }
+        
+        *state &= ~SOCKET_STATE_CONNECTED;
+        if (*state & SOCKET_STATE_READABLE) {
+            #if defined(TCP_QUICKACK)
+            if (Socket_findEntry(socket)->quickack) { Socket_setOption(socket, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK"); }
+            #endif
+            ListAppend(s.ready, psocket, sizeof(int));
+        } else {
+            *state &= ~SOCKET_STATE_QUEUED;
+            free(psocket);
+        }
+        ++s.served;
+        return socket;
+    }
+    return 0;
+}
+
+/*!
+ *  @abstract Drop the sockets that are not ready any more from the ready list.
+ *  @note Call with socket_mutex held.
+ */
+void Socket_pruneReady(void)
+{
+    ListElement* current = s.ready->first;
+    
+    while (current)
+    {
+        ListElement* next = current->next;
+        int const socket = *(int*)(current->content);
+        unsigned char* state = Socket_getState(socket);
+        
+        if (state == NULL || !Socket_isReady(*state))
+        {
+            if (state) { *state &= ~SOCKET_STATE_QUEUED; }
+            ListRemove(s.ready, current->content);
+        }
+        current = next;
+    }
+}
+
+/*!
+ *  @abstract Wait for readiness changes and apply them: mark sockets readable, complete connects and continue partial writes.
+ *
+ *  @param timeout the longest time to wait.
+ *  @return completion code.
+ */
+int Socket_poll(struct timeval* timeout)
+{
+    SocketPoll_event events[SOCKETPOLL_MAX_EVENTS];
+    int writers[SOCKETPOLL_MAX_EVENTS];
+    int nwriters = 0;
+    int rc;
+    
+    FUNC_ENTRY;
+    if ((rc = s.poller->wait(timeout, events, SOCKETPOLL_MAX_EVENTS)) == SOCKET_ERROR)
+    {
+        Socket_error("poll", 0);
+        goto exit;
+    }
+    Log(TRACE_MAX, -1, "Return code %d from %s", rc, s.poller->name);
+    
+    Thread_lock_mutex(socket_mutex);
+    for (int i = 0; i < rc; ++i)
+    {
+        int const socket = events[i].socket;
+        if (socket == wakeup_fds[0])
+        {
+            Socket_drainWakeup();
+            continue;
+        }
+        
+        Socket_entry* entry = Socket_findEntry(socket);
+        if (entry == NULL || !(entry->state & SOCKET_STATE_OPEN)) { continue; }   // Closed while we were waiting.
+        if (entry->race)
+        {   // One of the connects racing for a socket handed out by Socket_new.
+            if (socket != entry->race->socket && (events[i].events & (SOCKETPOLL_WRITE|SOCKETPOLL_ERROR))) { Socket_attemptDone(socket, entry); }
+            continue;
+        }
+        
+        unsigned char* state = &entry->state;
+
+        // Errors are picked up by the next read or write, so let both happen.
+        if (events[i].events & (SOCKETPOLL_READ|SOCKETPOLL_ERROR)) { *state |= SOCKET_STATE_READABLE; }
+        if (events[i].events & (SOCKETPOLL_WRITE|SOCKETPOLL_ERROR))
+        {
+            if (*state & SOCKET_STATE_CONNECTING)
+            {
+                *state = (*state & ~SOCKET_STATE_CONNECTING) | SOCKET_STATE_CONNECTED;
+                if (!(*state & SOCKET_STATE_WRITING)) { s.poller->setWriteInterest(socket, 0); }
+            }
+            if (*state & SOCKET_STATE_WRITING) { writers[nwriters++] = socket; }
+        }
+        if (Socket_isReady(*state)) { Socket_enqueueReady(socket, state); }
+    }
+    Thread_unlock_mutex(socket_mutex);
+    
+    for (int i = 0; i < nwriters; ++i) { Socket_continuePendingWrite(writers[i]); }
+    rc = 0;
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+/*!
+ *  @abstract Gets the specific error corresponding to SOCKET_ERROR
+ *
+ *  @param aString the function that was being used when the error occurred
+ *  @param sock the socket on which the error occurred
+ *  @return the specific TCP error code
+ */
+int Socket_error(char* aString, int sock)
+{
+
+	FUNC_ENTRY;
+	if (errno != EINTR && errno != EAGAIN && errno != EINPROGRESS && errno != EWOULDBLOCK)
+	{
+		if (strcmp(aString, "shutdown") != 0 || (errno != ENOTCONN && errno != ECONNRESET))
+			Log(TRACE_MINIMUM, -1, "Socket error %s in %s for socket %d", strerror(errno), aString, sock);
+	}
+	FUNC_EXIT_RC(errno);
 	return errno;
 }
 
@@ -552,7 +972,17 @@ char* Socket_getaddrname(struct sockaddr* sa, int sock)
      * maximum length of the port string
      */
 #define PORTLEN 10
-    static char addr_string[ADDRLEN + PORTLEN];
+    /*!
+     * maximum length of a unix socket path, which may fill sun_path without a terminating NUL
+     */
+#define PATHLEN sizeof(((struct sockaddr_un*)NULL)->sun_path)
+    static char addr_string[ADDRLEN + PORTLEN + PATHLEN];
+    if (sa->sa_family == AF_UNIX)
+    {   // Copied, as sa is usually on the stack of the caller.
+        snprintf(addr_string, sizeof(addr_string), "%.*s", (int)PATHLEN, ((struct sockaddr_un*)sa)->sun_path);
+        return addr_string;
+    }
+    
     struct sockaddr_in *sin = (struct sockaddr_in *)sa;
     inet_ntop(sin->sin_family, &sin->sin_addr, addr_string, ADDRLEN);
     sprintf(&addr_string[strlen(addr_string)], ":%d", ntohs(sin->sin_port));
@@ -567,6 +997,7 @@ char* Socket_getaddrname(struct sockaddr* sa, int sock)
  *  @param count number of buffers in iovecs.
  *  @param bytes number of bytes actually written returned
  *  @return completion code, especially TCPSOCKET_INTERRUPTED
+ *  @note Call with the write lock held.
  */
 int Socket_writev(int socket, iobuf* iovecs, int count, size_t* bytes)
 {
@@ -574,6 +1005,8 @@ int Socket_writev(int socket, iobuf* iovecs, int count, size_t* bytes)
     
     FUNC_ENTRY;
     *bytes = 0L;
+    write_queue* queue = SocketBuffer_getWrites(socket);
+    if (queue) { ++queue->writes; }
     rc = (int)writev(socket, iovecs, count);
     if (rc == SOCKET_ERROR)
     {
@@ -586,106 +1019,199 @@ int Socket_writev(int socket, iobuf* iovecs, int count, size_t* bytes)
     return rc;
 }
 
+#if defined(SOCKET_SENDFILE)
 /*!
- *  Continue any outstanding writes for a socket set
- *  @param pwset the set of sockets
- *  @return completion code
+ *  @abstract Write the next chunk of a payload streamed from a file (see SocketBuffer_stream) from the file straight to a socket.
+ *
+ *  @param socket the socket to write to.
+ *  @param pw the packet, of which all but the payload has been written.
+ *  @param len the number of bytes attempted, returned.
+ *  @param bytes number of bytes actually written returned
+ *  @return completion code, especially TCPSOCKET_INTERRUPTED
+ *  @note Call with the write lock held.
  */
-int Socket_continueWrites(fd_set* pwset)
+int Socket_sendfile(int socket, pending_writes const* pw, size_t* len, size_t* bytes)
 {
-    int rc1 = 0;
-    ListElement* curpending = s.write_pending->first;
+    int rc = TCPSOCKET_COMPLETE;
+    SocketBuffer_stream const* stream = pw->stream;
     
     FUNC_ENTRY;
-    while (curpending)
+    *bytes = 0L;
+    size_t const offset = pw->bytes - (pw->total - (size_t)stream->length);
+    *len = min(stream->chunksize, pw->total - pw->bytes);
+    write_queue* queue = SocketBuffer_getWrites(socket);
+    if (queue) { ++queue->writes; }
+    #if defined(__APPLE__)
+    off_t sent = (off_t)*len;   // Set to the bytes written even when interrupted.
+    if (sendfile(stream->fd, socket, stream->fdoffset + (off_t)offset, &sent, NULL, 0) == SOCKET_ERROR) { rc = SOCKET_ERROR; }
+    *bytes = (size_t)sent;
+    #else
+    off_t position = stream->fdoffset + (off_t)offset;
+    ssize_t const sent = sendfile(socket, stream->fd, &position, *len);
+    if (sent == SOCKET_ERROR) {
+        rc = SOCKET_ERROR;
+    } else {
+        *bytes = (size_t)sent;
+    }
+    #endif
+    
+    if (rc == SOCKET_ERROR)
     {
-        int socket = *(int*)(curpending->content);
-        if (FD_ISSET(socket, pwset) && Socket_continueWrite(socket))
-        {
-            if (!SocketBuffer_writeComplete(socket))
-                Log(LOG_SEVERE, -1, "Failed to remove pending write from socket buffer list");
-            FD_CLR(socket, &(s.pending_wset));
-            if (!ListRemove(s.write_pending, curpending->content))
-            {
-                Log(LOG_SEVERE, -1, "Failed to remove pending write from list");
-                ListNextElement(s.write_pending, &curpending);
-            }
-            curpending = s.write_pending->current;
-            
-            if (writecomplete)
-                (*writecomplete)(socket);
-        }
-        else
-            ListNextElement(s.write_pending, &curpending);
+        int err = Socket_error("sendfile", socket);
+        if (err == EWOULDBLOCK || err == EAGAIN) { rc = TCPSOCKET_INTERRUPTED; }
     }
-    FUNC_EXIT_RC(rc1);
-    return rc1;
+    else if (*bytes == 0)
+    {   // The packet length is already on the wire, so a file cut short leaves nothing to do but drop the connection.
+        Log(LOG_ERROR, -1, "Streamed payload of %ld bytes ends at offset %lu of file %d for socket %d", stream->length, offset, stream->fd, socket);
+        rc = SOCKET_ERROR;
+    }
+    FUNC_EXIT_RC(rc);
+    return rc;
 }
+#endif
 
 /*!
- *  @abstract Continue an outstanding write for a particular socket
+ *  @abstract Flush the write queue of a socket that became writable, and tidy up the packets written.
+ *  @discussion The write complete callback is called once for every packet that has been written, oldest first.
  *
- *  @param socket that socket
- *  @return completion code
+ *  @param socket the socket.
  */
-int Socket_continueWrite(int socket)
+void Socket_continuePendingWrite(int socket)
 {
-    int rc = 0;
-    pending_writes* pw;
-    size_t curbuflen = 0L, /* cumulative total of buffer lengths */
-    bytes;
-    int curbuf = -1, i;
-    iobuf iovecs1[5];
+    pending_writes* done = NULL;
     
     FUNC_ENTRY;
-    pw = SocketBuffer_getWrite(socket);
+    SocketBuffer_lockWrites();
+    if (Socket_continueWrite(socket, &done) == SOCKET_ERROR)
+        Log(TRACE_MIN, -1, "ContinueWrite failed on socket %d", socket);   // Reported to the owner by its next read.
+    
+    write_queue const* queue = SocketBuffer_getWrites(socket);
+    size_t const queued = (queue) ? queue->bytes : 0;
+    bool const empty = (queue == NULL || queue->first == NULL);
     
-    #if defined(OPENSSL)
-    if (pw->ssl)
+    Thread_lock_mutex(socket_mutex);
+    unsigned char* state = Socket_getState(socket);
+    if (state && (*state & SOCKET_STATE_OPEN))
     {
-        rc = SSLSocket_continueWrite(pw);
-        goto exit;
+        if (empty)
+        {
+            *state &= ~SOCKET_STATE_WRITING;
+            if (!(*state & SOCKET_STATE_CONNECTING)) { s.poller->setWriteInterest(socket, 0); }
+        }
+        if (queued < SOCKETBUFFER_MAX_QUEUED) { *state &= ~SOCKET_STATE_FULL; }
+        if (Socket_isReady(*state)) { Socket_enqueueReady(socket, state); }
     }
-    #endif
+    Thread_unlock_mutex(socket_mutex);
+    SocketBuffer_unlockWrites();
     
-    for (i = 0; i < pw->count; ++i)
+    pending_writes* pw;
+    while ((pw = done) != NULL)
     {
-        if (pw->bytes <= curbuflen)
-        { /* if previously written length is less than the buffer we are currently looking at,
-           add the whole buffer */
-            iovecs1[++curbuf].iov_len = pw->iovecs[i].iov_len;
-            iovecs1[curbuf].iov_base = pw->iovecs[i].iov_base;
-        }
-        else if (pw->bytes < curbuflen + pw->iovecs[i].iov_len)
-        { /* if previously written length is in the middle of the buffer we are currently looking at,
-           add some of the buffer */
-            long offset = pw->bytes - curbuflen;
-            iovecs1[++curbuf].iov_len = pw->iovecs[i].iov_len - offset;
-            iovecs1[curbuf].iov_base = pw->iovecs[i].iov_base + offset;
-            break;
-        }
-        curbuflen += pw->iovecs[i].iov_len;
+        done = pw->next;
+        if (writecomplete)
+            (*writecomplete)(socket, pw);
+        SocketBuffer_freeWrite(pw);
     }
+    FUNC_EXIT;
+}
+
+/*!
+ *  @abstract Write as much of the write queue of a socket as it takes, gathering the queued packets into as few writev calls as possible.
+ *  @note Call with the write lock held.
+ *
+ *  @param socket the socket.
+ *  @param done the packets completely written, taken off the queue and linked through their next field, returned.
+ *  @return completion code: TCPSOCKET_COMPLETE once the queue is empty, TCPSOCKET_INTERRUPTED if the socket would block, or SOCKET_ERROR.
+ */
+int Socket_continueWrite(int socket, pending_writes** done)
+{
+    int rc = TCPSOCKET_COMPLETE;
+    write_queue* queue = SocketBuffer_getWrites(socket);
+    pending_writes** tail = done;
     
-    if ((rc = Socket_writev(socket, iovecs1, curbuf+1, &bytes)) != SOCKET_ERROR)
+    FUNC_ENTRY;
+    *done = NULL;
+    while (queue && queue->first)
     {
-        pw->bytes += bytes;
-        if ((rc = (pw->bytes == pw->total)))
-        {  /* topic and payload buffers are freed elsewhere, when all references to them have been removed */
-            for (i = 0; i < pw->count; i++)
+        pending_writes* pw = queue->first;
+        
+        #if defined(OPENSSL)
+        if (pw->ssl)
+        {   // TLS records can not be gathered, so write them one packet at a time.
+            if ((rc = SSLSocket_continueWrite(pw)) != 1)
             {
-                if (pw->frees[i])
-                    free(pw->iovecs[i].iov_base);
+                rc = (rc == 0) ? TCPSOCKET_INTERRUPTED : SOCKET_ERROR;
+                break;
             }
-            Log(TRACE_MIN, -1, "ContinueWrite: partial write now complete for socket %d", socket);
+            rc = TCPSOCKET_COMPLETE;
+            *tail = SocketBuffer_writeComplete(socket);
+            tail = &(*tail)->next;
+            continue;
+        }
+        #endif
+        
+        size_t gathered = 0L, bytes;
+        #if defined(SOCKET_SENDFILE)
+        if (pw->stream && pw->stream->fd >= 0 && pw->bytes >= pw->total - (size_t)pw->stream->length)
+        {   // Everything before the payload is out, so the file goes to the socket without being read in.
+            if ((rc = Socket_sendfile(socket, pw, &gathered, &bytes)) == SOCKET_ERROR) { break; }
         }
         else
-            Log(TRACE_MIN, -1, "ContinueWrite wrote +%lu bytes on socket %d", bytes, socket);
+        #endif
+        {
+            iobuf iovecs[SOCKET_MAX_IOVECS];
+            int count = 0;
+            bool streaming = false;     // Whether the last packet gathered streams its payload, of which only the chunk read can be gathered.
+            for (; pw && !streaming && count + pw->count + 1 <= SOCKET_MAX_IOVECS; pw = pw->next)
+            {
+                size_t offset = pw->bytes;  // Skip what was already written.
+                for (int i = 0; i < pw->count; ++i)
+                {
+                    if (offset >= pw->iovecs[i].iov_len)
+                    {
+                        offset -= pw->iovecs[i].iov_len;
+                        continue;
+                    }
+                    iovecs[count].iov_base = (char*)pw->iovecs[i].iov_base + offset;
+                    iovecs[count].iov_len = pw->iovecs[i].iov_len - offset;
+                    gathered += iovecs[count++].iov_len;
+                    offset = 0;
+                }
+                if ((streaming = (pw->stream != NULL)))
+                {
+                    #if defined(SOCKET_SENDFILE)
+                    if (pw->stream->fd >= 0) { break; }
+                    #endif
+                    char* chunk = NULL;
+                    long const chunklen = SocketBuffer_produce(pw, &chunk);
+                    if ((rc = (chunklen < 0) ? SOCKET_ERROR : TCPSOCKET_COMPLETE) == SOCKET_ERROR) { break; }
+                    if (chunklen == 0) { continue; }
+                    iovecs[count].iov_base = chunk;
+                    iovecs[count].iov_len = (size_t)chunklen;
+                    gathered += iovecs[count++].iov_len;
+                }
+            }
+            if (rc == SOCKET_ERROR) { break; }
+            if ((rc = Socket_writev(socket, iovecs, count, &bytes)) == SOCKET_ERROR) { break; }
+        }
+        Log(TRACE_MIN, -1, "ContinueWrite wrote +%lu bytes on socket %d", bytes, socket);
+        rc = (bytes < gathered) ? TCPSOCKET_INTERRUPTED : TCPSOCKET_COMPLETE;
+        
+        while (bytes > 0 && (pw = queue->first) != NULL)
+        {
+            size_t const n = min(bytes, pw->total - pw->bytes);
+            pw->bytes += n;
+            queue->bytes -= n;
+            bytes -= n;
+            if (pw->bytes == pw->total)
+            {
+                *tail = SocketBuffer_writeComplete(socket);
+                tail = &(*tail)->next;
+            }
+        }
+        if (rc == TCPSOCKET_INTERRUPTED) { break; }
     }
     
-#if defined(OPENSSL)
-exit:
-#endif
     FUNC_EXIT_RC(rc);
     return rc;
 }
@@ -710,3 +1236,450 @@ int Socket_close_only(int socket)
     FUNC_EXIT_RC(rc);
     return rc;
 }
+
+/*!
+ *  @abstract Whether a packet written to a socket now is to be held back, i.e. the socket coalesces its output and nothing is being written for it already.
+ *  @note Call with the write lock held.
+ *
+ *  @param socket the socket.
+ *  @return boolean - hold the packet back?
+ */
+bool Socket_holdsWrites(int socket)
+{
+    write_queue const* queue = SocketBuffer_getWrites(socket);
+    bool const idle = (queue == NULL || queue->first == NULL);
+    
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry const* entry = Socket_findEntry(socket);
+    bool const rc = entry && entry->maxdelay > 0 && (entry->state & SOCKET_STATE_OPEN) && (idle || (entry->state & SOCKET_STATE_HELD));
+    Thread_unlock_mutex(socket_mutex);
+    return rc;
+}
+
+/*!
+ *  @abstract Hold back the packet just queued for a socket, unless the output held is already worth a write of its own.
+ *  @note Call with the write lock held.
+ *
+ *  @param socket the socket.
+ */
+void Socket_holdPendingWrite(int socket)
+{
+    write_queue const* queue = SocketBuffer_getWrites(socket);
+    size_t const queued = (queue) ? queue->bytes : 0;
+    int const segments = (queue) ? queue->segments : 0;
+    struct timeval now;
+    
+    gettimeofday(&now, NULL);
+    Thread_lock_mutex(socket_mutex);
+    Socket_entry* entry = Socket_findEntry(socket);
+    if (entry && (entry->state & SOCKET_STATE_OPEN))
+    {
+        entry->state |= SOCKET_STATE_WRITING;
+        if (queued >= SOCKETBUFFER_MAX_QUEUED) { entry->state |= SOCKET_STATE_FULL; }
+        if (!(entry->state & SOCKET_STATE_HELD))
+        {
+            entry->state |= SOCKET_STATE_HELD;
+            entry->held = now;
+            ++s.held;
+        }
+        if (queued >= SOCKET_COALESCE_BYTES || segments >= SOCKET_MAX_IOVECS || Socket_heldFor(entry, &now) >= entry->maxdelay) { Socket_release(socket, entry); }
+    }
+    Thread_unlock_mutex(socket_mutex);
+}
+
+/*!
+ *  @abstract Stop holding back the output of a socket, so that it is written as soon as the socket is writable.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param socket the socket.
+ *  @param entry the entry of the socket, in SOCKET_STATE_HELD.
+ */
+void Socket_release(int socket, Socket_entry* entry)
+{
+    entry->state &= ~SOCKET_STATE_HELD;
+    --s.held;
+    Socket_wantWrite(socket);
+}
+
+/*!
+ *  @abstract Release the sockets whose output has been held back for as long as it may, and shorten a timeout to when the next one is due.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param timeout the time the caller is about to wait, updated.
+ */
+void Socket_releaseHeld(struct timeval* timeout)
+{
+    long wait = timeout->tv_sec * 1000L + timeout->tv_usec / 1000L;
+    long const before = wait;
+    struct timeval now;
+    
+    gettimeofday(&now, NULL);
+    for (int i = 0; i < s.entrieslen; ++i)
+    {
+        Socket_entry* entry = s.entries[i];
+        if (entry == NULL || !(entry->state & SOCKET_STATE_HELD)) { continue; }
+        
+        long const left = entry->maxdelay - Socket_heldFor(entry, &now);
+        if (left <= 0) {
+            Socket_release(i, entry);
+        } else {
+            wait = min(wait, left);
+        }
+    }
+    
+    if (wait < before)
+    {
+        timeout->tv_sec = wait / 1000L;
+        timeout->tv_usec = (wait % 1000L) * 1000L;
+    }
+}
+
+/*!
+ *  @abstract How long a socket has been holding back its output.
+ *
+ *  @param entry the entry of the socket, in SOCKET_STATE_HELD.
+ *  @param now the current time.
+ *  @return the time in milliseconds.
+ */
+long Socket_heldFor(Socket_entry const* entry, struct timeval const* now)
+{
+    return (now->tv_sec - entry->held.tv_sec) * 1000L + (now->tv_usec - entry->held.tv_usec) / 1000L;
+}
+
+/*!
+ *  @abstract Ask the readiness backend to report when a socket becomes writable, waking the thread waiting for readiness if the backend would not see the change before its wait ends.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param socket the socket.
+ */
+void Socket_wantWrite(int socket)
+{
+    s.poller->setWriteInterest(socket, 1);
+    if (!s.poller->live_interest) { Socket_wakeup(); }
+}
+
+/*!
+ *  @abstract Create the wakeup descriptor and register it with the readiness backend.
+ *
+ *  @return completion code.
+ */
+int Socket_openWakeup(void)
+{
+    #if defined(__linux__)
+    if ((wakeup_fds[0] = wakeup_fds[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) { return SOCKET_ERROR; }
+    #else
+    if (pipe(wakeup_fds) == -1)
+    {
+        wakeup_fds[0] = wakeup_fds[1] = -1;
+        return SOCKET_ERROR;
+    }
+    Socket_setnonblocking(wakeup_fds[0]);
+    Socket_setnonblocking(wakeup_fds[1]);
+    #endif
+    return s.poller->add(wakeup_fds[0]);
+}
+
+/*!
+ *  @abstract Unregister and close the wakeup descriptor.
+ */
+void Socket_closeWakeup(void)
+{
+    if (wakeup_fds[0] == -1) { return; }
+    
+    s.poller->remove(wakeup_fds[0]);
+    close(wakeup_fds[0]);
+    if (wakeup_fds[1] != wakeup_fds[0]) { close(wakeup_fds[1]); }
+    wakeup_fds[0] = wakeup_fds[1] = -1;
+}
+
+/*!
+ *  @abstract Consume the pending wakeups, so that the descriptor is not reported again until the next Socket_wakeup.
+ */
+void Socket_drainWakeup(void)
+{
+    uint64_t buf[8];
+    while (read(wakeup_fds[0], buf, sizeof(buf)) > 0);
+}
+
+/*!
+ *  @abstract Get the addresses of the host of a connect race, if they are known yet.
+ *
+ *  @param race the race.
+ *  @return 0 with the addresses stored in the race, TCPSOCKET_INTERRUPTED while the lookup is in progress, or SOCKET_ERROR if the host can not be resolved.
+ */
+int Socket_resolve(Socket_race* race)
+{
+    int const rc = SocketResolver_lookup(race->host, race->addresses, &race->count);
+    if (rc != 0)
+    {
+        race->count = -1;
+        return rc;
+    }
+    
+    for (int i = 0; i < race->count; ++i)
+    {
+        struct sockaddr_storage* addr = &race->addresses[i].addr;
+        if (addr->ss_family == AF_INET6) {
+            ((struct sockaddr_in6*)addr)->sin6_port = htons(race->port);
+        } else {
+            ((struct sockaddr_in*)addr)->sin_port = htons(race->port);
+        }
+    }
+    race->next = 0;
+    return 0;
+}
+
+/*!
+ *  @abstract Move the connect races on, and shorten the timeout to when the next connect of a race is due.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param timeout the time Socket_poll would wait for. Shortened if a connect is due sooner.
+ */
+void Socket_runRaces(struct timeval* timeout)
+{
+    long wait = timeout->tv_sec * 1000L + timeout->tv_usec / 1000L;
+    long const before = wait;
+    struct timeval now;
+    
+    gettimeofday(&now, NULL);
+    for (ListElement* current = s.races->first; current != NULL; )
+    {
+        Socket_race* race = (Socket_race*)(current->content);
+        current = current->next;    // The race may end (and leave the list) now.
+        
+        long const left = Socket_advanceRace(race, &now);
+        if (left > 0) { wait = min(wait, left); }
+    }
+    
+    if (wait < before)
+    {
+        timeout->tv_sec = wait / 1000L;
+        timeout->tv_usec = (wait % 1000L) * 1000L;
+    }
+}
+
+/*!
+ *  @abstract Start the connects of a race that are due, or end the race if nothing is left to try.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param race the race.
+ *  @param now the current time.
+ *  @return the time in milliseconds until the next connect is due, or 0 if none is.
+ */
+long Socket_advanceRace(Socket_race* race, struct timeval const* now)
+{
+    if (race->count < 0)
+    {
+        int const rc = Socket_resolve(race);
+        if (rc == TCPSOCKET_INTERRUPTED) { return 0; }
+        if (rc == SOCKET_ERROR)
+        {
+            Log(LOG_ERROR, -1, "%s is not a valid IP address", race->host);
+            race->error = EHOSTUNREACH;
+            Socket_endRace(race, -1);
+            return 0;
+        }
+    }
+    
+    while (race->next < race->count)
+    {
+        if (race->attempts > 0)
+        {
+            long const left = SOCKET_CONNECT_DELAY - ((now->tv_sec - race->started.tv_sec) * 1000L + (now->tv_usec - race->started.tv_usec) / 1000L);
+            if (left > 0) { return left; }
+        }
+        Socket_startAttempt(race, now);
+    }
+    
+    if (race->attempts == 0) { Socket_endRace(race, -1); }    // Every address failed.
+    return 0;
+}
+
+/*!
+ *  @abstract Start a non-blocking connect to the next address of a race.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param race the race.
+ *  @param now the current time.
+ *  @return 0 if the connect is in progress, SOCKET_ERROR if it failed straight away (race->error tells why).
+ */
+int Socket_startAttempt(Socket_race* race, struct timeval const* now)
+{
+    SocketResolver_address const* address = &race->addresses[race->next++];
+    int rc = SOCKET_ERROR;
+    
+    FUNC_ENTRY;
+    int const sock = socket(address->addr.ss_family, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+    {
+        race->error = Socket_error("socket", sock);
+        goto exit;
+    }
+    
+    #if defined(NOSIGPIPE)
+    int opt = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
+        Log(LOG_ERROR, -1, "Could not set SO_NOSIGPIPE for socket %d", sock);
+    #endif
+    Socket_setOptions(sock, address->addr.ss_family, &race->options);
+    
+    unsigned char* state = Socket_newState(sock);
+    if (state == NULL || Socket_setnonblocking(sock) == SOCKET_ERROR || s.poller->add(sock) == SOCKET_ERROR)
+    {
+        race->error = Socket_error("setnonblocking", sock);
+        close(sock);
+        goto exit;
+    }
+    *state = SOCKET_STATE_OPEN | SOCKET_STATE_CONNECTING;
+    Socket_findEntry(sock)->race = race;
+    ++s.count;
+    
+    if (connect(sock, (struct sockaddr const*)&address->addr, address->len) == SOCKET_ERROR && errno != EINPROGRESS && errno != EWOULDBLOCK)
+    {
+        race->error = Socket_error("connect", sock);
+        Socket_dropAttempt(sock, Socket_findEntry(sock));
+        goto exit;
+    }
+    
+    // Completion (or failure) of the connect is reported as write readiness, even if it completed immediately.
+    ++race->attempts;
+    race->started = *now;
+    Socket_wantWrite(sock);
+    Log(TRACE_MIN, -1, "Connecting socket %d to address %d of %s for socket %d", sock, race->next, race->host, race->socket);
+    rc = 0;
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+/*!
+ *  @abstract Handle the end of a connect racing for a socket: the first to succeed wins the race, a failure makes way for the next address.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param socket the socket of the connect attempt.
+ *  @param entry its table entry.
+ */
+void Socket_attemptDone(int socket, Socket_entry* entry)
+{
+    Socket_race* race = entry->race;
+    int error = 0;
+    socklen_t len = sizeof(error);
+    
+    FUNC_ENTRY;
+    if (getsockopt(socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len) == SOCKET_ERROR) { error = errno; }
+    if (error == 0)
+    {   // The event may be left over from a socket closed earlier with the same descriptor, so make sure the connect did finish.
+        struct sockaddr_storage peer;
+        socklen_t peerlen = sizeof(peer);
+        if (getpeername(socket, (struct sockaddr*)&peer, &peerlen) == SOCKET_ERROR && errno == ENOTCONN) { goto exit; }
+        
+        --race->attempts;
+        Socket_endRace(race, socket);
+        goto exit;
+    }
+    
+    Log(TRACE_MIN, -1, "Connect of socket %d for socket %d failed: %s", socket, race->socket, strerror(error));
+    --race->attempts;
+    race->error = error;
+    Socket_dropAttempt(socket, entry);
+    
+    // Try the next address straight away, rather than when it would have been due.
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    timerclear(&race->started);
+    Socket_advanceRace(race, &now);
+exit:
+    FUNC_EXIT;
+}
+
+/*!
+ *  @abstract Stop watching and close a connect attempt.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param socket the socket of the connect attempt.
+ *  @param entry its table entry.
+ */
+void Socket_dropAttempt(int socket, Socket_entry* entry)
+{
+    s.poller->remove(socket);
+    entry->state = 0;
+    entry->race = NULL;
+    --s.count;
+    if (close(socket) == SOCKET_ERROR) { Socket_error("close", socket); }
+}
+
+/*!
+ *  @abstract Drop the connect attempts of a race that are still in progress.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param race the race.
+ *  @param keep an attempt to keep, or -1.
+ */
+void Socket_dropAttempts(Socket_race* race, int keep)
+{
+    for (int i = 0; i < s.entrieslen; ++i)
+    {
+        Socket_entry* entry = s.entries[i];
+        if (entry && entry->race == race && i != race->socket && i != keep) { Socket_dropAttempt(i, entry); }
+    }
+    race->attempts = 0;
+}
+
+/*!
+ *  @abstract End a race, moving the winning connection (if any) onto the socket handed out by Socket_new, and report that socket ready like any other finished connect.
+ *  @discussion A race without a winner stays attached to its socket, to tell Socket_connectError what went wrong, until the socket is closed.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param race the race.
+ *  @param winner the connected attempt, or -1 if every attempt failed.
+ */
+void Socket_endRace(Socket_race* race, int winner)
+{
+    int const socket = race->socket;
+    Socket_entry* entry = Socket_findEntry(socket);
+    
+    FUNC_ENTRY;
+    Socket_dropAttempts(race, winner);
+    ListDetach(s.races, race);
+    
+    if (winner != -1)
+    {
+        Socket_entry* won = Socket_findEntry(winner);
+        s.poller->remove(winner);
+        won->state = 0;
+        won->race = NULL;
+        --s.count;
+        
+        // Only close the attempt's descriptor: the connection lives on in the socket it was duplicated to.
+        if (dup2(winner, socket) == SOCKET_ERROR || s.poller->add(socket) == SOCKET_ERROR) {
+            race->error = Socket_error("dup2", socket);
+        } else {
+            Log(TRACE_MIN, -1, "Socket %d connected to %s, port %d", socket, race->host, race->port);
+            entry->race = NULL;
+            free(race->host);
+            free(race);
+        }
+        close(winner);
+    }
+    
+    entry->state = (entry->state & ~SOCKET_STATE_CONNECTING) | SOCKET_STATE_CONNECTED;
+    Socket_enqueueReady(socket, &entry->state);
+    FUNC_EXIT;
+}
+
+/*!
+ *  @abstract Abandon a race, closing its connect attempts, and free it.
+ *  @note Call with socket_mutex held.
+ *
+ *  @param race the race.
+ */
+void Socket_freeRace(Socket_race* race)
+{
+    Socket_entry* entry = Socket_findEntry(race->socket);
+    
+    Socket_dropAttempts(race, -1);
+    ListDetach(s.races, race);
+    if (entry) { entry->race = NULL; }
+    free(race->host);
+    free(race);
+}
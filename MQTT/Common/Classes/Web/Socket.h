@@ -21,7 +21,11 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>        // POSIX
+#include <sys/un.h>         // POSIX
 #include "LinkedList.h"     // MQTT (Utilities)
+#include "SocketPoll.h"     // MQTT (Web)
+#include "SocketBuffer.h"   // MQTT (Web)
+#include "SocketResolver.h" // MQTT (Web)
 
 #pragma mark Definitions
 
@@ -33,6 +37,9 @@
 	#define SOCKET_ERROR -1
 #endif
 
+// Scheme of server URIs naming a Unix domain socket, e.g. unix:///var/run/mqtt.sock.
+#define URI_UNIX "unix://"
+
 // Must be the same as SOCKETBUFFER_INTERRUPTED.
 #define TCPSOCKET_INTERRUPTED -22
 #define SSL_FATAL -3
@@ -45,32 +52,120 @@
 #if !defined(max)
     #define max(A,B) ( (A) > (B) ? (A):(B))
 #endif
+#if !defined(min)
+    #define min(A,B) ( (A) < (B) ? (A):(B))
+#endif
+
+/*!
+ *  @abstract Options applied to a socket when it is created, before it connects (so the receive buffer size can still shape the TCP window). 0 leaves a setting at the system default.
+ *  @discussion Only the buffer sizes apply to Unix domain sockets. Options the platform does not have are ignored.
+ *
+ *  @field nodelay 1 turns Nagle's algorithm off (TCP_NODELAY): small packets are sent straight away instead of waiting for the acknowledgement of earlier data.
+ *  @field sndbuf Size of the kernel send buffer in bytes (SO_SNDBUF).
+ *  @field rcvbuf Size of the kernel receive buffer in bytes (SO_RCVBUF).
+ *  @field usertimeout Longest time in milliseconds sent data may stay unacknowledged before the connection is dropped (TCP_USER_TIMEOUT, Linux).
+ *  @field keepalive 1 turns TCP keepalive probes on (SO_KEEPALIVE).
+ *  @field keepidle Seconds a connection is idle before the first keepalive probe (TCP_KEEPIDLE, TCP_KEEPALIVE on Darwin).
+ *  @field keepintvl Seconds between keepalive probes (TCP_KEEPINTVL).
+ *  @field keepcnt Number of unanswered keepalive probes after which the connection is dropped (TCP_KEEPCNT).
+ *  @field quickack 1 acknowledges received data straight away instead of delaying the acknowledgement (TCP_QUICKACK, Linux). The kernel turns it off again by itself, so it is set again whenever the socket is handed out as readable.
+ */
+typedef struct
+{
+    int nodelay;
+    int sndbuf;
+    int rcvbuf;
+    int usertimeout;
+    int keepalive;
+    int keepidle;
+    int keepintvl;
+    int keepcnt;
+    int quickack;
+} Socket_options;
+
+/*!
+ *  @abstract Connects racing each other to the addresses of a host (happy eyeballs, RFC 8305).
+ *  @discussion Socket_new hands out a placeholder socket straight away. The host is resolved in the background, then connects to its addresses are started SOCKET_CONNECT_DELAY apart, without waiting for the earlier ones to fail. The first connect to succeed is moved onto the placeholder descriptor (dup2), so the caller keeps the socket it was given.
+ *
+ *  @field socket The placeholder socket handed out by Socket_new.
+ *  @field host The host name.
+ *  @field port The TCP port.
+ *  @field addresses The addresses to connect to, in order.
+ *  @field count Number of addresses, -1 while the host is being resolved.
+ *  @field next Index of the next address to connect to.
+ *  @field attempts Number of connects in progress.
+ *  @field started When the last connect was started.
+ *  @field error Error of the last failed connect or lookup.
+ *  @field options The options every connect attempt is made with.
+ */
+typedef struct
+{
+    int socket;
+    char* host;
+    int port;
+    SocketResolver_address addresses[SOCKETRESOLVER_MAX_ADDRESSES];
+    int count;
+    int next;
+    int attempts;
+    struct timeval started;
+    int error;
+    Socket_options options;
+} Socket_race;
+
+/*!
+ *  @abstract Per socket data, kept in a table indexed by socket descriptor.
+ *  @discussion Entries are allocated once per descriptor value and never move, so a pointer to one stays valid while the table grows. Closing a socket resets its entry.
+ *
+ *  @field state Socket state flags (SOCKET_STATE_* in Socket.c), 0 when the socket is not open.
+ *  @field queue Read buffer (SocketBuffer module), NULL until data is first read.
+ *  @field writes Packets waiting to be written (SocketBuffer module).
+ *  @field maxdelay Longest time, in milliseconds, output may be held back to be written together with the packets that follow it. 0 writes every packet straight away.
+ *  @field held When the output being held back was first held.
+ *  @field client The Clients structure the socket belongs to, set with Socket_setClient.
+ *  @field race The connect race of a socket handed out by Socket_new until it is won, or that a connect attempt is part of.
+ *  @field quickack Whether TCP_QUICKACK is set again each time the socket is handed out as readable (see Socket_options).
+ */
+typedef struct
+{
+	unsigned char state;
+	socket_queue* queue;
+	write_queue writes;
+	int maxdelay;
+	struct timeval held;
+	void* client;
+	Socket_race* race;
+	int quickack;
+} Socket_entry;
 
 /**
  *  @abstract Structure to hold all socket data for the module
  *
- *  @field rset Socket read set.
- *  @field rset_saved Saved socket read set.
- *  @field maxfdp1 Max descriptor used +1.
- *  @field clientsds List of client socket descriptors.
- *  @field cur_clientsds Current client socket descriptor (iterator).
- *  @field connect_pending List of sockets for which a connect is pending.
- *  @field write_pending List of sockets for which a write is pending.
- *  @field pending_wset Socket pending write set for select.
+ *  @field count Number of open client sockets.
+ *  @field ready Sockets with readiness not consumed yet, in the order they are served.
+ *  @field served Number of ready sockets handed out since the readiness backend was last polled.
+ *  @field entries Per socket data, indexed by socket descriptor (NULL for descriptors never used).
+ *  @field entrieslen Number of slots in entries.
+ *  @field poller Readiness backend in use (epoll, kqueue or select).
+ *  @field held Number of sockets holding back output (see Socket_setMaxWriteDelay).
+ *  @field races Connect races still running (Socket_race).
  */
 typedef struct
 {
-    fd_set rset;
-    fd_set rset_saved;
-	int maxfdp1;
-	List* clientsds;
-	ListElement* cur_clientsds;
-	List* connect_pending;
-	List* write_pending;
-	fd_set pending_wset;
+	int count;
+	List* ready;
+	int served;
+	Socket_entry** entries;
+	int entrieslen;
+	SocketPoll_backend const* poller;
+	int held;
+	List* races;
 } Sockets;
 
-typedef void Socket_writeComplete(int socket);
+/*!
+ *  @abstract Called once a packet queued for a socket has been completely written.
+ *  @discussion The packet is only passed so that it can be identified by its id (see SocketBuffer_lastWriteId). It is freed when the callback returns.
+ */
+typedef void Socket_writeComplete(int socket, pending_writes* pw);
 
 #pragma mark Public API
 
@@ -85,44 +180,39 @@ void Socket_outInitialize(void);
 void Socket_outTerminate(void);
 
 /*!
- *  @abstract Returns the next socket ready for communications as indicated by select
+ *  @abstract Returns the next socket ready for communications as indicated by the readiness backend.
+ *  @discussion Only sockets that became ready are visited. A socket stays ready until a read on it would block, and is not handed out while it has a partial write pending.
  *
- *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should be used for the select.
- *  @param tp the timeout to be used for the select, unless overridden.
+ *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should be used for the wait.
+ *  @param tp the timeout to be used for the wait, unless overridden.
  *  @return the socket next ready, or 0 if none is ready.
  */
 int Socket_getReadySocket(int more_work, struct timeval *tp);
 
 /*!
- *  @abstract Reads one byte from a socket
- *
- *  @param socket the socket to read from
- *  @param c the character read, returned
- *  @return completion code
- */
-int Socket_getch(int socket, char* c);
-/*!
- *  @abstract Attempts to read a number of bytes from a socket, non-blocking. If a previous read did not finish, then retrieve that data.
+ *  @abstract Reads as much data as is available from a socket into its read buffer (see SocketBuffer_getQueuedData), non-blocking and in one call.
  *
  *  @param socket the socket to read from.
- *  @param bytes the number of bytes to read.
- *  @param actual_len the actual number of bytes read.
- *  @return completion code.
+ *  @param bytes the number of queued bytes the read buffer must be able to hold, i.e. the length of the packet being read if known.
+ *  @return completion code, TCPSOCKET_INTERRUPTED if no data was available.
  */
-char* Socket_getdata(int socket, size_t bytes, size_t* actual_len);
+int Socket_read(int socket, size_t bytes);
 
 /*!
  *  @abstract Attempts to write a series of buffers to a socket in *one* system call so that they are sent as one packet.
+ *  @discussion Whatever can not be written straight away is queued behind the packets already waiting for the socket, and written once it becomes writable.
  *
  *  @param socket the socket to write to
- *  @param buf0 the first buffer
+ *  @param buf0 the first buffer, typically the fixed header: it stays with the caller, and is copied if the packet is queued
  *  @param buf0len the length of data in the first buffer
  *  @param count number of buffers
  *  @param buffers an array of buffers to write
  *  @param buflens an array of corresponding buffer lengths
- *  @return completion code, especially TCPSOCKET_INTERRUPTED
+ *  @param frees whether each buffer is freed once the packet has been written, or SOCKETBUFFER_COPY for a buffer that is copied if the packet is queued
+ *  @param stream a payload streamed after the buffers (see SocketBuffer_stream), or NULL. A packet with a stream is always queued, and written by the thread waiting for socket readiness.
+ *  @return completion code, especially TCPSOCKET_INTERRUPTED when (part of) the packet was queued
  */
-int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees);
+int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees, SocketBuffer_stream const* stream);
 
 /*!
  *  @abstract Close a socket and remove it from the select list.
@@ -134,13 +224,34 @@ void Socket_close(int socket);
 
 /*!
  *  @abstract Create a new socket and TCP connect to an address/port.
+ *  @discussion Neither the name lookup nor the connects block: the socket is reported ready by Socket_getReadySocket once it is connected, or once every address failed. Check the outcome with Socket_connectError.
  *
- *  @param addr the address string.
+ *  @param addr the host name or numeric address.
  *  @param port the TCP port.
+ *  @param options the options set on every connect attempt, or NULL for the system defaults.
+ *  @param sock returns the new socket.
+ *  @return EINPROGRESS, or SOCKET_ERROR if the host is known not to resolve or no socket could be created.
+ */
+int Socket_new(char* addr, int port, Socket_options const* options, int* socket);
+
+/*!
+ *  @abstract Create a new socket and connect to a Unix domain (stream) socket.
+ *  @discussion Local connects finish straight away, so unlike Socket_new this never leaves a connect pending.
+ *
+ *  @param path the file system path of the socket.
+ *  @param options the options set on the socket (only the buffer sizes apply), or NULL for the system defaults.
  *  @param sock returns the new socket.
- *  @return completion code.
+ *  @return 0 if connected, else SOCKET_ERROR or the connect error.
  */
-int Socket_new(char* addr, int port, int* socket);
+int Socket_newUnix(char const* path, Socket_options const* options, int* sock);
+
+/*!
+ *  @abstract Get the outcome of the connect started by Socket_new, once the socket was reported ready.
+ *
+ *  @param socket the socket.
+ *  @return 0 if connected, else the error of the connect (or EHOSTUNREACH if the host could not be resolved).
+ */
+int Socket_connectError(int socket);
 
 /*!
  *  @abstract Indicate whether any data is pending outbound for a socket.
@@ -149,6 +260,13 @@ int Socket_new(char* addr, int port, int* socket);
  */
 int Socket_noPendingWrites(int socket);
 
+/*!
+ *  @abstract Indicate whether a socket has so much output queued (SOCKETBUFFER_MAX_QUEUED) that no new work should be taken on for it.
+ *
+ *  @return boolean - true == queue full.
+ */
+int Socket_queueFull(int socket);
+
 /*!
  *  @abstract Get information about the other end connected to a socket.
  *
@@ -158,16 +276,88 @@ int Socket_noPendingWrites(int socket);
 char* Socket_getpeer(int sock);
 
 /*!
- *  @abstract Add a socket to the pending write list, so that it is checked for writing in select.  This is used in connect processing when the TCP connect is incomplete, as we need to check the socket for both ready to read and write states.
+ *  @abstract Ask for write readiness of a socket to be reported.  This is used in connect processing when the TCP connect is incomplete, as we need to check the socket for both ready to read and write states.
  *
  *  @param socket the socket to add
  */
 void Socket_addPendingWrite(int socket);
 
 /*!
- *  @abstract Clear a socket from the pending write list - if one was added with Socket_addPendingWrite.
+ *  @abstract Stop reporting write readiness for a socket - if it was asked for with Socket_addPendingWrite and no partial write is outstanding.
  *  @param socket the socket to remove.
  */
 void Socket_clearPendingWrite(int socket);
 
+/*!
+ *  @abstract Record that a partially written packet is queued for a socket (see SocketBuffer_pendingWrite), so that the write is continued once the socket becomes writable.
+ *  @note Call with the write lock held (see SocketBuffer_lockWrites).
+ *
+ *  @param socket the socket with the pending write.
+ */
+void Socket_startPendingWrite(int socket);
+
+/*!
+ *  @abstract A read on the socket would block: it is not ready again until the readiness backend says so.
+ *
+ *  @param socket the socket.
+ */
+void Socket_clearReadable(int socket);
+
+/*!
+ *  @abstract Get the table entry of a socket.
+ *
+ *  @param socket the socket.
+ *  @return the entry, or NULL if the socket was never added.
+ */
+Socket_entry* Socket_getEntry(int socket);
+
+/*!
+ *  @abstract Record the client a socket belongs to, so it can be found from the socket without a search.
+ *
+ *  @param socket the open socket.
+ *  @param client the Clients structure using the socket.
+ */
+void Socket_setClient(int socket, void* client);
+
+/*!
+ *  @abstract Get the client a socket belongs to.
+ *
+ *  @param socket the socket.
+ *  @return the Clients structure set with Socket_setClient, or NULL if the socket is not open.
+ */
+void* Socket_getClient(int socket);
+
+/*!
+ *  @abstract Let the output of a socket be held back, so that the packets produced in one pass of the send or receive loop go out in one writev.
+ *  @discussion Held output is written once Socket_flush is called, once SOCKET_COALESCE_BYTES or a full writev worth of buffers is held, or once the oldest held packet has waited maxdelay milliseconds.
+ *
+ *  @param socket the socket.
+ *  @param maxdelay the longest time in milliseconds a packet may be held back. 0 turns holding off.
+ */
+void Socket_setMaxWriteDelay(int socket, int maxdelay);
+
+/*!
+ *  @abstract Stop holding back the output of a socket: it is written as soon as the socket is writable.
+ *
+ *  @param socket the socket.
+ */
+void Socket_flush(int socket);
+
+/*!
+ *  @abstract Get the write counters of a socket since it was opened.
+ *  @discussion packets / writes is the number of packets each write system call carried on average.
+ *
+ *  @param socket the socket.
+ *  @param packets the number of packets sent or queued, returned.
+ *  @param writes the number of write system calls made, returned.
+ *  @return boolean - false if the socket is not open.
+ */
+int Socket_getWriteStats(int socket, unsigned long* packets, unsigned long* writes);
+
+/*!
+ *  @abstract Make a thread waiting in Socket_getReadySocket return straight away, e.g. to stop, or to pick up work that is not visible to the readiness backend yet.
+ *  @discussion Safe to call from any thread. Wakeups sent while nobody waits are kept for the next wait.
+ */
+void Socket_wakeup(void);
+
 void Socket_setWriteCompleteCallback(Socket_writeComplete*);
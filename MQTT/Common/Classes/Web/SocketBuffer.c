@@ -1,200 +1,216 @@
 #include "SocketBuffer.h"
-#include "LinkedList.h"
+#include "Socket.h"
 #include "Log.h"
 #include "Messages.h"
 #include "StackTrace.h"
+#include "Thread.h"
 
 #include <stdbool.h>        // C Standard
 #include <stdlib.h>         // C Standard
 #include <stdio.h>          // C Standard
-#include <memory.h>         
+#include <memory.h>
+#include <unistd.h>         // POSIX
 
 #include "Heap.h"
 
+#pragma mark - Definitions
+
+#if !defined(max)
+    #define max(A,B) ( (A) > (B) ? (A):(B))
+#endif
+
 #pragma mark - Variables
 
-static socket_queue* def_queue; // Default input queue buffer
-static List* queues;            // List of queued input buffers
-static List writes;             // List of queued write buffers
+static pthread_mutex_t write_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t* write_mutex = &write_mutex_store;  // Guards the write queues of all sockets.
 
 #pragma mark - Private Prototypes
 
-void SocketBuffer_newDefQ(void);
-void SocketBuffer_freeDefQ(void);
-bool socketcompare(void const* a, void const* b);
-bool pending_socketcompare(void const * a, void const* b);
+socket_queue* SocketBuffer_getQueue(int socket);
 
 #pragma mark - Public API
 
-void SocketBuffer_initialize(void)
+void SocketBuffer_cleanup(int socket)
 {
-    FUNC_ENTRY;
-    SocketBuffer_newDefQ();
-    queues = ListInitialize();
-    ListZero(&writes);
-    FUNC_EXIT;
-}
+    Socket_entry* entry = Socket_getEntry(socket);
 
-void SocketBuffer_terminate(void)
-{
-    ListElement* cur = NULL;
-    ListEmpty(&writes);
-    
     FUNC_ENTRY;
-    while (ListNextElement(queues, &cur)) { free(((socket_queue*)(cur->content))->buf); }
-    ListFree(queues);
-    SocketBuffer_freeDefQ();
+    if (entry == NULL) { goto exit; }
+
+    if (entry->queue)
+    {
+        if (entry->queue->slab) { SocketBuffer_release(entry->queue->slab); }
+        free(entry->queue);
+        entry->queue = NULL;
+    }
+
+    // The socket is gone, so the queued packets are never going to be written.
+    SocketBuffer_lockWrites();
+    pending_writes* pw;
+    while ((pw = SocketBuffer_writeComplete(socket)) != NULL) { SocketBuffer_freeWrite(pw); }
+    SocketBuffer_unlockWrites();
+exit:
     FUNC_EXIT;
 }
 
-void SocketBuffer_cleanup(int socket)
+char* SocketBuffer_getQueuedData(int socket, size_t* len)
 {
+    char* buf = NULL;
+    Socket_entry* entry = Socket_getEntry(socket);
+
     FUNC_ENTRY;
-    if (ListFindItem(queues, &socket, socketcompare))
+    *len = 0;
+    if (entry && entry->queue)
     {
-        free(((socket_queue*)(queues->current->content))->buf);
-        ListRemove(queues, queues->current->content);
+        socket_queue* queue = entry->queue;
+        *len = queue->datalen - queue->start;
+        buf = queue->buf + queue->start;
     }
-    if (def_queue->socket == socket)
-        def_queue->socket = def_queue->index = def_queue->headerlen = def_queue->datalen = 0;
     FUNC_EXIT;
+    return buf;
 }
 
-char* SocketBuffer_getQueuedData(int socket, size_t bytes, size_t* actual_len)
+void SocketBuffer_consume(int socket, size_t bytes)
 {
-    socket_queue* queue = NULL;
-    
+    Socket_entry* entry = Socket_getEntry(socket);
+
     FUNC_ENTRY;
-    if (ListFindItem(queues, &socket, socketcompare))
-    {  /* if there is queued data for this socket, add any data read to it */
-        queue = (socket_queue*)(queues->current->content);
-        *actual_len = queue->datalen;
-    }
-    else
+    if (entry && entry->queue)
     {
-        *actual_len = 0;
-        queue = def_queue;
-    }
-    if (bytes > queue->buflen)
-    {
-        if (queue->datalen > 0)
-        {
-            void* newmem = malloc(bytes);
-            memcpy(newmem, queue->buf, queue->datalen);
-            free(queue->buf);
-            queue->buf = newmem;
-        }
-        else { queue->buf = realloc(queue->buf, bytes); }
-        queue->buflen = bytes;
+        socket_queue* queue = entry->queue;
+        queue->start += bytes;
+        if (queue->start >= queue->datalen) { queue->start = queue->datalen = 0; }
     }
-    
     FUNC_EXIT;
-    return queue->buf;
 }
 
-int SocketBuffer_getQueuedChar(int socket, char* c)
+char* SocketBuffer_getReadSpace(int socket, size_t bytes, size_t* space)
 {
-    int rc = SOCKETBUFFER_INTERRUPTED;
-    
+    char* buf = NULL;
+
     FUNC_ENTRY;
-    if (ListFindItem(queues, &socket, socketcompare))
-    {  /* if there is queued data for this socket, read that first */
-        socket_queue* queue = (socket_queue*)(queues->current->content);
-        if (queue->index < queue->headerlen)
+    *space = 0;
+    socket_queue* queue = SocketBuffer_getQueue(socket);
+    if (queue == NULL) { goto exit; }
+
+    size_t const pending = queue->datalen - queue->start;
+    size_t buflen = max(bytes, pending + SOCKETBUFFER_READ_SIZE);
+    if (pending == 0 && bytes <= SOCKETBUFFER_READ_SIZE) { buflen = SOCKETBUFFER_READ_SIZE; }   // Give back the memory of a large packet once it is done.
+
+    if (queue->slab && atomic_load(&queue->slab->refcount) > 1)
+    {   // Messages still point into the slab: leave it as it is, and carry the partial packet over to a new one.
+        SocketBuffer_slab* slab = malloc(sizeof(SocketBuffer_slab) + buflen);
+        if (slab == NULL)
         {
-            *c = queue->fixed_header[(queue->index)++];
-            Log(TRACE_MAX, -1, "index is now %d, headerlen %d", queue->index, queue->headerlen);
-            rc = SOCKETBUFFER_COMPLETE;
+            Log(LOG_ERROR, -1, "Could not allocate %lu bytes to read from socket %d", buflen, socket);
             goto exit;
         }
-        else if (queue->index > 4)
+        atomic_init(&slab->refcount, 1);
+        memcpy(slab->data, queue->buf + queue->start, pending);
+        SocketBuffer_release(queue->slab);
+        queue->slab = slab;
+        queue->buf = slab->data;
+        queue->buflen = buflen;
+        queue->start = 0;
+        queue->datalen = pending;
+    }
+
+    if (queue->start > 0)
+    {   // Carry the partial packet forward to the front of the buffer.
+        memmove(queue->buf, queue->buf + queue->start, pending);
+        queue->start = 0;
+        queue->datalen = pending;
+    }
+
+    if (buflen > queue->buflen || (pending == 0 && buflen < queue->buflen))
+    {
+        SocketBuffer_slab* slab = (queue->slab) ? realloc(queue->slab, sizeof(SocketBuffer_slab) + buflen) : malloc(sizeof(SocketBuffer_slab) + buflen);
+        if (slab == NULL)
         {
-            Log(LOG_FATAL, -1, "header is already at full length");
-            rc = SOCKET_ERROR;
+            Log(LOG_ERROR, -1, "Could not allocate %lu bytes to read from socket %d", buflen, socket);
             goto exit;
         }
+        if (queue->slab == NULL) { atomic_init(&slab->refcount, 1); }
+        queue->slab = slab;
+        queue->buf = slab->data;
+        queue->buflen = buflen;
     }
+
+    *space = queue->buflen - queue->datalen;
+    buf = queue->buf + queue->datalen;
 exit:
-    FUNC_EXIT_RC(rc);
-    return rc;  /* there was no queued char if rc is SOCKETBUFFER_INTERRUPTED*/
+    FUNC_EXIT;
+    return buf;
 }
 
-void SocketBuffer_interrupted(int socket, size_t actual_len)
+SocketBuffer_slab* SocketBuffer_retain(int socket, char const* data)
 {
-    socket_queue* queue = NULL;
-    
+    SocketBuffer_slab* slab = NULL;
+    Socket_entry* entry = Socket_getEntry(socket);
+
     FUNC_ENTRY;
-    if (ListFindItem(queues, &socket, socketcompare))
-    {
-        queue = (socket_queue*)(queues->current->content);
-    }
-    else /* new saved queue */
+    if (entry && entry->queue && entry->queue->slab)
     {
-        queue = def_queue;
-        ListAppend(queues, def_queue, sizeof(socket_queue)+def_queue->buflen);
-        SocketBuffer_newDefQ();
+        socket_queue* queue = entry->queue;
+        if (data >= queue->buf && data < queue->buf + queue->buflen)
+        {
+            slab = queue->slab;
+            atomic_fetch_add(&slab->refcount, 1);
+        }
     }
-    queue->index = 0;
-    queue->datalen = actual_len;
     FUNC_EXIT;
+    return slab;
 }
 
-char* SocketBuffer_complete(int socket)
+void SocketBuffer_release(SocketBuffer_slab* slab)
 {
-    FUNC_ENTRY;
-    if (ListFindItem(queues, &socket, socketcompare))
-    {
-        socket_queue* queue = (socket_queue*)(queues->current->content);
-        SocketBuffer_freeDefQ();
-        def_queue = queue;
-        ListDetach(queues, queue);
-    }
-    def_queue->socket = def_queue->index = def_queue->headerlen = def_queue->datalen = 0;
-    FUNC_EXIT;
-    return def_queue->buf;
+    if (atomic_fetch_sub(&slab->refcount, 1) == 1) { free(slab); }
 }
 
-void SocketBuffer_queueChar(int socket, char c)
+void SocketBuffer_received(int socket, size_t bytes)
 {
-    int error = 0;
-    socket_queue* curq = def_queue;
-    
+    Socket_entry* entry = Socket_getEntry(socket);
+
     FUNC_ENTRY;
-    if (ListFindItem(queues, &socket, socketcompare))
-        curq = (socket_queue*)(queues->current->content);
-    else if (def_queue->socket == 0)
+    if (entry && entry->queue)
     {
-        def_queue->socket = socket;
-        def_queue->index = def_queue->datalen = 0;
+        socket_queue* queue = entry->queue;
+        queue->datalen += bytes;
+        Log(TRACE_MAX, -1, "%lu bytes received, %lu bytes now queued for socket %d", bytes, queue->datalen - queue->start, socket);
     }
-    else if (def_queue->socket != socket)
-    {
-        Log(LOG_FATAL, -1, "attempt to reuse socket queue");
-        error = 1;
-    }
-    if (curq->index > 4)
-    {
-        Log(LOG_FATAL, -1, "socket queue fixed_header field full");
-        error = 1;
-    }
-    if (!error)
-    {
-        curq->fixed_header[(curq->index)++] = c;
-        curq->headerlen = curq->index;
-    }
-    Log(TRACE_MAX, -1, "queueChar: index is now %d, headerlen %d", curq->index, curq->headerlen);
     FUNC_EXIT;
 }
 
+void SocketBuffer_lockWrites(void)
+{
+    Thread_lock_mutex(write_mutex);
+}
+
+void SocketBuffer_unlockWrites(void)
+{
+    Thread_unlock_mutex(write_mutex);
+}
+
 #if defined(OPENSSL)
-void SocketBuffer_pendingWrite(int socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
+pending_writes* SocketBuffer_pendingWrite(int socket, SSL* ssl, int count, iobuf* iovecs, int* frees, SocketBuffer_stream const* stream, size_t total, size_t bytes)
 #else
-void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
+pending_writes* SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int* frees, SocketBuffer_stream const* stream, size_t total, size_t bytes)
 #endif
 {
+    pending_writes* pw = NULL;
+    write_queue* queue = SocketBuffer_getWrites(socket);
+
     FUNC_ENTRY;
-    /* store the buffers until the whole packet is written */
-    pending_writes* pw = malloc(sizeof(pending_writes));
+    if (queue == NULL)
+    {
+        Log(LOG_SEVERE, -1, "Pending write for socket %d which was never added", socket);
+        goto exit;
+    }
+
+    /* store the buffers until the whole packet is written, copying those only lent for the call */
+    pw = malloc(sizeof(pending_writes));
+    pw->next = NULL;
+    pw->id = ++queue->ids;
     pw->socket = socket;
     #if defined(OPENSSL)
     pw->ssl = ssl;
@@ -202,90 +218,168 @@ void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int* frees,
     pw->bytes = bytes;
     pw->total = total;
     pw->count = count;
+    pw->stream = stream;
+    pw->chunk = NULL;
+    pw->chunkstart = pw->chunklen = 0;
+    size_t copied = 0;
     for (int i = 0; i < count; i++)
     {
         pw->iovecs[i] = iovecs[i];
         pw->frees[i] = frees[i];
+        if (frees[i] != SOCKETBUFFER_COPY) { continue; }
+
+        size_t const len = iovecs[i].iov_len;
+        bool const fits = (copied + len <= SOCKETBUFFER_HEADER_SIZE);
+        char* copy = (fits) ? pw->header + copied : malloc(len);
+        memcpy(copy, iovecs[i].iov_base, len);
+        pw->iovecs[i].iov_base = copy;
+        pw->frees[i] = (fits) ? 0 : 1;
+        if (fits) { copied += len; }
+    }
+
+    if (queue->last) {
+        queue->last->next = pw;
+    } else {
+        queue->first = pw;
+    }
+    queue->last = pw;
+    queue->bytes += total - bytes;
+    queue->segments += count;
+exit:
+    FUNC_EXIT;
+    return pw;
+}
+
+long SocketBuffer_produce(pending_writes* pw, char** data)
+{
+    long rc = 0;
+    SocketBuffer_stream const* stream = pw->stream;
+
+    FUNC_ENTRY;
+    size_t headerlen = 0;
+    for (int i = 0; i < pw->count; i++) { headerlen += pw->iovecs[i].iov_len; }
+    size_t const offset = (pw->bytes > headerlen) ? pw->bytes - headerlen : 0;  // Bytes of the payload written
+    if (offset >= (size_t)stream->length) { goto exit; }
+
+    if (offset == pw->chunkstart + pw->chunklen)
+    {   // The chunk has all been written: read the next one into the same memory.
+        size_t const size = min(stream->chunksize, (size_t)stream->length - offset);
+        if (pw->chunk == NULL && (pw->chunk = malloc(stream->chunksize)) == NULL)
+        {
+            Log(LOG_ERROR, -1, "Could not allocate %lu bytes to stream a payload to socket %d", stream->chunksize, pw->socket);
+            rc = SOCKET_ERROR;
+            goto exit;
+        }
+        long const len = (stream->fd >= 0) ? (long)pread(stream->fd, pw->chunk, size, stream->fdoffset + (off_t)offset) : (*stream->producer)(stream->context, pw->chunk, size, offset);
+        if (len <= 0 || (size_t)len > size)
+        {   // The packet length is already on the wire, so a payload cut short leaves nothing to do but drop the connection.
+            Log(LOG_ERROR, -1, "Streamed payload of %ld bytes could not be read at offset %lu for socket %d", stream->length, offset, pw->socket);
+            rc = SOCKET_ERROR;
+            goto exit;
+        }
+        pw->chunkstart = offset;
+        pw->chunklen = (size_t)len;
     }
-    ListAppend(&writes, pw, sizeof(pw) + total);
+    *data = pw->chunk + (offset - pw->chunkstart);
+    rc = (long)(pw->chunkstart + pw->chunklen - offset);
+exit:
     FUNC_EXIT;
+    return rc;
+}
+
+write_queue* SocketBuffer_getWrites(int socket)
+{
+    Socket_entry* entry = Socket_getEntry(socket);
+    return (entry) ? &entry->writes : NULL;
 }
 
 pending_writes* SocketBuffer_getWrite(int socket)
 {
-    ListElement* le = ListFindItem(&writes, &socket, pending_socketcompare);
-    return (le) ? (pending_writes*)(le->content) : NULL;
+    write_queue* queue = SocketBuffer_getWrites(socket);
+    return (queue) ? queue->first : NULL;
 }
 
-int SocketBuffer_writeComplete(int socket)
+pending_writes* SocketBuffer_writeComplete(int socket)
 {
-    return ListRemoveItem(&writes, &socket, pending_socketcompare);
+    write_queue* queue = SocketBuffer_getWrites(socket);
+    pending_writes* pw = (queue) ? queue->first : NULL;
+    if (pw == NULL) { return NULL; }
+
+    if ((queue->first = pw->next) == NULL) { queue->last = NULL; }
+    queue->bytes -= pw->total - pw->bytes;
+    queue->segments -= pw->count;
+    pw->next = NULL;
+    return pw;
 }
 
-pending_writes* SocketBuffer_updateWrite(int socket, char* topic, char* payload)
+void SocketBuffer_freeWrite(pending_writes* pw)
 {
-    pending_writes* pw = NULL;
-    ListElement* le = NULL;
-    
-    FUNC_ENTRY;
-    if ((le = ListFindItem(&writes, &socket, pending_socketcompare)) != NULL)
+    /* topic and payload buffers are freed elsewhere, when all references to them have been removed */
+    for (int i = 0; i < pw->count; i++)
     {
-        pw = (pending_writes*)(le->content);
-        if (pw->count == 4)
-        {
-            pw->iovecs[2].iov_base = topic;
-            pw->iovecs[3].iov_base = payload;
-        }
+        if (pw->frees[i])
+            free(pw->iovecs[i].iov_base);
     }
-    
-    FUNC_EXIT;
-    return pw;
+    free(pw->chunk);
+    free(pw);
 }
 
-#pragma mark - Private functionality
-
-/*!
- *  @abstract Create a new default queue when one has just been used.
- */
-void SocketBuffer_newDefQ(void)
+size_t SocketBuffer_queuedBytes(int socket)
 {
-    def_queue = malloc(sizeof(socket_queue));
-    def_queue->buflen = 1000;
-    def_queue->buf = malloc(def_queue->buflen);
-    def_queue->socket = def_queue->index = def_queue->buflen = def_queue->datalen = 0;
+    SocketBuffer_lockWrites();
+    write_queue const* queue = SocketBuffer_getWrites(socket);
+    size_t const bytes = (queue) ? queue->bytes : 0;
+    SocketBuffer_unlockWrites();
+    return bytes;
 }
 
-/*!
- *  @abstract Free the default queue memory
- */
-void SocketBuffer_freeDefQ(void)
+pending_writes* SocketBuffer_updateWrite(int socket, unsigned long id, char* topic, char* payload)
 {
-    free(def_queue->buf);
-    free(def_queue);
-}
+    pending_writes* pw = NULL;
 
-#pragma mark Comparison functions
+    FUNC_ENTRY;
+    SocketBuffer_lockWrites();
+    write_queue* queue = SocketBuffer_getWrites(socket);
+    for (pw = (queue) ? queue->first : NULL; pw && pw->id != id; pw = pw->next);
+    if (pw && pw->count >= 2)
+    {   // The topic comes right after the fixed header, the payload last (MQTT 5 puts the properties in between) unless it is streamed.
+        pw->iovecs[1].iov_base = topic;
+        if (pw->stream == NULL && pw->count >= 3) { pw->iovecs[pw->count - 1].iov_base = payload; }
+    }
+    SocketBuffer_unlockWrites();
 
-/*!
- *  @abstract List callback function for comparing socket_queues by socket
- *
- *  @param a First integer value
- *  @param b Second integer value
- *  @return Boolean indicating whether a and b are equal
- */
-bool socketcompare(void const* a, void const* b)
+    FUNC_EXIT;
+    return pw;
+}
+
+unsigned long SocketBuffer_lastWriteId(int socket)
 {
-    return (((socket_queue*)a)->socket == *(int*)b) ? true : false;
+    SocketBuffer_lockWrites();
+    write_queue const* queue = SocketBuffer_getWrites(socket);
+    unsigned long const id = (queue) ? queue->ids : 0;
+    SocketBuffer_unlockWrites();
+    return id;
 }
 
+#pragma mark - Private functionality
+
 /*!
- *  @abstract List callback function for comparing pending_writes by socket
+ *  @abstract Get the input buffer of a socket, creating an empty one if the socket has none yet.
  *
- *  @param a First integer value.
- *  @param b Second integer value.
- *  @return Boolean indicating whether a and b are equal.
+ *  @param socket the socket.
+ *  @return the input buffer, or NULL if the socket was never added or memory could not be allocated.
  */
-bool pending_socketcompare(void const * a, void const* b)
+socket_queue* SocketBuffer_getQueue(int socket)
 {
-    return (((pending_writes*)a)->socket == *(int*)b) ? true : false;
+    Socket_entry* entry = Socket_getEntry(socket);
+    if (entry == NULL) { return NULL; }
+    if (entry->queue) { return entry->queue; }
+
+    socket_queue* queue = malloc(sizeof(socket_queue));
+    if (queue == NULL) { return NULL; }
+    queue->buflen = queue->start = queue->datalen = 0;
+    queue->buf = NULL;
+    queue->slab = NULL;
+    entry->queue = queue;
+    return queue;
 }
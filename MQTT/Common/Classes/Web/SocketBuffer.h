@@ -5,6 +5,8 @@
 #pragma once
 
 #include <sys/socket.h>     // Unix (System)
+#include <sys/types.h>      // Unix (System)
+#include <stdatomic.h>      // C Standard
 #if defined(OPENSSL)
 #include <openssl/ssl.h>    // OpenSSL
 #endif
@@ -13,28 +15,100 @@
 
 typedef struct iovec iobuf;
 
+/*!
+ *  @abstract Memory a socket receives data into.
+ *  @discussion Messages delivered without copying point into it (see SocketBuffer_retain), so it is reference counted: it is freed when neither the socket nor any message uses it any more.
+ *
+ *  @field refcount One reference from the socket while it receives into the slab, plus one per message pointing into it.
+ *  @field data The received bytes.
+ */
+typedef struct
+{
+    atomic_int refcount;
+    char data[];
+} SocketBuffer_slab;
+
+/*!
+ *  @abstract Read buffer of a socket.
+ *  @discussion Bytes are received in bulk at datalen and MQTT packets are taken out from start, so that any partial packet at the tail is carried forward to the next read. While messages point into the slab, the socket moves on to a new one instead of overwriting it.
+ */
 typedef struct
 {
-	int socket;
-	int index, headerlen;
-	char fixed_header[5];	// Header plus up to 4 length bytes
     size_t buflen; 			// Total length of the buffer
-    size_t datalen; 		// current length of data in buf
-	char* buf;
+    size_t start;           // Offset of the first byte not yet taken out
+    size_t datalen; 		// Offset one past the last byte received
+	char* buf;              // The data of slab
+	SocketBuffer_slab* slab;
 } socket_queue;
 
+#define SOCKETBUFFER_HEADER_SIZE 16  // Room in a queued packet for the buffers it was only lent: fixed header, topic length and message id.
+
+#define SOCKETBUFFER_COPY 2     // frees value of a buffer only valid during the write call: it is copied into the packet if the packet has to be queued.
+
+#define SOCKETBUFFER_CHUNK_SIZE 65536   // Default size of the chunks a streamed payload is read in.
+
+/*!
+ *  @abstract Function producing the bytes of a streamed payload, starting at offset, into buffer.
+ *  @return the number of bytes produced, at least 1 and at most size, or a negative value if the payload can not be produced.
+ */
+typedef long SocketBuffer_producer(void* context, void* buffer, size_t size, size_t offset);
+
+/*!
+ *  @abstract A payload written to a socket as it is read, chunk by chunk, rather than held in memory whole.
+ *  @discussion The bytes come from a file descriptor if fd is not negative, or else from producer. A packet is resent from the start of its payload, so either must be able to produce any part of it again.
+ */
 typedef struct
 {
+    long length;                        // Length of the payload
+    SocketBuffer_producer* producer;    // Produces the payload when fd is negative
+    void* context;                      // Passed to producer
+    int fd;                             // File descriptor to read the payload from, or -1
+    off_t fdoffset;                     // Offset of the payload in fd
+    size_t chunksize;                   // Most bytes held in memory at once while writing the payload
+} SocketBuffer_stream;
+
+/*!
+ *  @abstract A packet queued for writing to a socket.
+ */
+typedef struct pending_writes
+{
+	struct pending_writes* next;    // Next packet queued for the same socket
+	unsigned long id;               // Sequence number of the packet on its socket (see SocketBuffer_lastWriteId)
 	int socket, count;
     #if defined(OPENSSL)
 	SSL* ssl;
     #endif
-	size_t bytes;
-    size_t total;
+	size_t bytes;                   // Bytes of the packet already written
+    size_t total;                   // Length of the whole packet
 	iobuf iovecs[5];
 	int frees[5];
+	char header[SOCKETBUFFER_HEADER_SIZE];  // Copies of the buffers the packet was only lent (SOCKETBUFFER_COPY)
+	SocketBuffer_stream const* stream;      // Payload written after the buffers, or NULL
+	char* chunk;                            // Part of the streamed payload read but not written yet
+	size_t chunkstart;                      // Offset in the payload of the start of chunk
+	size_t chunklen;                        // Bytes of the payload in chunk
 } pending_writes;
 
+/*!
+ *  @abstract The packets waiting to be written to a socket, oldest first.
+ */
+typedef struct
+{
+	pending_writes* first;
+	pending_writes* last;
+	size_t bytes;                   // Bytes queued and not written yet
+	int segments;                   // Buffers queued, i.e. iovecs needed to write them all
+	unsigned long ids;              // Packets ever queued on the socket, used to number them
+	unsigned long packets;          // Packets sent on the connection, queued or not
+	unsigned long writes;           // Write system calls made for them
+} write_queue;
+
+#define SOCKETBUFFER_READ_SIZE 16384   // Smallest read attempted, and the size read buffers shrink back to.
+
+#if !defined(SOCKETBUFFER_MAX_QUEUED)
+    #define SOCKETBUFFER_MAX_QUEUED 1048576    // Queued output, in bytes, above which a socket takes no new work until some is written.
+#endif
+
 #define SOCKETBUFFER_COMPLETE 0
 #if !defined(SOCKET_ERROR)
 	#define SOCKET_ERROR -1
@@ -44,82 +118,119 @@ typedef struct
 #pragma mark Public API
 
 /*!
- *  @abstract Initialize the socketBuffer module
+ *  @abstract Cleanup any buffers for a specific socket.
+ *  @discussion The buffers live in the socket table entry of the socket (see Socket_getEntry). A partial write still pending is dropped.
+ *
+ *  @param socket The socket to clean up.
  */
-void SocketBuffer_initialize(void);
+void SocketBuffer_cleanup(int socket);
 
 /*!
- *  @abstract Terminate the socketBuffer module
+ *  @abstract Get the received data of a socket that has not been taken out yet.
+ *
+ *  @param socket the socket to get queued data for
+ *  @param len the number of bytes queued, returned
+ *  @return pointer to the queued data, or NULL if there is none
  */
-void SocketBuffer_terminate(void);
+char* SocketBuffer_getQueuedData(int socket, size_t* len);
 
 /*!
- *  @abstract Cleanup any buffers for a specific socket.
+ *  @abstract Take bytes out from the front of the queued data of a socket.
+ *  @discussion The bytes stay in place until the next call to SocketBuffer_getReadSpace for the socket, so packets can keep pointing into them while they are handled.
  *
- *  @param socket The socket to clean up.
+ *  @param socket the socket
+ *  @param bytes the number of bytes to take out
  */
-void SocketBuffer_cleanup(int socket);
+void SocketBuffer_consume(int socket, size_t bytes);
 
 /*!
- *  @abstract Get any queued data for a specific socket
+ *  @abstract Get room to receive more data for a socket.
+ *  @discussion Any partial packet is moved to the front of the buffer, and the buffer is grown so that it can hold at least bytes of queued data.
  *
- *  @param socket the socket to get queued data for
- *  @param bytes the number of bytes of data to retrieve
- *  @param actual_len the actual length returned
- *  @return the actual data
+ *  @param socket the socket to receive data for
+ *  @param bytes the number of queued bytes the buffer must be able to hold
+ *  @param space the number of bytes that can be received, returned
+ *  @return where to receive the data, or NULL if memory could not be allocated
  */
-char* SocketBuffer_getQueuedData(int socket, size_t bytes, size_t* actual_len);
+char* SocketBuffer_getReadSpace(int socket, size_t bytes, size_t* space);
 
 /*!
- *  @abstract Get any queued character for a specific socket
+ *  @abstract Keep the received data some bytes lie in, beyond the next read from the socket.
+ *  @discussion The data is not moved or overwritten until every reference taken is released with SocketBuffer_release.
  *
- *  @param socket the socket to get queued data for
- *  @param c the character returned if any
- *  @return completion code
+ *  @param socket the socket the data was received on
+ *  @param data a byte of the data taken out of the read buffer
+ *  @return the slab holding the data, or NULL if data is not in the read buffer of the socket
  */
-int SocketBuffer_getQueuedChar(int socket, char* c);
+SocketBuffer_slab* SocketBuffer_retain(int socket, char const* data);
 
 /*!
- *  @abstract A socket read was interrupted so we need to queue data
+ *  @abstract Release a reference taken with SocketBuffer_retain. May be called from any thread.
  *
- *  @param socket the socket to get queued data for
- *  @param actual_len the actual length of data that was read
+ *  @param slab the slab.
  */
-void SocketBuffer_interrupted(int socket, size_t actual_len);
+void SocketBuffer_release(SocketBuffer_slab* slab);
 
 /*!
- *  @abstract A socket read has now completed so we can get rid of the queue
+ *  @abstract Data has been received into the space returned by SocketBuffer_getReadSpace.
  *
- *  @param socket the socket for which the operation is now complete
- *  @return pointer to the default queue data
+ *  @param socket the socket the data was received for
+ *  @param bytes the number of bytes received
  */
-char* SocketBuffer_complete(int socket);
+void SocketBuffer_received(int socket, size_t bytes);
 
 /*!
- *  @abstract A socket operation had now completed so we can get rid of the queue
- *
- *  @param socket The socket for which the operation is now complete
- *  @param c The character to queue
+ *  @abstract Take the lock guarding the write queues.
+ *  @discussion Packets are queued by the threads sending MQTT packets, and written out by the thread waiting for socket readiness. Hold the lock around SocketBuffer_pendingWrite, SocketBuffer_getWrites, SocketBuffer_getWrite and SocketBuffer_writeComplete, and around the writes they describe, so that packets go out in order.
  */
-void SocketBuffer_queueChar(int socket, char c);
+void SocketBuffer_lockWrites(void);
 
 /*!
- *  @abstrac A socket write was interrupted so store the remaining data
+ *  @abstract Release the lock guarding the write queues.
+ */
+void SocketBuffer_unlockWrites(void);
+
+/*!
+ *  @abstrac Queue the unwritten part of a packet for a socket, behind any packets already queued.
+ *  @note Call with the write lock held.
  *
- *  @param socket The socket for which the write was interrupted
+ *  @param socket The socket to write to
  *  @param count The number of iovec buffers
  *  @param iovecs Buffer array
+ *  @param frees Whether each buffer is freed once the packet has been written, or SOCKETBUFFER_COPY if it must be copied
+ *  @param stream The payload streamed after the buffers, or NULL. It must outlive the packet.
  *  @param total Total data length to be written
  *  @param bytes Actual data length that was written
+ *  @return the queued packet, or NULL if the socket was never added
  */
 #if defined(OPENSSL)
-void SocketBuffer_pendingWrite(int socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes);
+pending_writes* SocketBuffer_pendingWrite(int socket, SSL* ssl, int count, iobuf* iovecs, int* frees, SocketBuffer_stream const* stream, size_t total, size_t bytes);
 #else
-void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes);
+pending_writes* SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int* frees, SocketBuffer_stream const* stream, size_t total, size_t bytes);
 #endif
 
 /*!
- *  @abstrac Get any queued write data for a specific socket
+ *  @abstract Get the unwritten part of the streamed payload of a queued packet, reading the next chunk of it once the previous one has been written.
+ *  @note Call with the write lock held.
+ *
+ *  @param pw the packet, which has a stream and whose buffers have all been written.
+ *  @param data the unwritten bytes, returned.
+ *  @return the number of unwritten bytes, 0 if the payload has all been written, or SOCKET_ERROR if it could not be read.
+ */
+long SocketBuffer_produce(pending_writes* pw, char** data);
+
+/*!
+ *  @abstract Get the write queue of a socket.
+ *  @note Call with the write lock held.
+ *
+ *  @param socket the socket
+ *  @return the queue, or NULL if the socket was never added
+ */
+write_queue* SocketBuffer_getWrites(int socket);
+
+/*!
+ *  @abstrac Get the oldest packet queued for writing to a socket
+ *  @note Call with the write lock held.
  *
  *  @param socket the socket to get queued data for
  *  @return pointer to the queued data or NULL
@@ -127,19 +238,46 @@ void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int* frees,
 pending_writes* SocketBuffer_getWrite(int socket);
 
 /*!
- *  @abstrac A socket write has now completed so we can get rid of the queue
+ *  @abstrac The oldest packet queued for a socket has now been written, so take it off the queue.
+ *  @note Call with the write lock held.
  *
  *  @param socket the socket for which the operation is now complete
- *  @return completion code, boolean - was the queue removed?
+ *  @return the packet, to be released with SocketBuffer_freeWrite, or NULL if nothing was queued
  */
-int SocketBuffer_writeComplete(int socket);
+pending_writes* SocketBuffer_writeComplete(int socket);
 
 /*!
- *  @abstrac Update the queued write data for a socket in the case of QoS 0 messages.
+ *  @abstract Free a packet taken off a write queue, and the buffers it owns.
  *
- *  @param socket the socket for which the operation is now complete
+ *  @param pw the packet
+ */
+void SocketBuffer_freeWrite(pending_writes* pw);
+
+/*!
+ *  @abstract Get the number of bytes queued for writing to a socket.
+ *
+ *  @param socket the socket
+ *  @return the number of bytes not written yet
+ */
+size_t SocketBuffer_queuedBytes(int socket);
+
+/*!
+ *  @abstrac Update a packet still queued for a socket in the case of QoS 0 messages, so that it points to saved copies of the topic and payload.
+ *  @discussion Takes the write lock. The topic must be the buffer after the fixed header, and the payload the last one (see MQTTPacket_send_publish), unless it is streamed.
+ *
+ *  @param socket the socket the packet is queued for
+ *  @param id the id of the packet (see SocketBuffer_lastWriteId)
  *  @param topic the topic of the QoS 0 write
  *  @param payload the payload of the QoS 0 write
- *  @return pointer to the updated queued data structure, or NULL
+ *  @return pointer to the updated queued data structure, or NULL if the packet has already been written
+ */
+pending_writes* SocketBuffer_updateWrite(int socket, unsigned long id, char* topic, char* payload);
+
+/*!
+ *  @abstract Get the id of the newest packet queued for a socket, i.e. the one queued by the last interrupted write.
+ *  @discussion Takes the write lock. The id stays valid after the packet has been written, to be matched with the packet passed to the write complete callback (see Socket_setWriteCompleteCallback).
+ *
+ *  @param socket the socket
+ *  @return the id, or 0 if nothing was ever queued
  */
-pending_writes* SocketBuffer_updateWrite(int socket, char* topic, char* payload);
+unsigned long SocketBuffer_lastWriteId(int socket);
@@ -0,0 +1,648 @@
+#include "SocketPoll.h"     // Header
+#include "Socket.h"         // MQTT (Web)
+#include "Log.h"            // MQTT (Utilities)
+#include "StackTrace.h"     // MQTT (Utilities)
+
+#include <string.h>         // C Standard
+#include <errno.h>          // C Standard
+#include <unistd.h>         // POSIX
+#include <sys/select.h>     // POSIX
+
+#if !defined(USE_SELECT)
+    #if defined(__linux__)
+        #define SOCKETPOLL_EPOLL
+        #include <sys/epoll.h>      // Linux
+        #if defined(USE_IO_URING)
+            #define SOCKETPOLL_IO_URING
+            #include <linux/io_uring.h> // Linux
+            #include <sys/syscall.h>    // Linux
+            #include <sys/mman.h>       // POSIX
+            #include <stdint.h>         // C Standard
+        #endif
+    #elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+        #define SOCKETPOLL_KQUEUE
+        #include <sys/event.h>      // Darwin/BSD
+    #endif
+#endif
+
+#if defined(SOCKETPOLL_IO_URING)
+    #include "Thread.h"             // MQTT (Utilities)
+    #include "Heap.h"               // MQTT (Utilities)
+
+    #define SOCKETPOLL_URING_ENTRIES 256    // Submission queue entries. Every poll request is submitted straight away, so this only bounds a burst of changes.
+
+    // The user data of a request tells the socket, which of its polls the request is and the generation of the socket (so completions left over from a closed socket are ignored once its descriptor is reused).
+    #define SOCKETPOLL_URING_READ   0ULL
+    #define SOCKETPOLL_URING_WRITE  1ULL
+    #define SOCKETPOLL_URING_IGNORE 2ULL    // Poll removals. Their completions carry no readiness.
+    #define SOCKETPOLL_URING_TAG(gen, kind, socket) (((uint64_t)(gen) << 32) | ((kind) << 30) | (uint64_t)(socket))
+#endif
+
+#pragma mark - Private prototypes
+
+int SocketPoll_selectInitialize(void);
+void SocketPoll_selectTerminate(void);
+int SocketPoll_selectAdd(int socket);
+void SocketPoll_selectRemove(int socket);
+void SocketPoll_selectSetWriteInterest(int socket, int on);
+int SocketPoll_selectWait(struct timeval* timeout, SocketPoll_event* events, int maxevents);
+
+#if defined(SOCKETPOLL_EPOLL)
+int SocketPoll_epollInitialize(void);
+void SocketPoll_epollTerminate(void);
+int SocketPoll_epollAdd(int socket);
+void SocketPoll_epollRemove(int socket);
+void SocketPoll_epollSetWriteInterest(int socket, int on);
+int SocketPoll_epollWait(struct timeval* timeout, SocketPoll_event* events, int maxevents);
+#endif
+
+#if defined(SOCKETPOLL_IO_URING)
+int SocketPoll_uringInitialize(void);
+void SocketPoll_uringTerminate(void);
+int SocketPoll_uringAdd(int socket);
+void SocketPoll_uringRemove(int socket);
+void SocketPoll_uringSetWriteInterest(int socket, int on);
+int SocketPoll_uringWait(struct timeval* timeout, SocketPoll_event* events, int maxevents);
+int SocketPoll_uringWatch(int socket, uint64_t kind);
+void SocketPoll_uringCancel(int socket, uint64_t kind);
+struct io_uring_sqe* SocketPoll_uringGetSQE(void);
+int SocketPoll_uringSubmit(void);
+#endif
+
+#if defined(SOCKETPOLL_KQUEUE)
+int SocketPoll_kqueueInitialize(void);
+void SocketPoll_kqueueTerminate(void);
+int SocketPoll_kqueueAdd(int socket);
+void SocketPoll_kqueueRemove(int socket);
+void SocketPoll_kqueueSetWriteInterest(int socket, int on);
+int SocketPoll_kqueueWait(struct timeval* timeout, SocketPoll_event* events, int maxevents);
+#endif
+
+#pragma mark - Variables
+
+static SocketPoll_backend const select_backend = {
+    "select", 0, 0,
+    SocketPoll_selectInitialize, SocketPoll_selectTerminate, SocketPoll_selectAdd, SocketPoll_selectRemove,
+    SocketPoll_selectSetWriteInterest, SocketPoll_selectWait
+};
+static fd_set select_rset;      // Sockets watched for reading.
+static fd_set select_wset;      // Sockets watched for writing.
+static int select_maxfdp1 = 0;  // Max descriptor watched +1.
+
+#if defined(SOCKETPOLL_EPOLL)
+static SocketPoll_backend const native_backend = {
+    "epoll", 1, 1,
+    SocketPoll_epollInitialize, SocketPoll_epollTerminate, SocketPoll_epollAdd, SocketPoll_epollRemove,
+    SocketPoll_epollSetWriteInterest, SocketPoll_epollWait
+};
+static int epoll_fd = -1;
+
+#if defined(SOCKETPOLL_IO_URING)
+static SocketPoll_backend const uring_backend = {
+    "io_uring", 1, 1,
+    SocketPoll_uringInitialize, SocketPoll_uringTerminate, SocketPoll_uringAdd, SocketPoll_uringRemove,
+    SocketPoll_uringSetWriteInterest, SocketPoll_uringWait
+};
+static struct
+{
+    int fd;                         // The ring descriptor, or -1.
+    void* rings;                    // Submission and completion rings (mapped together, IORING_FEAT_SINGLE_MMAP).
+    size_t rings_size;
+    struct io_uring_sqe* sqes;      // Submission queue entries.
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    struct
+    {
+        unsigned gen;               // Bumped every time the descriptor is added.
+        int write;                  // Whether write readiness is being watched.
+    }* sockets;                     // Indexed by socket descriptor.
+    int nsockets;
+} uring = { .fd = -1 };
+static pthread_mutex_t uring_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t* uring_mutex = &uring_mutex_store;  // Guards the submission queue and the socket table. The completion queue is only read by the waiting thread.
+#endif
+#elif defined(SOCKETPOLL_KQUEUE)
+static SocketPoll_backend const native_backend = {
+    "kqueue", 1, 1,
+    SocketPoll_kqueueInitialize, SocketPoll_kqueueTerminate, SocketPoll_kqueueAdd, SocketPoll_kqueueRemove,
+    SocketPoll_kqueueSetWriteInterest, SocketPoll_kqueueWait
+};
+static int kqueue_fd = -1;
+#endif
+
+static SocketPoll_backend const* const backends[] = {
+    #if defined(SOCKETPOLL_IO_URING)
+    &uring_backend,
+    #endif
+    #if defined(SOCKETPOLL_EPOLL) || defined(SOCKETPOLL_KQUEUE)
+    &native_backend,
+    #endif
+    &select_backend
+};
+
+#pragma mark - Public API
+
+SocketPoll_backend const* SocketPoll_initialize(void)
+{
+    SocketPoll_backend const* backend = &select_backend;
+
+    FUNC_ENTRY;
+    #if defined(SOCKETPOLL_IO_URING)
+    if (uring_backend.initialize() == 0)
+    {
+        backend = &uring_backend;
+        goto exit;
+    }
+    Log(LOG_ERROR, -1, "Could not initialize %s (%s), falling back to %s", uring_backend.name, strerror(errno), native_backend.name);
+    #endif
+
+    #if defined(SOCKETPOLL_EPOLL) || defined(SOCKETPOLL_KQUEUE)
+    if (native_backend.initialize() == 0) {
+        backend = &native_backend;
+    } else {
+        Log(LOG_ERROR, -1, "Could not initialize %s (%s), falling back to select", native_backend.name, strerror(errno));
+    }
+    #endif
+
+    if (backend == &select_backend) { backend->initialize(); }
+#if defined(SOCKETPOLL_IO_URING)
+exit:
+#endif
+    Log(TRACE_MIN, -1, "Using %s for socket readiness", backend->name);
+    FUNC_EXIT;
+    return backend;
+}
+
+SocketPoll_backend const* const* SocketPoll_backends(int* count)
+{
+    *count = sizeof(backends) / sizeof(backends[0]);
+    return backends;
+}
+
+#pragma mark - Private functionality
+
+int SocketPoll_selectInitialize(void)
+{
+    FD_ZERO(&select_rset);
+    FD_ZERO(&select_wset);
+    select_maxfdp1 = 0;
+    return 0;
+}
+
+void SocketPoll_selectTerminate(void)
+{
+    SocketPoll_selectInitialize();
+}
+
+int SocketPoll_selectAdd(int socket)
+{
+    if (socket >= FD_SETSIZE)
+    {
+        Log(LOG_ERROR, -1, "Socket %d is beyond the select limit of %d descriptors", socket, FD_SETSIZE);
+        errno = EMFILE;
+        return SOCKET_ERROR;
+    }
+    FD_SET(socket, &select_rset);
+    select_maxfdp1 = max(select_maxfdp1, socket + 1);
+    return 0;
+}
+
+void SocketPoll_selectRemove(int socket)
+{
+    if (socket >= FD_SETSIZE) { return; }
+
+    FD_CLR(socket, &select_rset);
+    FD_CLR(socket, &select_wset);
+    if (socket + 1 >= select_maxfdp1)
+    {
+        while (select_maxfdp1 > 0 && !FD_ISSET(select_maxfdp1 - 1, &select_rset)) { --select_maxfdp1; }
+        Log(TRACE_MAX, -1, "Reset max fdp1 to %d", select_maxfdp1);
+    }
+}
+
+void SocketPoll_selectSetWriteInterest(int socket, int on)
+{
+    if (socket >= FD_SETSIZE) { return; }
+
+    if (on) {
+        FD_SET(socket, &select_wset);
+    } else {
+        FD_CLR(socket, &select_wset);
+    }
+}
+
+int SocketPoll_selectWait(struct timeval* timeout, SocketPoll_event* events, int maxevents)
+{
+    fd_set rset, wset;
+    int rc, count = 0;
+
+    memcpy((void*)&rset, (void*)&select_rset, sizeof(rset));
+    memcpy((void*)&wset, (void*)&select_wset, sizeof(wset));
+    if ((rc = select(select_maxfdp1, &rset, &wset, NULL, timeout)) == SOCKET_ERROR) {
+        return (errno == EINTR) ? 0 : SOCKET_ERROR;
+    }
+
+    for (int fd = 0; rc > 0 && fd < select_maxfdp1 && count < maxevents; ++fd)
+    {
+        int const ev = (FD_ISSET(fd, &rset) ? SOCKETPOLL_READ : 0) | (FD_ISSET(fd, &wset) ? SOCKETPOLL_WRITE : 0);
+        if (ev == 0) { continue; }
+
+        events[count].socket = fd;
+        events[count++].events = ev;
+        rc -= (ev == (SOCKETPOLL_READ|SOCKETPOLL_WRITE)) ? 2 : 1;
+    }
+    return count;
+}
+
+#if defined(SOCKETPOLL_EPOLL)
+
+int SocketPoll_epollInitialize(void)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return (epoll_fd == -1) ? SOCKET_ERROR : 0;
+}
+
+void SocketPoll_epollTerminate(void)
+{
+    if (epoll_fd != -1) { close(epoll_fd); }
+    epoll_fd = -1;
+}
+
+int SocketPoll_epollAdd(int socket)
+{
+    struct epoll_event ev = { EPOLLIN | EPOLLRDHUP | EPOLLET, { .fd = socket } };
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &ev);
+}
+
+void SocketPoll_epollRemove(int socket)
+{
+    struct epoll_event ev = { 0, { .fd = socket } };  // Kernels before 2.6.9 require a non-null event even for EPOLL_CTL_DEL.
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket, &ev);
+}
+
+void SocketPoll_epollSetWriteInterest(int socket, int on)
+{
+    // Re-arming with EPOLL_CTL_MOD reports the current state again, so a socket that is already writable is not missed.
+    struct epoll_event ev = { EPOLLIN | EPOLLRDHUP | EPOLLET | (on ? EPOLLOUT : 0), { .fd = socket } };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket, &ev) == SOCKET_ERROR) {
+        Log(LOG_ERROR, -1, "Could not change write interest for socket %d: %s", socket, strerror(errno));
+    }
+}
+
+int SocketPoll_epollWait(struct timeval* timeout, SocketPoll_event* events, int maxevents)
+{
+    struct epoll_event ready[SOCKETPOLL_MAX_EVENTS];
+    int const ms = (timeout == NULL) ? -1 : (int)(timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000);
+    int rc;
+
+    if (maxevents > SOCKETPOLL_MAX_EVENTS) { maxevents = SOCKETPOLL_MAX_EVENTS; }
+    if ((rc = epoll_wait(epoll_fd, ready, maxevents, ms)) == SOCKET_ERROR) {
+        return (errno == EINTR) ? 0 : SOCKET_ERROR;
+    }
+
+    for (int i = 0; i < rc; ++i)
+    {
+        uint32_t const ev = ready[i].events;
+        events[i].socket = ready[i].data.fd;
+        events[i].events = ((ev & (EPOLLIN | EPOLLRDHUP)) ? SOCKETPOLL_READ : 0) |
+                           ((ev & EPOLLOUT) ? SOCKETPOLL_WRITE : 0) |
+                           ((ev & (EPOLLERR | EPOLLHUP)) ? SOCKETPOLL_ERROR : 0);
+    }
+    return rc;
+}
+
+#if defined(SOCKETPOLL_IO_URING)
+
+int SocketPoll_uringInitialize(void)
+{
+    struct io_uring_params params;
+    int rc = SOCKET_ERROR;
+
+    memset(&params, 0, sizeof(params));
+    if ((uring.fd = (int)syscall(__NR_io_uring_setup, SOCKETPOLL_URING_ENTRIES, &params)) == -1) { goto exit; }
+
+    // Multishot polls arrived together with resource tags (5.13), and timed waits need the extended enter arguments (5.11).
+    uint32_t const needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS;
+    if ((params.features & needed) != needed)
+    {
+        errno = ENOSYS;
+        goto exit;
+    }
+
+    uring.rings_size = max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    uring.rings = mmap(NULL, uring.rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (uring.rings == MAP_FAILED)
+    {
+        uring.rings = NULL;
+        goto exit;
+    }
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED)
+    {
+        uring.sqes = NULL;
+        goto exit;
+    }
+
+    char* const rings = uring.rings;
+    uring.sq_head = (unsigned*)(rings + params.sq_off.head);
+    uring.sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    uring.sq_array = (unsigned*)(rings + params.sq_off.array);
+    uring.sq_mask = *(unsigned*)(rings + params.sq_off.ring_mask);
+    uring.sq_entries = params.sq_entries;
+    uring.cq_head = (unsigned*)(rings + params.cq_off.head);
+    uring.cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    uring.cq_mask = *(unsigned*)(rings + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    rc = 0;
+exit:
+    if (rc != 0)
+    {
+        int const err = errno;
+        SocketPoll_uringTerminate();
+        errno = err;
+    }
+    return rc;
+}
+
+void SocketPoll_uringTerminate(void)
+{
+    if (uring.sqes) { munmap(uring.sqes, uring.sqes_size); }
+    if (uring.rings) { munmap(uring.rings, uring.rings_size); }
+    if (uring.fd != -1) { close(uring.fd); }
+    if (uring.sockets) { free(uring.sockets); }
+    memset(&uring, 0, sizeof(uring));
+    uring.fd = -1;
+}
+
+int SocketPoll_uringAdd(int socket)
+{
+    int rc = SOCKET_ERROR;
+
+    Thread_lock_mutex(uring_mutex);
+    if (socket >= uring.nsockets)
+    {
+        int const n = max(socket + 1, uring.nsockets * 2);
+        void* const sockets = (uring.sockets) ? realloc(uring.sockets, n * sizeof(*uring.sockets)) : malloc(n * sizeof(*uring.sockets));
+        if (sockets == NULL)
+        {
+            errno = ENOMEM;
+            goto exit;
+        }
+        uring.sockets = sockets;
+        memset(uring.sockets + uring.nsockets, 0, (n - uring.nsockets) * sizeof(*uring.sockets));
+        uring.nsockets = n;
+    }
+
+    ++uring.sockets[socket].gen;
+    uring.sockets[socket].write = 0;
+    if ((rc = SocketPoll_uringWatch(socket, SOCKETPOLL_URING_READ)) == 0) { rc = SocketPoll_uringSubmit(); }
+exit:
+    Thread_unlock_mutex(uring_mutex);
+    return rc;
+}
+
+void SocketPoll_uringRemove(int socket)
+{
+    Thread_lock_mutex(uring_mutex);
+    if (socket < uring.nsockets)
+    {
+        SocketPoll_uringCancel(socket, SOCKETPOLL_URING_READ);
+        if (uring.sockets[socket].write) { SocketPoll_uringCancel(socket, SOCKETPOLL_URING_WRITE); }
+        ++uring.sockets[socket].gen;   // Anything still on its way for this socket is stale now.
+        uring.sockets[socket].write = 0;
+        SocketPoll_uringSubmit();
+    }
+    Thread_unlock_mutex(uring_mutex);
+}
+
+void SocketPoll_uringSetWriteInterest(int socket, int on)
+{
+    Thread_lock_mutex(uring_mutex);
+    if (socket >= uring.nsockets) { goto exit; }
+
+    // Like epoll and kqueue, turning the interest on reports the current state again: the running poll is replaced by a fresh one, which is checked as soon as it is armed.
+    if (uring.sockets[socket].write) { SocketPoll_uringCancel(socket, SOCKETPOLL_URING_WRITE); }
+    uring.sockets[socket].write = on;
+    if (on && SocketPoll_uringWatch(socket, SOCKETPOLL_URING_WRITE) != 0) { uring.sockets[socket].write = 0; }
+    if (SocketPoll_uringSubmit() == SOCKET_ERROR) {
+        Log(LOG_ERROR, -1, "Could not change write interest for socket %d: %s", socket, strerror(errno));
+    }
+exit:
+    Thread_unlock_mutex(uring_mutex);
+}
+
+int SocketPoll_uringWait(struct timeval* timeout, SocketPoll_event* events, int maxevents)
+{
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    int rc = 0;
+
+    if (head == tail)
+    {
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+
+        memset(&arg, 0, sizeof(arg));
+        if (timeout)
+        {
+            ts.tv_sec = timeout->tv_sec;
+            ts.tv_nsec = timeout->tv_usec * 1000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        if (syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1) {
+            return (errno == EINTR || errno == ETIME) ? 0 : SOCKET_ERROR;
+        }
+        tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    Thread_lock_mutex(uring_mutex);
+    int rearm = 0;
+    for (; head != tail && rc < maxevents; ++head)
+    {
+        struct io_uring_cqe const* cqe = &uring.cqes[head & uring.cq_mask];
+        int const socket = (int)(cqe->user_data & 0x3FFFFFFF);
+        uint64_t const kind = (cqe->user_data >> 30) & 3;
+        unsigned const gen = (unsigned)(cqe->user_data >> 32);
+
+        if (kind == SOCKETPOLL_URING_IGNORE || socket >= uring.nsockets || uring.sockets[socket].gen != gen) { continue; }
+        if (cqe->res < 0)
+        {   // A poll cancelled by a removal or by a change of write interest, or one the kernel refused.
+            if (cqe->res != -ECANCELED) { Log(LOG_ERROR, -1, "%s poll for socket %d failed: %s", (kind == SOCKETPOLL_URING_READ) ? "Read" : "Write", socket, strerror(-cqe->res)); }
+            continue;
+        }
+
+        // The kernel ends a multishot poll on its own (e.g. when the completion queue overflows), so watch again if the interest is still there.
+        if (!(cqe->flags & IORING_CQE_F_MORE) && (kind == SOCKETPOLL_URING_READ || uring.sockets[socket].write)) {
+            rearm += (SocketPoll_uringWatch(socket, kind) == 0);
+        }
+
+        uint32_t const ev = (uint32_t)cqe->res;
+        events[rc].socket = socket;
+        events[rc].events = ((ev & (EPOLLIN | EPOLLRDHUP)) ? SOCKETPOLL_READ : 0) |
+                            ((ev & EPOLLOUT) ? SOCKETPOLL_WRITE : 0) |
+                            ((ev & (EPOLLERR | EPOLLHUP)) ? SOCKETPOLL_ERROR : 0);
+        ++rc;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    if (rearm) { SocketPoll_uringSubmit(); }
+    Thread_unlock_mutex(uring_mutex);
+    return rc;
+}
+
+/*!
+ *  @abstract Queue a multishot poll for the read or write readiness of a socket.
+ *  @note Call with uring_mutex held, and SocketPoll_uringSubmit afterwards.
+ *
+ *  @param socket the socket.
+ *  @param kind SOCKETPOLL_URING_READ or SOCKETPOLL_URING_WRITE.
+ *  @return 0 on success, SOCKET_ERROR if the submission queue is full.
+ */
+int SocketPoll_uringWatch(int socket, uint64_t kind)
+{
+    struct io_uring_sqe* sqe = SocketPoll_uringGetSQE();
+    if (sqe == NULL) { return SOCKET_ERROR; }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = socket;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = (kind == SOCKETPOLL_URING_READ) ? (EPOLLIN | EPOLLRDHUP) : EPOLLOUT;
+    sqe->user_data = SOCKETPOLL_URING_TAG(uring.sockets[socket].gen, kind, socket);
+    return 0;
+}
+
+/*!
+ *  @abstract Queue the removal of the read or write poll of a socket.
+ *  @discussion Requests are carried out in submission order, so a poll queued right after its removal is not affected by it.
+ *  @note Call with uring_mutex held, and SocketPoll_uringSubmit afterwards.
+ *
+ *  @param socket the socket.
+ *  @param kind SOCKETPOLL_URING_READ or SOCKETPOLL_URING_WRITE.
+ */
+void SocketPoll_uringCancel(int socket, uint64_t kind)
+{
+    struct io_uring_sqe* sqe = SocketPoll_uringGetSQE();
+    if (sqe == NULL) { return; }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = SOCKETPOLL_URING_TAG(uring.sockets[socket].gen, kind, socket);
+    sqe->user_data = SOCKETPOLL_URING_TAG(0, SOCKETPOLL_URING_IGNORE, socket);
+}
+
+/*!
+ *  @abstract Take the next free submission queue entry, cleared.
+ *  @note Call with uring_mutex held.
+ *
+ *  @return the entry, or NULL if the submission queue is full.
+ */
+struct io_uring_sqe* SocketPoll_uringGetSQE(void)
+{
+    unsigned const tail = *uring.sq_tail;
+    if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries)
+    {
+        Log(LOG_ERROR, -1, "%s submission queue is full", uring_backend.name);
+        errno = EBUSY;
+        return NULL;
+    }
+
+    unsigned const index = tail & uring.sq_mask;
+    struct io_uring_sqe* sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/*!
+ *  @abstract Hand every queued request over to the kernel.
+ *  @note Call with uring_mutex held.
+ *
+ *  @return 0 on success, SOCKET_ERROR on failure.
+ */
+int SocketPoll_uringSubmit(void)
+{
+    unsigned pending;
+    while ((pending = *uring.sq_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE)) > 0)
+    {
+        if (syscall(__NR_io_uring_enter, uring.fd, pending, 0, 0, NULL, 0) == -1 && errno != EINTR) { return SOCKET_ERROR; }
+    }
+    return 0;
+}
+
+#endif
+
+#elif defined(SOCKETPOLL_KQUEUE)
+
+int SocketPoll_kqueueInitialize(void)
+{
+    kqueue_fd = kqueue();
+    return (kqueue_fd == -1) ? SOCKET_ERROR : 0;
+}
+
+void SocketPoll_kqueueTerminate(void)
+{
+    if (kqueue_fd != -1) { close(kqueue_fd); }
+    kqueue_fd = -1;
+}
+
+int SocketPoll_kqueueAdd(int socket)
+{
+    struct kevent changes[2];
+    EV_SET(&changes[0], socket, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    EV_SET(&changes[1], socket, EVFILT_WRITE, EV_ADD | EV_CLEAR | EV_DISABLE, 0, 0, NULL);
+    return kevent(kqueue_fd, changes, 2, NULL, 0, NULL);
+}
+
+void SocketPoll_kqueueRemove(int socket)
+{
+    struct kevent changes[2];
+    EV_SET(&changes[0], socket, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&changes[1], socket, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent(kqueue_fd, changes, 2, NULL, 0, NULL);
+}
+
+void SocketPoll_kqueueSetWriteInterest(int socket, int on)
+{
+    // EV_ADD on an existing filter re-evaluates it, so a socket that is already writable is reported straight away.
+    struct kevent change;
+    EV_SET(&change, socket, EVFILT_WRITE, on ? (EV_ADD | EV_CLEAR | EV_ENABLE) : EV_DISABLE, 0, 0, NULL);
+    if (kevent(kqueue_fd, &change, 1, NULL, 0, NULL) == SOCKET_ERROR) {
+        Log(LOG_ERROR, -1, "Could not change write interest for socket %d: %s", socket, strerror(errno));
+    }
+}
+
+int SocketPoll_kqueueWait(struct timeval* timeout, SocketPoll_event* events, int maxevents)
+{
+    struct kevent ready[SOCKETPOLL_MAX_EVENTS];
+    struct timespec ts;
+    int rc;
+
+    if (timeout)
+    {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000;
+    }
+    if (maxevents > SOCKETPOLL_MAX_EVENTS) { maxevents = SOCKETPOLL_MAX_EVENTS; }
+    if ((rc = kevent(kqueue_fd, NULL, 0, ready, maxevents, (timeout) ? &ts : NULL)) == SOCKET_ERROR) {
+        return (errno == EINTR) ? 0 : SOCKET_ERROR;
+    }
+
+    for (int i = 0; i < rc; ++i)
+    {
+        events[i].socket = (int)ready[i].ident;
+        events[i].events = (ready[i].filter == EVFILT_READ) ? SOCKETPOLL_READ : SOCKETPOLL_WRITE;
+        if (ready[i].flags & EV_ERROR) { events[i].events |= SOCKETPOLL_ERROR; }
+    }
+    return rc;
+}
+
+#endif
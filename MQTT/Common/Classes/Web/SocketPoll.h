@@ -0,0 +1,73 @@
+/*!
+ *  @abstract Socket readiness backends.
+ *  @discussion The Socket module asks one of these backends which sockets became readable or writable. The select backend is always available; epoll (Linux) and kqueue (Darwin/BSD) are picked when the platform provides them, unless USE_SELECT is defined. On Linux, defining USE_IO_URING prefers multishot io_uring polls over epoll, falling back to epoll when the kernel does not support them (5.13 or later is needed).
+ */
+#pragma once
+
+#include <sys/time.h>       // POSIX
+
+#pragma mark Definitions
+
+#define SOCKETPOLL_READ  0x01   // Data (or end of stream) is waiting to be read.
+#define SOCKETPOLL_WRITE 0x02   // The socket accepts more output, or a pending connect has finished.
+#define SOCKETPOLL_ERROR 0x04   // Error or hang-up. The next read/write on the socket will report it.
+
+#define SOCKETPOLL_MAX_EVENTS 64 // Most events collected by a single wait.
+
+/*!
+ *  @abstract A readiness change reported by a backend.
+ *
+ *  @field socket The socket descriptor.
+ *  @field events Mask of SOCKETPOLL_READ, SOCKETPOLL_WRITE and SOCKETPOLL_ERROR.
+ */
+typedef struct
+{
+    int socket;
+    int events;
+} SocketPoll_event;
+
+/*!
+ *  @abstract Readiness backend interface.
+ *  @discussion Read interest is registered for every socket added. Write interest is only registered while asked for (connect or partial write pending).
+ *
+ *  @field name Name of the backend for tracing.
+ *  @field edge_triggered Whether readiness is reported only on change (epoll, kqueue) or on every wait while it lasts (select).
+ *  @field live_interest Whether sockets and write interest registered while another thread waits take effect in that wait (epoll, kqueue), or only in the next one (select).
+ *  @field initialize Set up the backend. Returns 0 on success.
+ *  @field terminate Release the backend resources.
+ *  @field add Start watching a socket for reading. Returns 0 on success.
+ *  @field remove Stop watching a socket. Must be called before the socket is closed.
+ *  @field setWriteInterest Turn write readiness reports for a socket on or off.
+ *  @field wait Wait up to timeout (NULL blocks) for readiness changes. Returns the number of events stored, or SOCKET_ERROR.
+ */
+typedef struct
+{
+    char const* name;
+    int edge_triggered;
+    int live_interest;
+    int (*initialize)(void);
+    void (*terminate)(void);
+    int (*add)(int socket);
+    void (*remove)(int socket);
+    void (*setWriteInterest)(int socket, int on);
+    int (*wait)(struct timeval* timeout, SocketPoll_event* events, int maxevents);
+} SocketPoll_backend;
+
+#pragma mark Public API
+
+/*!
+ *  @abstract Select and initialize the best readiness backend available on this platform.
+ *  @discussion Falls back to select if the preferred backend can not be initialized.
+ *
+ *  @return The initialized backend (never NULL).
+ */
+SocketPoll_backend const* SocketPoll_initialize(void);
+
+/*!
+ *  @abstract The backends built for this platform, the preferred one first and select last, whether the kernel supports them or not.
+ *  @discussion For the tests and benchmarks comparing them; the Socket module only uses the one SocketPoll_initialize picks.
+ *
+ *  @param count returns the number of backends.
+ *  @return The backends, none initialized.
+ */
+SocketPoll_backend const* const* SocketPoll_backends(int* count);
@@ -0,0 +1,289 @@
+#include "SocketResolver.h" // Header
+#include "Socket.h"         // MQTT (Web)
+#include "Log.h"            // MQTT (Utilities)
+#include "StackTrace.h"     // MQTT (Utilities)
+#include "Thread.h"         // MQTT (Utilities)
+
+#include <string.h>         // C Standard
+#include <time.h>           // C Standard
+#include <netdb.h>          // POSIX
+
+#include "Heap.h"           // MQTT (Utilities)
+
+#pragma mark - Definitions
+
+#define SOCKETRESOLVER_QUEUED    0  // Waiting for a resolver thread.
+#define SOCKETRESOLVER_RESOLVING 1  // Being looked up.
+#define SOCKETRESOLVER_DONE      2  // Addresses known.
+#define SOCKETRESOLVER_FAILED    3  // The lookup failed.
+
+#define SOCKETRESOLVER_IDLE_TIMEOUT 30  // Seconds a resolver thread waits for work before it exits.
+
+/*!
+ *  @abstract Cached lookup of a host.
+ *
+ *  @field host The host name.
+ *  @field state SOCKETRESOLVER_QUEUED, RESOLVING, DONE or FAILED.
+ *  @field addresses The addresses of the host, in the order they should be tried.
+ *  @field count Number of addresses.
+ *  @field expires When a finished lookup stops being used.
+ */
+typedef struct
+{
+    char host[SOCKETRESOLVER_MAX_HOST];
+    int state;
+    SocketResolver_address addresses[SOCKETRESOLVER_MAX_ADDRESSES];
+    int count;
+    time_t expires;
+} SocketResolver_entry;
+
+#pragma mark - Variables
+
+static List* cache = NULL;                  // SocketResolver_entry items, created on first use.
+static unsigned long generation = 0;        // Bumped by SocketResolver_terminate, so lookups started before are dropped.
+static int workers = 0;                     // Resolver threads running.
+static int idle = 0;                        // Resolver threads waiting for work.
+static pthread_mutex_t resolver_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t* resolver_mutex = &resolver_mutex_store;    // Guards the cache and the thread counts.
+static cond_type_struct resolver_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, 0 };
+static cond_type_struct* resolver_cond = &resolver_cond_store;     // Signalled when a lookup is queued.
+
+#pragma mark - Private prototypes
+
+SocketResolver_entry* SocketResolver_find(char const* host, time_t now);
+SocketResolver_entry* SocketResolver_nextQueued(void);
+void SocketResolver_dispatch(void);
+void* SocketResolver_worker(void* n);
+int SocketResolver_order(struct addrinfo const* result, SocketResolver_address* addresses);
+
+#pragma mark - Public API
+
+int SocketResolver_lookup(char const* host, SocketResolver_address* addresses, int* count)
+{
+    struct addrinfo* result = NULL;
+    struct addrinfo hints = {AI_NUMERICHOST, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+    int rc = SOCKET_ERROR;
+
+    FUNC_ENTRY;
+    *count = 0;
+    if (getaddrinfo(host, NULL, &hints, &result) == 0)
+    {   // A numeric address needs no name server.
+        *count = SocketResolver_order(result, addresses);
+        freeaddrinfo(result);
+        rc = (*count > 0) ? 0 : SOCKET_ERROR;
+        goto exit;
+    }
+
+    if (strlen(host) >= SOCKETRESOLVER_MAX_HOST)
+    {
+        Log(LOG_ERROR, -1, "Host name %s is too long", host);
+        goto exit;
+    }
+
+    Thread_lock_mutex(resolver_mutex);
+    if (cache == NULL) { cache = ListInitialize(); }
+
+    time_t const now = time(NULL);
+    SocketResolver_entry* entry = SocketResolver_find(host, now);
+    if (entry == NULL)
+    {
+        if ((entry = malloc(sizeof(SocketResolver_entry))) == NULL)
+        {
+            Thread_unlock_mutex(resolver_mutex);
+            Log(LOG_ERROR, -1, "Could not allocate %lu bytes to look up host %s", sizeof(SocketResolver_entry), host);
+            goto exit;
+        }
+        strcpy(entry->host, host);
+        entry->state = SOCKETRESOLVER_QUEUED;
+        entry->count = 0;
+        ListAppend(cache, entry, sizeof(SocketResolver_entry));
+        SocketResolver_dispatch();
+    }
+
+    if (entry->state == SOCKETRESOLVER_DONE)
+    {
+        memcpy(addresses, entry->addresses, entry->count * sizeof(SocketResolver_address));
+        *count = entry->count;
+        rc = 0;
+    }
+    else if (entry->state != SOCKETRESOLVER_FAILED) {
+        rc = TCPSOCKET_INTERRUPTED;
+    }
+    Thread_unlock_mutex(resolver_mutex);
+exit:
+    FUNC_EXIT_RC(rc);
+    return rc;
+}
+
+void SocketResolver_terminate(void)
+{
+    FUNC_ENTRY;
+    Thread_lock_mutex(resolver_mutex);
+    if (cache)
+    {
+        ListFree(cache);
+        cache = NULL;
+    }
+    ++generation;
+    Thread_unlock_mutex(resolver_mutex);
+    FUNC_EXIT;
+}
+
+#pragma mark - Private functionality
+
+/*!
+ *  @abstract Find the cache entry of a host, dropping the expired entries met on the way.
+ *  @note Call with resolver_mutex held.
+ *
+ *  @param host the host name.
+ *  @param now the current time.
+ *  @return the entry, or NULL if the host has no entry that can be used.
+ */
+SocketResolver_entry* SocketResolver_find(char const* host, time_t now)
+{
+    ListElement* current = NULL;
+    SocketResolver_entry* found = NULL;
+
+    while (ListNextElement(cache, &current))
+    {
+        SocketResolver_entry* entry = (SocketResolver_entry*)(current->content);
+        bool const finished = (entry->state == SOCKETRESOLVER_DONE || entry->state == SOCKETRESOLVER_FAILED);
+        if (finished && entry->expires <= now)
+        {
+            ListElement* prev = current->prev;
+            ListRemove(cache, entry);
+            current = prev;     // NULL starts over from the (new) first element.
+            continue;
+        }
+        if (found == NULL && strcmp(entry->host, host) == 0) { found = entry; }
+    }
+    return found;
+}
+
+/*!
+ *  @abstract Get the oldest lookup waiting for a resolver thread.
+ *  @note Call with resolver_mutex held.
+ */
+SocketResolver_entry* SocketResolver_nextQueued(void)
+{
+    ListElement* current = NULL;
+
+    if (cache == NULL) { return NULL; }
+    while (ListNextElement(cache, &current))
+    {
+        SocketResolver_entry* entry = (SocketResolver_entry*)(current->content);
+        if (entry->state == SOCKETRESOLVER_QUEUED) { return entry; }
+    }
+    return NULL;
+}
+
+/*!
+ *  @abstract Hand a queued lookup to an idle resolver thread, or start one if all are busy.
+ *  @note Call with resolver_mutex held.
+ */
+void SocketResolver_dispatch(void)
+{
+    if (idle == 0 && workers < SOCKETRESOLVER_MAX_THREADS)
+    {
+        if (Thread_start(SocketResolver_worker, NULL) != 0) {
+            ++workers;
+        } else if (workers == 0) {
+            Log(LOG_ERROR, -1, "Could not start a resolver thread");
+        }
+    }
+    Thread_signal_cond(resolver_cond);
+}
+
+/*!
+ *  @abstract Resolver thread: look up queued host names until there are none left for a while.
+ *  @discussion The name is copied before the lookup, and the result is only stored if the cache was not dropped in the meantime (see generation).
+ */
+void* SocketResolver_worker(void* n)
+{
+    Thread_lock_mutex(resolver_mutex);
+    for (;;)
+    {
+        SocketResolver_entry* entry = SocketResolver_nextQueued();
+        if (entry == NULL)
+        {
+            ++idle;
+            Thread_unlock_mutex(resolver_mutex);
+            int const rc = Thread_wait_cond(resolver_cond, SOCKETRESOLVER_IDLE_TIMEOUT * 1000L);
+            Thread_lock_mutex(resolver_mutex);
+            --idle;
+            if (rc != 0 && SocketResolver_nextQueued() == NULL) { break; }
+            continue;
+        }
+
+        char host[SOCKETRESOLVER_MAX_HOST];
+        unsigned long const started = generation;
+        strcpy(host, entry->host);
+        entry->state = SOCKETRESOLVER_RESOLVING;
+        if (SocketResolver_nextQueued()) { SocketResolver_dispatch(); }
+        Thread_unlock_mutex(resolver_mutex);
+
+        SocketResolver_address addresses[SOCKETRESOLVER_MAX_ADDRESSES];
+        struct addrinfo* result = NULL;
+        struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+        int count = 0;
+        int const gai = getaddrinfo(host, NULL, &hints, &result);
+        if (gai == 0)
+        {
+            count = SocketResolver_order(result, addresses);
+            freeaddrinfo(result);
+        }
+        else {
+            Log(LOG_ERROR, -1, "getaddrinfo failed for addr %s with rc %d (%s)", host, gai, gai_strerror(gai));
+        }
+
+        Thread_lock_mutex(resolver_mutex);
+        if (started == generation)
+        {
+            memcpy(entry->addresses, addresses, count * sizeof(SocketResolver_address));
+            entry->count = count;
+            entry->state = (count > 0) ? SOCKETRESOLVER_DONE : SOCKETRESOLVER_FAILED;
+            entry->expires = time(NULL) + ((count > 0) ? SOCKETRESOLVER_TTL : SOCKETRESOLVER_FAILED_TTL);
+            Log(TRACE_MIN, -1, "Resolved %s to %d addresses", host, count);
+        }
+        Thread_unlock_mutex(resolver_mutex);
+        Socket_wakeup();
+        Thread_lock_mutex(resolver_mutex);
+    }
+    --workers;
+    Thread_unlock_mutex(resolver_mutex);
+    return NULL;
+}
+
+/*!
+ *  @abstract Copy the TCP addresses of a getaddrinfo result in the order they should be tried.
+ *  @discussion getaddrinfo already sorts the addresses by preference (RFC 6724). They are interleaved by family, starting with the family of the first one, so a broken IPv6 or IPv4 path only delays the connect by one attempt.
+ *
+ *  @param result the getaddrinfo result.
+ *  @param addresses returns up to SOCKETRESOLVER_MAX_ADDRESSES addresses.
+ *  @return the number of addresses.
+ */
+int SocketResolver_order(struct addrinfo const* result, SocketResolver_address* addresses)
+{
+    struct addrinfo const* next[2] = { result, result };    // Next candidate of the first family, and of the others.
+    int const first = (result) ? result->ai_family : AF_UNSPEC;
+    int count = 0;
+
+    for (int turn = 0; count < SOCKETRESOLVER_MAX_ADDRESSES; turn ^= 1)
+    {
+        struct addrinfo const* res = next[turn];
+        while (res && (res->ai_addrlen > sizeof(struct sockaddr_storage) || (res->ai_family != AF_INET && res->ai_family != AF_INET6) || ((res->ai_family == first) != (turn == 0)))) { res = res->ai_next; }
+        if (res == NULL)
+        {
+            next[turn] = NULL;
+            if (next[turn ^ 1] == NULL) { break; }
+            continue;
+        }
+
+        memset(&addresses[count].addr, 0, sizeof(struct sockaddr_storage));
+        memcpy(&addresses[count].addr, res->ai_addr, res->ai_addrlen);
+        addresses[count].len = res->ai_addrlen;
+        ++count;
+        next[turn] = res->ai_next;
+    }
+    return count;
+}
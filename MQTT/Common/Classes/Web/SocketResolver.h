@@ -0,0 +1,52 @@
+/*!
+ *  @abstract Host name resolution off the I/O threads.
+ *  @discussion Names are looked up by a small pool of resolver threads, so a slow name server only delays the connects waiting for that name. Results are cached per host name.
+ */
+#pragma once
+
+#include <sys/socket.h>     // POSIX
+
+#pragma mark Definitions
+
+#if !defined(SOCKETRESOLVER_TTL)
+    #define SOCKETRESOLVER_TTL 60           // Seconds the addresses of a host are reused before it is looked up again.
+#endif
+
+#if !defined(SOCKETRESOLVER_FAILED_TTL)
+    #define SOCKETRESOLVER_FAILED_TTL 5     // Seconds a failed lookup is reported again before it is retried.
+#endif
+
+#define SOCKETRESOLVER_MAX_ADDRESSES 16     // Most addresses kept for a host.
+#define SOCKETRESOLVER_MAX_HOST 256         // Longest host name, terminator included.
+#define SOCKETRESOLVER_MAX_THREADS 4        // Most lookups running at the same time.
+
+/*!
+ *  @abstract A resolved address.
+ *
+ *  @field addr The address, with port 0.
+ *  @field len The length of the address.
+ */
+typedef struct
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+} SocketResolver_address;
+
+#pragma mark Public API
+
+/*!
+ *  @abstract Get the addresses of a host, starting a lookup in the background if they are not known yet.
+ *  @discussion Numeric addresses are returned straight away. Otherwise the cached result is used, or a resolver thread looks the name up and calls Socket_wakeup when it is done, so the caller can ask again. The addresses come in the order they should be tried, alternating between address families (RFC 8305) starting with the family the system prefers.
+ *
+ *  @param host the host name or numeric address.
+ *  @param addresses returns up to SOCKETRESOLVER_MAX_ADDRESSES addresses.
+ *  @param count returns the number of addresses.
+ *  @return 0 with the addresses, TCPSOCKET_INTERRUPTED while the lookup is in progress, or SOCKET_ERROR if the host can not be resolved.
+ */
+int SocketResolver_lookup(char const* host, SocketResolver_address* addresses, int* count);
+
+/*!
+ *  @abstract Forget the cached results.
+ *  @discussion Lookups still running are discarded when they finish. The resolver threads exit on their own once idle.
+ */
+void SocketResolver_terminate(void);
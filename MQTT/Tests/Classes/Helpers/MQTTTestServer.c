@@ -0,0 +1,370 @@
+#include "MQTTTestServer.h" // Header
+
+#include <arpa/inet.h>      // POSIX
+#include <netinet/in.h>     // POSIX
+#include <poll.h>           // POSIX
+#include <pthread.h>        // POSIX
+#include <sys/socket.h>     // POSIX
+#include <unistd.h>         // POSIX
+#include <stdio.h>          // C Standard
+#include <stdlib.h>         // C Standard
+#include <string.h>         // C Standard
+
+#pragma mark - Definitions
+
+#define MQTTTESTSERVER_MAX_CONNECTIONS 64   // Connections accepted over the life of a server
+#define MQTTTESTSERVER_ACCEPT_WAIT 100      // Longest time (ms) the server waits for a connection before checking whether it is stopped
+
+/*!
+ *  @abstract A connection accepted by the server, served by a thread of its own.
+ */
+typedef struct
+{
+    MQTTTestServer* server;
+    int socket;
+    pthread_t thread;
+    int version;            // MQTT version of the CONNECT packet.
+    char clientID[64];
+    int published;          // PUBLISH packets received.
+} MQTTTestServer_connection;
+
+struct MQTTTestServer
+{
+    int listener;
+    pthread_t thread;
+    volatile bool stopping;
+    char uri[32];
+    int receiveMaximum;
+    bool acknowledge;
+    pthread_mutex_t mutex;  // Guards count and the published counts.
+    int count;
+    MQTTTestServer_connection connections[MQTTTESTSERVER_MAX_CONNECTIONS];
+};
+
+#pragma mark - Private prototypes
+
+void* MQTTTestServer_accept(void* context);
+void* MQTTTestServer_serve(void* context);
+bool MQTTTestServer_handle(MQTTTestServer_connection* connection, unsigned char header, unsigned char const* body, size_t length);
+bool MQTTTestServer_read(int socket, void* buffer, size_t length);
+bool MQTTTestServer_write(int socket, void const* buffer, size_t length);
+size_t MQTTTestServer_skipProperties(unsigned char const* body, size_t length, size_t offset);
+
+#pragma mark - Public API
+
+MQTTTestServer* MQTTTestServer_start(int receiveMaximum, bool acknowledge)
+{
+    MQTTTestServer* server = malloc(sizeof(MQTTTestServer));
+    if (server == NULL) { return NULL; }
+    memset(server, 0, sizeof(MQTTTestServer));
+    server->receiveMaximum = receiveMaximum;
+    server->acknowledge = acknowledge;
+    pthread_mutex_init(&server->mutex, NULL);
+    
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    if ((server->listener = socket(AF_INET, SOCK_STREAM, 0)) < 0) { goto fail; }
+    if (bind(server->listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(server->listener, MQTTTESTSERVER_MAX_CONNECTIONS) != 0 ||
+        getsockname(server->listener, (struct sockaddr*)&address, &addressLength) != 0)
+    {
+        close(server->listener);
+        goto fail;
+    }
+    snprintf(server->uri, sizeof(server->uri), "tcp://127.0.0.1:%d", ntohs(address.sin_port));
+    
+    if (pthread_create(&server->thread, NULL, MQTTTestServer_accept, server) != 0)
+    {
+        close(server->listener);
+        goto fail;
+    }
+    return server;
+fail:
+    pthread_mutex_destroy(&server->mutex);
+    free(server);
+    return NULL;
+}
+
+char const* MQTTTestServer_uri(MQTTTestServer const* server)
+{
+    return server->uri;
+}
+
+int MQTTTestServer_published(MQTTTestServer* server, char const* clientID)
+{
+    int published = 0;
+    pthread_mutex_lock(&server->mutex);
+    for (int i = 0; i < server->count; ++i)
+    {
+        if (strcmp(server->connections[i].clientID, clientID) == 0) { published += server->connections[i].published; }
+    }
+    pthread_mutex_unlock(&server->mutex);
+    return published;
+}
+
+void MQTTTestServer_stop(MQTTTestServer* server)
+{
+    server->stopping = true;
+    pthread_join(server->thread, NULL);
+    close(server->listener);
+    
+    // No connection is accepted any more, so count stays as it is.
+    for (int i = 0; i < server->count; ++i) { shutdown(server->connections[i].socket, SHUT_RDWR); }
+    for (int i = 0; i < server->count; ++i)
+    {
+        pthread_join(server->connections[i].thread, NULL);
+        close(server->connections[i].socket);
+    }
+    pthread_mutex_destroy(&server->mutex);
+    free(server);
+}
+
+#pragma mark - Private functionality
+
+/*!
+ *  @abstract Accept connections until the server is stopped, each served by a thread of its own.
+ */
+void* MQTTTestServer_accept(void* context)
+{
+    MQTTTestServer* server = context;
+    struct pollfd listener = { server->listener, POLLIN, 0 };
+    
+    while (!server->stopping && server->count < MQTTTESTSERVER_MAX_CONNECTIONS)
+    {
+        if (poll(&listener, 1, MQTTTESTSERVER_ACCEPT_WAIT) <= 0) { continue; }
+        int const socket = accept(server->listener, NULL, NULL);
+        if (socket < 0) { continue; }
+        #if defined(SO_NOSIGPIPE)
+        int const on = 1;
+        setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+        #endif
+        
+        pthread_mutex_lock(&server->mutex);
+        MQTTTestServer_connection* connection = &server->connections[server->count];
+        memset(connection, 0, sizeof(MQTTTestServer_connection));
+        connection->server = server;
+        connection->socket = socket;
+        if (pthread_create(&connection->thread, NULL, MQTTTestServer_serve, connection) == 0) {
+            ++server->count;
+        } else {
+            close(socket);
+        }
+        pthread_mutex_unlock(&server->mutex);
+    }
+    return NULL;
+}
+
+/*!
+ *  @abstract Read and answer the packets of a connection until it is closed.
+ */
+void* MQTTTestServer_serve(void* context)
+{
+    MQTTTestServer_connection* connection = context;
+    unsigned char* body = NULL;
+    size_t capacity = 0;
+    
+    for (;;)
+    {
+        unsigned char header, byte;
+        size_t length = 0;
+        int shift = 0;
+        
+        if (!MQTTTestServer_read(connection->socket, &header, 1)) { break; }
+        do
+        {
+            if (shift > 21 || !MQTTTestServer_read(connection->socket, &byte, 1)) { goto exit; }
+            length |= (size_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        
+        if (length > capacity)
+        {
+            unsigned char* grown = realloc(body, length);
+            if (grown == NULL) { break; }
+            body = grown;
+            capacity = length;
+        }
+        if (!MQTTTestServer_read(connection->socket, body, length)) { break; }
+        if (!MQTTTestServer_handle(connection, header, body, length)) { break; }
+    }
+exit:
+    free(body);
+    shutdown(connection->socket, SHUT_RDWR);
+    return NULL;
+}
+
+/*!
+ *  @abstract Answer a packet.
+ *
+ *  @param connection the connection the packet was received on.
+ *  @param header the first byte of the fixed header.
+ *  @param body the variable header and payload of the packet.
+ *  @param length the length of body.
+ *  @return whether the connection stays open.
+ */
+bool MQTTTestServer_handle(MQTTTestServer_connection* connection, unsigned char header, unsigned char const* body, size_t length)
+{
+    MQTTTestServer* server = connection->server;
+    unsigned char reply[260];
+    size_t replyLength = 0;
+    
+    switch (header >> 4)
+    {
+        case 1:     // CONNECT
+        {
+            if (length < 10) { return false; }
+            size_t const nameLength = ((size_t)body[0] << 8) | body[1];
+            if (length < nameLength + 8) { return false; }
+            connection->version = body[2 + nameLength];
+            size_t offset = 2 + nameLength + 4;     // Level, flags and keep alive.
+            if (connection->version >= 5) { offset = MQTTTestServer_skipProperties(body, length, offset); }
+            if (offset + 2 > length) { return false; }
+            size_t const idLength = ((size_t)body[offset] << 8) | body[offset + 1];
+            if (offset + 2 + idLength > length) { return false; }
+            
+            pthread_mutex_lock(&server->mutex);
+            snprintf(connection->clientID, sizeof(connection->clientID), "%.*s", (int)idLength, (char const*)body + offset + 2);
+            pthread_mutex_unlock(&server->mutex);
+            
+            reply[replyLength++] = 0x20;
+            if (connection->version < 5)
+            {
+                unsigned char const connack[] = { 2, 0, 0 };
+                memcpy(reply + replyLength, connack, sizeof(connack));
+                replyLength += sizeof(connack);
+            }
+            else if (server->receiveMaximum == 0)
+            {
+                unsigned char const connack[] = { 3, 0, 0, 0 };
+                memcpy(reply + replyLength, connack, sizeof(connack));
+                replyLength += sizeof(connack);
+            }
+            else
+            {
+                unsigned char const connack[] = { 6, 0, 0, 3, 0x21, (unsigned char)(server->receiveMaximum >> 8), (unsigned char)server->receiveMaximum };
+                memcpy(reply + replyLength, connack, sizeof(connack));
+                replyLength += sizeof(connack);
+            }
+            break;
+        }
+        case 3:     // PUBLISH
+        {
+            int const qos = (header >> 1) & 3;
+            pthread_mutex_lock(&server->mutex);
+            ++connection->published;
+            pthread_mutex_unlock(&server->mutex);
+            if (qos == 0 || !server->acknowledge) { break; }
+            
+            if (length < 2) { return false; }
+            size_t const offset = 2 + (((size_t)body[0] << 8) | body[1]);
+            if (offset + 2 > length) { return false; }
+            unsigned char const ack[] = { (qos == 1) ? 0x40 : 0x50, 2, body[offset], body[offset + 1] };
+            memcpy(reply, ack, sizeof(ack));
+            replyLength = sizeof(ack);
+            break;
+        }
+        case 6:     // PUBREL
+        {
+            if (length < 2) { return false; }
+            unsigned char const pubcomp[] = { 0x70, 2, body[0], body[1] };
+            memcpy(reply, pubcomp, sizeof(pubcomp));
+            replyLength = sizeof(pubcomp);
+            break;
+        }
+        case 8:     // SUBSCRIBE
+        case 10:    // UNSUBSCRIBE
+        {
+            bool const subscribe = (header >> 4) == 8;
+            if (length < 2) { return false; }
+            size_t offset = 2;
+            if (connection->version >= 5) { offset = MQTTTestServer_skipProperties(body, length, offset); }
+            
+            reply[replyLength++] = (subscribe) ? 0x90 : 0xB0;
+            replyLength++;      // The remaining length, set once the reason codes are in.
+            reply[replyLength++] = body[0];
+            reply[replyLength++] = body[1];
+            if (connection->version >= 5) { reply[replyLength++] = 0; }
+            while (offset + 2 <= length && replyLength < sizeof(reply))
+            {
+                offset += 2 + (((size_t)body[offset] << 8) | body[offset + 1]);
+                if (subscribe)
+                {
+                    if (offset >= length) { return false; }
+                    reply[replyLength++] = body[offset++] & 3;
+                }
+                else if (connection->version >= 5) { reply[replyLength++] = 0; }
+            }
+            if (replyLength - 2 > 127) { return false; }
+            reply[1] = (unsigned char)(replyLength - 2);
+            break;
+        }
+        case 12:    // PINGREQ
+            reply[replyLength++] = 0xD0;
+            reply[replyLength++] = 0;
+            break;
+        case 14:    // DISCONNECT
+            return false;
+        default:
+            break;
+    }
+    return replyLength == 0 || MQTTTestServer_write(connection->socket, reply, replyLength);
+}
+
+/*!
+ *  @abstract Read exactly length bytes, unless the connection is closed.
+ */
+bool MQTTTestServer_read(int socket, void* buffer, size_t length)
+{
+    for (size_t done = 0; done < length; )
+    {
+        ssize_t const n = recv(socket, (char*)buffer + done, length - done, 0);
+        if (n <= 0) { return false; }
+        done += (size_t)n;
+    }
+    return true;
+}
+
+/*!
+ *  @abstract Write exactly length bytes, unless the connection is closed.
+ */
+bool MQTTTestServer_write(int socket, void const* buffer, size_t length)
+{
+    #if defined(MSG_NOSIGNAL)
+    int const flags = MSG_NOSIGNAL;
+    #else
+    int const flags = 0;
+    #endif
+    for (size_t done = 0; done < length; )
+    {
+        ssize_t const n = send(socket, (char const*)buffer + done, length - done, flags);
+        if (n <= 0) { return false; }
+        done += (size_t)n;
+    }
+    return true;
+}
+
+/*!
+ *  @abstract Skip the MQTT 5 properties of a packet.
+ *
+ *  @param body the variable header and payload of the packet.
+ *  @param length the length of body.
+ *  @param offset where the properties start, with their length.
+ *  @return where the properties end.
+ */
+size_t MQTTTestServer_skipProperties(unsigned char const* body, size_t length, size_t offset)
+{
+    size_t properties = 0;
+    int shift = 0;
+    while (offset < length && shift <= 21)
+    {
+        unsigned char const byte = body[offset++];
+        properties |= (size_t)(byte & 0x7F) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) { break; }
+    }
+    return offset + properties;
+}
@@ -0,0 +1,40 @@
+/*!
+ *  @abstract A stand-in MQTT server for the tests, on a port of the loopback interface.
+ *  @discussion It answers CONNECT, SUBSCRIBE, UNSUBSCRIBE and PINGREQ packets, and the QoS 1 and 2 PUBLISH packets unless told not to, counting the messages each client publishes. It never delivers a message.
+ */
+#pragma once
+
+#include <stdbool.h>        // C Standard
+
+#pragma mark Definitions
+
+/*!
+ *  @abstract A running stand-in server.
+ */
+typedef struct MQTTTestServer MQTTTestServer;
+
+#pragma mark Public API
+
+/*!
+ *  @abstract Start a server on a free port of the loopback interface.
+ *
+ *  @param receiveMaximum the Receive Maximum sent to MQTT 5 clients, or 0 to send none.
+ *  @param acknowledge whether QoS 1 and 2 messages are acknowledged, or left in flight forever.
+ *  @return the server, or NULL if it could not be started.
+ */
+MQTTTestServer* MQTTTestServer_start(int receiveMaximum, bool acknowledge);
+
+/*!
+ *  @abstract The URI clients connect to the server with, such as "tcp://127.0.0.1:50123".
+ */
+char const* MQTTTestServer_uri(MQTTTestServer const* server);
+
+/*!
+ *  @abstract The number of PUBLISH packets received from the clients with a client identifier, over all their connections.
+ */
+int MQTTTestServer_published(MQTTTestServer* server, char const* clientID);
+
+/*!
+ *  @abstract Close every connection and stop the server, which is freed.
+ */
+void MQTTTestServer_stop(MQTTTestServer* server);
@@ -0,0 +1,202 @@
+@import XCTest;                 // Apple
+#import "MessageIds.h"          // MQTT (Private)
+#import <stdint.h>              // C Standard
+#import <string.h>              // C Standard
+
+/*!
+ *  @abstract Test assigning, holding and releasing message identifiers, running out of them, and measure assigning.
+ *
+ *  @see MessageIds_assign
+ */
+@interface MessageIdsTest : XCTestCase
+@end
+
+#pragma mark - Helpers
+
+#define MESSAGEIDSTEST_MAX 65535
+
+/*!
+ *  @abstract Next number of a reproducible sequence (xorshift).
+ */
+static uint32_t MessageIdsTest_random(uint32_t* seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/*!
+ *  @abstract What MessageIds_assign must answer, found by trying each identifier after the last one in turn.
+ */
+static int MessageIdsTest_expected(bool const* held, int last)
+{
+    int msgid = (last < 1 || last >= MESSAGEIDSTEST_MAX) ? 1 : last + 1;
+    for (int n = 0; n < MESSAGEIDSTEST_MAX; ++n)
+    {
+        if (!held[msgid]) { return msgid; }
+        msgid = (msgid == MESSAGEIDSTEST_MAX) ? 1 : msgid + 1;
+    }
+    return 0;
+}
+
+/*!
+ *  @abstract Keep a number of identifiers in flight, then release the oldest and assign a new one over and over, as a steady flow of publishes does.
+ */
+static void MessageIdsTest_flow(messageIds* ids, int* flight, int inflight, int rounds)
+{
+    MessageIds_reset(ids);
+    int last = 0;
+    for (int i = 0; i < inflight; ++i) { flight[i] = last = MessageIds_assign(ids, last); }
+    for (int i = 0; i < rounds; ++i)
+    {
+        int const oldest = i % inflight;
+        MessageIds_release(ids, flight[oldest]);
+        flight[oldest] = last = MessageIds_assign(ids, last);
+    }
+}
+
+@implementation MessageIdsTest
+
+#pragma mark - Unit tests
+
+- (void)testAssignInTurn
+{
+    messageIds ids;
+    MessageIds_reset(&ids);
+    XCTAssertEqual(MessageIds_assign(&ids, 0), 1);
+    XCTAssertEqual(MessageIds_assign(&ids, 1), 2);
+    XCTAssertEqual(MessageIds_assign(&ids, 10), 11);
+    XCTAssertTrue(MessageIds_isHeld(&ids, 11));
+    XCTAssertFalse(MessageIds_isHeld(&ids, 10));
+
+    // Past the highest identifier, or from one out of range: back to the first free one.
+    XCTAssertEqual(MessageIds_assign(&ids, MESSAGEIDSTEST_MAX), 3);
+    XCTAssertEqual(MessageIds_assign(&ids, MESSAGEIDSTEST_MAX + 1), 4);
+    XCTAssertEqual(MessageIds_assign(&ids, -1), 5);
+    XCTAssertEqual(MessageIds_assign(&ids, MESSAGEIDSTEST_MAX - 1), MESSAGEIDSTEST_MAX);
+    XCTAssertEqual(MessageIds_assign(&ids, 63), 64);
+    XCTAssertEqual(MessageIds_assign(&ids, 63), 65);
+}
+
+- (void)testHoldAndRelease
+{
+    messageIds ids;
+    MessageIds_reset(&ids);
+    MessageIds_hold(&ids, 5);
+    MessageIds_hold(&ids, 6);
+    XCTAssertEqual(MessageIds_assign(&ids, 4), 7);
+    MessageIds_release(&ids, 5);
+    XCTAssertFalse(MessageIds_isHeld(&ids, 5));
+    XCTAssertTrue(MessageIds_isHeld(&ids, 6));
+    XCTAssertEqual(MessageIds_assign(&ids, 4), 5);
+
+    // 0 and out of range identifiers are never held.
+    MessageIds_hold(&ids, 0);
+    MessageIds_hold(&ids, MESSAGEIDSTEST_MAX + 1);
+    MessageIds_hold(&ids, -1);
+    XCTAssertFalse(MessageIds_isHeld(&ids, 0));
+    XCTAssertFalse(MessageIds_isHeld(&ids, MESSAGEIDSTEST_MAX + 1));
+    XCTAssertFalse(MessageIds_isHeld(&ids, -1));
+    MessageIds_release(&ids, 0);
+    MessageIds_release(&ids, MESSAGEIDSTEST_MAX + 1);
+    XCTAssertTrue(MessageIds_isHeld(&ids, 6));
+
+    MessageIds_reset(&ids);
+    XCTAssertFalse(MessageIds_isHeld(&ids, 6));
+    XCTAssertEqual(MessageIds_assign(&ids, 0), 1);
+}
+
+- (void)testExhaustion
+{
+    messageIds ids;
+    MessageIds_reset(&ids);
+    int last = 0;
+    for (int i = 1; i <= MESSAGEIDSTEST_MAX; ++i)
+    {
+        last = MessageIds_assign(&ids, last);
+        if (last != i) { XCTAssertEqual(last, i); break; }
+    }
+    XCTAssertEqual(MessageIds_assign(&ids, last), 0);
+    XCTAssertEqual(MessageIds_assign(&ids, 0), 0);
+    XCTAssertEqual(MessageIds_assign(&ids, 1000), 0);
+
+    // Freed identifiers are found from wherever the search starts, the ones just before it last.
+    MessageIds_release(&ids, 130);
+    MessageIds_release(&ids, 64);
+    MessageIds_release(&ids, MESSAGEIDSTEST_MAX);
+    XCTAssertEqual(MessageIds_assign(&ids, 135), MESSAGEIDSTEST_MAX);
+    XCTAssertEqual(MessageIds_assign(&ids, 135), 64);
+    XCTAssertEqual(MessageIds_assign(&ids, 135), 130);
+    XCTAssertEqual(MessageIds_assign(&ids, 135), 0);
+
+    MessageIds_release(&ids, 1);
+    XCTAssertEqual(MessageIds_assign(&ids, MESSAGEIDSTEST_MAX), 1);
+    MessageIds_release(&ids, 2);
+    XCTAssertEqual(MessageIds_assign(&ids, 2), 2);
+}
+
+- (void)testAgainstTryingEachIdentifier
+{
+    static bool held[MESSAGEIDSTEST_MAX + 1];
+    memset(held, 0, sizeof(held));
+    messageIds ids;
+    MessageIds_reset(&ids);
+    uint32_t seed = 2463534242;
+    int last = 0, count = 0, wrong = 0;
+
+    for (int i = 0; i < 300000; ++i)
+    {
+        uint32_t const r = MessageIdsTest_random(&seed);
+        // Fill up at first, then hover around full so that exhaustion and wrapping both happen.
+        bool const assign = (i < 200000) ? (r % 4 != 0) : (r % 2 == 0);
+        if (assign)
+        {
+            int const expected = MessageIdsTest_expected(held, last);
+            int const msgid = MessageIds_assign(&ids, last);
+            wrong += (msgid != expected);
+            if (msgid > 0) { held[msgid] = true; last = msgid; ++count; }
+        }
+        else
+        {
+            int const msgid = 1 + (int)(r >> 8) % MESSAGEIDSTEST_MAX;
+            count -= held[msgid];
+            held[msgid] = false;
+            MessageIds_release(&ids, msgid);
+        }
+        wrong += (MessageIds_isHeld(&ids, (int)(r >> 16)) != held[r >> 16]);
+    }
+    XCTAssertEqual(wrong, 0);
+    XCTAssertGreaterThan(count, MESSAGEIDSTEST_MAX - 1000);
+}
+
+#pragma mark - Performance tests
+
+- (void)testPerformance1kInFlight
+{
+    static int flight[1000];
+    [self measureBlock:^{
+        messageIds ids;
+        MessageIdsTest_flow(&ids, flight, 1000, 1000000);
+    }];
+}
+
+- (void)testPerformance10kInFlight
+{
+    static int flight[10000];
+    [self measureBlock:^{
+        messageIds ids;
+        MessageIdsTest_flow(&ids, flight, 10000, 1000000);
+    }];
+}
+
+- (void)testPerformance60kInFlight
+{
+    static int flight[60000];
+    [self measureBlock:^{
+        messageIds ids;
+        MessageIdsTest_flow(&ids, flight, 60000, 1000000);
+    }];
+}
+
+@end
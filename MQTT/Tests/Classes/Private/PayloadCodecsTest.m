@@ -0,0 +1,168 @@
+@import XCTest;                 // Apple
+#import "MQTTAsync.h"           // MQTT (Public)
+#import <stdlib.h>              // C Standard
+#import <string.h>              // C Standard
+
+#import "Heap.h"                // MQTT (Utilities)
+
+/*!
+ *  @abstract Test the deflate codec, and that a payload can not make it allocate more than the payload really decodes to.
+ *
+ *  @see MQTTAsync_deflateCodec
+ */
+@interface PayloadCodecsTest : XCTestCase
+@end
+
+#pragma mark - Helpers
+
+/*!
+ *  @abstract Fill a buffer with JSON-like text, which deflates to about a quarter of its length.
+ */
+static void PayloadCodecsTest_fill(char* buffer, size_t length, unsigned int seed)
+{
+    size_t used = 0;
+    while (used < length)
+    {
+        seed = seed * 1103515245 + 12345;
+        char record[64];
+        int const n = snprintf(record, sizeof(record), "{\"sensor\":%u,\"value\":%u},", (seed >> 24) % 16, (seed >> 8) % 100000);
+        size_t const take = (length - used < (size_t)n) ? length - used : (size_t)n;
+        memcpy(buffer + used, record, take);
+        used += take;
+    }
+}
+
+/*!
+ *  @abstract Set the decoded length a deflated payload declares.
+ */
+static void PayloadCodecsTest_declare(unsigned char* encoded, size_t length)
+{
+    encoded[4] = (unsigned char)(length >> 24);
+    encoded[5] = (unsigned char)(length >> 16);
+    encoded[6] = (unsigned char)(length >> 8);
+    encoded[7] = (unsigned char)length;
+}
+
+@implementation PayloadCodecsTest
+
+#pragma mark - Setup
+
++ (void)setUp
+{
+    [super setUp];
+    Heap_initialize();
+}
+
+#pragma mark - Unit tests
+
+- (void)testRoundTrip
+{
+    MQTTAsync_codec const codec = MQTTAsync_deflateCodec;
+    size_t const lengths[] = { 256, 1000, 4095, 4096, 4097, 8192, 65536, 1000000 };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+    {
+        char* data = malloc(lengths[i]);
+        PayloadCodecsTest_fill(data, lengths[i], (unsigned int)i);
+
+        void* encoded = NULL; size_t encodedlen = 0;
+        XCTAssertEqual(codec.encode(codec.context, data, lengths[i], &encoded, &encodedlen), 1);
+        XCTAssertTrue(encoded != NULL && memcmp(encoded, codec.marker, sizeof(codec.marker)) == 0);
+        XCTAssertLessThan(encodedlen, lengths[i]);
+
+        void* decoded = NULL; size_t decodedlen = 0;
+        XCTAssertEqual(codec.decode(codec.context, encoded, encodedlen, &decoded, &decodedlen), 1);
+        XCTAssertEqual(decodedlen, lengths[i]);
+        XCTAssertTrue(decoded != NULL && memcmp(decoded, data, lengths[i]) == 0);
+
+        MQTTAsync_free(decoded);
+        MQTTAsync_free(encoded);
+        free(data);
+    }
+}
+
+- (void)testDeclaredLengthIsNotAllocated
+{
+    MQTTAsync_codec const codec = MQTTAsync_deflateCodec;
+    size_t const length = 2048;
+    char data[2048];
+    PayloadCodecsTest_fill(data, length, 7);
+    void* encoded = NULL; size_t encodedlen = 0;
+    XCTAssertEqual(codec.encode(codec.context, data, length, &encoded, &encodedlen), 1);
+
+    // Within the ratio of the payload, but far beyond what the stream decodes to.
+    size_t const declared = (encodedlen - 8) * MQTTASYNC_DEFLATE_MAX_RATIO;
+    PayloadCodecsTest_declare(encoded, declared);
+    heap_info* const heap = Heap_get_info();
+    heap->max_size = (size_t)heap->current_size;
+    void* decoded = NULL; size_t decodedlen = 0;
+    XCTAssertEqual(codec.decode(codec.context, encoded, encodedlen, &decoded, &decodedlen), 0);
+    XCTAssertTrue(decoded == NULL);
+    XCTAssertLessThanOrEqual(heap->max_size - (size_t)heap->current_size, (size_t)8192);
+
+    // Beyond the ratio, or the largest payload: refused before decoding anything.
+    PayloadCodecsTest_declare(encoded, declared + 1);
+    XCTAssertEqual(codec.decode(codec.context, encoded, encodedlen, &decoded, &decodedlen), 0);
+    PayloadCodecsTest_declare(encoded, 0xFFFFFFFF);
+    XCTAssertEqual(codec.decode(codec.context, encoded, encodedlen, &decoded, &decodedlen), 0);
+    XCTAssertTrue(decoded == NULL);
+    MQTTAsync_free(encoded);
+}
+
+- (void)testDeclaredLengthMismatch
+{
+    MQTTAsync_codec const codec = MQTTAsync_deflateCodec;
+    size_t const length = 100000;
+    char* data = malloc(length);
+    PayloadCodecsTest_fill(data, length, 3);
+    void* encoded = NULL; size_t encodedlen = 0;
+    XCTAssertEqual(codec.encode(codec.context, data, length, &encoded, &encodedlen), 1);
+
+    size_t const declared[] = { length - 1, length / 2, 4096, 1, length + 1 };
+    for (size_t i = 0; i < sizeof(declared) / sizeof(declared[0]); ++i)
+    {
+        PayloadCodecsTest_declare(encoded, declared[i]);
+        void* decoded = NULL; size_t decodedlen = 0;
+        XCTAssertEqual(codec.decode(codec.context, encoded, encodedlen, &decoded, &decodedlen), 0);
+        XCTAssertTrue(decoded == NULL);
+    }
+
+    // Cut short, anywhere in the stream.
+    PayloadCodecsTest_declare(encoded, length);
+    for (size_t cut = 8; cut < encodedlen; cut += encodedlen / 16)
+    {
+        void* decoded = NULL; size_t decodedlen = 0;
+        XCTAssertEqual(codec.decode(codec.context, encoded, cut, &decoded, &decodedlen), 0);
+    }
+    MQTTAsync_free(encoded);
+    free(data);
+}
+
+- (void)testOptions
+{
+    MQTTAsync_deflateOptions options = MQTTAsync_deflateOptions_initializer;
+    options.maxLength = 10000;
+    options.maxRatio = 2;
+    MQTTAsync_codec codec = MQTTAsync_deflateCodec;
+    codec.context = &options;
+
+    char data[20000];
+    PayloadCodecsTest_fill(data, sizeof(data), 5);
+    void* encoded = NULL; size_t encodedlen = 0;
+    // Longer than the limit, or compressed beyond the ratio: left as it is.
+    XCTAssertEqual(codec.encode(codec.context, data, sizeof(data), &encoded, &encodedlen), 0);
+    XCTAssertEqual(codec.encode(codec.context, data, 5000, &encoded, &encodedlen), 0);
+
+    // Encoded by a sender with the default limits: not decoded by this one.
+    XCTAssertEqual(MQTTAsync_deflateCodec.encode(NULL, data, 5000, &encoded, &encodedlen), 1);
+    void* decoded = NULL; size_t decodedlen = 0;
+    XCTAssertEqual(codec.decode(codec.context, encoded, encodedlen, &decoded, &decodedlen), 0);
+    options.maxRatio = 0;
+    XCTAssertEqual(codec.decode(codec.context, encoded, encodedlen, &decoded, &decodedlen), 1);
+    XCTAssertEqual(decodedlen, (size_t)5000);
+    MQTTAsync_free(decoded);
+    options.maxLength = 4999;
+    XCTAssertEqual(codec.decode(codec.context, encoded, encodedlen, &decoded, &decodedlen), 0);
+    MQTTAsync_free(encoded);
+}
+
+@end
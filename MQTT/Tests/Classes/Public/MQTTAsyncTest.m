@@ -0,0 +1,242 @@
+@import XCTest;                     // Apple
+#import "MQTTAsync.h"               // MQTT (Public)
+#import "MQTTClientPersistence.h"   // MQTT (Public)
+#import "MQTTTestServer.h"          // Tests
+#import <stdatomic.h>               // C Standard
+#import <stdio.h>                   // C Standard
+#import <time.h>                    // C Standard
+#import <unistd.h>                  // POSIX
+
+#import "Heap.h"                    // MQTT (Utilities)
+
+/*!
+ *  @abstract Test how MQTTAsync clients queue and send their commands, against a stand-in server.
+ *
+ *  @see MQTTTestServer
+ */
+@interface MQTTAsyncTest : XCTestCase
+@end
+
+#pragma mark - Helpers
+
+#define MQTTASYNCTEST_WINDOW 20     // Receive Maximum of the server, for the clients to be held up by.
+#define MQTTASYNCTEST_HELD 5        // Held up clients of the benchmark.
+#define MQTTASYNCTEST_CLIENTS 50    // Clients of the benchmark; a thousand would not fit in the descriptors a test gets.
+
+static atomic_int MQTTAsyncTest_connected;
+static atomic_int MQTTAsyncTest_written;
+
+static void MQTTAsyncTest_onConnect(void* context, MQTTAsync_successData* response)
+{
+    ++MQTTAsyncTest_connected;
+}
+
+static void MQTTAsyncTest_onWritten(void* context, MQTTAsync_successData* response)
+{
+    ++MQTTAsyncTest_written;
+}
+
+/*!
+ *  @abstract Wait until a counter reaches a value, or some seconds have passed.
+ */
+static bool MQTTAsyncTest_waitFor(atomic_int* counter, int value, int seconds)
+{
+    for (int i = 0; i < seconds * 1000 && *counter < value; ++i) { usleep(1000); }
+    return *counter >= value;
+}
+
+/*!
+ *  @abstract Create a client of the server, and connect it.
+ */
+static MQTTAsync MQTTAsyncTest_connect(MQTTTestServer const* server, char const* clientID, int version)
+{
+    MQTTAsync client = NULL;
+    if (MQTTAsync_create(&client, MQTTTestServer_uri(server), clientID, MQTTCLIENT_PERSISTENCE_NONE, NULL) != MQTTCODE_SUCCESS) { return NULL; }
+    
+    MQTTAsync_connectOptions options = MQTTAsync_connectOptions_initializer;
+    options.MQTTVersion = version;
+    options.onSuccess = MQTTAsyncTest_onConnect;
+    int const connected = MQTTAsyncTest_connected;
+    if (MQTTAsync_connect(client, &options) != MQTTCODE_SUCCESS || !MQTTAsyncTest_waitFor(&MQTTAsyncTest_connected, connected + 1, 5))
+    {
+        MQTTAsync_destroy(&client);
+        return NULL;
+    }
+    return client;
+}
+
+/*!
+ *  @abstract Disconnect a client and destroy it, if there is one.
+ */
+static void MQTTAsyncTest_disconnect(MQTTAsync client)
+{
+    if (client == NULL) { return; }
+    MQTTAsync_disconnectOptions options = MQTTAsync_disconnectOptions_initializer;
+    options.timeout = 100;
+    MQTTAsync_disconnect(client, &options);
+    for (int i = 0; i < 1000 && MQTTAsync_isConnected(client); ++i) { usleep(1000); }
+    MQTTAsync_destroy(&client);
+}
+
+/*!
+ *  @abstract Create clients of the server, identified by a prefix and a number, and connect them.
+ *
+ *  @return whether they were all connected.
+ */
+static bool MQTTAsyncTest_connectMany(MQTTTestServer const* server, char const* prefix, MQTTAsync* clients, int count, int version)
+{
+    memset(clients, 0, (size_t)count * sizeof(MQTTAsync));
+    for (int i = 0; i < count; ++i)
+    {
+        char clientID[32];
+        snprintf(clientID, sizeof(clientID), "%s-%d", prefix, i);
+        if ((clients[i] = MQTTAsyncTest_connect(server, clientID, version)) == NULL) { return false; }
+    }
+    return true;
+}
+
+/*!
+ *  @abstract Wait until the server has received a number of messages from a client, or some seconds have passed.
+ */
+static bool MQTTAsyncTest_waitForServer(MQTTTestServer* server, char const* clientID, int count, int seconds)
+{
+    for (int i = 0; i < seconds * 1000 && MQTTTestServer_published(server, clientID) < count; ++i) { usleep(1000); }
+    return MQTTTestServer_published(server, clientID) == count;
+}
+
+/*!
+ *  @abstract The number of messages of a client not completed yet, queued or in flight.
+ */
+static int MQTTAsyncTest_pending(MQTTAsync client)
+{
+    MQTTAsync_token* tokens = NULL;
+    int count = 0;
+    MQTTAsync_getPendingTokens(client, &tokens);
+    for (; tokens != NULL && tokens[count] != -1; ++count);
+    MQTTAsync_free(tokens);
+    return count;
+}
+
+/*!
+ *  @abstract Queue messages of 100 bytes, without waiting for them to be sent. QoS 0 messages count as written once they are.
+ *
+ *  @return whether they were all queued.
+ */
+static bool MQTTAsyncTest_queue(MQTTAsync client, char const* topic, int count, int qos)
+{
+    char payload[100];
+    memset(payload, 'x', sizeof(payload));
+    MQTTAsync_responseOptions response = MQTTAsync_responseOptions_initializer;
+    response.onSuccess = MQTTAsyncTest_onWritten;
+    
+    for (int i = 0; i < count; ++i)
+    {
+        if (MQTTAsync_send(client, topic, sizeof(payload), payload, qos, 0, &response) != MQTTCODE_SUCCESS) { return false; }
+    }
+    return true;
+}
+
+/*!
+ *  @abstract Publish QoS 0 messages, and wait until they are written.
+ *
+ *  @return whether they were all queued and written.
+ */
+static bool MQTTAsyncTest_publish(MQTTAsync client, char const* topic, int count)
+{
+    int const written = MQTTAsyncTest_written;
+    return MQTTAsyncTest_queue(client, topic, count, 0) && MQTTAsyncTest_waitFor(&MQTTAsyncTest_written, written + count, 5);
+}
+
+@implementation MQTTAsyncTest
+
+#pragma mark - Setup
+
++ (void)setUp
+{
+    [super setUp];
+    Heap_initialize();
+}
+
+#pragma mark - Unit tests
+
+- (void)testPublishAllocations
+{
+    MQTTTestServer* server = MQTTTestServer_start(0, true);
+    XCTAssertTrue(server != NULL);
+    MQTTAsync client = MQTTAsyncTest_connect(server, "allocations", MQTTVERSION_3_1_1);
+    XCTAssertTrue(client != NULL);
+    
+    // Warmed up with more messages at once than are counted, so that the commands to reuse are there, whatever the timing.
+    for (int i = 0; i < 4; ++i) { XCTAssertTrue(MQTTAsyncTest_publish(client, "tests/allocations", 100)); }
+    usleep(100000);
+    
+    heap_info const* heap = Heap_get_info();
+    size_t const allocations = heap->allocations;
+    for (int i = 0; i < 20; ++i) { XCTAssertTrue(MQTTAsyncTest_publish(client, "tests/allocations", 50)); }
+    XCTAssertEqual(heap->allocations - allocations, (size_t)0);
+    
+    MQTTAsyncTest_disconnect(client);
+    XCTAssertEqual(MQTTTestServer_published(server, "allocations"), 1400);
+    MQTTTestServer_stop(server);
+}
+
+- (void)testHeldUpClientsDoNotHoldUpOthers
+{
+    // The server never acknowledges, so the held up clients fill their window and queue the rest.
+    MQTTTestServer* server = MQTTTestServer_start(MQTTASYNCTEST_WINDOW, false);
+    XCTAssertTrue(server != NULL);
+    MQTTAsync held[2], others[8];
+    XCTAssertTrue(MQTTAsyncTest_connectMany(server, "held", held, 2, MQTTVERSION_5));
+    XCTAssertTrue(MQTTAsyncTest_connectMany(server, "other", others, 8, MQTTVERSION_5));
+    
+    for (int i = 0; i < 2; ++i) { XCTAssertTrue(MQTTAsyncTest_queue(held[i], "tests/held", 2000, 1)); }
+    int const written = MQTTAsyncTest_written;
+    for (int i = 0; i < 8; ++i) { XCTAssertTrue(MQTTAsyncTest_queue(others[i], "tests/others", 100, 0)); }
+    XCTAssertTrue(MQTTAsyncTest_waitFor(&MQTTAsyncTest_written, written + 800, 5));
+    for (int i = 0; i < 8; ++i)
+    {
+        char clientID[32];
+        snprintf(clientID, sizeof(clientID), "other-%d", i);
+        XCTAssertTrue(MQTTAsyncTest_waitForServer(server, clientID, 100, 5));
+    }
+    
+    // Nothing else goes out, and the send thread waits rather than going over the held up clients again and again.
+    clock_t const cpu = clock();
+    usleep(500000);
+    XCTAssertLessThan((double)(clock() - cpu) / CLOCKS_PER_SEC, 0.1);
+    XCTAssertEqual(MQTTTestServer_published(server, "held-0"), MQTTASYNCTEST_WINDOW);
+    XCTAssertEqual(MQTTTestServer_published(server, "held-1"), MQTTASYNCTEST_WINDOW);
+    for (int i = 0; i < 2; ++i) { XCTAssertEqual(MQTTAsyncTest_pending(held[i]), 2000); }
+    
+    for (int i = 0; i < 8; ++i) { MQTTAsyncTest_disconnect(others[i]); }
+    for (int i = 0; i < 2; ++i) { MQTTAsyncTest_disconnect(held[i]); }
+    MQTTTestServer_stop(server);
+}
+
+#pragma mark - Performance tests
+
+- (void)testPerformanceQueuedPublishes
+{
+    // Many clients with messages queued, behind a few held up ones with a backlog.
+    MQTTTestServer* server = MQTTTestServer_start(MQTTASYNCTEST_WINDOW, false);
+    XCTAssertTrue(server != NULL);
+    MQTTAsync* const held = malloc(MQTTASYNCTEST_HELD * sizeof(MQTTAsync));
+    MQTTAsync* const clients = malloc(MQTTASYNCTEST_CLIENTS * sizeof(MQTTAsync));
+    XCTAssertTrue(MQTTAsyncTest_connectMany(server, "held", held, MQTTASYNCTEST_HELD, MQTTVERSION_5));
+    XCTAssertTrue(MQTTAsyncTest_connectMany(server, "client", clients, MQTTASYNCTEST_CLIENTS, MQTTVERSION_5));
+    for (int i = 0; i < MQTTASYNCTEST_HELD; ++i) { XCTAssertTrue(MQTTAsyncTest_queue(held[i], "tests/held", 1000, 1)); }
+    
+    [self measureBlock:^{
+        int const written = MQTTAsyncTest_written;
+        for (int i = 0; i < MQTTASYNCTEST_CLIENTS; ++i) { XCTAssertTrue(MQTTAsyncTest_queue(clients[i], "tests/queued", 100, 0)); }
+        XCTAssertTrue(MQTTAsyncTest_waitFor(&MQTTAsyncTest_written, written + MQTTASYNCTEST_CLIENTS * 100, 10));
+    }];
+    
+    for (int i = 0; i < MQTTASYNCTEST_CLIENTS; ++i) { MQTTAsyncTest_disconnect(clients[i]); }
+    for (int i = 0; i < MQTTASYNCTEST_HELD; ++i) { MQTTAsyncTest_disconnect(held[i]); }
+    free(clients);
+    free(held);
+    MQTTTestServer_stop(server);
+}
+
+@end
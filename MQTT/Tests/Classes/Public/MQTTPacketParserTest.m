@@ -0,0 +1,363 @@
+@import XCTest;                 // Apple
+#import "MQTTPacket.h"          // MQTT (Public)
+#import "MQTTPacketParser.h"    // MQTT (Public)
+#import <stdint.h>              // C Standard
+#import <stdlib.h>              // C Standard
+#import <string.h>              // C Standard
+
+/*!
+ *  @abstract Test that the parser finds the same packets however the input is split, and measure it.
+ *
+ *  @see MQTTPacketParser_parse
+ */
+@interface MQTTPacketParserTest : XCTestCase
+@end
+
+#pragma mark - Helpers
+
+#define MQTTPACKETPARSERTEST_PACKETS 64 // Most packets in a capture.
+
+/*!
+ *  @abstract A synthetic capture: packets back to back, as a connection would receive them.
+ *
+ *  @field bytes The packets.
+ *  @field length The length of bytes.
+ *  @field count Number of packets.
+ *  @field headers The header byte of each packet.
+ *  @field bodies The offset of the variable header and payload of each packet in bytes.
+ *  @field lengths The remaining length of each packet.
+ */
+typedef struct
+{
+    char* bytes;
+    size_t length;
+    int count;
+    unsigned char headers[MQTTPACKETPARSERTEST_PACKETS];
+    size_t bodies[MQTTPACKETPARSERTEST_PACKETS];
+    size_t lengths[MQTTPACKETPARSERTEST_PACKETS];
+} MQTTPacketParserTest_capture;
+
+/*!
+ *  @abstract Where the packets found in a capture are up to.
+ *
+ *  @field packet Index of the packet expected next.
+ *  @field offset The bytes of that packet already handed out in chunks.
+ *  @field chunks Number of chunks handed out.
+ *  @field wrong Number of frames not matching the capture.
+ */
+typedef struct
+{
+    int packet;
+    size_t offset;
+    int chunks;
+    int wrong;
+} MQTTPacketParserTest_progress;
+
+/*!
+ *  @abstract Next number of a reproducible sequence (xorshift).
+ */
+static uint32_t MQTTPacketParserTest_random(uint32_t* seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/*!
+ *  @abstract Append a packet to a capture; a publish gets a topic, a message id for QoS 1 and 2, and properties if asked.
+ *  @discussion The rest of the body is filled with bytes depending on the packet's place in the capture.
+ */
+static void MQTTPacketParserTest_add(MQTTPacketParserTest_capture* capture, unsigned char header, size_t payloadlen, bool properties)
+{
+    char body[32] = { 0 };
+    size_t headlen = 0;
+    if ((header >> 4) == PUBLISH)
+    {
+        char const* topic = "sensors/a";
+        body[headlen++] = 0;
+        body[headlen++] = (char)strlen(topic);
+        memcpy(body + headlen, topic, strlen(topic));
+        headlen += strlen(topic);
+        if (((header >> 1) & 3) > 0) { body[headlen++] = 0; body[headlen++] = (char)capture->count; }
+        if (properties) { body[headlen++] = 3; body[headlen++] = TOPIC_ALIAS; body[headlen++] = 0; body[headlen++] = 1; }
+    }
+    size_t const remaining = headlen + payloadlen;
+
+    char encoded[4];
+    int lenbytes = 0;
+    size_t rest = remaining;
+    do
+    {
+        encoded[lenbytes] = (char)(rest % 128);
+        rest /= 128;
+        if (rest > 0) { encoded[lenbytes] |= (char)128; }
+        ++lenbytes;
+    } while (rest > 0);
+
+    capture->bytes = realloc(capture->bytes, capture->length + 1 + (size_t)lenbytes + remaining);
+    char* out = capture->bytes + capture->length;
+    *out++ = (char)header;
+    memcpy(out, encoded, (size_t)lenbytes);
+    out += lenbytes;
+    memcpy(out, body, headlen);
+    for (size_t i = 0; i < payloadlen; ++i) { out[headlen + i] = (char)(capture->count * 31 + i); }
+
+    capture->headers[capture->count] = header;
+    capture->bodies[capture->count] = (size_t)(out - capture->bytes);
+    capture->lengths[capture->count] = remaining;
+    ++capture->count;
+    capture->length += 1 + (size_t)lenbytes + remaining;
+}
+
+/*!
+ *  @abstract A capture with every kind of packet, and remaining lengths on both sides of each length of their encoding.
+ */
+static MQTTPacketParserTest_capture MQTTPacketParserTest_mixed(bool properties)
+{
+    MQTTPacketParserTest_capture capture = { 0 };
+    size_t const payloads[] = { 0, 1, 100, 127, 128, 999, 1000, 1001, 16383, 16384, 70000 };
+    for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); ++i)
+    {
+        MQTTPacketParserTest_add(&capture, PUBLISH << 4, payloads[i], properties);
+        MQTTPacketParserTest_add(&capture, PUBLISH << 4 | 1 << 1, payloads[i], properties);
+        MQTTPacketParserTest_add(&capture, PUBACK << 4, 2, properties);
+        MQTTPacketParserTest_add(&capture, PUBLISH << 4 | 2 << 1 | 1, payloads[i], properties);
+        MQTTPacketParserTest_add(&capture, PINGRESP << 4, 0, properties);
+    }
+    MQTTPacketParserTest_add(&capture, SUBACK << 4, 3, properties);
+    MQTTPacketParserTest_add(&capture, CONNACK << 4, 2, properties);
+    return capture;
+}
+
+/*!
+ *  @abstract Check a frame against the packet of the capture expected next.
+ */
+static void MQTTPacketParserTest_check(MQTTPacketParserTest_capture const* capture, MQTTPacketParserTest_progress* progress, MQTTPacketParser_frame const* frame)
+{
+    int const i = progress->packet;
+    if (i >= capture->count || frame->header != capture->headers[i] || frame->packet_length != capture->lengths[i] || frame->offset != progress->offset ||
+        frame->remaining_length > capture->lengths[i] - progress->offset || (!frame->chunked && frame->remaining_length != capture->lengths[i]) ||
+        memcmp(frame->data, capture->bytes + capture->bodies[i] + progress->offset, frame->remaining_length) != 0)
+    {
+        ++progress->wrong;
+        return;
+    }
+    progress->chunks += frame->chunked;
+    progress->offset += frame->remaining_length;
+    if (progress->offset == capture->lengths[i])
+    {
+        ++progress->packet;
+        progress->offset = 0;
+    }
+}
+
+/*!
+ *  @abstract Feed a capture to a parser in chunks, as a connection reading them would.
+ *  @discussion Each call gets a copy of the bytes not consumed yet followed by the chunk, in a buffer just long enough, followed by bytes that are not MQTT.
+ *
+ *  @param sizes the chunk sizes, used in turn; 0 for the whole capture in one go.
+ *  @return SOCKET_ERROR if the parser refused the input or took more than it was given, otherwise how many packets it handed out.
+ */
+static int MQTTPacketParserTest_feed(MQTTPacketParser* parser, MQTTPacketParserTest_capture const* capture, size_t const* sizes, size_t count, MQTTPacketParserTest_progress* progress)
+{
+    char* const input = malloc(capture->length + 16);
+    size_t start = 0, end = 0;
+    for (size_t turn = 0; end < capture->length; ++turn)
+    {
+        size_t const size = (sizes[turn % count] == 0) ? capture->length : sizes[turn % count];
+        end = (capture->length - end < size) ? capture->length : end + size;
+        while (true)
+        {
+            size_t const len = end - start;
+            memcpy(input, capture->bytes + start, len);
+            memset(input + len, 0xFF, 16);
+            size_t consumed = 0, needed = 0;
+            int const found = MQTTPacketParser_parse(parser, input, len, &consumed, &needed);
+            if (found == SOCKET_ERROR || consumed > len) { free(input); return SOCKET_ERROR; }
+
+            MQTTPacketParser_frame const* frame;
+            while ((frame = MQTTPacketParser_next(parser)) != NULL) { MQTTPacketParserTest_check(capture, progress, frame); }
+            start += consumed;
+            if (needed > 0)
+            {   // The parser must have asked for more than it has.
+                if (needed <= len - consumed) { ++progress->wrong; }
+                break;
+            }
+        }
+    }
+    free(input);
+    return progress->packet;
+}
+
+/*!
+ *  @abstract A parser for a new connection.
+ */
+static MQTTPacketParser MQTTPacketParserTest_parser(size_t chunkThreshold, bool properties)
+{
+    MQTTPacketParser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.chunkThreshold = chunkThreshold;
+    parser.properties = properties;
+    MQTTPacketParser_reset(&parser);
+    return parser;
+}
+
+@implementation MQTTPacketParserTest
+
+#pragma mark - Unit tests
+
+- (void)testSplits
+{
+    size_t const whole[] = { 0 };
+    size_t const bytes[] = { 1 };
+    size_t const uneven[] = { 3, 1, 7, 2, 1000, 5, 64, 1 };
+    size_t const reads[] = { 4096 };
+    struct { size_t const* sizes; size_t count; } const splits[] = {
+        { whole, 1 }, { bytes, 1 }, { uneven, sizeof(uneven) / sizeof(uneven[0]) }, { reads, 1 },
+    };
+    size_t const thresholds[] = { 0, 1000, 1 };
+
+    for (int properties = 0; properties < 2; ++properties)
+    {
+        MQTTPacketParserTest_capture capture = MQTTPacketParserTest_mixed(properties);
+        for (size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); ++t)
+        {
+            for (size_t s = 0; s < sizeof(splits) / sizeof(splits[0]); ++s)
+            {
+                MQTTPacketParser parser = MQTTPacketParserTest_parser(thresholds[t], properties);
+                MQTTPacketParserTest_progress progress = { 0 };
+                XCTAssertEqual(MQTTPacketParserTest_feed(&parser, &capture, splits[s].sizes, splits[s].count, &progress), capture.count);
+                XCTAssertEqual(progress.wrong, 0);
+                XCTAssertEqual(progress.offset, (size_t)0);
+                if (thresholds[t] == 0) { XCTAssertEqual(progress.chunks, 0); }
+                else { XCTAssertGreaterThan(progress.chunks, 0); }
+            }
+        }
+        free(capture.bytes);
+    }
+}
+
+- (void)testRandomSplits
+{
+    uint32_t seed = 2463534242;
+    for (int properties = 0; properties < 2; ++properties)
+    {
+        MQTTPacketParserTest_capture capture = MQTTPacketParserTest_mixed(properties);
+        for (int round = 0; round < 200; ++round)
+        {
+            size_t sizes[64];
+            for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+            {   // Mostly short reads, some long ones.
+                uint32_t const r = MQTTPacketParserTest_random(&seed);
+                sizes[i] = 1 + ((r & 3) ? (r >> 8) % 16 : (r >> 8) % 20000);
+            }
+            MQTTPacketParser parser = MQTTPacketParserTest_parser((round % 3 == 0) ? 0 : 1 + round * 7, properties);
+            MQTTPacketParserTest_progress progress = { 0 };
+            XCTAssertEqual(MQTTPacketParserTest_feed(&parser, &capture, sizes, sizeof(sizes) / sizeof(sizes[0]), &progress), capture.count);
+            XCTAssertEqual(progress.wrong, 0);
+        }
+        free(capture.bytes);
+    }
+}
+
+- (void)testEverySplitInTwo
+{
+    MQTTPacketParserTest_capture capture = { 0 };
+    MQTTPacketParserTest_add(&capture, PUBLISH << 4 | 1 << 1, 300, true);
+    MQTTPacketParserTest_add(&capture, PUBACK << 4, 2, true);
+    MQTTPacketParserTest_add(&capture, PUBLISH << 4, 20, true);
+    MQTTPacketParserTest_add(&capture, PINGRESP << 4, 0, true);
+
+    for (size_t split = 1; split < capture.length; ++split)
+    {
+        size_t const sizes[] = { split, capture.length };
+        for (size_t threshold = 0; threshold < 400; threshold += 100)
+        {
+            MQTTPacketParser parser = MQTTPacketParserTest_parser(threshold, true);
+            MQTTPacketParserTest_progress progress = { 0 };
+            XCTAssertEqual(MQTTPacketParserTest_feed(&parser, &capture, sizes, 2, &progress), capture.count);
+            XCTAssertEqual(progress.wrong, 0);
+        }
+    }
+    free(capture.bytes);
+}
+
+- (void)testFullBatch
+{
+    MQTTPacketParserTest_capture capture = { 0 };
+    for (int i = 0; i < MQTTPACKETPARSERTEST_PACKETS; ++i) { MQTTPacketParserTest_add(&capture, PUBACK << 4, 2, false); }
+
+    MQTTPacketParser parser = MQTTPacketParserTest_parser(0, false);
+    size_t consumed = 0, needed = 0;
+    XCTAssertEqual(MQTTPacketParser_parse(&parser, capture.bytes, capture.length, &consumed, &needed), MQTTPACKETPARSER_BATCH);
+    XCTAssertEqual(consumed, (size_t)(MQTTPACKETPARSER_BATCH * 4));
+    XCTAssertEqual(needed, (size_t)0);
+
+    size_t const whole[] = { 0 };
+    MQTTPacketParserTest_progress progress = { 0 };
+    parser = MQTTPacketParserTest_parser(0, false);
+    XCTAssertEqual(MQTTPacketParserTest_feed(&parser, &capture, whole, 1, &progress), capture.count);
+    XCTAssertEqual(progress.wrong, 0);
+    free(capture.bytes);
+}
+
+- (void)testBadInput
+{
+    size_t const bytes[] = { 1 };
+    size_t const whole[] = { 0 };
+
+    // A remaining length of more than four bytes.
+    char length[] = { (char)(PUBACK << 4), (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, 0x01 };
+    MQTTPacketParserTest_capture capture = { .bytes = length, .length = sizeof(length) };
+    MQTTPacketParser parser = MQTTPacketParserTest_parser(0, false);
+    MQTTPacketParserTest_progress progress = { 0 };
+    XCTAssertEqual(MQTTPacketParserTest_feed(&parser, &capture, bytes, 1, &progress), SOCKET_ERROR);
+
+    // A publish handed out in chunks whose topic overruns it.
+    char topic[40] = { (char)(PUBLISH << 4), 38, 0x01, 0x00 };
+    capture = (MQTTPacketParserTest_capture){ .bytes = topic, .length = sizeof(topic) };
+    parser = MQTTPacketParserTest_parser(1, false);
+    XCTAssertEqual(MQTTPacketParserTest_feed(&parser, &capture, bytes, 1, &progress), SOCKET_ERROR);
+    parser = MQTTPacketParserTest_parser(1, false);
+    XCTAssertEqual(MQTTPacketParserTest_feed(&parser, &capture, whole, 1, &progress), SOCKET_ERROR);
+    XCTAssertEqual(progress.packet, 0);
+}
+
+#pragma mark - Performance tests
+
+- (void)testPerformancePacketsPerSecond
+{
+    // Small publishes and their acknowledgements, read 4 KB at a time.
+    MQTTPacketParserTest_capture capture = { 0 };
+    for (int i = 0; i < MQTTPACKETPARSERTEST_PACKETS / 2; ++i)
+    {
+        MQTTPacketParserTest_add(&capture, PUBLISH << 4 | 1 << 1, 20 + (size_t)i, false);
+        MQTTPacketParserTest_add(&capture, PUBACK << 4, 2, false);
+    }
+    size_t const copies = 10000;
+    char* const bytes = malloc(capture.length * copies);
+    for (size_t i = 0; i < copies; ++i) { memcpy(bytes + i * capture.length, capture.bytes, capture.length); }
+    size_t const total = capture.length * copies;
+
+    [self measureBlock:^{
+        MQTTPacketParser parser = MQTTPacketParserTest_parser(0, false);
+        size_t start = 0, end = 0, packets = 0;
+        while (start < total)
+        {
+            end = (total - end < 4096) ? total : end + 4096;
+            size_t consumed = 0, needed = 0;
+            do
+            {
+                XCTAssertGreaterThanOrEqual(MQTTPacketParser_parse(&parser, bytes + start, end - start, &consumed, &needed), 0);
+                while (MQTTPacketParser_next(&parser) != NULL) { ++packets; }
+                start += consumed;
+            } while (needed == 0 && start < end);
+        }
+        XCTAssertEqual(packets, (size_t)capture.count * copies);
+    }];
+    free(bytes);
+    free(capture.bytes);
+}
+
+@end
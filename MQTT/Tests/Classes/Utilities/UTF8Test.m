@@ -0,0 +1,299 @@
+@import XCTest;                 // Apple
+#import "utf-8.h"               // MQTT (Utilities)
+#import <stdint.h>              // C Standard
+#import <stdlib.h>              // C Standard
+#import <string.h>              // C Standard
+#import <sys/mman.h>            // POSIX
+#import <unistd.h>              // POSIX
+
+/*!
+ *  @abstract Test that the vector validator agrees with the character by character one, and measure it.
+ *  @discussion Where the library is built without a vector unit both paths are the same, and only the benchmarks tell anything.
+ *
+ *  @see UTF8_validate
+ *  @see UTF8_validateStringLength
+ */
+@interface UTF8Test : XCTestCase
+@end
+
+#pragma mark - Helpers
+
+bool UTF8_scalar_validate(size_t const len, char const* restrict data);
+
+#define UTF8TEST_BENCHMARK_LENGTH (1 << 20)
+
+/*!
+ *  @abstract Next number of a reproducible sequence (xorshift).
+ */
+static uint32_t UTF8Test_random(uint32_t* seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/*!
+ *  @abstract Write a random well formed character, other than NUL; half of them ASCII.
+ *
+ *  @return the number of bytes written (1 to 4).
+ */
+static size_t UTF8Test_character(unsigned char* out, uint32_t* seed)
+{
+    uint32_t const r = UTF8Test_random(seed);
+    uint32_t code;
+    switch (r % 8)
+    {
+        case 0: case 1: case 2: case 3: code = 1 + (r >> 8) % 0x7F; break;
+        case 4: case 5: code = 0x80 + (r >> 8) % (0x800 - 0x80); break;
+        case 6: code = 0x800 + (r >> 8) % (0x10000 - 0x800); break;
+        default: code = 0x10000 + (r >> 8) % (0x110000 - 0x10000); break;
+    }
+    if (code >= 0xD800 && code < 0xE000) { code -= 0x800; }    // Surrogates are not characters.
+
+    if (code < 0x80) { out[0] = (unsigned char)code; return 1; }
+    if (code < 0x800)
+    {
+        out[0] = (unsigned char)(0xC0 | code >> 6);
+        out[1] = (unsigned char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000)
+    {
+        out[0] = (unsigned char)(0xE0 | code >> 12);
+        out[1] = (unsigned char)(0x80 | (code >> 6 & 0x3F));
+        out[2] = (unsigned char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (unsigned char)(0xF0 | code >> 18);
+    out[1] = (unsigned char)(0x80 | (code >> 12 & 0x3F));
+    out[2] = (unsigned char)(0x80 | (code >> 6 & 0x3F));
+    out[3] = (unsigned char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+/*!
+ *  @abstract Fill a buffer with random characters, the last one possibly cut short, then overwrite some bytes at random.
+ *  @discussion No byte is NUL, so the buffer can be terminated to be a string of the same length.
+ */
+static void UTF8Test_fill(unsigned char* out, size_t length, unsigned int corruptions, uint32_t* seed)
+{
+    size_t used = 0;
+    while (used < length)
+    {
+        unsigned char character[4];
+        size_t const n = UTF8Test_character(character, seed);
+        size_t const take = (length - used < n) ? length - used : n;
+        memcpy(out + used, character, take);
+        used += take;
+    }
+    for (unsigned int i = 0; i < corruptions && length > 0; ++i)
+    {
+        out[UTF8Test_random(seed) % length] = (unsigned char)(1 + UTF8Test_random(seed) % 255);
+    }
+}
+
+/*!
+ *  @abstract Whether both validators give the same answer for a length-delimited buffer.
+ */
+static bool UTF8Test_agree(unsigned char const* data, size_t length)
+{
+    return UTF8_validate(length, (char const*)data) == UTF8_scalar_validate(length, (char const*)data);
+}
+
+/*!
+ *  @abstract Whether UTF8_validateStringLength measures a string as strlen does, and judges it as the scalar validator does.
+ */
+static bool UTF8Test_agreeString(char const* string)
+{
+    size_t length = 0;
+    bool const valid = UTF8_validateStringLength(string, &length);
+    return length == strlen(string) && valid == UTF8_scalar_validate(length, string);
+}
+
+@implementation UTF8Test
+
+#pragma mark - Unit tests
+
+- (void)testEveryShortSequence
+{
+    unsigned char buffer[3 * 16];
+    size_t const positions[] = { 0, 13, 14, 15, 16, 31, 46, 47 };  // Across and at the ends of the blocks.
+    unsigned int disagreements = 0;
+
+    for (size_t p = 0; p < sizeof(positions) / sizeof(positions[0]); ++p)
+    {
+        for (unsigned int sequence = 0; sequence < (1 << 16); ++sequence)
+        {
+            memset(buffer, 'a', sizeof(buffer));
+            buffer[positions[p]] = (unsigned char)(sequence >> 8);
+            if (positions[p] + 1 < sizeof(buffer)) { buffer[positions[p] + 1] = (unsigned char)sequence; }
+            disagreements += !UTF8Test_agree(buffer, sizeof(buffer));
+        }
+    }
+
+    // Three bytes from a lead byte on, with every second and third byte.
+    for (size_t p = 14; p < sizeof(buffer); p += 32)
+    {
+        for (unsigned int sequence = 0xC00000; sequence < (1 << 24); ++sequence)
+        {
+            memset(buffer, 'a', sizeof(buffer));
+            buffer[p] = (unsigned char)(sequence >> 16);
+            buffer[p + 1] = (unsigned char)(sequence >> 8);
+            if (p + 2 < sizeof(buffer)) { buffer[p + 2] = (unsigned char)sequence; }
+            disagreements += !UTF8Test_agree(buffer, sizeof(buffer));
+        }
+    }
+
+    // Four bytes from a four byte lead on, the last byte a few telling values.
+    unsigned char const lasts[] = { 0x00, 0x41, 0x7F, 0x80, 0xBF, 0xC0, 0xF4, 0xFF };
+    for (unsigned int sequence = 0xF00000; sequence < 0xF80000; ++sequence)
+    {
+        for (size_t l = 0; l < sizeof(lasts); ++l)
+        {
+            memset(buffer, 'a', sizeof(buffer));
+            buffer[13] = (unsigned char)(sequence >> 16);
+            buffer[14] = (unsigned char)(sequence >> 8);
+            buffer[15] = (unsigned char)sequence;
+            buffer[16] = lasts[l];
+            disagreements += !UTF8Test_agree(buffer, sizeof(buffer));
+        }
+    }
+    XCTAssertEqual(disagreements, 0U);
+}
+
+- (void)testRandomBuffers
+{
+    unsigned char buffer[256];
+    uint32_t seed = 2463534242;
+    unsigned int disagreements = 0, valid = 0;
+
+    for (unsigned int i = 0; i < 100000; ++i)
+    {
+        size_t const length = UTF8Test_random(&seed) % (sizeof(buffer) + 1);
+        UTF8Test_fill(buffer, length, UTF8Test_random(&seed) % 3, &seed);
+        disagreements += !UTF8Test_agree(buffer, length);
+        valid += UTF8_scalar_validate(length, (char const*)buffer);
+    }
+    XCTAssertEqual(disagreements, 0U);
+    // Both answers must have been exercised.
+    XCTAssertGreaterThan(valid, 10000U);
+    XCTAssertLessThan(valid, 90000U);
+}
+
+- (void)testStringLengthAtEveryAlignment
+{
+    unsigned char fillers[] = { 'a', 0x80, 0xBF, 0xC3, 0xE0, 0xF0, 0xFF };  // What lies around the string must not matter.
+    unsigned char* buffer = NULL;
+    XCTAssertEqual(posix_memalign((void**)&buffer, 64, 512), 0);
+    uint32_t seed = 88675123;
+    unsigned int disagreements = 0;
+
+    for (unsigned int i = 0; i < 20000; ++i)
+    {
+        size_t const offset = i % 64;
+        size_t const length = UTF8Test_random(&seed) % 200;
+        memset(buffer, fillers[UTF8Test_random(&seed) % sizeof(fillers)], offset);
+        UTF8Test_fill(buffer + offset, length, UTF8Test_random(&seed) % 2, &seed);
+        buffer[offset + length] = 0;
+        memset(buffer + offset + length + 1, fillers[UTF8Test_random(&seed) % sizeof(fillers)], 512 - offset - length - 1);
+        disagreements += !UTF8Test_agreeString((char const*)buffer + offset);
+    }
+    XCTAssertEqual(disagreements, 0U);
+    free(buffer);
+}
+
+- (void)testStringLengthOnTheHeap
+{
+    // Each string in an allocation just long enough for it, as the topics given to the client are; the address sanitizer reports any byte read past it.
+    uint32_t seed = 3624360;
+    unsigned int disagreements = 0;
+
+    for (size_t length = 0; length < 200; ++length)
+    {
+        for (unsigned int i = 0; i < 8; ++i)
+        {
+            char* const string = malloc(length + 1);
+            UTF8Test_fill((unsigned char*)string, length, i % 2, &seed);
+            string[length] = 0;
+            disagreements += !UTF8Test_agreeString(string);
+            free(string);
+        }
+    }
+
+    char* const topic = strdup("abcd");
+    size_t length = 0;
+    XCTAssertTrue(UTF8_validateStringLength(topic, &length));
+    XCTAssertEqual(length, (size_t)4);
+    free(topic);
+    XCTAssertEqual(disagreements, 0U);
+}
+
+- (void)testStringLengthNextToUnmappedPages
+{
+    size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned char* const pages = mmap(NULL, 3 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    XCTAssertTrue(pages != MAP_FAILED);
+    // Reading a byte of the first or the last page faults.
+    XCTAssertEqual(mprotect(pages, page, PROT_NONE), 0);
+    XCTAssertEqual(mprotect(pages + 2 * page, page, PROT_NONE), 0);
+    unsigned char* const start = pages + page;
+    unsigned char* const end = pages + 2 * page;
+    uint32_t seed = 521288629;
+    unsigned int disagreements = 0;
+
+    for (size_t length = 0; length < 100; ++length)
+    {
+        // Starting the page, and ending it.
+        UTF8Test_fill(start, length, length % 2, &seed);
+        start[length] = 0;
+        disagreements += !UTF8Test_agreeString((char const*)start);
+
+        UTF8Test_fill(end - length - 1, length, length % 2, &seed);
+        end[-1] = 0;
+        disagreements += !UTF8Test_agreeString((char const*)end - length - 1);
+    }
+    XCTAssertEqual(disagreements, 0U);
+    munmap(pages, 3 * page);
+}
+
+#pragma mark - Performance tests
+
+- (void)testPerformanceASCII
+{
+    unsigned char* const buffer = malloc(UTF8TEST_BENCHMARK_LENGTH);
+    for (size_t i = 0; i < UTF8TEST_BENCHMARK_LENGTH; ++i) { buffer[i] = (unsigned char)(' ' + i % 95); }
+    [self measureBlock:^{
+        for (int i = 0; i < 32; ++i) { XCTAssertTrue(UTF8_validate(UTF8TEST_BENCHMARK_LENGTH, (char const*)buffer)); }
+    }];
+    free(buffer);
+}
+
+- (void)testPerformanceMixed
+{
+    unsigned char* const buffer = malloc(UTF8TEST_BENCHMARK_LENGTH);
+    uint32_t seed = 123456789;
+    UTF8Test_fill(buffer, UTF8TEST_BENCHMARK_LENGTH, 0, &seed);
+    size_t length = UTF8TEST_BENCHMARK_LENGTH;
+    while (!UTF8_scalar_validate(length, (char const*)buffer)) { --length; }    // Drop the character cut short.
+    [self measureBlock:^{
+        for (int i = 0; i < 32; ++i) { XCTAssertTrue(UTF8_validate(length, (char const*)buffer)); }
+    }];
+    free(buffer);
+}
+
+- (void)testPerformanceInvalid
+{
+    unsigned char* const buffer = malloc(UTF8TEST_BENCHMARK_LENGTH);
+    uint32_t seed = 362436069;
+    UTF8Test_fill(buffer, UTF8TEST_BENCHMARK_LENGTH, 0, &seed);
+    // The error is at the end, so that all the input is read.
+    buffer[UTF8TEST_BENCHMARK_LENGTH - 2] = 0xC0;
+    buffer[UTF8TEST_BENCHMARK_LENGTH - 1] = 0x80;
+    [self measureBlock:^{
+        for (int i = 0; i < 32; ++i) { XCTAssertFalse(UTF8_validate(UTF8TEST_BENCHMARK_LENGTH, (char const*)buffer)); }
+    }];
+    free(buffer);
+}
+
+@end
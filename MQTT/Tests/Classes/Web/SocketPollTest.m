@@ -0,0 +1,265 @@
+@import XCTest;                 // Apple
+#import "SocketPoll.h"          // MQTT (Web)
+#import <string.h>              // C Standard
+#import <fcntl.h>               // POSIX
+#import <sys/select.h>          // POSIX
+#import <sys/socket.h>          // POSIX
+#import <unistd.h>              // POSIX
+
+#import "Heap.h"                // MQTT (Utilities)
+
+/*!
+ *  @abstract Test that every readiness backend built reports the same readiness over socket pairs, and measure them against each other.
+ *  @discussion The io_uring backend is only built on Linux with USE_IO_URING, and only checked where the kernel supports it.
+ *
+ *  @see SocketPoll_backends
+ */
+@interface SocketPollTest : XCTestCase
+@end
+
+#pragma mark - Helpers
+
+#define SOCKETPOLLTEST_PAIRS 64     // Socket pairs watched at once.
+#define SOCKETPOLLTEST_BATCH 8      // Most events collected by a single wait, fewer than the sockets ready at once.
+
+/*!
+ *  @abstract Open a pair of connected, non-blocking sockets.
+ */
+static bool SocketPollTest_pair(int pair[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) { return false; }
+    for (int i = 0; i < 2; ++i) { fcntl(pair[i], F_SETFL, fcntl(pair[i], F_GETFL) | O_NONBLOCK); }
+    return true;
+}
+
+/*!
+ *  @abstract Wait once, and tell the events reported for a socket.
+ */
+static int SocketPollTest_events(SocketPoll_backend const* backend, int socket, int milliseconds)
+{
+    SocketPoll_event events[SOCKETPOLL_MAX_EVENTS];
+    struct timeval timeout = { 0, milliseconds * 1000 };
+    int const count = backend->wait(&timeout, events, SOCKETPOLL_MAX_EVENTS);
+    int mask = 0;
+    for (int i = 0; i < count; ++i) { mask |= (events[i].socket == socket) ? events[i].events : 0; }
+    return (count < 0) ? -1 : mask;
+}
+
+/*!
+ *  @abstract Read all there is on a socket.
+ */
+static void SocketPollTest_drain(int socket)
+{
+    char buffer[256];
+    while (read(socket, buffer, sizeof(buffer)) > 0);
+}
+
+/*!
+ *  @abstract Wait until a wait reports nothing, reading the sockets reported readable, and tell which were.
+ *
+ *  @param readable set for the sockets reported readable, indexed by descriptor.
+ *  @return the number of waits that reported something, or -1 if one failed.
+ */
+static int SocketPollTest_collect(SocketPoll_backend const* backend, bool* readable, int size)
+{
+    SocketPoll_event events[SOCKETPOLLTEST_BATCH];
+    struct timeval timeout = { 0, 100000 };
+    int waits = 0, count;
+    while ((count = backend->wait(&timeout, events, SOCKETPOLLTEST_BATCH)) > 0)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (!(events[i].events & SOCKETPOLL_READ) || events[i].socket >= size) { continue; }
+            readable[events[i].socket] = true;
+            SocketPollTest_drain(events[i].socket);
+        }
+        ++waits;
+        timeout = (struct timeval){ 0, 100000 };
+    }
+    return (count < 0) ? -1 : waits;
+}
+
+/*!
+ *  @abstract A backend built for this platform, by name.
+ *
+ *  @return the backend, or NULL if it is not built here.
+ */
+static SocketPoll_backend const* SocketPollTest_backend(char const* name)
+{
+    int count = 0;
+    SocketPoll_backend const* const* backends = SocketPoll_backends(&count);
+    for (int i = 0; i < count; ++i)
+    {
+        if (strcmp(backends[i]->name, name) == 0) { return backends[i]; }
+    }
+    return NULL;
+}
+
+/*!
+ *  @abstract Make a byte readable on a few of many sockets at a time, and wait until the backend has reported them all, over and over.
+ *
+ *  @return whether every byte written was reported.
+ */
+static bool SocketPollTest_benchmark(SocketPoll_backend const* backend, int rounds)
+{
+    int pairs[SOCKETPOLLTEST_PAIRS][2];
+    bool reported = true;
+    for (int i = 0; i < SOCKETPOLLTEST_PAIRS; ++i)
+    {
+        SocketPollTest_pair(pairs[i]);
+        backend->add(pairs[i][0]);
+    }
+
+    SocketPoll_event events[SOCKETPOLL_MAX_EVENTS];
+    for (int round = 0; round < rounds && reported; ++round)
+    {
+        for (int i = 0; i < SOCKETPOLLTEST_BATCH; ++i) { write(pairs[(round * SOCKETPOLLTEST_BATCH + i) % SOCKETPOLLTEST_PAIRS][1], "x", 1); }
+        int seen = 0;
+        while (seen < SOCKETPOLLTEST_BATCH)
+        {
+            struct timeval timeout = { 1, 0 };
+            int const count = backend->wait(&timeout, events, SOCKETPOLL_MAX_EVENTS);
+            if (count <= 0) { reported = false; break; }
+            for (int i = 0; i < count; ++i)
+            {
+                char byte;
+                seen += (read(events[i].socket, &byte, 1) == 1);
+            }
+        }
+    }
+
+    for (int i = 0; i < SOCKETPOLLTEST_PAIRS; ++i)
+    {
+        backend->remove(pairs[i][0]);
+        close(pairs[i][0]);
+        close(pairs[i][1]);
+    }
+    return reported;
+}
+
+@implementation SocketPollTest
+
+#pragma mark - Setup
+
++ (void)setUp
+{
+    [super setUp];
+    Heap_initialize();
+}
+
+#pragma mark - Unit tests
+
+- (void)testReadiness
+{
+    int count = 0;
+    SocketPoll_backend const* const* backends = SocketPoll_backends(&count);
+    XCTAssertEqual(strcmp(backends[count - 1]->name, "select"), 0);
+
+    for (int b = 0; b < count; ++b)
+    {
+        SocketPoll_backend const* backend = backends[b];
+        if (backend->initialize() != 0) { continue; }   // Built, but not supported by the kernel.
+        int pair[2];
+        XCTAssertTrue(SocketPollTest_pair(pair));
+        XCTAssertEqual(backend->add(pair[0]), 0);
+        XCTAssertEqual(SocketPollTest_events(backend, pair[0], 50), 0);
+
+        // Readable, reported again until read only by a level-triggered backend.
+        write(pair[1], "x", 1);
+        XCTAssertEqual(SocketPollTest_events(backend, pair[0], 1000), SOCKETPOLL_READ);
+        XCTAssertEqual(SocketPollTest_events(backend, pair[0], 50), (backend->edge_triggered) ? 0 : SOCKETPOLL_READ);
+        SocketPollTest_drain(pair[0]);
+        while (SocketPollTest_events(backend, pair[0], 50) > 0);
+
+        // Writable while asked for.
+        backend->setWriteInterest(pair[0], 1);
+        XCTAssertEqual(SocketPollTest_events(backend, pair[0], 1000), SOCKETPOLL_WRITE);
+        backend->setWriteInterest(pair[0], 0);
+        XCTAssertEqual(SocketPollTest_events(backend, pair[0], 50), 0);
+
+        // Removed, then added again: only what happens once it is back is reported.
+        backend->remove(pair[0]);
+        write(pair[1], "x", 1);
+        XCTAssertEqual(SocketPollTest_events(backend, pair[0], 50), 0);
+        SocketPollTest_drain(pair[0]);
+        XCTAssertEqual(backend->add(pair[0]), 0);
+        XCTAssertEqual(SocketPollTest_events(backend, pair[0], 50), 0);
+
+        // The other end gone: reported, so that the next read finds out.
+        close(pair[1]);
+        XCTAssertTrue((SocketPollTest_events(backend, pair[0], 1000) & (SOCKETPOLL_READ | SOCKETPOLL_ERROR)) != 0);
+        XCTAssertEqual(read(pair[0], &(char){ 0 }, 1), (ssize_t)0);
+
+        backend->remove(pair[0]);
+        close(pair[0]);
+        backend->terminate();
+    }
+}
+
+- (void)testManySockets
+{
+    int count = 0;
+    SocketPoll_backend const* const* backends = SocketPoll_backends(&count);
+    for (int b = 0; b < count; ++b)
+    {
+        SocketPoll_backend const* backend = backends[b];
+        if (backend->initialize() != 0) { continue; }
+        int pairs[SOCKETPOLLTEST_PAIRS][2];
+        for (int i = 0; i < SOCKETPOLLTEST_PAIRS; ++i)
+        {
+            XCTAssertTrue(SocketPollTest_pair(pairs[i]));
+            XCTAssertEqual(backend->add(pairs[i][0]), 0);
+        }
+
+        // More sockets ready than a wait collects: the others are reported by the next waits.
+        bool readable[FD_SETSIZE] = { false };
+        for (int i = 0; i < SOCKETPOLLTEST_PAIRS; i += 3) { write(pairs[i][1], "xyz", 3); }
+        XCTAssertGreaterThanOrEqual(SocketPollTest_collect(backend, readable, FD_SETSIZE), (SOCKETPOLLTEST_PAIRS / 3) / SOCKETPOLLTEST_BATCH);
+        int wrong = 0;
+        for (int i = 0; i < SOCKETPOLLTEST_PAIRS; ++i) { wrong += (readable[pairs[i][0]] != (i % 3 == 0)); }
+        XCTAssertEqual(wrong, 0);
+
+        for (int i = 0; i < SOCKETPOLLTEST_PAIRS; ++i)
+        {
+            backend->remove(pairs[i][0]);
+            close(pairs[i][0]);
+            close(pairs[i][1]);
+        }
+        backend->terminate();
+    }
+}
+
+#pragma mark - Performance tests
+
+- (void)testPerformanceSelect
+{
+    SocketPoll_backend const* backend = SocketPollTest_backend("select");
+    XCTAssertEqual(backend->initialize(), 0);
+    [self measureBlock:^{
+        XCTAssertTrue(SocketPollTest_benchmark(backend, 5000));
+    }];
+    backend->terminate();
+}
+
+- (void)testPerformanceNative
+{
+    SocketPoll_backend const* backend = SocketPollTest_backend("epoll");
+    if (backend == NULL) { backend = SocketPollTest_backend("kqueue"); }
+    if (backend == NULL || backend->initialize() != 0) { return; }
+    [self measureBlock:^{
+        XCTAssertTrue(SocketPollTest_benchmark(backend, 5000));
+    }];
+    backend->terminate();
+}
+
+- (void)testPerformanceIOUring
+{
+    SocketPoll_backend const* backend = SocketPollTest_backend("io_uring");
+    if (backend == NULL || backend->initialize() != 0) { return; }
+    [self measureBlock:^{
+        XCTAssertTrue(SocketPollTest_benchmark(backend, 5000));
+    }];
+    backend->terminate();
+}
+
+@end